@@ -528,16 +528,22 @@ void lookup_send_request(const sid_t *srcsid, int srcport, const sid_t *dstsid,
   bcopy(did,&mdp.out.payload[0],strlen(did)+1);
   mdp.out.payload_length=strlen(did)+1;
   
-  overlay_mdp_send(&mdp,0,0);
+  overlay_mdp_frame frames[2];
+  int count=0;
+  frames[count++]=mdp;
   
   /* Also send an encrypted unicast request to a configured directory service */
   if (!dstsid){
     if (!is_sid_any(config.directory.service.binary)) {
       memcpy(mdp.out.dst.sid, config.directory.service.binary, SID_SIZE);
       mdp.packetTypeAndFlags=MDP_TX;
-      overlay_mdp_send(&mdp,0,0);
+      frames[count++]=mdp;
     }
   }
+  int sent=overlay_mdp_send_batch(frames, count);
+  // send whatever the socket would not take without blocking one at a time
+  for (i=sent<0?0:sent;i<count;i++)
+    overlay_mdp_send(&frames[i],0,0);
 }
 
 int app_dna_lookup(const struct cli_parsed *parsed, void *context)
@@ -2441,6 +2447,8 @@ struct cli_schema command_line_options[]={
    "Run cryptography speed test"},
   {app_slip_test,{"test","slip",NULL},0,
    "Run serial encapsulation test"},
+  {app_mesh_simulate,{"test","mesh","<nodes>","[<neighbours>]","[<loss>]","[<seconds>]",NULL},0,
+   "Simulate a mesh of <nodes> nodes in one process and report routing convergence time, control traffic and CPU use"},
 #ifdef HAVE_VOIPTEST
   {app_pa_phone,{"phone",NULL},0,
    "Run phone test application"},
@@ -562,6 +562,7 @@ int cf_opt_network_interface(struct config_network_interface *nifp, const struct
 int cf_opt_interface_list(struct config_interface_list *listp, const struct cf_om_node *node);
 int cf_opt_socket_type(int *typep, const char *text);
 int cf_opt_encapsulation(int *typep, const char *text);
+int cf_opt_sqlite_synchronous(int *syncp, const char *text);
 
 extern int cf_limbo;
 extern struct config_main config;
@@ -349,6 +349,23 @@ int cf_opt_encapsulation(int *typep, const char *text)
   return CFINVALID;
 }
 
+int cf_opt_sqlite_synchronous(int *syncp, const char *text)
+{
+  if (strcasecmp(text, "off") == 0) {
+    *syncp = RHIZOME_DB_SYNC_OFF;
+    return CFOK;
+  }
+  if (strcasecmp(text, "normal") == 0) {
+    *syncp = RHIZOME_DB_SYNC_NORMAL;
+    return CFOK;
+  }
+  if (strcasecmp(text, "full") == 0) {
+    *syncp = RHIZOME_DB_SYNC_FULL;
+    return CFOK;
+  }
+  return CFINVALID;
+}
+
 int cf_opt_pattern_list(struct pattern_list *listp, const char *text)
 {
   struct pattern_list list;
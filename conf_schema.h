@@ -235,6 +235,7 @@ STRUCT(server)
 STRING(256,                 chdir,      "/", absolute_path,, "Absolute path of chdir(2) for server process")
 STRING(256,                 interface_path, "", str_nonempty,, "Path of directory containing interface files, either absolute or relative to instance directory")
 ATOM(int,                   respawn_on_crash, 0, int_boolean,, "If true, server will exec(2) itself on fatal signals, eg SEGV")
+ATOM(int,                   worker_threads, 0, int32_nonneg,, "Number of threads for signature checks, 0 to do them in the main loop")
 END_STRUCT
 
 STRUCT(monitor)
@@ -252,9 +253,21 @@ KEY_ATOM(short, interface_type, cmp_short)
 VALUE_SUB_STRUCT(mdp_iftype)
 END_ARRAY(5)
 
+STRUCT(mdp_advertise)
+ATOM(int,                   delta,      0, int_boolean,, "If true, route advertisements send changed routes first and repeat unchanged routes less often")
+ATOM(uint32_t,              refresh_ms, 10000, uint32_nonzero,, "Minimum interval between advertisements of an unchanged route in delta mode")
+ATOM(uint32_t,              score_threshold, 8, uint32_nonzero,, "Change in route score that causes a route to be advertised again in delta mode")
+END_STRUCT
+
 STRUCT(mdp)
 STRING(256,                 socket,     DEFAULT_MDP_SOCKET_NAME, str_nonempty,, "Name of socket for MDP client interface")
 SUB_STRUCT(mdp_iftypelist,  iftype,)
+SUB_STRUCT(mdp_advertise,   advertise,)
+ATOM(int,                   ring,       0, int_boolean,, "If true, MDP clients pass frames to and from the daemon through shared memory rings")
+END_STRUCT
+
+STRUCT(keyring)
+ATOM(uint32_t,              nm_cache_size, 512, uint32_nonzero,, "Number of crypto_box shared secrets to keep, one per pair of local and remote identities in use")
 END_STRUCT
 
 STRUCT(olsr)
@@ -317,6 +330,13 @@ ATOM(int,                   enable,     1, int_boolean,, "If true, Rhizome adver
 ATOM(uint32_t,              interval,   500, uint32_nonzero,, "Interval between Rhizome advertisements")
 END_STRUCT
 
+STRUCT(rhizome_db)
+ATOM(int,                   wal,        0, int_boolean,, "If true, use write-ahead logging so that readers do not block the writer")
+ATOM(int,                   synchronous, RHIZOME_DB_SYNC_FULL, sqlite_synchronous,, "When to sync to disk: off, normal or full")
+ATOM(uint64_t,              cache_size, 0, uint64_scaled,, "Size of page cache in bytes, 0 for the SQLite default")
+ATOM(uint64_t,              mmap_size,  0, uint64_scaled,, "Size of database to memory map in bytes, 0 to disable")
+END_STRUCT
+
 STRUCT(rhizome)
 ATOM(int,                   enable,     1, int_boolean,, "If true, server opens Rhizome database when starting")
 ATOM(int,                   clean_on_open, 1, int_boolean,, "If true, Rhizome database is cleaned at start of every command")
@@ -332,6 +352,7 @@ SUB_STRUCT(rhizome_api,     api,)
 SUB_STRUCT(rhizome_http,    http,)
 SUB_STRUCT(rhizome_mdp,     mdp,)
 SUB_STRUCT(rhizome_advertise, advertise,)
+SUB_STRUCT(rhizome_db,      db,)
 END_STRUCT
 
 STRUCT(directory)
@@ -361,6 +382,7 @@ ATOM(struct in_addr,        dummy_netmask,    hton_in_addr(0xFFFFFF00), in_addr,
 ATOM(uint16_t,              port,       PORT_DNA, uint16_nonzero,, "Port number for network interface")
 ATOM(char,                  drop_broadcasts,     0, char_boolean,, "If true, drop all incoming broadcast packets")
 ATOM(char,                  drop_unicasts,     0, char_boolean,, "If true, drop all incoming unicast packets")
+ATOM(int,                   drop_percent,      0, int32_nonneg,, "Percentage of incoming packets on a dummy interface to drop at random, for testing")
 ATOM(short,                 type,       OVERLAY_INTERFACE_WIFI, interface_type,, "Type of network interface")
 ATOM(int,                   packet_interval,    -1, int,, "Minimum interval between packets in microseconds")
 ATOM(int,                   mdp_tick_ms, -1, int32_nonneg,, "Override MDP tick interval for this interface")
@@ -385,6 +407,7 @@ SUB_STRUCT(dna,             dna,)
 SUB_STRUCT(debug,           debug,)
 SUB_STRUCT(rhizome,         rhizome,)
 SUB_STRUCT(directory,       directory,)
+SUB_STRUCT(keyring,         keyring,)
 SUB_STRUCT(olsr,            olsr,)
 SUB_STRUCT(host_list,       hosts,)
 END_STRUCT
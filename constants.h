@@ -92,6 +92,8 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #define OF_TYPE_RHIZOME_ADVERT 0x50 /* Advertisment of file availability via Rhizome */
 #define OF_TYPE_PLEASEEXPLAIN 0x60 /* Request for resolution of an abbreviated address */
 #define OF_TYPE_NODEANNOUNCE 0x70
+#define OF_TYPE_NODEANNOUNCE_DELTA 0x80 /* Changed routes first, stable routes refreshed less often */
+#define OF_TYPE_NODEANNOUNCE_RESYNC 0x90 /* Ask a neighbour to repeat all of its routes on one interface */
 
 #define PAYLOAD_FLAG_SENDER_SAME (1<<0)
 #define PAYLOAD_FLAG_TO_BROADCAST (1<<1)
@@ -157,6 +159,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #define MDP_NODEINFO 8
 #define MDP_GOODBYE 9
 #define MDP_SCAN 10
+#define MDP_RING 11
 
 // These are back-compatible with the old values of 'mode' when it was 'selfP'
 #define MDP_ADDRLIST_MODE_ROUTABLE_PEERS 0
@@ -208,6 +211,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #define DEFAULT_MDP_SOCKET_NAME "org.servalproject.servald.mdp.socket"
 
 #define SOCK_FILE 0xFF
+#define SOCK_SIMULATED 0xFE
 #define SOCK_UNSPECIFIED 0
 
 #define ENCAP_OVERLAY 1
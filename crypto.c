@@ -50,6 +50,32 @@ int crypto_verify_message(struct subscriber *subscriber, unsigned char *message,
 				 crypto_hash_sha512_BYTES, &message[*message_len], SIGNATURE_BYTES);
 }
 
+// verify many signatures at once, setting checks[i].valid for each.
+// returns 0 only if every signature is valid.
+// doesn't log or use IN()/OUT(), so it is safe to call from a worker thread.
+int crypto_verify_signatures(struct signature_check *checks, int count)
+{
+  if (count<=0)
+    return 0;
+  
+  const unsigned char *content[count];
+  unsigned long long content_len[count];
+  const unsigned char *public_key[count];
+  const unsigned char *signature[count];
+  int valid[count];
+  int i;
+  for (i=0;i<count;i++){
+    content[i]=checks[i].content;
+    content_len[i]=checks[i].content_len;
+    public_key[i]=checks[i].public_key;
+    signature[i]=checks[i].signature;
+  }
+  int ret=crypto_sign_edwards25519sha512batch_open_batch(content, content_len, public_key, signature, count, valid);
+  for (i=0;i<count;i++)
+    checks[i].valid=valid[i];
+  return ret?-1:0;
+}
+
 // generate a signature for this raw content, copy the signature to the address requested.
 int crypto_create_signature(unsigned char *key, 
 			    unsigned char *content, unsigned long long content_len, 
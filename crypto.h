@@ -9,6 +9,16 @@ int crypto_verify_signature(unsigned char *sas_key,
 			    unsigned char *content, unsigned long long content_len, 
 			    unsigned char *signature_block, unsigned long long signature_len);
 int crypto_verify_message(struct subscriber *subscriber, unsigned char *message, int *message_len);
+
+struct signature_check{
+  const unsigned char *public_key;
+  const unsigned char *content;
+  unsigned long long content_len;
+  const unsigned char *signature;
+  // set to 1 if the signature is valid
+  int valid;
+};
+int crypto_verify_signatures(struct signature_check *checks, int count);
 int crypto_create_signature(unsigned char *key, 
 			    unsigned char *content, unsigned long long content_len, 
 			    unsigned char *signature, unsigned long long *sig_length);
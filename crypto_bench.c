@@ -0,0 +1,613 @@
+/*
+Serval crypto known answer tests and benchmark
+Copyright (C) 2013 Serval Project, Inc.
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+/*
+  Checks the NaCl primitives servald was built with against published test
+  vectors and, when configure selected the 64 bit donna implementations
+  (HAVE_FAST_CRYPTO), against the reference implementations on random inputs.
+  Batch signature verification is checked against crypto_sign_open() with
+  corrupted signatures mixed in, and every width of sha512_multi() the CPU
+  supports against sha2.c.  Then times each implementation of the primitives
+  that sit under crypto_box, single versus batch signature verification, and
+  each implementation of SHA-512.
+
+    make crypto_bench
+    ./crypto_bench [-n <iterations>] [-k]
+
+  -n sets the number of random comparisons per primitive, -k stops after the
+  known answer tests.  Exits non-zero if any output differs.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include "crypto_box_curve25519xsalsa20poly1305.h"
+#include "crypto_scalarmult_curve25519.h"
+#include "crypto_onetimeauth_poly1305.h"
+#include "crypto_sign_edwards25519sha512batch.h"
+#include "crypto_hash_sha512.h"
+#include "randombytes.h"
+#include "sha2.h"
+#include "sha512_multi.h"
+
+typedef int (*scalarmult_func)(unsigned char *,const unsigned char *,const unsigned char *);
+typedef int (*onetimeauth_func)(unsigned char *,const unsigned char *,unsigned long long,const unsigned char *);
+
+static int failures=0;
+
+static int hexvalue(char c)
+{
+  if (c>='0' && c<='9') return c-'0';
+  if (c>='a' && c<='f') return c-'a'+10;
+  return -1;
+}
+
+static void fromhex(unsigned char *dst, const char *hex, size_t len)
+{
+  size_t i;
+  for (i=0;i<len;i++)
+    dst[i]=(hexvalue(hex[i*2])<<4)|hexvalue(hex[i*2+1]);
+}
+
+static void check(const char *name, const unsigned char *got, const unsigned char *expected, size_t len)
+{
+  if (memcmp(got, expected, len)==0)
+    return;
+  size_t i;
+  fprintf(stderr, "FAIL %s\n  got      ", name);
+  for (i=0;i<len;i++) fprintf(stderr, "%02x", got[i]);
+  fprintf(stderr, "\n  expected ");
+  for (i=0;i<len;i++) fprintf(stderr, "%02x", expected[i]);
+  fprintf(stderr, "\n");
+  failures++;
+}
+
+static double now_seconds()
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+/* RFC 7748 section 6.1 */
+static void kat_scalarmult(const char *impl, scalarmult_func scalarmult)
+{
+  unsigned char alice_sk[32], alice_pk[32], bob_sk[32], bob_pk[32], shared[32];
+  unsigned char base[32]={9}, out[32];
+  char name[64];
+
+  fromhex(alice_sk, "77076d0a7318a57d3c16c17251b26645df4c2f87ebc0992ab177fba51db92c2a", 32);
+  fromhex(alice_pk, "8520f0098930a754748b7ddcb43ef75a0dbf3a0d26381af4eba4a98eaa9b4e6a", 32);
+  fromhex(bob_sk, "5dab087e624a8a4b79e17f8b83800ee66f3bb1292618b6fd1c2f8b27ff88e0eb", 32);
+  fromhex(bob_pk, "de9edb7d7b7dc1b4d35b61c2ece435373f8343c85b78674dadfc7e146f882b4f", 32);
+  fromhex(shared, "4a5d9d5ba4ce2de1728e3bf480350f25e07e21c947d19e3376f09b3c1e161742", 32);
+
+  snprintf(name, sizeof name, "curve25519/%s alice public", impl);
+  scalarmult(out, alice_sk, base);
+  check(name, out, alice_pk, 32);
+  snprintf(name, sizeof name, "curve25519/%s bob public", impl);
+  scalarmult(out, bob_sk, base);
+  check(name, out, bob_pk, 32);
+  snprintf(name, sizeof name, "curve25519/%s alice shared", impl);
+  scalarmult(out, alice_sk, bob_pk);
+  check(name, out, shared, 32);
+  snprintf(name, sizeof name, "curve25519/%s bob shared", impl);
+  scalarmult(out, bob_sk, alice_pk);
+  check(name, out, shared, 32);
+}
+
+/* RFC 7539 section 2.5.2 */
+static void kat_onetimeauth(const char *impl, onetimeauth_func onetimeauth)
+{
+  const char *message="Cryptographic Forum Research Group";
+  unsigned char key[32], tag[16], out[16];
+  char name[64];
+
+  fromhex(key, "85d6be7857556d337f4452fe42d506a80103808afb0db2fd4abff6af4149f51b", 32);
+  fromhex(tag, "a8061dc1305136c6c22b8baf0c0127a9", 16);
+
+  snprintf(name, sizeof name, "poly1305/%s", impl);
+  onetimeauth(out, (const unsigned char *)message, strlen(message), key);
+  check(name, out, tag, 16);
+}
+
+static void sha2_hash(unsigned char *digest, const unsigned char *message, size_t len)
+{
+  SHA512_CTX context;
+  SHA512_Init(&context);
+  SHA512_Update(&context, message, len);
+  SHA512_Final(digest, &context);
+}
+
+static const int sha512_widths[]={1, 4, 8};
+
+/* FIPS 180-2 appendix C, and the empty message */
+static const char *sha512_messages[]={
+  "abc",
+  "",
+  "abcdefghbcdefghicdefghijdefghijkefghijklfghijklmghijklmnhijklmnoijklmnopjklmnopqklmnopqrlmnopqrsmnopqrstnopqrstu",
+};
+static const char *sha512_digests[]={
+  "ddaf35a193617abacc417349ae20413112e6fa4e89a97ea20a9eeee64b55d39a2192992a274fc1a836ba3c23a3feebbd454d4423643ce80e2a9ac94fa54ca49f",
+  "cf83e1357eefb8bdf1542850d66d8007d620e4050b5715dc83f4a921d36ce9ce47d0d13c5d85f2b0ff8318d2877eec2f63b931bd47417a81a538327af927da3e",
+  "8e959b75dae313da8cf4f72814fc143f8f7779c6eb9f7fa17299aeadb6889018501d289e4900f7e4331b99dec4b5433ac7d329eeb6dd26545e96e55b874be909",
+};
+#define SHA512_MESSAGES (sizeof sha512_messages / sizeof sha512_messages[0])
+
+static void kat_sha512()
+{
+  unsigned char expected[SHA512_MESSAGES][SHA512_DIGEST_LENGTH], out[SHA512_DIGEST_LENGTH];
+  char name[64];
+  unsigned i, w;
+
+  for (i=0;i<SHA512_MESSAGES;i++){
+    const unsigned char *message=(const unsigned char *)sha512_messages[i];
+    size_t len=strlen(sha512_messages[i]);
+    fromhex(expected[i], sha512_digests[i], SHA512_DIGEST_LENGTH);
+    snprintf(name, sizeof name, "sha512/nacl %zu bytes", len);
+    crypto_hash_sha512(out, message, len);
+    check(name, out, expected[i], SHA512_DIGEST_LENGTH);
+    snprintf(name, sizeof name, "sha512/sha2 %zu bytes", len);
+    sha2_hash(out, message, len);
+    check(name, out, expected[i], SHA512_DIGEST_LENGTH);
+  }
+
+  // more messages than lanes, so that lanes are refilled
+  const unsigned char *data[SHA512_MESSAGES*4];
+  size_t lengths[SHA512_MESSAGES*4];
+  unsigned char digests[SHA512_MESSAGES*4][SHA512_DIGEST_LENGTH];
+  for (i=0;i<SHA512_MESSAGES*4;i++){
+    data[i]=(const unsigned char *)sha512_messages[i%SHA512_MESSAGES];
+    lengths[i]=strlen(sha512_messages[i%SHA512_MESSAGES]);
+  }
+  for (w=0;w<sizeof sha512_widths/sizeof sha512_widths[0];w++){
+    if (sha512_multi_set_lanes(sha512_widths[w])==-1)
+      continue;
+    sha512_multi(SHA512_MESSAGES*4, data, lengths, digests);
+    for (i=0;i<SHA512_MESSAGES*4;i++){
+      snprintf(name, sizeof name, "sha512/multi x%d %zu bytes", sha512_widths[w], lengths[i]);
+      check(name, digests[i], expected[i%SHA512_MESSAGES], SHA512_DIGEST_LENGTH);
+    }
+  }
+}
+
+/* Random numbers of messages of random lengths, with every length up to a few
+   blocks well represented, so that the padding lands in one block or two */
+static void compare_sha512_multi(int iterations)
+{
+  unsigned char *buffer=malloc(16*1024);
+  unsigned w;
+  randombytes(buffer, 16*1024);
+  for (w=0;w<sizeof sha512_widths/sizeof sha512_widths[0];w++){
+    if (sha512_multi_set_lanes(sha512_widths[w])==-1)
+      continue;
+    char name[64];
+    snprintf(name, sizeof name, "sha512/multi x%d vs sha2", sha512_widths[w]);
+    int i;
+    for (i=0;i<iterations;i++){
+      const unsigned char *data[20];
+      size_t lengths[20];
+      unsigned char digests[20][SHA512_DIGEST_LENGTH], ref[SHA512_DIGEST_LENGTH];
+      unsigned count=1+random()%20, j;
+      for (j=0;j<count;j++){
+	lengths[j]=random()%(j==0 && i%4==0 ? 8192 : 512);
+	data[j]=buffer+random()%(16*1024-lengths[j]+1);
+      }
+      sha512_multi(count, data, lengths, digests);
+      for (j=0;j<count;j++){
+	sha2_hash(ref, data[j], lengths[j]);
+	check(name, digests[j], ref, SHA512_DIGEST_LENGTH);
+      }
+    }
+  }
+  free(buffer);
+}
+
+static void bench_sha512(size_t len, int count)
+{
+  unsigned char *message=malloc(len);
+  unsigned char digest[SHA512_DIGEST_LENGTH];
+  randombytes(message, len);
+  double start=now_seconds();
+  int i;
+  for (i=0;i<count;i++)
+    crypto_hash_sha512(digest, message, len);
+  double elapsed=now_seconds()-start;
+  printf("sha512/nacl     %7zu bytes %8.1f MB/s\n", len, (double)len*count/elapsed/1000000);
+  start=now_seconds();
+  for (i=0;i<count;i++)
+    sha2_hash(digest, message, len);
+  elapsed=now_seconds()-start;
+  printf("sha512/sha2     %7zu bytes %8.1f MB/s\n", len, (double)len*count/elapsed/1000000);
+
+  // the same message in every lane, as long as they all take the same time
+  const unsigned char *data[SHA512_MULTI_MAX_LANES*4];
+  size_t lengths[SHA512_MULTI_MAX_LANES*4];
+  unsigned char digests[SHA512_MULTI_MAX_LANES*4][SHA512_DIGEST_LENGTH];
+  for (i=0;i<SHA512_MULTI_MAX_LANES*4;i++){
+    data[i]=message;
+    lengths[i]=len;
+  }
+  unsigned w;
+  for (w=0;w<sizeof sha512_widths/sizeof sha512_widths[0];w++){
+    if (sha512_multi_set_lanes(sha512_widths[w])==-1)
+      continue;
+    start=now_seconds();
+    for (i=0;i<count;i+=SHA512_MULTI_MAX_LANES*4)
+      sha512_multi(SHA512_MULTI_MAX_LANES*4, data, lengths, digests);
+    elapsed=now_seconds()-start;
+    printf("sha512/multi x%d %7zu bytes %8.1f MB/s\n", sha512_widths[w], len,
+      (double)len*i/elapsed/1000000);
+  }
+  free(message);
+}
+
+#define SIGNATURES 64
+#define SIGNED_BYTES 64
+
+struct signed_messages{
+  unsigned char pk[SIGNATURES][crypto_sign_edwards25519sha512batch_PUBLICKEYBYTES];
+  unsigned char sm[SIGNATURES][crypto_sign_edwards25519sha512batch_BYTES + SIGNED_BYTES];
+  const unsigned char *m[SIGNATURES];
+  const unsigned char *pkp[SIGNATURES];
+  const unsigned char *sig[SIGNATURES];
+  unsigned long long mlen[SIGNATURES];
+};
+
+static void sign_messages(struct signed_messages *s)
+{
+  unsigned char sk[crypto_sign_edwards25519sha512batch_SECRETKEYBYTES];
+  unsigned char message[SIGNED_BYTES];
+  unsigned long long smlen;
+  int i;
+  for (i=0;i<SIGNATURES;i++){
+    crypto_sign_edwards25519sha512batch_keypair(s->pk[i], sk);
+    randombytes(message, sizeof message);
+    crypto_sign_edwards25519sha512batch(s->sm[i], &smlen, message, sizeof message, sk);
+    s->sig[i]=s->sm[i];
+    s->m[i]=s->sm[i] + crypto_sign_edwards25519sha512batch_BYTES;
+    s->mlen[i]=SIGNED_BYTES;
+    s->pkp[i]=s->pk[i];
+  }
+}
+
+/* Batch verification must give exactly the same answer as crypto_sign_open() */
+static void check_open_batch(int iterations)
+{
+  struct signed_messages *s=malloc(sizeof *s);
+  int valid[SIGNATURES];
+  int i, j;
+  sign_messages(s);
+  for (i=0;i<iterations/10+1;i++){
+    int n = 1 + random() % SIGNATURES;
+    int bad = random() % (n + 1);
+    if (bad<n){
+      // flip one bit of the signature or message
+      int len = crypto_sign_edwards25519sha512batch_BYTES + SIGNED_BYTES;
+      s->sm[bad][random() % len] ^= 1 << (random() % 8);
+    }
+    int ret=crypto_sign_edwards25519sha512batch_open_batch(s->m, s->mlen, s->pkp, s->sig, n, valid);
+    int all_valid=1;
+    for (j=0;j<n;j++){
+      unsigned char m[sizeof s->sm[j]];
+      unsigned long long mlen;
+      int expect=crypto_sign_edwards25519sha512batch_open(m, &mlen, s->sm[j], sizeof s->sm[j], s->pk[j])==0;
+      if (valid[j]!=expect){
+	fprintf(stderr, "FAIL open_batch signature %d of %d: %d, crypto_sign_open says %d\n", j, n, valid[j], expect);
+	failures++;
+      }
+      if (!expect)
+	all_valid=0;
+    }
+    if ((ret==0)!=all_valid){
+      fprintf(stderr, "FAIL open_batch returned %d\n", ret);
+      failures++;
+    }
+    if (bad<n)
+      sign_messages(s);
+  }
+  free(s);
+}
+
+/* Signatures with small order components, which crypto_sign() never makes but
+   a key holder can.  The first two are by the same key, with R offset by a
+   point T of order 8 and by -T, so they would cancel in a batch whenever the
+   random multipliers are equal mod 8.  The last has a public key of order 8.
+   crypto_sign_open() accepts all three, as 8(SB - hA - R) = 0.
+ */
+static const char *small_order_pk[]={
+  "2bcae17142809c32733e2e93abd49088db2df6ed54eb69fbfd4e0bde518b0189",
+  "2bcae17142809c32733e2e93abd49088db2df6ed54eb69fbfd4e0bde518b0189",
+  "c7176a703d4dd84fba3c0b760d10670f2a2053fa2c39ccc64ec7fd7792ac037a",
+};
+static const char *small_order_sig[]={
+  "9dbab365f606a56d63145465b5162742375b191de80ca1e7f686b9b5a260fc85"
+  "e3c120a15f8db654f401671404183f31e68fae81acfdf61aae64839cf208a907",
+  "1545845d75fb1c706435807b88d2b90366af66aa2be43d5068b8bd83baf9913c"
+  "45aae95b96849a33a6fbe54bc4c26380bbc789d06d5a2ee8022fe2ec2f276908",
+  "0100000000000000000000000000000000000000000000000000000000000000"
+  "0000000000000000000000000000000000000000000000000000000000000000",
+};
+static const char *small_order_m[]={
+  "small order R 0",
+  "small order R 1",
+  "small order A 0",
+};
+#define SMALL_ORDER (sizeof small_order_m / sizeof small_order_m[0])
+
+/* Batches mixing these with ordinary signatures must agree with crypto_sign_open()
+   every time, whatever random multipliers are chosen */
+static void check_small_order(int iterations)
+{
+  struct signed_messages *s=malloc(sizeof *s);
+  unsigned char pk[SMALL_ORDER][crypto_sign_edwards25519sha512batch_PUBLICKEYBYTES];
+  unsigned char sm[SMALL_ORDER][crypto_sign_edwards25519sha512batch_BYTES + SIGNED_BYTES];
+  const unsigned char *m[SIGNATURES], *pkp[SIGNATURES], *sig[SIGNATURES];
+  unsigned long long mlen[SIGNATURES];
+  int valid[SIGNATURES];
+  unsigned i, j;
+  sign_messages(s);
+  for (i=0;i<SMALL_ORDER;i++){
+    size_t len=strlen(small_order_m[i]);
+    unsigned char out[sizeof sm[i]];
+    unsigned long long outlen;
+    fromhex(pk[i], small_order_pk[i], sizeof pk[i]);
+    fromhex(sm[i], small_order_sig[i], crypto_sign_edwards25519sha512batch_BYTES);
+    memcpy(sm[i] + crypto_sign_edwards25519sha512batch_BYTES, small_order_m[i], len);
+    if (crypto_sign_edwards25519sha512batch_open(out, &outlen, sm[i], crypto_sign_edwards25519sha512batch_BYTES + len, pk[i])){
+      fprintf(stderr, "FAIL crypto_sign_open rejected small order signature %u\n", i);
+      failures++;
+    }
+  }
+  for (i=0;i<iterations/10+1;i++){
+    // the crafted signatures among a few ordinary ones, in a random order
+    int n=SMALL_ORDER + random() % 8;
+    for (j=0;j<(unsigned)n;j++){
+      m[j]=s->m[j]; mlen[j]=s->mlen[j]; pkp[j]=s->pkp[j]; sig[j]=s->sig[j];
+    }
+    for (j=0;j<SMALL_ORDER;j++){
+      int k=random() % n;
+      while(pkp[k]!=s->pkp[k])
+	k=(k+1) % n;
+      m[k]=sm[j] + crypto_sign_edwards25519sha512batch_BYTES;
+      mlen[k]=strlen(small_order_m[j]);
+      pkp[k]=pk[j];
+      sig[k]=sm[j];
+    }
+    int ret=crypto_sign_edwards25519sha512batch_open_batch(m, mlen, pkp, sig, n, valid);
+    for (j=0;j<(unsigned)n;j++){
+      if (!valid[j]){
+	fprintf(stderr, "FAIL open_batch rejected signature %u of %d with small order signatures\n", j, n);
+	failures++;
+      }
+    }
+    if (ret!=0){
+      fprintf(stderr, "FAIL open_batch returned %d with small order signatures\n", ret);
+      failures++;
+    }
+  }
+  free(s);
+}
+
+static void bench_open(int batch)
+{
+  struct signed_messages *s=malloc(sizeof *s);
+  int valid[SIGNATURES];
+  int i, rounds=20;
+  sign_messages(s);
+  double start=now_seconds();
+  for (i=0;i<rounds;i++){
+    if (batch){
+      crypto_sign_edwards25519sha512batch_open_batch(s->m, s->mlen, s->pkp, s->sig, SIGNATURES, valid);
+    }else{
+      int j;
+      for (j=0;j<SIGNATURES;j++){
+	unsigned char m[sizeof s->sm[j]];
+	unsigned long long mlen;
+	crypto_sign_edwards25519sha512batch_open(m, &mlen, s->sm[j], sizeof s->sm[j], s->pk[j]);
+      }
+    }
+  }
+  double elapsed=now_seconds()-start;
+  printf("sign_open%-10s %8.1f us/signature\n", batch?"_batch":"", elapsed*1000000/(rounds*SIGNATURES));
+  free(s);
+}
+
+#ifdef HAVE_FAST_CRYPTO
+static void compare_scalarmult(int iterations)
+{
+  unsigned char n[32], p[32], ref[32], fast[32];
+  int i;
+  for (i=0;i<iterations;i++){
+    randombytes(n, sizeof n);
+    randombytes(p, sizeof p);
+    /* The reference code does not ignore the top bit of the point, so only
+       compare canonical encodings */
+    p[31]&=0x7f;
+    crypto_scalarmult_curve25519_ref(ref, n, p);
+    crypto_scalarmult_curve25519_donna64(fast, n, p);
+    check("curve25519 donna64 vs ref", fast, ref, 32);
+    crypto_scalarmult_curve25519_ref_base(ref, n);
+    crypto_scalarmult_curve25519_donna64_base(fast, n);
+    check("curve25519 base donna64 vs ref", fast, ref, 32);
+  }
+}
+
+static void compare_onetimeauth(int iterations)
+{
+  unsigned char key[32], message[1024], ref[16], fast[16];
+  int i;
+  for (i=0;i<iterations;i++){
+    unsigned long long len = random() % (sizeof message + 1);
+    randombytes(key, sizeof key);
+    randombytes(message, len);
+    crypto_onetimeauth_poly1305_ref(ref, message, len, key);
+    crypto_onetimeauth_poly1305_donna64(fast, message, len, key);
+    check("poly1305 donna64 vs ref", fast, ref, 16);
+    if (crypto_onetimeauth_poly1305_donna64_verify(ref, message, len, key)){
+      fprintf(stderr, "FAIL poly1305 donna64 verify of reference tag\n");
+      failures++;
+    }
+    ref[i%16]^=1;
+    if (crypto_onetimeauth_poly1305_donna64_verify(ref, message, len, key)==0){
+      fprintf(stderr, "FAIL poly1305 donna64 verify accepted a corrupt tag\n");
+      failures++;
+    }
+  }
+}
+#endif
+
+static void bench_scalarmult(const char *impl, scalarmult_func scalarmult, int count)
+{
+  unsigned char n[32], p[32];
+  randombytes(n, sizeof n);
+  randombytes(p, sizeof p);
+  p[31]&=0x7f;
+  double start=now_seconds();
+  int i;
+  for (i=0;i<count;i++)
+    scalarmult(p, n, p);
+  double elapsed=now_seconds()-start;
+  printf("curve25519/%-8s %8.1f us/op\n", impl, elapsed*1000000/count);
+}
+
+static void bench_onetimeauth(const char *impl, onetimeauth_func onetimeauth, size_t len, int count)
+{
+  unsigned char key[32], tag[16];
+  unsigned char *message=malloc(len);
+  randombytes(key, sizeof key);
+  randombytes(message, len);
+  double start=now_seconds();
+  int i;
+  for (i=0;i<count;i++){
+    onetimeauth(tag, message, len, key);
+    key[0]^=tag[0];
+  }
+  double elapsed=now_seconds()-start;
+  printf("poly1305/%-8s %5zu bytes %8.3f us/op %8.1f MB/s\n", impl, len,
+    elapsed*1000000/count, (double)len*count/elapsed/1000000);
+  free(message);
+}
+
+/* The path every MDP payload takes: the shared secret is cached, so only the
+   salsa20 and poly1305 work is per packet */
+static void bench_box(size_t len, int count)
+{
+  unsigned char pk[crypto_box_curve25519xsalsa20poly1305_PUBLICKEYBYTES];
+  unsigned char sk[crypto_box_curve25519xsalsa20poly1305_SECRETKEYBYTES];
+  unsigned char k[crypto_box_curve25519xsalsa20poly1305_BEFORENMBYTES];
+  unsigned char nonce[crypto_box_curve25519xsalsa20poly1305_NONCEBYTES];
+  size_t padded=len+crypto_box_curve25519xsalsa20poly1305_ZEROBYTES;
+  unsigned char *plain=calloc(padded, 1);
+  unsigned char *cipher=malloc(padded);
+
+  crypto_box_curve25519xsalsa20poly1305_keypair(pk, sk);
+  crypto_box_curve25519xsalsa20poly1305_beforenm(k, pk, sk);
+  randombytes(nonce, sizeof nonce);
+  double start=now_seconds();
+  int i;
+  for (i=0;i<count;i++){
+    crypto_box_curve25519xsalsa20poly1305_afternm(cipher, plain, padded, nonce, k);
+    nonce[0]++;
+  }
+  double elapsed=now_seconds()-start;
+  printf("box_afternm        %5zu bytes %8.3f us/op %8.1f MB/s\n", len,
+    elapsed*1000000/count, (double)len*count/elapsed/1000000);
+  free(plain);
+  free(cipher);
+}
+
+static void usage(const char *name)
+{
+  fprintf(stderr, "usage: %s [-n <iterations>] [-k]\n", name);
+  exit(1);
+}
+
+int main(int argc, char **argv)
+{
+  int iterations=1000;
+  int kat_only=0;
+  int c;
+  while((c=getopt(argc, argv, "n:k"))!=-1){
+    switch(c){
+      case 'n':
+	iterations=atoi(optarg);
+	break;
+      case 'k':
+	kat_only=1;
+	break;
+      default:
+	usage(argv[0]);
+    }
+  }
+  if (iterations<0)
+    usage(argv[0]);
+
+  unsigned int seed;
+  randombytes((unsigned char *)&seed, sizeof seed);
+  srandom(seed);
+
+  printf("crypto_scalarmult_curve25519 %s\n", crypto_scalarmult_curve25519_IMPLEMENTATION);
+  printf("crypto_onetimeauth_poly1305  %s\n", crypto_onetimeauth_poly1305_IMPLEMENTATION);
+  int sha512_lanes=sha512_multi_lanes();
+  printf("sha512_multi                 %d lanes\n", sha512_lanes);
+
+  kat_scalarmult("ref", crypto_scalarmult_curve25519_ref);
+  kat_onetimeauth("ref", crypto_onetimeauth_poly1305_ref);
+#ifdef HAVE_FAST_CRYPTO
+  kat_scalarmult("donna64", crypto_scalarmult_curve25519_donna64);
+  kat_onetimeauth("donna64", crypto_onetimeauth_poly1305_donna64);
+  compare_scalarmult(iterations);
+  compare_onetimeauth(iterations);
+#endif
+  check_open_batch(iterations);
+  check_small_order(iterations);
+  kat_sha512();
+  compare_sha512_multi(iterations);
+  sha512_multi_set_lanes(sha512_lanes);
+  if (failures){
+    fprintf(stderr, "%d known answer tests FAILED\n", failures);
+    return 1;
+  }
+  printf("known answer tests passed\n");
+  if (kat_only)
+    return 0;
+
+  bench_scalarmult("ref", crypto_scalarmult_curve25519_ref, 500);
+#ifdef HAVE_FAST_CRYPTO
+  bench_scalarmult("donna64", crypto_scalarmult_curve25519_donna64, 5000);
+#endif
+  size_t sizes[]={64, 1024};
+  unsigned i;
+  for (i=0;i<sizeof sizes/sizeof sizes[0];i++){
+    bench_onetimeauth("ref", crypto_onetimeauth_poly1305_ref, sizes[i], 20000);
+#ifdef HAVE_FAST_CRYPTO
+    bench_onetimeauth("donna64", crypto_onetimeauth_poly1305_donna64, sizes[i], 200000);
+#endif
+    bench_box(sizes[i], 20000);
+  }
+  bench_open(0);
+  bench_open(1);
+  // a manifest, and a large payload
+  bench_sha512(1024, 8192);
+  bench_sha512(1024*1024, 64);
+  return 0;
+}
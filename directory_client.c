@@ -83,6 +83,7 @@ static int load_directory_config()
     directory_service = find_subscriber(config.directory.service.binary, SID_SIZE, 1);
     if (!directory_service)
       return WHYF("Failed to create subscriber record");
+    overlay_forwarding_invalidate();
     // used by tests
     INFOF("ADD DIRECTORY SERVICE %s", alloca_tohex_sid(directory_service->sid));
   }
@@ -1,5 +1,6 @@
 
 #include "constants.h"
+#include "conf.h"
 #include "mdp_client.h"
 #include <poll.h>
 #include <stdio.h>
@@ -69,28 +70,22 @@ static void add_item(char *key, char *value){
   fprintf(stderr, "PUBLISHED \"%s\" = \"%s\"\n", key, value);
 }
 
-static void add_record(){
-  int ttl;
-  overlay_mdp_frame mdp;
-  
-  if (overlay_mdp_recv(&mdp, MDP_PORT_DIRECTORY, &ttl))
-    return;
-  
-  if (mdp.packetTypeAndFlags&MDP_NOCRYPT){
+static void add_record(overlay_mdp_frame *mdp){
+  if (mdp->packetTypeAndFlags&MDP_NOCRYPT){
     fprintf(stderr, "Only encrypted packets will be considered for publishing\n");
     return;
   }
   
   // make sure the payload is a NULL terminated string
-  mdp.in.payload[mdp.in.payload_length]=0;
+  mdp->in.payload[mdp->in.payload_length]=0;
   
-  char *did=(char *)mdp.in.payload;
+  char *did=(char *)mdp->in.payload;
   int i=0;
-  while(i<mdp.in.payload_length && mdp.in.payload[i] && mdp.in.payload[i]!='|')
+  while(i<mdp->in.payload_length && mdp->in.payload[i] && mdp->in.payload[i]!='|')
     i++;
-  mdp.in.payload[i]=0;
-  char *name = (char *)mdp.in.payload+i+1;
-  char *sid = alloca_tohex_sid(mdp.in.src.sid);
+  mdp->in.payload[i]=0;
+  char *name = (char *)mdp->in.payload+i+1;
+  char *sid = alloca_tohex_sid(mdp->in.src.sid);
   
   // TODO check that did is a valid phone number
   
@@ -99,6 +94,13 @@ static void add_record(){
   add_item(did, url);
 }
 
+static void add_records(){
+  overlay_mdp_frame frames[MDP_BATCH_MAX];
+  int i, count = overlay_mdp_recv_batch(frames, MDP_BATCH_MAX, MDP_PORT_DIRECTORY);
+  for (i=0;i<count;i++)
+    add_record(&frames[i]);
+}
+
 static void respond(char *token, struct item *item, char *key){
   if (!item)
     return;
@@ -159,8 +161,12 @@ static void resolve_request(){
 }
 
 int main(int argc, char **argv){
-  struct pollfd fds[2];
+  struct pollfd fds[3];
 
+  // read the daemon's config, eg to find out whether to use an MDP ring
+  cf_init();
+  cf_load_permissive();
+  
   // bind for incoming directory updates
   sid_t srcsid;
   if (overlay_mdp_getmyaddr(0, &srcsid))
@@ -172,17 +178,22 @@ int main(int argc, char **argv){
   fds[0].events = POLLIN;
   fds[1].fd = mdp_client_socket;
   fds[1].events = POLLIN;
+  // frames may arrive through a shared memory ring instead, poll() ignores -1
+  fds[2].fd = overlay_mdp_client_doorbell();
+  fds[2].events = POLLIN;
   
   printf("STARTED\n");
   fflush(stdout);
   
   while(1){
-    int r = poll(fds, 2, 100);
+    int r = poll(fds, 3, 100);
     if (r>0){
       if (fds[0].revents & POLLIN)
 	resolve_request();
-      if (fds[1].revents & POLLIN)
-	add_record();
+      // the daemon only rings the doorbell when the ring was empty, so drain it
+      if ((fds[1].revents | fds[2].revents) & POLLIN)
+	while(overlay_mdp_client_poll(0)>0)
+	  add_records();
       
       if (fds[0].revents & (POLLHUP | POLLERR))
 	break;
@@ -18,6 +18,8 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 */
 
 #include <poll.h>
+#include <pthread.h>
+#include <signal.h>
 #include "serval.h"
 #include "conf.h"
 #include "str.h"
@@ -231,6 +233,206 @@ static void call_alarm(struct sched_ent *alarm, int revents)
   OUT();
 }
 
+/* Call the alarms that have fallen due without waiting on any file handles, and
+   return the time of the next alarm, or -1 if nothing is scheduled.  Alarms that
+   reschedule themselves for the current time are left for the next call.
+   Used by the mesh simulator to drive each virtual node from its own clock. */
+time_ms_t fd_run_alarms()
+{
+  IN();
+  time_ms_t now = gettime_ms();
+  struct sched_ent *alarm;
+  
+  while (next_alarm!=NULL&&next_alarm->alarm <=now){
+    alarm = next_alarm;
+    unschedule(alarm);
+    deadline(alarm);
+  }
+  
+  int count=0;
+  for (alarm = next_deadline; alarm; alarm = alarm->_next)
+    count++;
+  
+  while (count-- > 0 && next_deadline){
+    alarm = next_deadline;
+    unschedule(alarm);
+    call_alarm(alarm, 0);
+  }
+  
+  if (next_deadline)
+    RETURN(now);
+  if (next_alarm)
+    RETURN(next_alarm->alarm);
+  RETURN(-1);
+  OUT();
+}
+
+struct fd_state{
+  struct sched_ent *next_alarm;
+  struct sched_ent *next_deadline;
+};
+
+/* Exchange the scheduled alarm lists with those saved in *state, so that each
+   simulated node keeps its own schedule.  A NULL *state is replaced with an
+   empty schedule. Watched file handles are not swapped. */
+int fd_swap_state(void **state)
+{
+  struct fd_state *s = *state;
+  if (!s){
+    s = calloc(1, sizeof(struct fd_state));
+    if (!s)
+      return WHY_perror("calloc");
+    *state = s;
+  }
+  struct fd_state old = {.next_alarm=next_alarm, .next_deadline=next_deadline};
+  next_alarm = s->next_alarm;
+  next_deadline = s->next_deadline;
+  *s = old;
+  return 0;
+}
+
+/* Worker threads, for jobs such as signature checks that would otherwise stall
+   the main loop.  Finished jobs are put on a done list, and a byte written to a
+   pipe wakes up fd_poll(), which calls each job's complete() function in the
+   order the jobs finished.  With no workers running, fd_submit_work() runs
+   each job immediately. */
+static pthread_mutex_t work_lock=PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work_ready=PTHREAD_COND_INITIALIZER;
+static struct work_item *work_queue=NULL, *work_queue_tail=NULL;
+static struct work_item *work_done=NULL, *work_done_tail=NULL;
+static int worker_count=0;
+static int work_pipe[2]={-1,-1};
+
+static void fd_work_completed(struct sched_ent *alarm);
+static struct profile_total work_completed_stats={.name="fd_work_completed"};
+static struct sched_ent work_completed_alarm={
+  .function=fd_work_completed,
+  .stats=&work_completed_stats,
+};
+
+static void *fd_worker(void *arg)
+{
+  while(1){
+    pthread_mutex_lock(&work_lock);
+    while(!work_queue)
+      pthread_cond_wait(&work_ready, &work_lock);
+    struct work_item *item=work_queue;
+    work_queue=item->_next;
+    if (!work_queue)
+      work_queue_tail=NULL;
+    pthread_mutex_unlock(&work_lock);
+    
+    item->work(item);
+    
+    item->_next=NULL;
+    pthread_mutex_lock(&work_lock);
+    if (work_done_tail)
+      work_done_tail->_next=item;
+    else
+      work_done=item;
+    work_done_tail=item;
+    pthread_mutex_unlock(&work_lock);
+    
+    // if the pipe is full, the main loop has a wake up pending already
+    char c=0;
+    if (write(work_pipe[1], &c, 1)==-1 && errno!=EAGAIN)
+      break;
+  }
+  return NULL;
+}
+
+static void fd_work_completed(struct sched_ent *alarm)
+{
+  char buf[64];
+  while(read(alarm->poll.fd, buf, sizeof buf)>0)
+    ;
+  
+  pthread_mutex_lock(&work_lock);
+  struct work_item *item=work_done;
+  work_done=work_done_tail=NULL;
+  pthread_mutex_unlock(&work_lock);
+  
+  while(item){
+    struct work_item *next=item->_next;
+    item->complete(item);
+    item=next;
+  }
+}
+
+/* Start count worker threads, which then run until the process exits. */
+int fd_start_workers(int count)
+{
+  if (worker_count || count<=0)
+    return 0;
+  
+  if (pipe(work_pipe)==-1)
+    return WHY_perror("pipe");
+  set_nonblock(work_pipe[0]);
+  set_nonblock(work_pipe[1]);
+  
+  work_completed_alarm.poll.fd=work_pipe[0];
+  work_completed_alarm.poll.events=POLLIN;
+  if (watch(&work_completed_alarm))
+    return -1;
+  
+  // leave all signal handling to the main thread
+  sigset_t all, old;
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &old);
+  
+  int i;
+  for (i=0;i<count;i++){
+    pthread_t thread;
+    int err=pthread_create(&thread, NULL, fd_worker, NULL);
+    if (err){
+      errno=err;
+      WHY_perror("pthread_create");
+      break;
+    }
+    pthread_detach(thread);
+    worker_count++;
+  }
+  
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+  
+  if (worker_count==0){
+    unwatch(&work_completed_alarm);
+    close(work_pipe[0]);
+    close(work_pipe[1]);
+    work_pipe[0]=work_pipe[1]=-1;
+    return -1;
+  }
+  INFOF("Started %d worker threads", worker_count);
+  return 0;
+}
+
+int fd_workers_running()
+{
+  return worker_count;
+}
+
+/* Queue item->work() to run on a worker thread, and item->complete() to be
+   called from fd_poll() when it has finished. */
+int fd_submit_work(struct work_item *item)
+{
+  item->_next=NULL;
+  if (!worker_count){
+    item->work(item);
+    item->complete(item);
+    return 0;
+  }
+  
+  pthread_mutex_lock(&work_lock);
+  if (work_queue_tail)
+    work_queue_tail->_next=item;
+  else
+    work_queue=item;
+  work_queue_tail=item;
+  pthread_cond_signal(&work_ready);
+  pthread_mutex_unlock(&work_lock);
+  return 0;
+}
+
 int fd_poll()
 {
   IN();
@@ -12,6 +12,7 @@ HDRS=	fifo.h \
 	strbuf.h \
 	strbuf_helpers.h \
 	sha2.h \
+	sha512_multi.h \
 	conf.h \
 	conf_schema.h \
 	crypto.h \
@@ -21,4 +22,5 @@ HDRS=	fifo.h \
 	constants.h \
 	monitor-client.h \
 	mdp_client.h \
+	mdp_ring.h \
 	sqlite-amalgamation-3070900/sqlite3.h
@@ -151,6 +151,31 @@ keyring_file *keyring_open(char *file)
   return k;
 }
 
+/* Create a keyring that is never written to disk, holding a single new identity.
+   Used when running simulated nodes and test harnesses in one process. */
+keyring_file *keyring_create_in_memory()
+{
+  keyring_file *k=calloc(sizeof(keyring_file),1);
+  if (!k) {
+    WHY_perror("calloc");
+    return NULL;
+  }
+  k->bam=calloc(sizeof(keyring_bam),1);
+  k->contexts[0]=calloc(sizeof(keyring_context),1);
+  if (!k->bam || !k->contexts[0]) {
+    WHY_perror("calloc");
+    keyring_free(k);
+    return NULL;
+  }
+  k->contexts[0]->KeyRingPin=strdup("");
+  k->context_count=1;
+  if (!keyring_create_identity(k, k->contexts[0], "")) {
+    keyring_free(k);
+    return NULL;
+  }
+  return k;
+}
+
 void keyring_free(keyring_file *k)
 {
   int i;
@@ -233,6 +258,7 @@ void keyring_free_identity(keyring_identity *id)
   if (id->subscriber){
     id->subscriber->identity=NULL;
     set_reachable(id->subscriber, REACHABLE_NONE);
+    keyring_forget_nm_bytes();
   }
     
   bzero(id,sizeof(keyring_identity));
@@ -712,6 +738,7 @@ int keyring_decrypt_pkr(keyring_file *k,keyring_context *c,
 	id->subscriber->identity = id;
 	if (!my_subscriber)
 	  my_subscriber=id->subscriber;
+	keyring_forget_nm_bytes();
       }
       // only one key per identity supported
       break;
@@ -914,6 +941,7 @@ keyring_identity *keyring_create_identity(keyring_file *k,keyring_context *c, co
     id->subscriber->identity = id;
     if (!my_subscriber)
       my_subscriber=id->subscriber;
+    keyring_forget_nm_bytes();
   }
   
   /* Everything went fine */
@@ -1217,6 +1245,13 @@ int keyring_mapping_request(keyring_file *k, overlay_mdp_frame *req)
   if (req->out.payload_length==1) {
     /* It's a request, so find the SAS for the SID the request was addressed to,
        use that to sign that SID, and then return it in an authcrypted frame. */
+    struct subscriber *requester=find_subscriber(req->out.src.sid, SID_SIZE, 0);
+    if (!requester || (requester->reachable!=REACHABLE_SELF && !overlay_forwarding_lookup(requester))){
+      /* They will ask again, no point signing a reply we can't route yet */
+      if (config.debug.keyring)
+	DEBUGF("Ignoring SAS mapping request from %s, it isn't reachable yet", alloca_tohex_sid(req->out.src.sid));
+      return 0;
+    }
     unsigned char *sas_public=NULL;
     unsigned char *sas_priv =keyring_find_sas_private(keyring,req->out.dst.sid,&sas_public);
 
@@ -1273,6 +1308,14 @@ int keyring_send_sas_request(struct subscriber *subscriber){
   if (!my_subscriber)
     return WHY("couldn't request SAS (I don't know who I am)");
   
+  /* We'll ask again when they become reachable (see set_reachable()), or
+     send us another signed frame */
+  if (!overlay_forwarding_lookup(subscriber)){
+    if (config.debug.keyring)
+      DEBUGF("Not requesting SAS mapping for SID=%s, it isn't reachable yet", alloca_tohex_sid(subscriber->sid));
+    return 0;
+  }
+  
   if (config.debug.keyring)
     DEBUGF("Requesting SAS mapping for SID=%s", alloca_tohex_sid(subscriber->sid));
   
@@ -1402,19 +1445,93 @@ int keyring_seed(keyring_file *k)
   can indeed be reused.
 */
 
-/* XXX We need a more efficient implementation than a linear list, but it will
-   do for now. */
+/* The cache is a hash table of records chained by index, with every record
+   also on a doubly linked list in least recently used order, so both lookups
+   and evictions are constant time.
+   Its size comes from keyring.nm_cache_size, and is only changed (and the
+   cache flushed) when that setting changes. */
 struct nm_record {
-  /* 96 bytes per record */
   unsigned char known_key[crypto_box_curve25519xsalsa20poly1305_PUBLICKEYBYTES];
   unsigned char unknown_key[crypto_box_curve25519xsalsa20poly1305_PUBLICKEYBYTES];
   unsigned char nm_bytes[crypto_box_curve25519xsalsa20poly1305_BEFORENMBYTES];
+  int hash_next;
+  int lru_prev;
+  int lru_next;
 };
 
-int nm_slots_used=0;
-/* 512 x 96 bytes = 48KB, not too big */
-#define NM_CACHE_SLOTS 512
-struct nm_record nm_cache[NM_CACHE_SLOTS];
+static struct nm_record *nm_cache=NULL;
+static int *nm_buckets=NULL;
+static unsigned int nm_slots=0;
+static unsigned int nm_bucket_mask=0;
+static unsigned int nm_slots_used=0;
+/* most and least recently used records */
+static int nm_lru_head=-1;
+static int nm_lru_tail=-1;
+struct nm_cache_stats nm_cache_stats;
+
+/* The keys are curve25519 public keys, so any of their bytes are as good a hash as we need */
+static unsigned int nm_hash(const unsigned char *known_sid, const unsigned char *unknown_sid)
+{
+  uint32_t h = ((unsigned int)known_sid[0]<<24 | (unsigned int)known_sid[1]<<16 | (unsigned int)known_sid[2]<<8 | known_sid[3])
+    ^ ((unsigned int)unknown_sid[0]<<24 | (unsigned int)unknown_sid[1]<<16 | (unsigned int)unknown_sid[2]<<8 | unknown_sid[3]) * 2654435761u;
+  return h & nm_bucket_mask;
+}
+
+static void nm_lru_unlink(int i)
+{
+  struct nm_record *r=&nm_cache[i];
+  if (r->lru_prev==-1) nm_lru_head=r->lru_next; else nm_cache[r->lru_prev].lru_next=r->lru_next;
+  if (r->lru_next==-1) nm_lru_tail=r->lru_prev; else nm_cache[r->lru_next].lru_prev=r->lru_prev;
+}
+
+static void nm_lru_push(int i)
+{
+  struct nm_record *r=&nm_cache[i];
+  r->lru_prev=-1;
+  r->lru_next=nm_lru_head;
+  if (nm_lru_head!=-1) nm_cache[nm_lru_head].lru_prev=i;
+  nm_lru_head=i;
+  if (nm_lru_tail==-1) nm_lru_tail=i;
+}
+
+static int nm_cache_resize(unsigned int slots)
+{
+  unsigned int buckets=1;
+  while(buckets < slots*2)
+    buckets<<=1;
+  struct nm_record *cache=malloc(slots * sizeof(struct nm_record));
+  int *bucket=malloc(buckets * sizeof(int));
+  if (!cache || !bucket){
+    if (cache) free(cache);
+    if (bucket) free(bucket);
+    return WHY_perror("malloc");
+  }
+  if (nm_cache) free(nm_cache);
+  if (nm_buckets) free(nm_buckets);
+  nm_cache=cache;
+  nm_buckets=bucket;
+  memset(nm_buckets, 0xFF, buckets * sizeof(int));
+  nm_slots=slots;
+  nm_bucket_mask=buckets-1;
+  nm_slots_used=0;
+  nm_lru_head=nm_lru_tail=-1;
+  if (config.debug.keyring)
+    DEBUGF("Caching up to %u crypto_box shared secrets", slots);
+  return 0;
+}
+
+/* Forget every cached shared secret.  Called whenever the set of unlocked
+   identities changes, as a secret is only valid while we hold its known key */
+void keyring_forget_nm_bytes()
+{
+  if (nm_cache){
+    bzero(nm_cache, nm_slots * sizeof(struct nm_record));
+    memset(nm_buckets, 0xFF, (nm_bucket_mask+1) * sizeof(int));
+  }
+  nm_slots_used=0;
+  nm_lru_head=nm_lru_tail=-1;
+  overlay_mdp_forget_crypt_key();
+}
 
 unsigned char *keyring_get_nm_bytes(unsigned char *known_sid, unsigned char *unknown_sid)
 {
@@ -1423,13 +1540,21 @@ unsigned char *keyring_get_nm_bytes(unsigned char *known_sid, unsigned char *unk
   if (!unknown_sid) { RETURNNULL(WHYNULL("unknown pub key is null")); }
   if (!keyring) { RETURNNULL(WHYNULL("keyring is null")); }
 
-  int i;
+  if (nm_slots!=config.keyring.nm_cache_size && nm_cache_resize(config.keyring.nm_cache_size))
+    RETURNNULL(NULL);
 
   /* See if we have it cached already */
-  for(i=0;i<nm_slots_used;i++)
+  unsigned int h=nm_hash(known_sid, unknown_sid);
+  int i;
+  for(i=nm_buckets[h];i!=-1;i=nm_cache[i].hash_next)
     {
       if (memcmp(nm_cache[i].known_key,known_sid,SID_SIZE)) continue;
       if (memcmp(nm_cache[i].unknown_key,unknown_sid,SID_SIZE)) continue;
+      if (nm_lru_head!=i){
+	nm_lru_unlink(i);
+	nm_lru_push(i);
+      }
+      nm_cache_stats.hits++;
       RETURN(nm_cache[i].nm_bytes);
     }
 
@@ -1438,12 +1563,20 @@ unsigned char *keyring_get_nm_bytes(unsigned char *known_sid, unsigned char *unk
   int cn=0,in=0,kp=0;
   if (!keyring_find_sid(keyring,&cn,&in,&kp,known_sid))
     { RETURNNULL(WHYNULL("known key is not in fact known.")); }
+  nm_cache_stats.misses++;
 
   /* work out where to store it */
-  if (nm_slots_used<NM_CACHE_SLOTS) {
-    i=nm_slots_used; nm_slots_used++; 
+  if (nm_slots_used<nm_slots) {
+    i=nm_slots_used++;
   } else {
-    i=random()%NM_CACHE_SLOTS;
+    /* evict the least recently used record */
+    i=nm_lru_tail;
+    nm_lru_unlink(i);
+    int *p=&nm_buckets[nm_hash(nm_cache[i].known_key, nm_cache[i].unknown_key)];
+    while(*p!=i)
+      p=&nm_cache[*p].hash_next;
+    *p=nm_cache[i].hash_next;
+    nm_cache_stats.evictions++;
   }
 
   /* calculate and store */
@@ -1455,6 +1588,9 @@ unsigned char *keyring_get_nm_bytes(unsigned char *known_sid, unsigned char *unk
 						 ->contexts[cn]
 						 ->identities[in]
 						 ->keypairs[kp]->private_key);
+  nm_cache[i].hash_next=nm_buckets[h];
+  nm_buckets[h]=i;
+  nm_lru_push(i);
 						 
   RETURN(nm_cache[i].nm_bytes);
   OUT();
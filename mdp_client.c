@@ -17,6 +17,9 @@
  */
 
 #include <sys/stat.h>
+#ifdef HAVE_SYS_EVENTFD_H
+#include <sys/eventfd.h>
+#endif
 #include "serval.h"
 #include "conf.h"
 #include "str.h"
@@ -25,8 +28,16 @@
 #include "overlay_address.h"
 #include "overlay_packet.h"
 #include "mdp_client.h"
+#include "mdp_ring.h"
 
 int mdp_client_socket=-1;
+
+/* Shared memory ring to the daemon, if config.mdp.ring is set and the daemon
+   accepted it.  Only MDP_TX frames travel through it. */
+static struct mdp_ring_region *mdp_client_ring=NULL;
+static int mdp_ring_to_server=-1;
+static int mdp_ring_to_client=-1;
+
 int overlay_mdp_send(overlay_mdp_frame *mdp,int flags,int timeout_ms)
 {
   int len=4;
@@ -40,6 +51,16 @@ int overlay_mdp_send(overlay_mdp_frame *mdp,int flags,int timeout_ms)
   len=overlay_mdp_relevant_bytes(mdp);
   if (len<0) return WHY("MDP frame invalid (could not compute length)");
   
+  if (mdp_client_ring && !(flags&MDP_AWAITREPLY)
+      && (mdp->packetTypeAndFlags&MDP_TYPE_MASK)==MDP_TX){
+    int r=mdp_ring_put(&mdp_client_ring->to_server, mdp, len, NULL, 0);
+    if (r==1)
+      mdp_ring_doorbell(mdp_ring_to_server);
+    if (r>=0)
+      return 0;
+    // the ring is full, so use the socket this time
+  }
+  
   /* Construct name of socket to send to. */
   struct sockaddr_un name;
   name.sun_family = AF_UNIX;
@@ -92,6 +113,105 @@ int overlay_mdp_send(overlay_mdp_frame *mdp,int flags,int timeout_ms)
 char overlay_mdp_client_socket_path[1024];
 int overlay_mdp_client_socket_path_len=-1;
 
+#ifdef HAVE_SYS_EVENTFD_H
+static void overlay_mdp_ring_close()
+{
+  if (mdp_client_ring)
+    mdp_ring_unmap(mdp_client_ring);
+  mdp_client_ring=NULL;
+  if (mdp_ring_to_server!=-1)
+    close(mdp_ring_to_server);
+  mdp_ring_to_server=-1;
+  if (mdp_ring_to_client!=-1)
+    close(mdp_ring_to_client);
+  mdp_ring_to_client=-1;
+}
+
+/* Create a ring region and its doorbells, and pass them to the daemon.  If
+   the daemon doesn't accept them we carry on with the socket alone. */
+static int overlay_mdp_ring_open()
+{
+  int fd=mdp_ring_create();
+  if (fd==-1)
+    return -1;
+  
+  struct mdp_ring_region *region=mdp_ring_map(fd, 1);
+  mdp_ring_to_server=eventfd(0, EFD_NONBLOCK);
+  mdp_ring_to_client=eventfd(0, EFD_NONBLOCK);
+  if (!region || mdp_ring_to_server==-1 || mdp_ring_to_client==-1){
+    if (mdp_ring_to_server==-1 || mdp_ring_to_client==-1)
+      WHY_perror("eventfd");
+    close(fd);
+    if (region)
+      mdp_ring_unmap(region);
+    overlay_mdp_ring_close();
+    return WHY("Could not create MDP ring");
+  }
+  
+  struct sockaddr_un name;
+  name.sun_family = AF_UNIX;
+  if (!FORM_SERVAL_INSTANCE_PATH(name.sun_path, "mdp.socket")){
+    close(fd);
+    mdp_ring_unmap(region);
+    overlay_mdp_ring_close();
+    return -1;
+  }
+  
+  overlay_mdp_frame mdp;
+  mdp.packetTypeAndFlags=MDP_RING;
+  int fds[MDP_RING_FD_COUNT];
+  fds[MDP_RING_FD_REGION]=fd;
+  fds[MDP_RING_FD_TO_SERVER]=mdp_ring_to_server;
+  fds[MDP_RING_FD_TO_CLIENT]=mdp_ring_to_client;
+  union {
+    struct cmsghdr header;
+    unsigned char buf[CMSG_SPACE(sizeof fds)];
+  } control;
+  struct iovec iov={.iov_base=&mdp, .iov_len=overlay_mdp_relevant_bytes(&mdp)};
+  struct msghdr msg={
+    .msg_name=&name,
+    .msg_namelen=sizeof(struct sockaddr_un),
+    .msg_iov=&iov,
+    .msg_iovlen=1,
+    .msg_control=control.buf,
+    .msg_controllen=sizeof control.buf,
+  };
+  struct cmsghdr *cmsg=CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level=SOL_SOCKET;
+  cmsg->cmsg_type=SCM_RIGHTS;
+  cmsg->cmsg_len=CMSG_LEN(sizeof fds);
+  bcopy(fds, CMSG_DATA(cmsg), sizeof fds);
+  
+  int r=sendmsg(mdp_client_socket, &msg, 0);
+  // the daemon has its own copy now, and our mapping keeps the file open
+  close(fd);
+  if (r==-1){
+    WHY_perror("sendmsg");
+    mdp_ring_unmap(region);
+    overlay_mdp_ring_close();
+    return -1;
+  }
+  
+  time_ms_t timeout=gettime_ms()+1000;
+  time_ms_t now;
+  while((now=gettime_ms())<timeout && overlay_mdp_client_poll(timeout-now)>0){
+    int ttl=-1;
+    if (overlay_mdp_recv(&mdp, 0, &ttl)==0 && (mdp.packetTypeAndFlags&MDP_TYPE_MASK)==MDP_ERROR){
+      if (mdp.error.error)
+	break;
+      mdp_client_ring=region;
+      if (config.debug.io)
+	DEBUG("Using shared memory ring for MDP frames");
+      return 0;
+    }
+  }
+  mdp_ring_unmap(region);
+  overlay_mdp_ring_close();
+  return WHY("MDP server did not accept the ring");
+}
+#endif
+
+
 int overlay_mdp_client_init()
 {
   if (mdp_client_socket==-1) {
@@ -135,6 +255,11 @@ int overlay_mdp_client_init()
     if (setsockopt(mdp_client_socket, SOL_SOCKET, SO_RCVBUF, 
 		   &send_buffer_size, sizeof(send_buffer_size)) == -1)
       WARN_perror("setsockopt");
+    
+#ifdef HAVE_SYS_EVENTFD_H
+    if (config.mdp.ring && overlay_mdp_ring_open()==-1)
+      WARN("Sending MDP frames through the socket instead");
+#endif
   }
   
   return 0;
@@ -149,6 +274,9 @@ int overlay_mdp_client_done()
     overlay_mdp_send(&mdp,0,0);
   }
   
+#ifdef HAVE_SYS_EVENTFD_H
+  overlay_mdp_ring_close();
+#endif
   if (overlay_mdp_client_socket_path_len>-1)
     unlink(overlay_mdp_client_socket_path);
   if (mdp_client_socket!=-1)
@@ -157,12 +285,35 @@ int overlay_mdp_client_done()
   return 0;
 }
 
+/* The descriptor that becomes readable when the daemon puts frames in an
+   empty ring, or -1 if we aren't using one.  A client with its own poll loop
+   must watch this as well as mdp_client_socket, then call
+   overlay_mdp_client_poll() to clear it and find out whether frames are
+   still waiting. */
+int overlay_mdp_client_doorbell()
+{
+  return mdp_client_ring?mdp_ring_to_client:-1;
+}
+
 int overlay_mdp_client_poll(time_ms_t timeout_ms)
 {
-  fd_set r;
+  fd_set r, e;
   int ret;
+  
+  // frames already waiting in the ring don't need a system call
+  if (mdp_client_ring && !mdp_ring_empty(&mdp_client_ring->to_client))
+    return 1;
+  
   FD_ZERO(&r);
   FD_SET(mdp_client_socket,&r);
+  int max_fd=mdp_client_socket;
+  if (mdp_client_ring){
+    FD_SET(mdp_ring_to_client,&r);
+    if (mdp_ring_to_client>max_fd)
+      max_fd=mdp_ring_to_client;
+  }
+  // a separate exception set, or select() would overwrite which fds are readable
+  e=r;
   if (timeout_ms<0) timeout_ms=0;
   
   struct timeval tv;
@@ -170,13 +321,51 @@ int overlay_mdp_client_poll(time_ms_t timeout_ms)
   if (timeout_ms>=0) {
     tv.tv_sec=timeout_ms/1000;
     tv.tv_usec=(timeout_ms%1000)*1000;
-    ret=select(mdp_client_socket+1,&r,NULL,&r,&tv);
+    ret=select(max_fd+1,&r,NULL,&e,&tv);
   }
   else
-    ret=select(mdp_client_socket+1,&r,NULL,&r,NULL);
+    ret=select(max_fd+1,&r,NULL,&e,NULL);
+  
+  if (ret>0 && mdp_client_ring && FD_ISSET(mdp_ring_to_client,&r))
+    mdp_ring_doorbell_clear(mdp_ring_to_client);
   return ret;
 }
 
+/* Make sure a datagram came from the server, given its NUL terminated sender path */
+static int overlay_mdp_check_sender(const char *mdp_socket_name, const char *sender)
+{
+  if (strncmp(mdp_socket_name, sender, sizeof(((struct sockaddr_un *)0)->sun_path))) {
+    /* Okay, reply was PROBABLY not from the server, but on OSX if the path
+     has a symlink in it, it is resolved in the reply path, but might not
+     be in the request path (mdp_socket_name), thus we need to stat() and
+     compare inode numbers etc */
+    struct stat sb1,sb2;
+    if (stat(mdp_socket_name,&sb1)) return WHY("stat(mdp_socket_name) failed, so could not verify that reply came from MDP server");
+    if (stat(sender,&sb2)) return WHY("stat(ra->sun_path) failed, so could not verify that reply came from MDP server");
+    if ((sb1.st_ino!=sb2.st_ino)||(sb1.st_dev!=sb2.st_dev))
+      return WHY("Reply did not come from server");
+  }
+  return 0;
+}
+
+static int overlay_mdp_check_received(overlay_mdp_frame *mdp, ssize_t len, int port)
+{
+  // silently drop incoming packets for the wrong port number
+  if (port>0 && port != mdp->in.dst.port){
+    WARNF("Ignoring packet for port %d",mdp->in.dst.port);
+    return -1;
+  }
+  
+  int expected_len = overlay_mdp_relevant_bytes(mdp);
+  
+  if (len < expected_len){
+    return WHYF("Expected packet length of %d, received only %lld bytes", expected_len, (long long) len);
+  }
+  
+  /* Valid packet received */
+  return 0;
+}
+
 int overlay_mdp_recv(overlay_mdp_frame *mdp, int port, int *ttl) 
 {
   char mdp_socket_name[101];
@@ -189,9 +378,16 @@ int overlay_mdp_recv(overlay_mdp_frame *mdp, int port, int *ttl)
     return WHY("Could not find mdp socket");
   mdp->packetTypeAndFlags=0;
   
+  /* Frames in the ring can only have come from the server */
+  ssize_t len = 0;
+  if (mdp_client_ring)
+    len = mdp_ring_get(&mdp_client_ring->to_client, mdp);
+  if (len>0)
+    return overlay_mdp_check_received(mdp, len, port);
+  
   /* Check if reply available */
   set_nonblock(mdp_client_socket);
-  ssize_t len = recvwithttl(mdp_client_socket,(unsigned char *)mdp, sizeof(overlay_mdp_frame),ttl,recvaddr,&recvaddrlen);
+  len = recvwithttl(mdp_client_socket,(unsigned char *)mdp, sizeof(overlay_mdp_frame),ttl,recvaddr,&recvaddrlen);
   set_block(mdp_client_socket);
   
   recvaddr_un=(struct sockaddr_un *)recvaddr;
@@ -199,38 +395,161 @@ int overlay_mdp_recv(overlay_mdp_frame *mdp, int port, int *ttl)
   if (recvaddrlen<1024) recvaddrbuffer[recvaddrlen]=0;
   if (len>0) {
     /* Make sure recvaddr matches who we sent it to */
-    if (strncmp(mdp_socket_name, recvaddr_un->sun_path, sizeof(recvaddr_un->sun_path))) {
-      /* Okay, reply was PROBABLY not from the server, but on OSX if the path
-       has a symlink in it, it is resolved in the reply path, but might not
-       be in the request path (mdp_socket_name), thus we need to stat() and
-       compare inode numbers etc */
-      struct stat sb1,sb2;
-      if (stat(mdp_socket_name,&sb1)) return WHY("stat(mdp_socket_name) failed, so could not verify that reply came from MDP server");
-      if (stat(recvaddr_un->sun_path,&sb2)) return WHY("stat(ra->sun_path) failed, so could not verify that reply came from MDP server");
-      if ((sb1.st_ino!=sb2.st_ino)||(sb1.st_dev!=sb2.st_dev))
-	return WHY("Reply did not come from server");
-    }
-    
-    // silently drop incoming packets for the wrong port number
-    if (port>0 && port != mdp->in.dst.port){
-      WARNF("Ignoring packet for port %d",mdp->in.dst.port);
+    if (overlay_mdp_check_sender(mdp_socket_name, recvaddr_un->sun_path))
       return -1;
-    }
-    
-    int expected_len = overlay_mdp_relevant_bytes(mdp);
-    
-    if (len < expected_len){
-      return WHYF("Expected packet length of %d, received only %lld bytes", expected_len, (long long) len);
-    }
-    
-    /* Valid packet received */
-    return 0;
+    return overlay_mdp_check_received(mdp, len, port);
   } else 
   /* no packet received */
     return -1;
   
 }
 
+/* Send count frames without waiting for any replies.  MDP_TX frames go
+   through the shared memory ring while it has room, the rest through the
+   socket, as many per system call as sendmmsg() will take.
+   Returns the number of frames sent, which is less than count if the socket
+   would have blocked, or -1 if none could be sent because of an error.
+ */
+int overlay_mdp_send_batch(overlay_mdp_frame *frames, int count)
+{
+  int sent=0;
+  
+  if (mdp_client_socket==-1) 
+    if (overlay_mdp_client_init() != 0)
+      return -1;
+  
+  if (mdp_client_ring){
+    int doorbell=0;
+    while(sent<count && (frames[sent].packetTypeAndFlags&MDP_TYPE_MASK)==MDP_TX){
+      int len=overlay_mdp_relevant_bytes(&frames[sent]);
+      if (len<0)
+	return WHY("MDP frame invalid (could not compute length)");
+      int r=mdp_ring_put(&mdp_client_ring->to_server, &frames[sent], len, NULL, 0);
+      if (r<0)
+	break;
+      if (r==1)
+	doorbell=1;
+      sent++;
+    }
+    if (doorbell)
+      mdp_ring_doorbell(mdp_ring_to_server);
+  }
+  
+  struct sockaddr_un name;
+  name.sun_family = AF_UNIX;
+  if (!FORM_SERVAL_INSTANCE_PATH(name.sun_path, "mdp.socket"))
+    return -1;
+  
+  while(sent<count){
+#ifdef HAVE_SENDMMSG
+    struct mmsghdr msgs[MDP_BATCH_MAX];
+    struct iovec iov[MDP_BATCH_MAX];
+    int i, n=count-sent;
+    if (n>MDP_BATCH_MAX)
+      n=MDP_BATCH_MAX;
+    bzero(msgs, sizeof msgs);
+    for (i=0;i<n;i++){
+      int len=overlay_mdp_relevant_bytes(&frames[sent+i]);
+      if (len<0)
+	return WHY("MDP frame invalid (could not compute length)");
+      iov[i].iov_base=&frames[sent+i];
+      iov[i].iov_len=len;
+      msgs[i].msg_hdr.msg_name=&name;
+      msgs[i].msg_hdr.msg_namelen=sizeof(struct sockaddr_un);
+      msgs[i].msg_hdr.msg_iov=&iov[i];
+      msgs[i].msg_hdr.msg_iovlen=1;
+    }
+    int r=sendmmsg(mdp_client_socket, msgs, n, MSG_DONTWAIT);
+#else
+    int len=overlay_mdp_relevant_bytes(&frames[sent]);
+    if (len<0)
+      return WHY("MDP frame invalid (could not compute length)");
+    int n=1;
+    int r=sendto(mdp_client_socket, &frames[sent], len, MSG_DONTWAIT,
+		 (struct sockaddr *)&name, sizeof(struct sockaddr_un));
+    if (r>=0)
+      r=1;
+#endif
+    if (r==-1){
+      if (errno==EAGAIN || errno==EWOULDBLOCK)
+	break;
+      WHY_perror("sendmmsg");
+      return sent?sent:-1;
+    }
+    sent+=r;
+    if (r<n)
+      break;
+  }
+  return sent;
+}
+
+/* Receive up to count frames that are already waiting, without blocking.
+   Frames are checked as by overlay_mdp_recv(), and any that fail are dropped.
+   Returns the number of frames received, or -1 on error.
+ */
+int overlay_mdp_recv_batch(overlay_mdp_frame *frames, int count, int port)
+{
+  int received=0;
+  
+  while(mdp_client_ring && received<count){
+    int len=mdp_ring_get(&mdp_client_ring->to_client, &frames[received]);
+    if (len==0)
+      break;
+    if (len>0 && overlay_mdp_check_received(&frames[received], len, port)==0)
+      received++;
+  }
+  if (received>=count)
+    return received;
+  
+#ifdef HAVE_RECVMMSG
+  char mdp_socket_name[101];
+  if (!FORM_SERVAL_INSTANCE_PATH(mdp_socket_name, "mdp.socket"))
+    return WHY("Could not find mdp socket");
+  
+  struct mmsghdr msgs[MDP_BATCH_MAX];
+  struct iovec iov[MDP_BATCH_MAX];
+  // room to NUL terminate each sender path
+  char addrs[MDP_BATCH_MAX][sizeof(struct sockaddr_un)+1];
+  int i, n=count-received;
+  if (n>MDP_BATCH_MAX)
+    n=MDP_BATCH_MAX;
+  bzero(msgs, sizeof msgs);
+  for (i=0;i<n;i++){
+    iov[i].iov_base=&frames[received+i];
+    iov[i].iov_len=sizeof(overlay_mdp_frame);
+    msgs[i].msg_hdr.msg_name=addrs[i];
+    msgs[i].msg_hdr.msg_namelen=sizeof(struct sockaddr_un);
+    msgs[i].msg_hdr.msg_iov=&iov[i];
+    msgs[i].msg_hdr.msg_iovlen=1;
+  }
+  int r=recvmmsg(mdp_client_socket, msgs, n, MSG_DONTWAIT, NULL);
+  if (r==-1){
+    if (errno==EAGAIN || errno==EWOULDBLOCK)
+      return received;
+    WHY_perror("recvmmsg");
+    return received?received:-1;
+  }
+  
+  /* Frames are received in place, so close up any gaps left by dropped ones */
+  int first=received;
+  for (i=0;i<r;i++){
+    overlay_mdp_frame *mdp=&frames[first+i];
+    addrs[i][msgs[i].msg_hdr.msg_namelen]=0;
+    if (overlay_mdp_check_sender(mdp_socket_name, ((struct sockaddr_un *)addrs[i])->sun_path)
+      || overlay_mdp_check_received(mdp, msgs[i].msg_len, port))
+      continue;
+    if (mdp!=&frames[received])
+      bcopy(mdp, &frames[received], msgs[i].msg_len);
+    received++;
+  }
+#else
+  int ttl=-1;
+  while(received<count && overlay_mdp_recv(&frames[received], port, &ttl)==0)
+    received++;
+#endif
+  return received;
+}
+
 // send a request to servald deamon to add a port binding
 int overlay_mdp_bind(const sid_t *localaddr, int port) 
 {
@@ -280,6 +599,7 @@ int overlay_mdp_relevant_bytes(overlay_mdp_frame *mdp)
   {
     case MDP_ROUTING_TABLE:
     case MDP_GOODBYE:
+    case MDP_RING:
       /* no arguments for saying goodbye */
       len=&mdp->raw[0]-(char *)mdp;
       break;
@@ -37,8 +37,13 @@ extern int mdp_client_socket;
 int overlay_mdp_client_init();
 int overlay_mdp_client_done();
 int overlay_mdp_client_poll(time_ms_t timeout_ms);
+int overlay_mdp_client_doorbell();
 int overlay_mdp_recv(overlay_mdp_frame *mdp, int port, int *ttl);
 int overlay_mdp_send(overlay_mdp_frame *mdp,int flags,int timeout_ms);
+/* Frames handed to the kernel in one call by the batch functions */
+#define MDP_BATCH_MAX 32
+int overlay_mdp_send_batch(overlay_mdp_frame *frames, int count);
+int overlay_mdp_recv_batch(overlay_mdp_frame *frames, int count, int port);
 int overlay_mdp_relevant_bytes(overlay_mdp_frame *mdp);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,182 @@
+/*
+ Copyright (C) 2012 Serval Project Inc.
+
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU General Public License
+ as published by the Free Software Foundation; either version 2
+ of the License, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <sys/stat.h>
+#include "serval.h"
+#include "mdp_ring.h"
+
+/* Create the file for a ring region, sized and then sealed so that neither
+   process can shrink it while the other has it mapped.  Touching a mapped
+   page past the end of the file would kill the daemon with SIGBUS. */
+int mdp_ring_create()
+{
+#if defined(HAVE_MEMFD_CREATE) && defined(F_SEAL_SHRINK)
+  int fd=memfd_create("mdp-ring", MFD_CLOEXEC|MFD_ALLOW_SEALING);
+  if (fd==-1)
+    return WHY_perror("memfd_create");
+  if (ftruncate(fd, sizeof(struct mdp_ring_region))==-1){
+    WHY_perror("ftruncate");
+    close(fd);
+    return -1;
+  }
+  if (fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK|F_SEAL_GROW|F_SEAL_SEAL)==-1){
+    WHY_perror("fcntl(F_ADD_SEALS)");
+    close(fd);
+    return -1;
+  }
+  return fd;
+#else
+  return WHY("MDP rings need memfd_create() and file seals");
+#endif
+}
+
+/* Map a ring region file.  The creator stamps it, the other end checks that
+   it can't shrink and that both agree on the layout.  The file contents may
+   be changed at any time by the other process, so nothing read from it is
+   trusted beyond what mdp_ring_get() checks. */
+struct mdp_ring_region *mdp_ring_map(int fd, int create)
+{
+  if (!create){
+#ifdef F_SEAL_SHRINK
+    int seals=fcntl(fd, F_GET_SEALS);
+    if (seals==-1){
+      WHY_perror("fcntl(F_GET_SEALS)");
+      return NULL;
+    }
+    if (!(seals&F_SEAL_SHRINK)){
+      WHY("MDP ring region is not sealed against shrinking");
+      return NULL;
+    }
+#else
+    WHY("Can't check that the MDP ring region is sealed against shrinking");
+    return NULL;
+#endif
+    struct stat stat;
+    if (fstat(fd, &stat)==-1){
+      WHY_perror("fstat");
+      return NULL;
+    }
+    if (!S_ISREG(stat.st_mode) || stat.st_size < sizeof(struct mdp_ring_region)){
+      WHYF("MDP ring region is not a regular file of at least %d bytes", (int)sizeof(struct mdp_ring_region));
+      return NULL;
+    }
+  }
+
+  struct mdp_ring_region *region = mmap(NULL, sizeof(struct mdp_ring_region),
+    PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  if (region==MAP_FAILED){
+    WHY_perror("mmap");
+    return NULL;
+  }
+
+  if (create){
+    region->slot_count = MDP_RING_SLOTS;
+    region->frame_size = sizeof(overlay_mdp_frame);
+    region->magic = MDP_RING_MAGIC;
+  }else if (region->magic!=MDP_RING_MAGIC
+    || region->slot_count!=MDP_RING_SLOTS
+    || region->frame_size!=sizeof(overlay_mdp_frame)){
+    WHY("MDP ring region has the wrong layout");
+    munmap(region, sizeof(struct mdp_ring_region));
+    return NULL;
+  }
+  return region;
+}
+
+int mdp_ring_unmap(struct mdp_ring_region *region)
+{
+  if (munmap(region, sizeof(struct mdp_ring_region))==-1)
+    return WHY_perror("munmap");
+  return 0;
+}
+
+/* Copy a frame, given as a header and a payload, into the next free slot.
+   Returns -1 if the ring is full, 1 if the ring was empty so the consumer
+   may be asleep and needs its doorbell rung, otherwise 0.
+ */
+int mdp_ring_put(struct mdp_ring *ring, const void *header, size_t header_len, const void *payload, size_t payload_len)
+{
+  uint32_t head = ring->head;
+  if (head - ring->tail >= MDP_RING_SLOTS)
+    return -1;
+  if (header_len + payload_len > sizeof(overlay_mdp_frame))
+    return WHYF("Frame of %d bytes is too large for an MDP ring slot", (int)(header_len + payload_len));
+
+  struct mdp_ring_slot *slot = &ring->slots[head % MDP_RING_SLOTS];
+  bcopy(header, slot->frame, header_len);
+  if (payload_len)
+    bcopy(payload, slot->frame + header_len, payload_len);
+  slot->length = header_len + payload_len;
+
+  // the slot must be complete before the consumer can see it
+  __sync_synchronize();
+  ring->head = head + 1;
+  // and the consumer must see the new head before we decide whether it has gone to sleep
+  __sync_synchronize();
+  return ring->tail == head ? 1 : 0;
+}
+
+/* Copy the oldest frame out of the ring, so that the producer can't change
+   it while we are looking at it.  Returns the frame length, 0 if the ring is
+   empty, or -1 if the slot was not valid.
+ */
+int mdp_ring_get(struct mdp_ring *ring, overlay_mdp_frame *mdp)
+{
+  uint32_t tail = ring->tail;
+  if (ring->head == tail)
+    return 0;
+  // don't read the slot before the head that published it
+  __sync_synchronize();
+
+  struct mdp_ring_slot *slot = &ring->slots[tail % MDP_RING_SLOTS];
+  // read the length once, the producer may change it again at any time
+  uint32_t length = *(volatile uint32_t *)&slot->length;
+  if (length <= sizeof(overlay_mdp_frame))
+    bcopy(slot->frame, mdp, length);
+
+  // finish reading before the producer may reuse the slot
+  __sync_synchronize();
+  ring->tail = tail + 1;
+  __sync_synchronize();
+
+  if (length > sizeof(overlay_mdp_frame) || length < sizeof(mdp->packetTypeAndFlags))
+    return WHYF("Invalid MDP ring slot length %u", length);
+  return length;
+}
+
+int mdp_ring_empty(struct mdp_ring *ring)
+{
+  __sync_synchronize();
+  return ring->head == ring->tail;
+}
+
+int mdp_ring_doorbell(int fd)
+{
+  uint64_t count=1;
+  if (write(fd, &count, sizeof count)==-1 && errno!=EAGAIN)
+    return WHY_perror("write(doorbell)");
+  return 0;
+}
+
+int mdp_ring_doorbell_clear(int fd)
+{
+  uint64_t count;
+  if (read(fd, &count, sizeof count)==-1 && errno!=EAGAIN)
+    return WHY_perror("read(doorbell)");
+  return 0;
+}
@@ -0,0 +1,81 @@
+/*
+ Copyright (C) 2012 Serval Project Inc.
+
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU General Public License
+ as published by the Free Software Foundation; either version 2
+ of the License, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef __SERVALD_MDP_RING_H
+#define __SERVALD_MDP_RING_H
+
+#include "serval.h"
+
+/* Shared memory transport between an MDP client and the daemon.
+
+   The client creates an anonymous file, sealed so that it can never be
+   shrunk under the daemon's mapping, maps it, and passes it to the daemon
+   over mdp.socket in an MDP_RING frame together with two eventfd doorbells
+   (one for each direction).  The daemon refuses a region without that seal.  The region holds two single producer, single
+   consumer rings of whole overlay_mdp_frames; the client produces to_server
+   and the daemon produces to_client.  A producer only rings the doorbell
+   when the ring was empty, so a busy consumer drains many frames per wakeup
+   without any system calls.
+
+   Everything else (binds, address lists, errors) stays on the datagram
+   socket, as does any frame that does not fit in a full ring.
+ */
+
+#define MDP_RING_MAGIC 0x4d445052
+#define MDP_RING_SLOTS 64
+
+struct mdp_ring_slot{
+  uint32_t length;
+  unsigned char frame[sizeof(overlay_mdp_frame)];
+};
+
+struct mdp_ring{
+  // written only by the producer
+  volatile uint32_t head;
+  char _pad1[60];
+  // written only by the consumer
+  volatile uint32_t tail;
+  char _pad2[60];
+  struct mdp_ring_slot slots[MDP_RING_SLOTS];
+};
+
+struct mdp_ring_region{
+  uint32_t magic;
+  uint32_t slot_count;
+  uint32_t frame_size;
+  char _pad[52];
+  struct mdp_ring to_server;
+  struct mdp_ring to_client;
+};
+
+/* fd order in the SCM_RIGHTS of an MDP_RING frame */
+#define MDP_RING_FD_REGION 0
+#define MDP_RING_FD_TO_SERVER 1
+#define MDP_RING_FD_TO_CLIENT 2
+#define MDP_RING_FD_COUNT 3
+
+int mdp_ring_create();
+struct mdp_ring_region *mdp_ring_map(int fd, int create);
+int mdp_ring_unmap(struct mdp_ring_region *region);
+int mdp_ring_put(struct mdp_ring *ring, const void *header, size_t header_len, const void *payload, size_t payload_len);
+int mdp_ring_get(struct mdp_ring *ring, overlay_mdp_frame *mdp);
+int mdp_ring_empty(struct mdp_ring *ring);
+int mdp_ring_doorbell(int fd);
+int mdp_ring_doorbell_clear(int fd);
+
+#endif
@@ -569,21 +569,30 @@ int monitor_process_command(struct monitor_context *c)
 }
 
 int monitor_announce_bundle(rhizome_manifest *m)
+{
+  return monitor_announce_bundle_fields(m->cryptoSignPublic,
+	rhizome_manifest_get(m, "service", NULL, 0),
+	m->version,
+	m->fileLength,
+	rhizome_manifest_get(m, "sender", NULL, 0),
+	rhizome_manifest_get(m, "recipient", NULL, 0),
+	m->dataFileName);
+}
+
+int monitor_announce_bundle_fields(const unsigned char *bid, const char *service, int64_t version,
+  int64_t filesize, const char *sender, const char *recipient, const char *filename)
 {
   int i;
   char msg[1024];
-  const char *service = rhizome_manifest_get(m, "service", NULL, 0);
-  const char *sender = rhizome_manifest_get(m, "sender", NULL, 0);
-  const char *recipient = rhizome_manifest_get(m, "recipient", NULL, 0);
   snprintf(msg,1024,"\nBUNDLE:%s:%s:%lld:%lld:%s:%s:%s\n",
 	   /* XXX bit of a hack here, since SIDs and cryptosign public keys have the same length */
-	   alloca_tohex_sid(m->cryptoSignPublic),
+	   alloca_tohex_sid(bid),
 	   service ? service : "",
-	   m->version,
-	   m->fileLength,
+	   (long long) version,
+	   (long long) filesize,
 	   sender ? sender : "",
 	   recipient ? recipient : "",
-	   m->dataFileName?m->dataFileName:"");
+	   filename ? filename : "");
   for(i=monitor_socket_count -1;i>=0;i--) {
     if (monitor_sockets[i].flags & MONITOR_RHIZOME) {
       if ( set_nonblock(monitor_sockets[i].alarm.poll.fd) == -1
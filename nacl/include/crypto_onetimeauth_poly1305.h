@@ -3,6 +3,8 @@
 
 #define crypto_onetimeauth_poly1305_ref_BYTES 16
 #define crypto_onetimeauth_poly1305_ref_KEYBYTES 32
+#define crypto_onetimeauth_poly1305_donna64_BYTES 16
+#define crypto_onetimeauth_poly1305_donna64_KEYBYTES 32
 #ifdef __cplusplus
 #include <string>
 extern std::string crypto_onetimeauth_poly1305_ref(const std::string &,const std::string &);
@@ -11,10 +13,23 @@ extern "C" {
 #endif
 extern int crypto_onetimeauth_poly1305_ref(unsigned char *,const unsigned char *,unsigned long long,const unsigned char *);
 extern int crypto_onetimeauth_poly1305_ref_verify(const unsigned char *,const unsigned char *,unsigned long long,const unsigned char *);
+extern int crypto_onetimeauth_poly1305_donna64(unsigned char *,const unsigned char *,unsigned long long,const unsigned char *);
+extern int crypto_onetimeauth_poly1305_donna64_verify(const unsigned char *,const unsigned char *,unsigned long long,const unsigned char *);
 #ifdef __cplusplus
 }
 #endif
 
+#ifdef HAVE_FAST_CRYPTO
+#define crypto_onetimeauth_poly1305 crypto_onetimeauth_poly1305_donna64
+/* POTATO crypto_onetimeauth_poly1305_donna64 crypto_onetimeauth_poly1305_donna64 crypto_onetimeauth_poly1305 */
+#define crypto_onetimeauth_poly1305_verify crypto_onetimeauth_poly1305_donna64_verify
+/* POTATO crypto_onetimeauth_poly1305_donna64_verify crypto_onetimeauth_poly1305_donna64 crypto_onetimeauth_poly1305 */
+#define crypto_onetimeauth_poly1305_BYTES crypto_onetimeauth_poly1305_donna64_BYTES
+/* POTATO crypto_onetimeauth_poly1305_donna64_BYTES crypto_onetimeauth_poly1305_donna64 crypto_onetimeauth_poly1305 */
+#define crypto_onetimeauth_poly1305_KEYBYTES crypto_onetimeauth_poly1305_donna64_KEYBYTES
+/* POTATO crypto_onetimeauth_poly1305_donna64_KEYBYTES crypto_onetimeauth_poly1305_donna64 crypto_onetimeauth_poly1305 */
+#define crypto_onetimeauth_poly1305_IMPLEMENTATION "crypto_onetimeauth/poly1305/donna64"
+#else
 #define crypto_onetimeauth_poly1305 crypto_onetimeauth_poly1305_ref
 /* POTATO crypto_onetimeauth_poly1305_ref crypto_onetimeauth_poly1305_ref crypto_onetimeauth_poly1305 */
 #define crypto_onetimeauth_poly1305_verify crypto_onetimeauth_poly1305_ref_verify
@@ -24,6 +39,7 @@ extern int crypto_onetimeauth_poly1305_ref_verify(const unsigned char *,const un
 #define crypto_onetimeauth_poly1305_KEYBYTES crypto_onetimeauth_poly1305_ref_KEYBYTES
 /* POTATO crypto_onetimeauth_poly1305_ref_KEYBYTES crypto_onetimeauth_poly1305_ref crypto_onetimeauth_poly1305 */
 #define crypto_onetimeauth_poly1305_IMPLEMENTATION "crypto_onetimeauth/poly1305/ref"
+#endif
 #ifndef crypto_onetimeauth_poly1305_ref_VERSION
 #define crypto_onetimeauth_poly1305_ref_VERSION "-"
 #endif
@@ -14,6 +14,7 @@ extern "C" {
 extern int crypto_sign_edwards25519sha512batch_ref(unsigned char *,unsigned long long *,const unsigned char *,unsigned long long,const unsigned char *);
 extern int crypto_sign_edwards25519sha512batch_ref_open(unsigned char *,unsigned long long *,const unsigned char *,unsigned long long,const unsigned char *);
 extern int crypto_sign_edwards25519sha512batch_ref_keypair(unsigned char *,unsigned char *);
+extern int crypto_sign_edwards25519sha512batch_ref_open_batch(const unsigned char *const *,const unsigned long long *,const unsigned char *const *,const unsigned char *const *,unsigned long long,int *);
 #ifdef __cplusplus
 }
 #endif
@@ -22,6 +23,8 @@ extern int crypto_sign_edwards25519sha512batch_ref_keypair(unsigned char *,unsig
 /* POTATO crypto_sign_edwards25519sha512batch_ref crypto_sign_edwards25519sha512batch_ref crypto_sign_edwards25519sha512batch */
 #define crypto_sign_edwards25519sha512batch_open crypto_sign_edwards25519sha512batch_ref_open
 /* POTATO crypto_sign_edwards25519sha512batch_ref_open crypto_sign_edwards25519sha512batch_ref crypto_sign_edwards25519sha512batch */
+#define crypto_sign_edwards25519sha512batch_open_batch crypto_sign_edwards25519sha512batch_ref_open_batch
+/* POTATO crypto_sign_edwards25519sha512batch_ref_open_batch crypto_sign_edwards25519sha512batch_ref crypto_sign_edwards25519sha512batch */
 #define crypto_sign_edwards25519sha512batch_keypair crypto_sign_edwards25519sha512batch_ref_keypair
 /* POTATO crypto_sign_edwards25519sha512batch_ref_keypair crypto_sign_edwards25519sha512batch_ref crypto_sign_edwards25519sha512batch */
 #define crypto_sign_edwards25519sha512batch_BYTES crypto_sign_edwards25519sha512batch_ref_BYTES
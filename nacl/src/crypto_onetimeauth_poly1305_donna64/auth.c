@@ -0,0 +1,141 @@
+/*
+poly1305-donna-64
+Andrew Moon
+Public domain.
+
+The accumulator and key are held as 44+44+42 bit limbs and multiplied with
+64x64->128 bit products, which needs a compiler that supports
+unsigned __int128.
+*/
+
+#include <stdint.h>
+#include "crypto_onetimeauth.h"
+
+typedef unsigned __int128 uint128_t;
+
+#define MASK44 0xfffffffffffULL
+#define MASK42 0x3ffffffffffULL
+
+static uint64_t load64(const unsigned char *p)
+{
+  return
+    ((uint64_t)p[0]) |
+    (((uint64_t)p[1]) << 8) |
+    (((uint64_t)p[2]) << 16) |
+    (((uint64_t)p[3]) << 24) |
+    (((uint64_t)p[4]) << 32) |
+    (((uint64_t)p[5]) << 40) |
+    (((uint64_t)p[6]) << 48) |
+    (((uint64_t)p[7]) << 56);
+}
+
+static void store64(unsigned char *p, uint64_t v)
+{
+  p[0] = v & 0xff;
+  p[1] = (v >> 8) & 0xff;
+  p[2] = (v >> 16) & 0xff;
+  p[3] = (v >> 24) & 0xff;
+  p[4] = (v >> 32) & 0xff;
+  p[5] = (v >> 40) & 0xff;
+  p[6] = (v >> 48) & 0xff;
+  p[7] = (v >> 56) & 0xff;
+}
+
+/* h = (h + m) * r for each whole 16 byte block of m; hibit is 2^128 within
+   the third limb for full blocks, and zero for the padded final block. */
+static void blocks(uint64_t h[3], const uint64_t r[3], const unsigned char *m,
+  unsigned long long bytes, uint64_t hibit)
+{
+  uint64_t r0 = r[0], r1 = r[1], r2 = r[2];
+  uint64_t s1 = r1 * (5 << 2);
+  uint64_t s2 = r2 * (5 << 2);
+  uint64_t h0 = h[0], h1 = h[1], h2 = h[2];
+  uint64_t t0, t1, c;
+  uint128_t d0, d1, d2;
+
+  while (bytes >= 16) {
+    t0 = load64(&m[0]);
+    t1 = load64(&m[8]);
+
+    h0 += (( t0                    ) & MASK44);
+    h1 += (((t0 >> 44) | (t1 << 20)) & MASK44);
+    h2 += (((t1 >> 24)             ) & MASK42) | hibit;
+
+    d0 = (uint128_t)h0 * r0 + (uint128_t)h1 * s2 + (uint128_t)h2 * s1;
+    d1 = (uint128_t)h0 * r1 + (uint128_t)h1 * r0 + (uint128_t)h2 * s2;
+    d2 = (uint128_t)h0 * r2 + (uint128_t)h1 * r1 + (uint128_t)h2 * r0;
+
+                 c = (uint64_t)(d0 >> 44); h0 = (uint64_t)d0 & MASK44;
+    d1 += c;     c = (uint64_t)(d1 >> 44); h1 = (uint64_t)d1 & MASK44;
+    d2 += c;     c = (uint64_t)(d2 >> 42); h2 = (uint64_t)d2 & MASK42;
+    h0 += c * 5; c = (h0 >> 44);           h0 = h0 & MASK44;
+    h1 += c;
+
+    m += 16;
+    bytes -= 16;
+  }
+
+  h[0] = h0; h[1] = h1; h[2] = h2;
+}
+
+int crypto_onetimeauth(unsigned char *out,const unsigned char *in,unsigned long long inlen,const unsigned char *k)
+{
+  uint64_t r[3], h[3] = {0, 0, 0};
+  uint64_t h0, h1, h2, g0, g1, g2, c, t0, t1;
+  unsigned long long full = inlen & ~15ULL;
+
+  /* r &= 0xffffffc0ffffffc0ffffffc0fffffff */
+  t0 = load64(&k[0]);
+  t1 = load64(&k[8]);
+  r[0] = ( t0                    ) & 0xffc0fffffffULL;
+  r[1] = ((t0 >> 44) | (t1 << 20)) & 0xfffffc0ffffULL;
+  r[2] = ((t1 >> 24)             ) & 0x00ffffffc0fULL;
+
+  blocks(h, r, in, full, ((uint64_t)1) << 40);
+
+  if (inlen > full) {
+    unsigned char last[16];
+    unsigned long long i, n = inlen - full;
+    for (i = 0;i < n;++i) last[i] = in[full + i];
+    last[i++] = 1;
+    for (;i < 16;++i) last[i] = 0;
+    blocks(h, r, last, 16, 0);
+  }
+
+  /* fully carry h */
+  h0 = h[0]; h1 = h[1]; h2 = h[2];
+               c = (h1 >> 44); h1 &= MASK44;
+  h2 += c;     c = (h2 >> 42); h2 &= MASK42;
+  h0 += c * 5; c = (h0 >> 44); h0 &= MASK44;
+  h1 += c;     c = (h1 >> 44); h1 &= MASK44;
+  h2 += c;     c = (h2 >> 42); h2 &= MASK42;
+  h0 += c * 5; c = (h0 >> 44); h0 &= MASK44;
+  h1 += c;
+
+  /* compute h + -p */
+  g0 = h0 + 5; c = (g0 >> 44); g0 &= MASK44;
+  g1 = h1 + c; c = (g1 >> 44); g1 &= MASK44;
+  g2 = h2 + c - (((uint64_t)1) << 42);
+
+  /* select h if h < p, or h + -p if h >= p */
+  c = (g2 >> 63) - 1;
+  g0 &= c;
+  g1 &= c;
+  g2 &= c;
+  c = ~c;
+  h0 = (h0 & c) | g0;
+  h1 = (h1 & c) | g1;
+  h2 = (h2 & c) | g2;
+
+  /* h = (h + s) */
+  t0 = load64(&k[16]);
+  t1 = load64(&k[24]);
+  h0 += (( t0                    ) & MASK44)    ; c = (h0 >> 44); h0 &= MASK44;
+  h1 += (((t0 >> 44) | (t1 << 20)) & MASK44) + c; c = (h1 >> 44); h1 &= MASK44;
+  h2 += (((t1 >> 24)             ) & MASK42) + c;                 h2 &= MASK42;
+
+  /* out = h % 2^128 */
+  store64(&out[0], ((h0      ) | (h1 << 44)));
+  store64(&out[8], ((h1 >> 20) | (h2 << 24)));
+  return 0;
+}
@@ -7,6 +7,8 @@
 /* CHEESEBURGER crypto_sign_edwards25519sha512batch */
 #define crypto_sign_open crypto_sign_edwards25519sha512batch_open
 /* CHEESEBURGER crypto_sign_edwards25519sha512batch_open */
+#define crypto_sign_open_batch crypto_sign_edwards25519sha512batch_open_batch
+/* CHEESEBURGER crypto_sign_edwards25519sha512batch_open_batch */
 #define crypto_sign_keypair crypto_sign_edwards25519sha512batch_keypair
 /* CHEESEBURGER crypto_sign_edwards25519sha512batch_keypair */
 #define crypto_sign_BYTES crypto_sign_edwards25519sha512batch_BYTES
@@ -51,6 +51,7 @@ typedef struct {
 } ge_cached;
 
 #define ge_frombytes_negate_vartime crypto_sign_ed25519_ref10_ge_frombytes_negate_vartime
+#define ge_frombytes_canonical_negate_vartime crypto_sign_ed25519_ref10_ge_frombytes_canonical_negate_vartime
 #define ge_tobytes crypto_sign_ed25519_ref10_ge_tobytes
 #define ge_p3_tobytes crypto_sign_ed25519_ref10_ge_p3_tobytes
 
@@ -63,6 +64,7 @@ typedef struct {
 #define ge_p1p1_to_p3 crypto_sign_ed25519_ref10_ge_p1p1_to_p3
 #define ge_p2_dbl crypto_sign_ed25519_ref10_ge_p2_dbl
 #define ge_p3_dbl crypto_sign_ed25519_ref10_ge_p3_dbl
+#define ge_p2_cofactor_isneutral crypto_sign_ed25519_ref10_ge_p2_cofactor_isneutral
 
 #define ge_madd crypto_sign_ed25519_ref10_ge_madd
 #define ge_msub crypto_sign_ed25519_ref10_ge_msub
@@ -74,6 +76,7 @@ typedef struct {
 extern void ge_tobytes(unsigned char *,const ge_p2 *);
 extern void ge_p3_tobytes(unsigned char *,const ge_p3 *);
 extern int ge_frombytes_negate_vartime(ge_p3 *,const unsigned char *);
+extern int ge_frombytes_canonical_negate_vartime(ge_p3 *,const unsigned char *);
 
 extern void ge_p2_0(ge_p2 *);
 extern void ge_p3_0(ge_p3 *);
@@ -84,6 +87,7 @@ extern void ge_p1p1_to_p2(ge_p2 *,const ge_p1p1 *);
 extern void ge_p1p1_to_p3(ge_p3 *,const ge_p1p1 *);
 extern void ge_p2_dbl(ge_p1p1 *,const ge_p2 *);
 extern void ge_p3_dbl(ge_p1p1 *,const ge_p3 *);
+extern int ge_p2_cofactor_isneutral(const ge_p2 *);
 
 extern void ge_madd(ge_p1p1 *,const ge_p3 *,const ge_precomp *);
 extern void ge_msub(ge_p1p1 *,const ge_p3 *,const ge_precomp *);
@@ -48,3 +48,23 @@ int ge_frombytes_negate_vartime(ge_p3 *h,const unsigned char *s)
   fe_mul(h->T,h->X,h->Y);
   return 0;
 }
+
+/*
+As ge_frombytes_negate_vartime, but fails unless s is the encoding ge_tobytes
+would produce: y must be less than 2^255-19, and x = 0 must not have its sign
+bit set.
+*/
+
+int ge_frombytes_canonical_negate_vartime(ge_p3 *h,const unsigned char *s)
+{
+  int i;
+
+  if ((s[31] & 127) == 127) {
+    for (i = 30;i > 0;--i)
+      if (s[i] != 255) break;
+    if (i == 0 && s[0] >= 237) return -1;
+  }
+  if (ge_frombytes_negate_vartime(h,s) != 0) return -1;
+  if (!fe_isnonzero(h->X) && (s[31] >> 7)) return -1;
+  return 0;
+}
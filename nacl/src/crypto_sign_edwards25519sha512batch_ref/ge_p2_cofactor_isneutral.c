@@ -0,0 +1,24 @@
+#include "ge.h"
+
+/*
+return 1 if 8 * p is the neutral element,
+ie if p is a point of small order
+*/
+
+int ge_p2_cofactor_isneutral(const ge_p2 *p)
+{
+  ge_p1p1 t;
+  ge_p2 r;
+  fe check;
+  int i;
+
+  r = *p;
+  for (i = 0;i < 3;++i) {
+    ge_p2_dbl(&t,&r);
+    ge_p1p1_to_p2(&r,&t);
+  }
+  /* neutral element is (0:Z:Z) */
+  if (fe_isnonzero(r.X)) return 0;
+  fe_sub(check,r.Y,r.Z);
+  return !fe_isnonzero(check);
+}
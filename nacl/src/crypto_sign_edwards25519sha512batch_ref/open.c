@@ -1,9 +1,16 @@
 #include "crypto_sign.h"
 #include "crypto_hash_sha512.h"
-#include "crypto_verify_32.h"
 #include "ge.h"
 #include "sc.h"
 
+/*
+The signature is accepted if 8(SB - hA - R) is the neutral element, rather
+than if the encoding of SB - hA equals R.  The two agree for any signature
+made by crypto_sign(), but only the cofactored equation can also be checked
+exactly for a batch of signatures (see open_batch.c), so that a signature
+whose R or A has a small order component is treated the same either way.
+*/
+
 int crypto_sign_open(
   unsigned char *m,unsigned long long *mlen,
   const unsigned char *sm,unsigned long long smlen,
@@ -11,24 +18,36 @@ int crypto_sign_open(
 )
 {
   unsigned char h[64];
-  unsigned char checkr[32];
   ge_p3 A;
-  ge_p2 R;
+  ge_p3 R;
+  ge_cached Rc;
+  ge_p2 sbha;
+  ge_p3 u;
+  ge_p1p1 t;
+  ge_p2 check;
   unsigned long long i;
 
   *mlen = -1;
   if (smlen < 64) return -1;
   if (sm[63] & 224) return -1;
   if (ge_frombytes_negate_vartime(&A,pk) != 0) return -1;
+  if (ge_frombytes_canonical_negate_vartime(&R,sm) != 0) return -1;
 
   for (i = 0;i < smlen;++i) m[i] = sm[i];
   for (i = 0;i < 32;++i) m[32 + i] = pk[i];
   crypto_hash_sha512(h,m,smlen);
   sc_reduce(h);
 
-  ge_double_scalarmult_vartime(&R,h,&A,sm + 32);
-  ge_tobytes(checkr,&R);
-  if (crypto_verify_32(checkr,sm) != 0) {
+  ge_double_scalarmult_vartime(&sbha,h,&A,sm + 32);
+  /* (X:Y:Z) is (XZ:YZ:Z^2:XY) in extended coordinates */
+  fe_mul(u.X,sbha.X,sbha.Z);
+  fe_mul(u.Y,sbha.Y,sbha.Z);
+  fe_sq(u.Z,sbha.Z);
+  fe_mul(u.T,sbha.X,sbha.Y);
+  ge_p3_to_cached(&Rc,&R);
+  ge_add(&t,&u,&Rc);
+  ge_p1p1_to_p2(&check,&t);
+  if (!ge_p2_cofactor_isneutral(&check)) {
     for (i = 0;i < smlen;++i) m[i] = 0;
     return -1;
   }
@@ -0,0 +1,198 @@
+#include "crypto_sign.h"
+#include "crypto_hash_sha512.h"
+#include "randombytes.h"
+#include "ge.h"
+#include "sc.h"
+
+/*
+Verify many signatures at once.
+
+For each signature (R,S) by A on M, with h = H(R,A,M), a random 128 bit z is
+chosen and the single equation
+  8((sum z*S) B - sum (z*h) A - sum z R) = 0
+is checked with one interleaved multi-scalar multiplication, so the 256
+doublings are shared by the whole batch.  If it does not hold, or any input
+cannot be decoded, each signature in that batch is checked individually with
+crypto_sign_open().
+
+crypto_sign_open() checks the same cofactored equation for one signature.
+Multiplying by 8 removes any small order component of R or A before the
+random combination is taken, so a batch containing signatures that
+crypto_sign_open() rejects only passes with probability 2^-128, whatever
+torsion the signer put into them.  Without the factor of 8, two signatures
+with small order components T and -T would cancel for one z in four.
+*/
+
+#define BATCH 16
+
+static void slide(signed char *r,const unsigned char *a)
+{
+  int i;
+  int b;
+  int k;
+
+  for (i = 0;i < 256;++i)
+    r[i] = 1 & (a[i >> 3] >> (i & 7));
+
+  for (i = 0;i < 256;++i)
+    if (r[i]) {
+      for (b = 1;b <= 6 && i + b < 256;++b) {
+        if (r[i + b]) {
+          if (r[i] + (r[i + b] << b) <= 15) {
+            r[i] += r[i + b] << b; r[i + b] = 0;
+          } else if (r[i] - (r[i + b] << b) >= -15) {
+            r[i] -= r[i + b] << b;
+            for (k = i + b;k < 256;++k) {
+              if (!r[k]) {
+                r[k] = 1;
+                break;
+              }
+              r[k] = 0;
+            }
+          } else
+            break;
+        }
+      }
+    }
+
+}
+
+static ge_precomp Bi[8] = {
+#include "base2.h"
+} ;
+
+/* Table of odd multiples A,3A,5A,...,15A */
+static void multiples(ge_cached *Ai,const ge_p3 *A)
+{
+  ge_p1p1 t;
+  ge_p3 u;
+  ge_p3 A2;
+  int i;
+
+  ge_p3_to_cached(&Ai[0],A);
+  ge_p3_dbl(&t,A); ge_p1p1_to_p3(&A2,&t);
+  for (i = 1;i < 8;++i) {
+    ge_add(&t,&A2,&Ai[i - 1]); ge_p1p1_to_p3(&u,&t); ge_p3_to_cached(&Ai[i],&u);
+  }
+}
+
+static int open_one(const unsigned char *m,unsigned long long mlen,
+  const unsigned char *pk,const unsigned char *sig)
+{
+  unsigned char sm[64 + mlen];
+  unsigned char out[64 + mlen];
+  unsigned long long outlen;
+  unsigned long long i;
+
+  for (i = 0;i < 64;++i) sm[i] = sig[i];
+  for (i = 0;i < mlen;++i) sm[64 + i] = m[i];
+  return crypto_sign_open(out,&outlen,sm,64 + mlen,pk);
+}
+
+/* 0 if every signature in the batch is valid */
+static int batch(const unsigned char *const *m,const unsigned long long *mlen,
+  const unsigned char *const *pk,const unsigned char *const *sig,int n)
+{
+  ge_cached Pi[2 * BATCH][8];
+  signed char pslide[2 * BATCH][256];
+  signed char bslide[256];
+  unsigned char z[32];
+  unsigned char h[64];
+  unsigned char zh[32];
+  unsigned char s[32];
+  unsigned char zero[32];
+  ge_p3 P;
+  ge_p2 r;
+  ge_p1p1 t;
+  ge_p3 u;
+  int i;
+  int j;
+  unsigned long long k;
+
+  for (i = 0;i < 32;++i) { s[i] = 0; zero[i] = 0; }
+
+  for (j = 0;j < n;++j) {
+    unsigned char buf[64 + mlen[j]];
+
+    if (sig[j][63] & 224) return -1;
+    if (ge_frombytes_negate_vartime(&P,pk[j]) != 0) return -1;
+    multiples(Pi[2 * j],&P);
+    if (ge_frombytes_canonical_negate_vartime(&P,sig[j]) != 0) return -1;
+    multiples(Pi[2 * j + 1],&P);
+
+    for (k = 0;k < 32;++k) buf[k] = sig[j][k];
+    for (k = 0;k < 32;++k) buf[32 + k] = pk[j][k];
+    for (k = 0;k < mlen[j];++k) buf[64 + k] = m[j][k];
+    crypto_hash_sha512(h,buf,64 + mlen[j]);
+    sc_reduce(h);
+
+    randombytes(z,16);
+    for (i = 16;i < 32;++i) z[i] = 0;
+
+    sc_muladd(zh,z,h,zero);
+    sc_muladd(s,z,sig[j] + 32,s);
+    slide(pslide[2 * j],zh);
+    slide(pslide[2 * j + 1],z);
+  }
+  slide(bslide,s);
+
+  for (i = 255;i >= 0;--i) {
+    if (bslide[i]) break;
+    for (j = 0;j < 2 * n;++j)
+      if (pslide[j][i]) break;
+    if (j < 2 * n) break;
+  }
+
+  ge_p2_0(&r);
+  for (;i >= 0;--i) {
+    ge_p2_dbl(&t,&r);
+
+    for (j = 0;j < 2 * n;++j) {
+      if (pslide[j][i] > 0) {
+        ge_p1p1_to_p3(&u,&t);
+        ge_add(&t,&u,&Pi[j][pslide[j][i]/2]);
+      } else if (pslide[j][i] < 0) {
+        ge_p1p1_to_p3(&u,&t);
+        ge_sub(&t,&u,&Pi[j][(-pslide[j][i])/2]);
+      }
+    }
+
+    if (bslide[i] > 0) {
+      ge_p1p1_to_p3(&u,&t);
+      ge_madd(&t,&u,&Bi[bslide[i]/2]);
+    } else if (bslide[i] < 0) {
+      ge_p1p1_to_p3(&u,&t);
+      ge_msub(&t,&u,&Bi[(-bslide[i])/2]);
+    }
+
+    ge_p1p1_to_p2(&r,&t);
+  }
+
+  if (!ge_p2_cofactor_isneutral(&r)) return -1;
+  return 0;
+}
+
+int crypto_sign_open_batch(
+  const unsigned char *const *m,const unsigned long long *mlen,
+  const unsigned char *const *pk,const unsigned char *const *sig,
+  unsigned long long n,int *valid
+)
+{
+  unsigned long long i;
+  unsigned long long j;
+  int ret = 0;
+
+  for (i = 0;i < n;i += BATCH) {
+    int count = (n - i < BATCH) ? n - i : BATCH;
+    /* a batch of one costs more than crypto_sign_open() */
+    if (count > 1 && batch(m + i,mlen + i,pk + i,sig + i,count) == 0) {
+      for (j = 0;j < count;++j) valid[i + j] = 1;
+      continue;
+    }
+    for (j = 0;j < count;++j) {
+      valid[i + j] = open_one(m[i + j],mlen[i + j],pk[i + j],sig[i + j]) == 0;
+      if (!valid[i + j]) ret = -1;
+    }
+  }
+  return ret;
+}
@@ -126,6 +126,20 @@ ssize_t _write_str_nonblock(int fd, const char *str, struct __sourceloc __whence
 ssize_t recvwithttl(int sock,unsigned char *buffer, size_t bufferlen,int *ttl,
 		    struct sockaddr *recvaddr, socklen_t *recvaddrlen)
 {
+  return recvwithttl_fds(sock, buffer, bufferlen, ttl, recvaddr, recvaddrlen, NULL, NULL, 0);
+}
+
+/* As recvwithttl(), but also returns up to *fd_count file descriptors passed
+   with SCM_RIGHTS.  Any descriptors the caller has no room for are closed.
+   flags are passed to recvmsg(), eg MSG_DONTWAIT to drain a blocking socket. */
+ssize_t recvwithttl_fds(int sock,unsigned char *buffer, size_t bufferlen,int *ttl,
+		    struct sockaddr *recvaddr, socklen_t *recvaddrlen,
+		    int *fds, int *fd_count, int flags)
+{
+  int max_fds = fd_count ? *fd_count : 0;
+  if (fd_count)
+    *fd_count = 0;
+
   struct msghdr msg;
   struct iovec iov[1];
   
@@ -145,7 +159,7 @@ ssize_t recvwithttl(int sock,unsigned char *buffer, size_t bufferlen,int *ttl,
   msg.msg_controllen = sizeof(struct cmsghdr)*16;
   msg.msg_flags = 0;
   
-  ssize_t len = recvmsg(sock,&msg,0);
+  ssize_t len = recvmsg(sock,&msg,flags);
   if (len == -1 && errno != EAGAIN && errno != EWOULDBLOCK)
     return WHY_perror("recvmsg");
   
@@ -171,6 +185,15 @@ ssize_t recvwithttl(int sock,unsigned char *buffer, size_t bufferlen,int *ttl,
 	  if (config.debug.packetrx)
 	    DEBUGF("  TTL of packet is %d", *ttl);
 	} 
+      } else if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+	int *passed = (int *) CMSG_DATA(cmsg);
+	int i, n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+	for (i = 0; i < n; i++) {
+	  if (fd_count && *fd_count < max_fds)
+	    fds[(*fd_count)++] = passed[i];
+	  else
+	    close(passed[i]);
+	}
       } else {
 	if (config.debug.packetrx)
 	  DEBUGF("I didn't expect to see level=%02x, type=%02x",
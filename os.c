@@ -104,8 +104,12 @@ int urandombytes(unsigned char *buf, unsigned long long len)
   return 0;
 }
 
+const time_ms_t *virtual_time_ms = NULL;
+
 time_ms_t gettime_ms()
 {
+  if (virtual_time_ms)
+    return *virtual_time_ms;
   struct timeval nowtv;
   // If gettimeofday() fails or returns an invalid value, all else is lost!
   if (gettimeofday(&nowtv, NULL) == -1)
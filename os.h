@@ -54,6 +54,11 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
  */
 typedef long long time_ms_t;
 
+/* When set, gettime_ms() returns this value instead of reading the system
+ * clock.  The mesh simulator uses it to run many nodes against a virtual clock.
+ */
+extern const time_ms_t *virtual_time_ms;
+
 time_ms_t gettime_ms();
 time_ms_t sleep_ms(time_ms_t milliseconds);
 
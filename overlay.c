@@ -71,12 +71,30 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include "serval.h"
 #include "conf.h"
 #include "rhizome.h"
+#include "overlay_address.h"
+#include "randombytes.h"
 #include "strbuf.h"
 
 int overlayMode=0;
 
 keyring_file *keyring=NULL;
 
+/* Exchange the running overlay state with *state.  A zeroed *state is replaced
+   with a fresh node that has no identity or interfaces. */
+int overlay_swap_state(struct overlay_state *state)
+{
+  if (fd_swap_state(&state->fd)
+    || overlay_address_swap_state(&state->address)
+    || overlay_route_swap_state(&state->route)
+    || overlay_queue_swap_state(&state->queue)
+    || overlay_interface_swap_state(&state->interface))
+    return WHY("Failed to swap overlay state");
+  keyring_file *k=keyring;
+  keyring=state->keyring;
+  state->keyring=k;
+  return 0;
+}
+
 int overlayServerMode()
 {
   IN();
@@ -97,6 +115,14 @@ int overlayServerMode()
 
   overlay_queue_init();
   
+  /* Start worker threads for signature checks.  randombytes() opens its
+     device on first use, so make sure it has done that before they can race. */
+  if (config.server.worker_threads){
+    unsigned char seed;
+    randombytes(&seed, 1);
+    fd_start_workers(config.server.worker_threads);
+  }
+  
   /* Get the set of socket file descriptors we need to monitor.
      Note that end-of-file will trigger select(), so we cannot run select() if we 
      have any dummy interfaces running. So we do an ugly hack of just waiting no more than
@@ -130,8 +156,10 @@ schedule(&_sched_##X); }
 
   /* Get rhizome server started BEFORE populating fd list so that
      the server's listen socket is in the list for poll() */
-  if (is_rhizome_enabled())
+  if (is_rhizome_enabled()){
     rhizome_opendb();
+    rhizome_bar_index_load();
+  }
 
   /* Rhizome http server needs to know which callback to attach
 	 to client sockets, so provide it here, along with the name to
@@ -35,11 +35,18 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 
 #define MAX_BPIS 1024
 #define BPI_MASK 0x3ff
-static struct broadcast bpilist[MAX_BPIS];
+static struct broadcast _bpilist[MAX_BPIS];
+static struct broadcast *bpilist=_bpilist;
 
 #define OA_CODE_SELF 0xff
 #define OA_CODE_PREVIOUS 0xfe
 
+/* An abbreviation is only unique among the SIDs the sender knows.  A receiver that
+   knows one other SID with the same prefix, but not the one intended, would take
+   it for that one without asking for an explanation.  So never send fewer bytes
+   than make that unlikely in a mesh of any realistic size. */
+#define OA_MIN_ABBREVIATION 4
+
 // each node has 16 slots based on the next 4 bits of a subscriber id
 // each slot either points to another tree node or a struct subscriber.
 struct tree_node{
@@ -52,7 +59,8 @@ struct tree_node{
   };
 };
 
-static struct tree_node root;
+static struct tree_node _root;
+static struct tree_node *root=&_root;
 
 struct subscriber *my_subscriber=NULL;
 
@@ -65,7 +73,7 @@ static unsigned char get_nibble(const unsigned char *sid, int pos){
 
 // find a subscriber struct from a whole or abbreviated subscriber id
 struct subscriber *find_subscriber(const unsigned char *sid, int len, int create){
-  struct tree_node *ptr = &root;
+  struct tree_node *ptr = root;
   int pos=0;
   if (len!=SID_SIZE)
     create =0;
@@ -154,7 +162,49 @@ static int walk_tree(struct tree_node *node, int pos,
  walk the tree, starting at start inclusive, calling the supplied callback function
  */
 void enum_subscribers(struct subscriber *start, int(*callback)(struct subscriber *, void *), void *context){
-  walk_tree(&root, 0, start->sid, SID_SIZE, NULL, 0, callback, context);
+  walk_tree(root, 0, start->sid, SID_SIZE, NULL, 0, callback, context);
+}
+
+struct address_state{
+  struct tree_node *root;
+  struct broadcast *bpilist;
+  struct subscriber *my_subscriber;
+  struct subscriber *directory_service;
+};
+
+/*
+ Exchange the subscriber tree, recently seen broadcast ids and our own identity with
+ those saved in *state. A NULL *state is replaced with an empty set.
+ This lets the mesh simulator keep many nodes in one process.
+ */
+int overlay_address_swap_state(void **state){
+  struct address_state *s = *state;
+  if (!s){
+    s = calloc(1, sizeof(struct address_state));
+    if (!s)
+      return WHY_perror("calloc");
+    s->root = calloc(1, sizeof(struct tree_node));
+    s->bpilist = calloc(MAX_BPIS, sizeof(struct broadcast));
+    if (!s->root || !s->bpilist){
+      free(s->root);
+      free(s->bpilist);
+      free(s);
+      return WHY_perror("calloc");
+    }
+    *state = s;
+  }
+  struct address_state old={
+    .root=root,
+    .bpilist=bpilist,
+    .my_subscriber=my_subscriber,
+    .directory_service=directory_service,
+  };
+  root=s->root;
+  bpilist=s->bpilist;
+  my_subscriber=s->my_subscriber;
+  directory_service=s->directory_service;
+  *s=old;
+  return 0;
 }
 
 // generate a new random broadcast address
@@ -221,6 +271,8 @@ int overlay_address_append(struct decode_context *context, struct overlay_buffer
       len=(subscriber->abbreviate_len+2)/2;
       if (subscriber->reachable==REACHABLE_SELF)
 	len++;
+      if (len<OA_MIN_ABBREVIATION)
+	len=OA_MIN_ABBREVIATION;
       if (len>SID_SIZE)
 	len=SID_SIZE;
     }
@@ -293,7 +345,7 @@ static int find_subscr_buffer(struct decode_context *context, struct overlay_buf
     
     // And I'll tell you about any subscribers I know that match this abbreviation, 
     // so you don't try to use an abbreviation that's too short in future.
-    walk_tree(&root, 0, id, len, id, len, add_explain_response, context);
+    walk_tree(root, 0, id, len, id, len, add_explain_response, context);
     
     INFOF("Asking for explanation of %s", alloca_tohex(id, len));
     ob_append_byte(context->please_explain->payload, len);
@@ -404,7 +456,7 @@ int process_explain(struct overlay_frame *frame){
     }else{
       // reply to the sender with all subscribers that match this abbreviation
       INFOF("Sending responses for %s", alloca_tohex(sid, len));
-      walk_tree(&root, 0, sid, len, sid, len, add_explain_response, &context);
+      walk_tree(root, 0, sid, len, sid, len, add_explain_response, &context);
     }
   }
   
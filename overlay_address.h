@@ -45,6 +45,25 @@
 #define BROADCAST_LEN 8
 
 
+// Where to send frames for a destination, resolved through any next hop or directory service.
+// Entries are only valid while their version matches forwarding_version.
+struct forwarding_entry{
+  unsigned int version;
+  struct subscriber *next_hop;
+  struct overlay_interface *interface;
+  struct sockaddr_in addr;
+  char unicast;
+  // both unicast and broadcast were possible, and the interface preferred unicast
+  char prefer_unicast;
+};
+
+struct forwarding_stats{
+  unsigned int lookups;
+  unsigned int rebuilds;
+  unsigned int invalidations;
+  unsigned int forwarded;
+};
+
 // This structure supports both our own routing protocol which can store calculation details in *node 
 // or IP4 addresses reachable via any other kind of normal layer3 routing protocol, eg olsr
 struct subscriber{
@@ -77,6 +96,12 @@ struct subscriber{
   time_ms_t last_acked;
   time_ms_t last_tx;
   
+  // last delta route advertisement header heard from each of this peer's interfaces
+  unsigned int advert_seen;
+  unsigned char advert_epoch[OVERLAY_MAX_INTERFACES];
+  unsigned char advert_sequence[OVERLAY_MAX_INTERFACES];
+  time_ms_t advert_resync_requested;
+  
   // public signing key details for remote peers
   unsigned char sas_public[SAS_SIZE];
   time_ms_t sas_last_request;
@@ -84,6 +109,9 @@ struct subscriber{
   
   // private keys for local identities
   keyring_identity *identity;
+  
+  // cached next hop, see overlay_forwarding_lookup()
+  struct forwarding_entry forwarding;
 };
 
 struct broadcast{
@@ -101,13 +129,18 @@ struct decode_context{
 
 extern struct subscriber *my_subscriber;
 extern struct subscriber *directory_service;
+extern struct forwarding_stats forwarding_stats;
 
 struct subscriber *find_subscriber(const unsigned char *sid, int len, int create);
 void enum_subscribers(struct subscriber *start, int(*callback)(struct subscriber *, void *), void *context);
+int overlay_address_swap_state(void **state);
 int subscriber_is_reachable(struct subscriber *subscriber);
 int set_reachable(struct subscriber *subscriber, int reachable);
 int reachable_unicast(struct subscriber *subscriber, overlay_interface *interface, struct in_addr addr, int port);
+void set_subscriber_address(struct subscriber *subscriber, overlay_interface *interface, const struct sockaddr_in *addr);
 int load_subscriber_address(struct subscriber *subscriber);
+void overlay_forwarding_invalidate();
+struct forwarding_entry *overlay_forwarding_lookup(struct subscriber *destination);
 
 int process_explain(struct overlay_frame *frame);
 int overlay_broadcast_drop_check(struct broadcast *addr);
@@ -63,30 +63,63 @@ int overlay_route_please_advertise(overlay_node *n)
 struct advertisement_state{
   struct overlay_buffer *payload;
   struct subscriber *next_advertisement;
+  int interface_number;
+  time_ms_t now;
+  // in delta mode, only advertise routes that have changed (1) or have not been repeated recently (2)
+  int delta;
+  // a neighbour asked for every route to be repeated
+  int resync;
 };
 
+#define DELTA_CHANGED 1
+#define DELTA_STALE 2
+
+static int should_advertise(struct subscriber *subscriber, struct advertisement_state *state){
+  overlay_node *n=subscriber->node;
+  
+  if (!n || !(subscriber->reachable&REACHABLE) || (subscriber->reachable&REACHABLE_ASSUMED)
+      || n->best_link_score<=0 || n->observations[n->best_observation].gateways_en_route >= 64)
+    return 0;
+  
+  int i=state->interface_number;
+  switch(state->delta){
+    case DELTA_CHANGED:
+      {
+	if (!n->most_recent_advertisment_ms[i])
+	  return 1;
+	int diff=n->best_link_score - n->most_recent_advertised_score[i];
+	return diff >= (int)config.mdp.advertise.score_threshold || -diff >= (int)config.mdp.advertise.score_threshold;
+      }
+    case DELTA_STALE:
+      return state->resync || state->now - n->most_recent_advertisment_ms[i] >= config.mdp.advertise.refresh_ms;
+  }
+  return 1;
+}
+
 int add_advertisement(struct subscriber *subscriber, void *context){
   struct advertisement_state *state=context;
   
-  if (subscriber->node){
+  if (should_advertise(subscriber, state)){
     overlay_node *n=subscriber->node;
     
-    if ((subscriber->reachable&REACHABLE) && (!(subscriber->reachable&REACHABLE_ASSUMED)) 
-	&& n->best_link_score>0 && n->observations[n->best_observation].gateways_en_route < 64){
-      // never send the full sid in an advertisement
-      subscriber->send_full=0;
+    // never send the full sid in an advertisement
+    subscriber->send_full=0;
+    
+    if (overlay_address_append(NULL,state->payload,subscriber) ||
+	ob_append_byte(state->payload,n->best_link_score -1) ||
+	ob_append_byte(state->payload,n->observations[n->best_observation].gateways_en_route +1)){
       
-      if (overlay_address_append(NULL,state->payload,subscriber) ||
-	  ob_append_byte(state->payload,n->best_link_score -1) ||
-	  ob_append_byte(state->payload,n->observations[n->best_observation].gateways_en_route +1)){
-	
-	// stop if we run out of space, remember where we should start next time.
+      // stop if we run out of space, remember where we should start next time.
+      // Changed routes are always searched from the start of the list.
+      if (state->delta!=DELTA_CHANGED)
 	state->next_advertisement=subscriber;
-	ob_rewind(state->payload);
-	return 1;
-      }
-      ob_checkpoint(state->payload);
+      ob_rewind(state->payload);
+      return 1;
     }
+    ob_checkpoint(state->payload);
+    
+    n->most_recent_advertisment_ms[state->interface_number]=state->now;
+    n->most_recent_advertised_score[state->interface_number]=n->best_link_score>255?255:n->best_link_score;
   }
   
   return 0;
@@ -118,6 +151,15 @@ int overlay_route_queue_advertisements(overlay_interface *interface)
      The src,dst and nexthop can each be encoded with a single byte.
      Thus using a fixed 1-byte RFS field we are limited to RFS<0xfa,
      which gives us 30 available advertisement slots per packet.
+
+     In delta mode (mdp.advertise.delta) the frame starts with a two byte header;
+     the sweep epoch in the high nibble and our interface number in the low nibble,
+     followed by a sequence number. Routes that are new or whose score has moved by
+     at least mdp.advertise.score_threshold are sent first, then any remaining space
+     is filled round-robin with unchanged routes that have not been repeated on this
+     interface for mdp.advertise.refresh_ms. Receivers use the sequence number
+     to notice lost deltas, and ask us with an OF_TYPE_NODEANNOUNCE_RESYNC frame to
+     repeat every route in a new sweep.
    */
   
   if (!my_subscriber)
@@ -134,31 +176,52 @@ int overlay_route_queue_advertisements(overlay_interface *interface)
   frame->payload = ob_new();
   ob_limitsize(frame->payload, 400);
   
-  struct advertisement_state state={.payload = frame->payload,};
+  time_ms_t now = gettime_ms();
+  struct advertisement_state state={
+    .payload = frame->payload,
+    .interface_number = interface - overlay_interfaces,
+    .now = now,
+  };
   
-  // TODO high priority advertisements first....
-  /*
-  while (slots>0&&oad_request_count) {
-      oad_request_count--;
-      ob_append_bytes(e,oad_requests[oad_request_count]->subscriber->sid,6);
-      ob_append_byte(e,oad_requests[oad_request_count]->best_link_score);
-      ob_append_byte(e,oad_requests[oad_request_count]
-		     ->observations[oad_requests[oad_request_count]
-				    ->best_observation].gateways_en_route);
-      slots--;
-      slots_used++;
-    } 
-*/
-  ob_checkpoint(frame->payload);
-  // append announcements starting from the last node we couldn't advertise last time
-  enum_subscribers(interface->next_advert, add_advertisement, &state);
-
-  // if we didn't start at the beginning and still have space, start again from the beginning
-  if (interface->next_advert && !state.next_advertisement && ob_remaining(frame->payload) > 0){
+  if (config.mdp.advertise.delta){
+    frame->type=OF_TYPE_NODEANNOUNCE_DELTA;
+    ob_append_byte(frame->payload, ((interface->advert_epoch&0xF)<<4) | (state.interface_number&0xF));
+    ob_append_byte(frame->payload, interface->advert_sequence);
+    ob_checkpoint(frame->payload);
+    
+    // new and changed routes take priority
+    state.delta=DELTA_CHANGED;
     enum_subscribers(NULL, add_advertisement, &state);
+    
+    // then fill any remaining space with routes that haven't been repeated for a while
+    state.delta=DELTA_STALE;
+    state.resync=interface->advert_resync;
+    if (ob_remaining(frame->payload) > 0){
+      enum_subscribers(interface->next_advert, add_advertisement, &state);
+      if (!state.next_advertisement){
+	// we've reached the end of the list, so this sweep is complete
+	interface->advert_resync=0;
+	state.resync=0;
+	if (interface->next_advert && ob_remaining(frame->payload) > 0)
+	  enum_subscribers(NULL, add_advertisement, &state);
+      }
+      interface->next_advert=state.next_advertisement;
+    }
+    
+    // always send the frame, even with no routes, as it is also our heartbeat on this interface
+    interface->advert_sequence++;
+  }else{
+    ob_checkpoint(frame->payload);
+    // append announcements starting from the last node we couldn't advertise last time
+    enum_subscribers(interface->next_advert, add_advertisement, &state);
+
+    // if we didn't start at the beginning and still have space, start again from the beginning
+    if (interface->next_advert && !state.next_advertisement && ob_remaining(frame->payload) > 0){
+      enum_subscribers(NULL, add_advertisement, &state);
+    }
+    
+    interface->next_advert=state.next_advertisement;
   }
-  
-  interface->next_advert=state.next_advertisement;
   ob_limitsize(frame->payload, ob_position(frame->payload));
   
   if (overlay_payload_enqueue(frame)){
@@ -177,11 +240,101 @@ int overlay_route_queue_advertisements(overlay_interface *interface)
    a rather complicated scheme whereby we attempt to trace through the list
    of nodes from here to there.  That seems silly, and is agains't the BATMAN
    approach of each node just knowing single-hop information.
+
+   Delta advertisements only carry routes that have changed or are due for a
+   refresh, so we track the sequence number from each of the sender's interfaces
+   to notice when we have missed one. When we find one we ask the sender to repeat
+   all of its routes, rather than waiting for them to be refreshed.
+   The sender picks a new epoch whenever it (re)starts an interface, so a jump in
+   the sequence with a different epoch means it has started again and will
+   announce every route as new, not that we have missed anything.
+ */
+
+// don't ask the same neighbour to resync more often than this
+#define ADVERT_RESYNC_INTERVAL_MS 1000
+
+static int overlay_route_request_resync(struct subscriber *sender, int sender_interface, time_ms_t now)
+{
+  if (!(subscriber_is_reachable(sender)&REACHABLE))
+    return 0;
+  if (sender->advert_resync_requested && now - sender->advert_resync_requested < ADVERT_RESYNC_INTERVAL_MS)
+    return 0;
+  sender->advert_resync_requested=now;
+
+  struct overlay_frame *frame=calloc(1,sizeof(struct overlay_frame));
+  if (!frame)
+    return WHY_perror("calloc");
+  frame->type=OF_TYPE_NODEANNOUNCE_RESYNC;
+  frame->source=my_subscriber;
+  frame->destination=sender;
+  frame->ttl=1;
+  frame->queue=OQ_MESH_MANAGEMENT;
+  frame->payload=ob_new();
+  ob_append_byte(frame->payload, sender_interface);
+  if (overlay_payload_enqueue(frame)){
+    op_free(frame);
+    return -1;
+  }
+  return 0;
+}
+
+static void overlay_route_check_advert_sequence(struct subscriber *sender, int header, int sequence, time_ms_t now)
+{
+  int sender_interface = header&0xF;
+  int epoch = (header>>4)&0xF;
+  
+  if ((sender->advert_seen & (1<<sender_interface))
+    && sender->advert_epoch[sender_interface]!=epoch){
+    if (config.debug.overlayrouting)
+      DEBUGF("%s restarted route advertisements on interface %d",
+	     alloca_tohex_sid(sender->sid), sender_interface);
+  }else if (sender->advert_seen & (1<<sender_interface)){
+    unsigned char missed=sequence - sender->advert_sequence[sender_interface] - 1;
+    // a repeat of the last sequence number is a duplicate, not a gap
+    if (missed && missed!=255){
+      if (config.debug.overlayrouting)
+	DEBUGF("Missed %d route advertisement(s) from %s on interface %d, asking for a resync",
+	       missed, alloca_tohex_sid(sender->sid), sender_interface);
+      overlay_route_request_resync(sender, sender_interface, now);
+    }
+  }
+  sender->advert_seen |= 1<<sender_interface;
+  sender->advert_epoch[sender_interface]=epoch;
+  sender->advert_sequence[sender_interface]=sequence;
+}
+
+/* A neighbour has missed one of our delta advertisements, so start a new sweep
+   on that interface that repeats every route.
  */
+int overlay_route_saw_advert_resync(int i, struct overlay_frame *f)
+{
+  int interface_number=ob_get(f->payload);
+  if (interface_number<0 || interface_number>=OVERLAY_MAX_INTERFACES)
+    return WHY("Invalid advertisement resync request");
+  overlay_interface *interface=&overlay_interfaces[interface_number];
+  if (interface->state!=INTERFACE_STATE_UP)
+    return 0;
+  if (config.debug.overlayrouting)
+    DEBUGF("%s asked us to repeat our routes on interface %s",
+	   alloca_tohex_sid(f->source->sid), interface->name);
+  interface->next_advert=NULL;
+  interface->advert_resync=1;
+  return 0;
+}
+
 int overlay_route_saw_advertisements(int i, struct overlay_frame *f, struct decode_context *context, time_ms_t now)
 {
   IN();
   struct subscriber *previous=context->previous;
+  
+  if (f->type==OF_TYPE_NODEANNOUNCE_DELTA){
+    int header=ob_get(f->payload);
+    int sequence=ob_get(f->payload);
+    if (header<0 || sequence<0)
+      RETURN(WHY("Delta advertisement is too short"));
+    overlay_route_check_advert_sequence(f->source, header, sequence, now);
+  }
+  
   // minimum record length is (address code, 3 byte sid, score, gateways)
   while(ob_remaining(f->payload)>0)
     {
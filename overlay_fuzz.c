@@ -0,0 +1,395 @@
+/*
+Serval overlay packet parser benchmark and fuzzing harness
+Copyright (C) 2013 Serval Project, Inc.
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+/*
+  Feeds overlay packets straight into packetOkOverlay(), and so through
+  parseEnvelopeHeader() and parseMdpPacketHeader(), without running a daemon.
+
+  The receiving node has an in-memory identity and one interface whose
+  transmit side writes to /dev/null, so any replies, probes or forwarded frames
+  the parser queues are built and "sent" as usual, but go nowhere.
+
+    make overlay_fuzz
+    ./overlay_fuzz [-n <packets>] [-o <corpus_dir>] [<dummy_file> ...]
+
+  Packets are read from dummy interface files, like the ones left behind by the
+  tests in tests/routing.  With no files, a few peers with their own overlay
+  state are created in this process and their real transmit path generates
+  node announcements, SAS requests and MDP echo frames addressed to the
+  receiver.  The corpus is then replayed until <packets> packets have been
+  parsed, and the packet rate and heap allocations per packet are reported.
+  -o writes each corpus packet to its own file, to seed a fuzzer.
+
+  The same object provides LLVMFuzzerTestOneInput().  To build a libFuzzer
+  binary, compile everything with clang and -fsanitize=fuzzer-no-link (eg, from
+  Makefile.dbg), then
+    make overlay_fuzz FUZZ_CFLAGS=-DLIBFUZZER FUZZ_LDFLAGS=-fsanitize=fuzzer
+*/
+
+#include <sys/time.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <arpa/inet.h>
+#include "serval.h"
+#include "conf.h"
+#include "overlay_address.h"
+
+#define SYNTHETIC_PEERS 8
+
+/* The Makefile links this harness with -Wl,--wrap for each allocator, so every
+   heap allocation made by the overlay code passes through here to be counted. */
+static unsigned long long allocations=0;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+void *__wrap_malloc(size_t size)
+{
+  allocations++;
+  return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t nmemb, size_t size)
+{
+  allocations++;
+  return __real_calloc(nmemb, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size)
+{
+  allocations++;
+  return __real_realloc(ptr, size);
+}
+
+struct corpus_packet{
+  struct sockaddr_in src_addr;
+  int length;
+  unsigned char *bytes;
+};
+
+static struct corpus_packet *corpus=NULL;
+static int corpus_count=0;
+static int corpus_size=0;
+
+static time_ms_t fuzz_now;
+static overlay_interface *rx_interface=NULL;
+
+static struct in_addr fuzz_address(int n)
+{
+  struct in_addr addr = {.s_addr=htonl(0x0A000000 | n)};
+  return addr;
+}
+
+/* Bring up interface 0 of whichever node is swapped in, writing any packets it
+   sends to fd in dummy interface file format. */
+static overlay_interface *setup_interface(int n, int fd)
+{
+  overlay_interface *interface=&overlay_interfaces[0];
+  bzero(interface, sizeof *interface);
+  snprintf(interface->name, sizeof interface->name, "fuzz%d", n);
+  interface->type=OVERLAY_INTERFACE_ETHERNET;
+  interface->socket_type=SOCK_FILE;
+  interface->encapsulation=ENCAP_OVERLAY;
+  interface->port=PORT_DNA;
+  interface->send_broadcasts=1;
+  interface->mtu=1200;
+  interface->tick_ms=500;
+  interface->last_tick_ms=-1;
+  interface->alarm.poll.fd=fd;
+  limit_init(&interface->transfer_limit, 100);
+
+  interface->address.sin_family=AF_INET;
+  interface->address.sin_port=htons(PORT_DNA);
+  interface->address.sin_addr=fuzz_address(n);
+  interface->netmask.s_addr=htonl(0xFF000000);
+  interface->broadcast_address.sin_family=AF_INET;
+  interface->broadcast_address.sin_port=htons(PORT_DNA);
+  interface->broadcast_address.sin_addr.s_addr=interface->address.sin_addr.s_addr | ~interface->netmask.s_addr;
+  interface->state=INTERFACE_STATE_UP;
+  overlay_interface_count=1;
+  return interface;
+}
+
+static int init_receiver()
+{
+  if (cf_init())
+    return WHY("Could not initialise configuration");
+  fuzz_now=gettime_ms();
+  virtual_time_ms=&fuzz_now;
+  overlay_queue_init();
+  if (!(keyring = keyring_create_in_memory()))
+    return WHY("Could not create receiver identity");
+  int fd = open("/dev/null", O_WRONLY);
+  if (fd==-1)
+    return WHY_perror("open(/dev/null)");
+  rx_interface=setup_interface(1, fd);
+  return 0;
+}
+
+/* Parse one packet as the receiver, then let anything it queued in response go out */
+static int feed_packet(unsigned char *bytes, size_t len, struct sockaddr_in *src_addr)
+{
+  int ret = packetOkOverlay(rx_interface, bytes, len, -1, (struct sockaddr *)src_addr, sizeof *src_addr);
+  fuzz_now++;
+  fd_run_alarms();
+  return ret;
+}
+
+static int add_packet(const struct sockaddr_in *src_addr, const unsigned char *bytes, int length)
+{
+  if (length<=0 || length>sizeof(((struct file_packet *)0)->payload))
+    return WHYF("Invalid packet length %d", length);
+  if (corpus_count>=corpus_size){
+    int size = corpus_size?corpus_size*2:64;
+    struct corpus_packet *c = realloc(corpus, size * sizeof(struct corpus_packet));
+    if (!c)
+      return WHY_perror("realloc");
+    corpus=c;
+    corpus_size=size;
+  }
+  struct corpus_packet *p=&corpus[corpus_count];
+  p->src_addr=*src_addr;
+  p->length=length;
+  p->bytes=malloc(length);
+  if (!p->bytes)
+    return WHY_perror("malloc");
+  bcopy(bytes, p->bytes, length);
+  corpus_count++;
+  return 0;
+}
+
+static int load_dummy_file(int fd, const char *name)
+{
+  struct file_packet packet;
+  ssize_t nread;
+  int count=0;
+  while((nread = read(fd, &packet, sizeof packet)) == sizeof packet){
+    if (add_packet(&packet.src_addr, packet.payload, packet.payload_length)==0)
+      count++;
+  }
+  if (nread == -1)
+    return WHYF_perror("read(%s)", name);
+  if (nread != 0)
+    WARNF("Ignoring %d trailing bytes in %s", (int)nread, name);
+  INFOF("Loaded %d packets from %s", count, name);
+  return count;
+}
+
+static int send_echo(const unsigned char *dst_sid, int flags)
+{
+  overlay_mdp_frame mdp;
+  bzero(&mdp, sizeof mdp);
+  mdp.packetTypeAndFlags=MDP_TX|flags;
+  bcopy(my_subscriber->sid, mdp.out.src.sid, SID_SIZE);
+  mdp.out.src.port=MDP_PORT_ECHO;
+  bcopy(dst_sid, mdp.out.dst.sid, SID_SIZE);
+  mdp.out.dst.port=MDP_PORT_ECHO;
+  mdp.out.queue=OQ_ORDINARY;
+  mdp.out.payload_length=64;
+  urandombytes(mdp.out.payload, mdp.out.payload_length);
+  return overlay_mdp_dispatch(&mdp, 0, NULL, 0);
+}
+
+/* Run the transmit side of some peers, each with its own overlay state, and
+   capture what they send to the receiver */
+static int synthesise_corpus(int peers)
+{
+  unsigned char rx_sid[SID_SIZE];
+  bcopy(my_subscriber->sid, rx_sid, SID_SIZE);
+  unsigned char broadcast_sid[SID_SIZE];
+  memset(broadcast_sid, 0xFF, SID_SIZE);
+
+  FILE *capture = tmpfile();
+  if (!capture)
+    return WHY_perror("tmpfile");
+  int fd = fileno(capture);
+  int i, ret=0;
+
+  for (i=0;i<peers && ret==0;i++){
+    struct overlay_state state;
+    bzero(&state, sizeof state);
+    if (overlay_swap_state(&state))
+      return -1;
+
+    if (!(keyring = keyring_create_in_memory())){
+      ret = WHY("Could not create peer identity");
+    }else{
+      overlay_interface *interface=setup_interface(i+2, fd);
+      // knowing the receiver's address lets the peer send it unicast frames, starting with a SAS request
+      struct subscriber *rx = find_subscriber(rx_sid, SID_SIZE, 1);
+      reachable_unicast(rx, interface, fuzz_address(1), PORT_DNA);
+      overlay_route_queue_advertisements(interface);
+      send_echo(broadcast_sid, MDP_NOCRYPT|MDP_NOSIGN);
+      send_echo(rx_sid, 0);
+      int j;
+      for (j=0;j<20;j++){
+	fuzz_now+=100;
+	fd_run_alarms();
+      }
+    }
+
+    // the peer's state is simply abandoned, we only wanted its packets
+    if (overlay_swap_state(&state))
+      return -1;
+  }
+
+  if (ret==0){
+    if (lseek(fd, 0, SEEK_SET)==-1)
+      ret = WHY_perror("lseek");
+    else if (load_dummy_file(fd, "synthetic peers")<=0)
+      ret = WHY("Synthetic peers did not send anything");
+  }
+  fclose(capture);
+  return ret;
+}
+
+static int write_corpus(const char *dir)
+{
+  if (mkdir(dir, 0700)==-1 && errno!=EEXIST)
+    return WHYF_perror("mkdir(%s)", dir);
+  int i;
+  for (i=0;i<corpus_count;i++){
+    char path[1024];
+    snprintf(path, sizeof path, "%s/packet-%04d", dir, i);
+    int fd = open(path, O_WRONLY|O_CREAT|O_TRUNC, 0600);
+    if (fd==-1)
+      return WHYF_perror("open(%s)", path);
+    if (write_all(fd, corpus[i].bytes, corpus[i].length)==-1){
+      close(fd);
+      return -1;
+    }
+    close(fd);
+  }
+  return 0;
+}
+
+static long long real_time_us()
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec * 1000000LL + tv.tv_usec;
+}
+
+static int benchmark(long long count)
+{
+  unsigned char buffer[sizeof(((struct file_packet *)0)->payload)];
+  long long i, bytes=0, rejected=0;
+  unsigned long long start_allocations=allocations;
+  struct nm_cache_stats start_nm=nm_cache_stats;
+  long long start=real_time_us();
+
+  for (i=0;i<count;i++){
+    struct corpus_packet *p=&corpus[i % corpus_count];
+    // the parser is allowed to modify the packet in place
+    bcopy(p->bytes, buffer, p->length);
+    if (feed_packet(buffer, p->length, &p->src_addr)<0)
+      rejected++;
+    bytes+=p->length;
+  }
+
+  long long elapsed=real_time_us()-start;
+  if (elapsed<1)
+    elapsed=1;
+  unsigned long long used=allocations-start_allocations;
+  printf("Parsed %lld packets (%lld bytes, %d distinct, %lld rejected) in %.3fs\n",
+	 count, bytes, corpus_count, rejected, elapsed/1000000.0);
+  printf("%.0f packets/sec, %.2f MB/sec, %.2f allocations per packet\n",
+	 count*1000000.0/elapsed, bytes/(double)elapsed, (double)used/count);
+  printf("crypto_box shared secrets: %u cached, %u computed\n",
+	 nm_cache_stats.hits-start_nm.hits, nm_cache_stats.misses-start_nm.misses);
+  return 0;
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+  static int initialised=0;
+  if (!initialised){
+    if (init_receiver())
+      FATAL("Could not initialise overlay fuzzing harness");
+    initialised=1;
+  }
+  unsigned char buffer[sizeof(((struct file_packet *)0)->payload)];
+  if (size>sizeof buffer)
+    return 0;
+  bcopy(data, buffer, size);
+  struct sockaddr_in src_addr={
+    .sin_family=AF_INET,
+    .sin_port=htons(PORT_DNA),
+    .sin_addr=fuzz_address(2),
+  };
+  feed_packet(buffer, size, &src_addr);
+  return 0;
+}
+
+#ifndef LIBFUZZER
+static void usage(const char *name)
+{
+  fprintf(stderr, "usage: %s [-n <packets>] [-o <corpus_dir>] [<dummy_file> ...]\n", name);
+  exit(1);
+}
+
+int main(int argc, char **argv)
+{
+  long long count=100000;
+  const char *corpus_dir=NULL;
+  int c;
+  while((c=getopt(argc, argv, "n:o:"))!=-1){
+    switch(c){
+      case 'n':
+	count=atoll(optarg);
+	break;
+      case 'o':
+	corpus_dir=optarg;
+	break;
+      default:
+	usage(argv[0]);
+    }
+  }
+  if (count<1)
+    usage(argv[0]);
+
+  srandomdev();
+  if (init_receiver())
+    return 1;
+
+  int i;
+  for (i=optind;i<argc;i++){
+    int fd = open(argv[i], O_RDONLY);
+    if (fd==-1){
+      WHYF_perror("open(%s)", argv[i]);
+      return 1;
+    }
+    int r=load_dummy_file(fd, argv[i]);
+    close(fd);
+    if (r==-1)
+      return 1;
+  }
+  if (optind>=argc && synthesise_corpus(SYNTHETIC_PEERS))
+    return 1;
+  if (corpus_count==0){
+    WHY("No packets to parse");
+    return 1;
+  }
+  if (corpus_dir && write_corpus(corpus_dir))
+    return 1;
+  return benchmark(count)?1:0;
+}
+#endif
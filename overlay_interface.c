@@ -38,7 +38,8 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 
 int overlay_ready=0;
 int overlay_interface_count=0;
-overlay_interface overlay_interfaces[OVERLAY_MAX_INTERFACES];
+static overlay_interface _overlay_interfaces[OVERLAY_MAX_INTERFACES];
+overlay_interface *overlay_interfaces=_overlay_interfaces;
 int overlay_last_interface_number=-1;
 
 struct profile_total interface_poll_stats;
@@ -136,6 +137,40 @@ error:
   return -1;
 }
 
+struct interface_state{
+  overlay_interface *interfaces;
+  int interface_count;
+  int last_interface_number;
+};
+
+/* Exchange the interface table with the one saved in *state, or with an empty
+   table if *state is NULL.  Used by the mesh simulator to host many nodes. */
+int overlay_interface_swap_state(void **state){
+  struct interface_state *s = *state;
+  if (!s){
+    s = calloc(1, sizeof(struct interface_state));
+    if (!s)
+      return WHY_perror("calloc");
+    s->interfaces = calloc(OVERLAY_MAX_INTERFACES, sizeof(overlay_interface));
+    if (!s->interfaces){
+      free(s);
+      return WHY_perror("calloc");
+    }
+    s->last_interface_number = -1;
+    *state = s;
+  }
+  struct interface_state old={
+    .interfaces=overlay_interfaces,
+    .interface_count=overlay_interface_count,
+    .last_interface_number=overlay_last_interface_number,
+  };
+  overlay_interfaces=s->interfaces;
+  overlay_interface_count=s->interface_count;
+  overlay_last_interface_number=s->last_interface_number;
+  *s=old;
+  return 0;
+}
+
 overlay_interface * overlay_interface_get_default(){
   int i;
   for (i=0;i<OVERLAY_MAX_INTERFACES;i++){
@@ -335,6 +370,7 @@ overlay_interface_init(const char *name, struct in_addr src_addr, struct in_addr
   // copy ifconfig values
   interface->drop_broadcasts = ifconfig->drop_broadcasts;
   interface->drop_unicasts = ifconfig->drop_unicasts;
+  interface->drop_percent = ifconfig->drop_percent;
   interface->port = ifconfig->port;
   interface->type = ifconfig->type;
   interface->send_broadcasts = ifconfig->send_broadcasts;
@@ -347,7 +383,10 @@ overlay_interface_init(const char *name, struct in_addr src_addr, struct in_addr
      This will ultimately get tuned by the bandwidth and other properties of the interface */
   interface->mtu=1200;
   interface->state=INTERFACE_STATE_DOWN;
+  // forget any routes that used an old interface in this slot
+  overlay_forwarding_invalidate();
   interface->last_tick_ms= -1; // not ticked yet
+  interface->advert_epoch=random()&0xF;
   interface->alarm.poll.fd=0;
   
   // How often do we announce ourselves on this interface?
@@ -521,29 +560,6 @@ static void interface_read_dgram(struct overlay_interface *interface){
   }
 }
 
-struct file_packet{
-  struct sockaddr_in src_addr;
-  struct sockaddr_in dst_addr;
-  int pid;
-  int payload_length;
-  
-  /* TODO ? ;
-   half-power beam height (uint16)
-   half-power beam width (uint16)
-   range in metres, centre beam (uint32)
-   latitude (uint32)
-   longitude (uint32)
-   X/Z direction (uint16)
-   Y direction (uint16)
-   speed in metres per second (uint16)
-   TX frequency in Hz, uncorrected for doppler (which must be done at the receiving end to take into account
-   relative motion)
-   coding method (use for doppler response etc) null terminated string
-   */
-  
-  unsigned char payload[1400];
-};
-
 static void interface_read_file(struct overlay_interface *interface)
 {
   IN();
@@ -581,7 +597,10 @@ static void interface_read_file(struct overlay_interface *interface)
       if (config.debug.packetrx)
 	DEBUG_packet_visualise("Read from dummy interface", packet.payload, packet.payload_length);
       
-      if (((!interface->drop_unicasts) && memcmp(&packet.dst_addr, &interface->address, sizeof(packet.dst_addr))==0) ||
+      if (interface->drop_percent && random()%100 < interface->drop_percent){
+	if (config.debug.packetrx)
+	  DEBUGF("Dropped packet from dummy interface %s at random", interface->name);
+      }else if (((!interface->drop_unicasts) && memcmp(&packet.dst_addr, &interface->address, sizeof(packet.dst_addr))==0) ||
 	  ((!interface->drop_broadcasts) &&
 	   memcmp(&packet.dst_addr, &interface->broadcast_address, sizeof(packet.dst_addr))==0)){
 	    
@@ -844,6 +863,9 @@ overlay_broadcast_ensemble(overlay_interface *interface,
       return 0;
     }
       
+    case SOCK_SIMULATED:
+      return overlay_simulator_transmit(interface, recipientaddr, bytes, len);
+      
     default:
       return WHY("Unsupported socket type");
   }
@@ -91,11 +91,89 @@ int subscriber_is_reachable(struct subscriber *subscriber){
   return ret;
 }
 
+/* Every subscriber caches how to reach it in subscriber->forwarding, so that
+   queueing and forwarding a frame doesn't need to walk the next hop chain,
+   directory service and interface preferences every time.
+   Any change to reachability, next hops, addresses or interfaces bumps the
+   version, which invalidates every cached entry at once. They are rebuilt as
+   frames need them. */
+static unsigned int forwarding_version=1;
+struct forwarding_stats forwarding_stats;
+
+void overlay_forwarding_invalidate()
+{
+  forwarding_version++;
+  forwarding_stats.invalidations++;
+}
+
+static int forwarding_rebuild(struct subscriber *destination, struct forwarding_entry *entry)
+{
+  struct subscriber *next_hop = destination;
+  int r = subscriber_is_reachable(next_hop);
+  
+  // should we try to bounce this payload off the directory service?
+  if (r==REACHABLE_NONE && directory_service && next_hop!=directory_service){
+    next_hop=directory_service;
+    r=subscriber_is_reachable(directory_service);
+  }
+  
+  // do we need to route via a neighbour?
+  if (r&REACHABLE_INDIRECT){
+    next_hop = next_hop->next_hop;
+    r = subscriber_is_reachable(next_hop);
+  }
+  
+  if (!(r&REACHABLE_DIRECT))
+    return -1;
+  
+  entry->next_hop = next_hop;
+  entry->interface = next_hop->interface;
+  entry->prefer_unicast = 0;
+  
+  // if both broadcast and unicast are available, pick on based on interface preference
+  if ((r&(REACHABLE_UNICAST|REACHABLE_BROADCAST))==(REACHABLE_UNICAST|REACHABLE_BROADCAST)){
+    if (entry->interface->prefer_unicast){
+      r=REACHABLE_UNICAST;
+      entry->prefer_unicast = 1;
+    }else
+      r=REACHABLE_BROADCAST;
+  }
+  
+  if (r&REACHABLE_UNICAST){
+    entry->addr = next_hop->address;
+    entry->unicast = 1;
+  }else{
+    entry->addr = entry->interface->broadcast_address;
+    entry->unicast = 0;
+  }
+  entry->version = forwarding_version;
+  return 0;
+}
+
+/* Where should we send a frame for this destination next? Returns NULL if we
+   have no usable route. Only successful lookups are cached, an interface going
+   down also invalidates any entry that uses it. */
+struct forwarding_entry *overlay_forwarding_lookup(struct subscriber *destination)
+{
+  if (!destination)
+    return NULL;
+  forwarding_stats.lookups++;
+  struct forwarding_entry *entry = &destination->forwarding;
+  if (entry->version == forwarding_version && entry->interface->state==INTERFACE_STATE_UP)
+    return entry;
+  forwarding_stats.rebuilds++;
+  entry->version = 0;
+  if (forwarding_rebuild(destination, entry))
+    return NULL;
+  return entry;
+}
+
 int set_reachable(struct subscriber *subscriber, int reachable){
   if (subscriber->reachable==reachable)
     return 0;
   int old_value = subscriber->reachable;
   subscriber->reachable=reachable;
+  overlay_forwarding_invalidate();
   
   // These log messages are for use in tests.  Changing them may break test scripts.
   if (config.debug.overlayrouting) {
@@ -141,6 +219,18 @@ int set_reachable(struct subscriber *subscriber, int reachable){
   return 0;
 }
 
+/* Remember the interface and address we can reach a neighbour on.  Cached forwarding
+   entries hold a copy of both, so any change must invalidate them. */
+void set_subscriber_address(struct subscriber *subscriber, overlay_interface *interface, const struct sockaddr_in *addr){
+  if (subscriber->interface != interface
+    || subscriber->address.sin_family != addr->sin_family
+    || subscriber->address.sin_addr.s_addr != addr->sin_addr.s_addr
+    || subscriber->address.sin_port != addr->sin_port)
+    overlay_forwarding_invalidate();
+  subscriber->interface = interface;
+  subscriber->address = *addr;
+}
+
 // mark the subscriber as reachable via reply unicast packet
 int reachable_unicast(struct subscriber *subscriber, overlay_interface *interface, struct in_addr addr, int port){
   if (subscriber->reachable&REACHABLE)
@@ -149,10 +239,12 @@ int reachable_unicast(struct subscriber *subscriber, overlay_interface *interfac
   if (subscriber->node)
     return -1;
   
-  subscriber->interface = interface;
-  subscriber->address.sin_family = AF_INET;
-  subscriber->address.sin_addr = addr;
-  subscriber->address.sin_port = htons(port);
+  struct sockaddr_in address;
+  bzero(&address, sizeof address);
+  address.sin_family = AF_INET;
+  address.sin_addr = addr;
+  address.sin_port = htons(port);
+  set_subscriber_address(subscriber, interface, &address);
   set_reachable(subscriber, REACHABLE_UNICAST);
   
   return 0;
@@ -237,10 +329,12 @@ overlay_mdp_service_probe(overlay_mdp_frame *mdp)
     RETURN(WHY("Unsupported address family"));
   
   peer->last_probe_response = gettime_ms();
-  peer->interface = &overlay_interfaces[probe.interface];
-  peer->address.sin_family = AF_INET;
-  peer->address.sin_addr = probe.addr.sin_addr;
-  peer->address.sin_port = probe.addr.sin_port;
+  struct sockaddr_in address;
+  bzero(&address, sizeof address);
+  address.sin_family = AF_INET;
+  address.sin_addr = probe.addr.sin_addr;
+  address.sin_port = probe.addr.sin_port;
+  set_subscriber_address(peer, &overlay_interfaces[probe.interface], &address);
   set_reachable(peer, REACHABLE_UNICAST | (peer->reachable & REACHABLE_DIRECT));
   RETURN(0);
   OUT();
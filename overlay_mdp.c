@@ -16,6 +16,7 @@ along with this program; if not, write to the Free Software
 Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 */
 
+#include <stddef.h>
 #include <sys/stat.h>
 #include "serval.h"
 #include "conf.h"
@@ -25,9 +26,11 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include "overlay_address.h"
 #include "overlay_packet.h"
 #include "mdp_client.h"
+#include "mdp_ring.h"
 #include "crypto.h"
 
 struct profile_total mdp_stats={.name="overlay_mdp_poll"};
+struct profile_total mdp_ring_stats={.name="overlay_mdp_ring_poll"};
 
 struct sched_ent mdp_abstract={
   .function = overlay_mdp_poll,
@@ -39,7 +42,7 @@ struct sched_ent mdp_named={
   .stats = &mdp_stats,
 };
 
-static int overlay_saw_mdp_frame(struct overlay_frame *frame, overlay_mdp_frame *mdp, time_ms_t now);
+static int overlay_saw_mdp_frame(struct internal_mdp_header *header, struct overlay_buffer *payload, time_ms_t now);
 
 int overlay_mdp_setup_sockets()
 {
@@ -119,7 +122,7 @@ int overlay_mdp_setup_sockets()
   
 }
 
-#define MDP_MAX_BINDINGS 100
+#define MDP_BINDING_HASH_SIZE 256
 #define MDP_MAX_SOCKET_NAME_LEN 110
 
 struct mdp_binding{
@@ -128,10 +131,278 @@ struct mdp_binding{
   char socket_name[MDP_MAX_SOCKET_NAME_LEN];
   int name_len;
   time_ms_t binding_time;
+  struct mdp_binding *next_by_address;
+  struct mdp_binding *next_by_port;
+  struct mdp_binding *next_by_client;
 };
 
-struct mdp_binding mdp_bindings[MDP_MAX_BINDINGS];
-int mdp_bindings_initialised=0;
+/* Port bindings are hashed three ways:
+   by subscriber and port, to deliver incoming frames and check outgoing ones,
+   by port alone, to deliver broadcast frames to any bound subscriber,
+   and by client socket name, to release all of a client's bindings when it goes away.
+   A binding for all local subscribers has a NULL subscriber. */
+static struct mdp_binding *bindings_by_address[MDP_BINDING_HASH_SIZE];
+static struct mdp_binding *bindings_by_port[MDP_BINDING_HASH_SIZE];
+static struct mdp_binding *bindings_by_client[MDP_BINDING_HASH_SIZE];
+static int mdp_binding_count=0;
+
+static unsigned int hash_port(int port)
+{
+  return ((unsigned int)port * 2654435761u >> 16) & (MDP_BINDING_HASH_SIZE - 1);
+}
+
+static unsigned int hash_address(struct subscriber *subscriber, int port)
+{
+  return hash_port(port ^ (int)((uintptr_t)subscriber >> 4));
+}
+
+static unsigned int hash_client(const char *name, int name_len)
+{
+  // FNV-1a
+  uint32_t h = 2166136261u;
+  int i;
+  for (i=0;i<name_len;i++)
+    h = (h ^ (unsigned char)name[i]) * 16777619u;
+  return h & (MDP_BINDING_HASH_SIZE - 1);
+}
+
+static struct mdp_binding *find_binding(struct subscriber *subscriber, int port)
+{
+  struct mdp_binding *b = bindings_by_address[hash_address(subscriber, port)];
+  while(b && (b->port!=port || b->subscriber!=subscriber))
+    b=b->next_by_address;
+  return b;
+}
+
+static struct mdp_binding *find_any_binding(int port)
+{
+  struct mdp_binding *b = bindings_by_port[hash_port(port)];
+  while(b && b->port!=port)
+    b=b->next_by_port;
+  return b;
+}
+
+static int binding_owned_by(struct mdp_binding *b, const char *name, int name_len)
+{
+  return b->name_len==name_len && !memcmp(b->socket_name, name, name_len);
+}
+
+static void add_binding(struct mdp_binding *b)
+{
+  unsigned int h=hash_address(b->subscriber, b->port);
+  b->next_by_address=bindings_by_address[h];
+  bindings_by_address[h]=b;
+  h=hash_port(b->port);
+  b->next_by_port=bindings_by_port[h];
+  bindings_by_port[h]=b;
+  h=hash_client(b->socket_name, b->name_len);
+  b->next_by_client=bindings_by_client[h];
+  bindings_by_client[h]=b;
+  mdp_binding_count++;
+}
+
+static void free_binding(struct mdp_binding *b)
+{
+  struct mdp_binding **p;
+  for (p=&bindings_by_address[hash_address(b->subscriber, b->port)];*p!=b;p=&(*p)->next_by_address)
+    ;
+  *p=b->next_by_address;
+  for (p=&bindings_by_port[hash_port(b->port)];*p!=b;p=&(*p)->next_by_port)
+    ;
+  *p=b->next_by_port;
+  for (p=&bindings_by_client[hash_client(b->socket_name, b->name_len)];*p!=b;p=&(*p)->next_by_client)
+    ;
+  *p=b->next_by_client;
+  mdp_binding_count--;
+  free(b);
+}
+
+#define MDP_MAX_RING_CLIENTS 16
+
+/* A client that has attached a shared memory ring, see mdp_ring.h */
+struct mdp_ring_client{
+  struct mdp_ring_client *next;
+  char socket_name[MDP_MAX_SOCKET_NAME_LEN];
+  int name_len;
+  struct mdp_ring_region *region;
+  // doorbell we ring when to_client becomes non-empty
+  int to_client;
+  // watches the to_server doorbell
+  struct sched_ent alarm;
+  // set while frames are being dispatched, so they can't free us
+  int draining;
+  int closed;
+};
+
+static struct mdp_ring_client *ring_clients=NULL;
+static int ring_client_count=0;
+
+static struct mdp_ring_client *find_ring_client(const char *name, int name_len)
+{
+  struct mdp_ring_client *c;
+  for (c=ring_clients;c;c=c->next)
+    if (c->name_len==name_len && !memcmp(c->socket_name, name, name_len))
+      return c;
+  return NULL;
+}
+
+static void free_ring_client(struct mdp_ring_client *c)
+{
+  if (c->draining){
+    c->closed=1;
+    return;
+  }
+  struct mdp_ring_client **p;
+  for (p=&ring_clients;*p!=c;p=&(*p)->next)
+    ;
+  *p=c->next;
+  ring_client_count--;
+  unwatch(&c->alarm);
+  close(c->alarm.poll.fd);
+  close(c->to_client);
+  mdp_ring_unmap(c->region);
+  free(c);
+}
+
+/* Dispatch the frames waiting in a client's to_server ring, at most one ring
+   full per call so that other alarms get a turn */
+static void ring_client_drain(struct mdp_ring_client *c)
+{
+  struct sockaddr_un addr;
+  addr.sun_family=AF_UNIX;
+  bcopy(c->socket_name, addr.sun_path, c->name_len);
+  int addrlen=c->name_len + sizeof(short);
+  overlay_mdp_frame mdp;
+  int i;
+
+  c->draining=1;
+  for (i=0;i<MDP_RING_SLOTS && !c->closed;i++){
+    int len=mdp_ring_get(&c->region->to_server, &mdp);
+    if (len==0)
+      break;
+    if (len<0)
+      continue;
+    if ((mdp.packetTypeAndFlags&MDP_TYPE_MASK)!=MDP_TX || len < overlay_mdp_relevant_bytes(&mdp)){
+      WARNF("Ignoring invalid frame in MDP ring of '%s'", alloca_toprint(-1, c->socket_name, c->name_len));
+      continue;
+    }
+    // Dont allow mdp clients to send very high priority payloads
+    if (mdp.out.queue<=OQ_MESH_MANAGEMENT)
+      mdp.out.queue=OQ_ORDINARY;
+    overlay_mdp_dispatch(&mdp,1,&addr,addrlen);
+  }
+  c->draining=0;
+
+  if (c->closed)
+    free_ring_client(c);
+  else if (!mdp_ring_empty(&c->region->to_server))
+    mdp_ring_doorbell(c->alarm.poll.fd);
+}
+
+static void overlay_mdp_ring_poll(struct sched_ent *alarm)
+{
+  struct mdp_ring_client *c=alarm->context;
+  if (alarm->poll.revents & POLLIN){
+    mdp_ring_doorbell_clear(alarm->poll.fd);
+    ring_client_drain(c);
+  }else if (alarm->poll.revents & (POLLHUP | POLLERR)){
+    INFOF("Error on MDP ring doorbell of '%s'", alloca_toprint(-1, c->socket_name, c->name_len));
+    free_ring_client(c);
+  }
+}
+
+/* Attach the ring region and doorbells passed with an MDP_RING frame.
+   Takes ownership of the descriptors. */
+static int overlay_mdp_ring_open(int *fds, int fd_count, struct sockaddr_un *recvaddr, int recvaddrlen)
+{
+  int name_len = recvaddrlen - sizeof(short);
+  struct mdp_ring_region *region=NULL;
+
+  if (fd_count!=MDP_RING_FD_COUNT){
+    WHYF("MDP_RING frame carried %d descriptors, expected %d", fd_count, MDP_RING_FD_COUNT);
+    goto error;
+  }
+  if (name_len<=0 || name_len>MDP_MAX_SOCKET_NAME_LEN){
+    WHY("Invalid socket name for MDP ring");
+    goto error;
+  }
+  struct mdp_ring_client *c=find_ring_client(recvaddr->sun_path, name_len);
+  if (c)
+    free_ring_client(c);
+  if (ring_client_count>=MDP_MAX_RING_CLIENTS){
+    // make room by dropping the rings of clients that died without saying goodbye
+    struct mdp_ring_client *next;
+    for (c=ring_clients;c;c=next){
+      char path[MDP_MAX_SOCKET_NAME_LEN+1];
+      struct stat st;
+      next=c->next;
+      bcopy(c->socket_name, path, c->name_len);
+      path[c->name_len]=0;
+      if (path[0] && stat(path, &st)==-1 && errno==ENOENT)
+	free_ring_client(c);
+    }
+  }
+  if (ring_client_count>=MDP_MAX_RING_CLIENTS){
+    WHY("Too many MDP ring clients");
+    goto error;
+  }
+  region=mdp_ring_map(fds[MDP_RING_FD_REGION], 0);
+  if (!region)
+    goto error;
+  // the mapping holds the file open
+  close(fds[MDP_RING_FD_REGION]);
+
+  c=calloc(1, sizeof(struct mdp_ring_client));
+  if (!c){
+    WHY_perror("calloc");
+    mdp_ring_unmap(region);
+    fds[MDP_RING_FD_REGION]=-1;
+    goto error;
+  }
+  bcopy(recvaddr->sun_path, c->socket_name, name_len);
+  c->name_len=name_len;
+  c->region=region;
+  c->to_client=fds[MDP_RING_FD_TO_CLIENT];
+  set_nonblock(c->to_client);
+  c->alarm.function=overlay_mdp_ring_poll;
+  c->alarm.context=c;
+  c->alarm.stats=&mdp_ring_stats;
+  c->alarm.poll.fd=fds[MDP_RING_FD_TO_SERVER];
+  c->alarm.poll.events=POLLIN;
+  set_nonblock(c->alarm.poll.fd);
+  watch(&c->alarm);
+  c->next=ring_clients;
+  ring_clients=c;
+  ring_client_count++;
+
+  if (config.debug.mdprequests)
+    DEBUGF("Attached MDP ring of '%s'", alloca_toprint(-1, c->socket_name, c->name_len));
+  return overlay_mdp_reply_error(mdp_named.poll.fd, recvaddr, recvaddrlen, 0, "Ring attached");
+
+error:
+  while(fd_count>0){
+    fd_count--;
+    if (fds[fd_count]!=-1)
+      close(fds[fd_count]);
+  }
+  return overlay_mdp_reply_error(mdp_named.poll.fd, recvaddr, recvaddrlen, 1, "Could not attach MDP ring");
+}
+
+/* Free up any MDP bindings held by the client with this socket name */
+static int release_client_bindings(const char *name, int name_len)
+{
+  struct mdp_binding *b = bindings_by_client[hash_client(name, name_len)];
+  while(b){
+    struct mdp_binding *next=b->next_by_client;
+    if (binding_owned_by(b, name, name_len))
+      free_binding(b);
+    b=next;
+  }
+  struct mdp_ring_client *c=find_ring_client(name, name_len);
+  if (c)
+    free_ring_client(c);
+  return 0;
+}
 
 int overlay_mdp_reply_error(int sock,
 			    struct sockaddr_un *recvaddr,int recvaddrlen,
@@ -185,114 +456,90 @@ int overlay_mdp_reply_ok(int sock,
 int overlay_mdp_releasebindings(struct sockaddr_un *recvaddr,int recvaddrlen)
 {
   /* Free up any MDP bindings held by this client. */
-  int i;
-  for(i=0;i<MDP_MAX_BINDINGS;i++)
-    if (mdp_bindings[i].name_len==recvaddrlen)
-      if (!memcmp(mdp_bindings[i].socket_name,recvaddr->sun_path,recvaddrlen))
-	mdp_bindings[i].port=0;
-
-  return 0;
-
+  int name_len = recvaddrlen - sizeof(short);
+  // don't lose frames that were queued before the client said goodbye
+  struct mdp_ring_client *c=find_ring_client(recvaddr->sun_path, name_len);
+  if (c)
+    ring_client_drain(c);
+  return release_client_bindings(recvaddr->sun_path, name_len);
 }
 
 int overlay_mdp_process_bind_request(int sock, struct subscriber *subscriber, int port,
 				     int flags, struct sockaddr_un *recvaddr, int recvaddrlen)
 {
-  int i;
-  
   if (port<=0){
     return WHYF("Port %d cannot be bound", port);
   }
-  if (!mdp_bindings_initialised) {
-    /* Mark all slots as unused */
-    for(i=0;i<MDP_MAX_BINDINGS;i++)
-      mdp_bindings[i].port=0;
-    mdp_bindings_initialised=1;
-  }
+  int name_len = recvaddrlen - sizeof(short);
+  if (name_len<0 || name_len>MDP_MAX_SOCKET_NAME_LEN)
+    return WHYF("Invalid socket name length %d", name_len);
 
   /* See if binding already exists */
-  int free=-1;
-  for(i=0;i<MDP_MAX_BINDINGS;i++) {
-    /* Look for duplicate bindings */
-    if (mdp_bindings[i].port == port && mdp_bindings[i].subscriber == subscriber) {
-      if (mdp_bindings[i].name_len==recvaddrlen &&
-	  !memcmp(mdp_bindings[i].socket_name,recvaddr->sun_path,recvaddrlen)) {
-	// this client already owns this port binding?
-	INFO("Identical binding exists");
-	return 0;
-      }else if(flags&MDP_FORCE){
-	// steal the port binding
-	free=i;
-	break;
-      }else{
-	return WHY("Port already in use");
-      }
+  struct mdp_binding *b = find_binding(subscriber, port);
+  if (b){
+    if (binding_owned_by(b, recvaddr->sun_path, name_len)) {
+      // this client already owns this port binding?
+      INFO("Identical binding exists");
+      return 0;
+    }else if(flags&MDP_FORCE){
+      // steal the port binding
+      free_binding(b);
+    }else{
+      return WHY("Port already in use");
     }
-    /* Look for free slots in case we need one */
-    if ((free==-1)&&(mdp_bindings[i].port==0)) free=i;
   }
  
   /* Okay, so no binding exists.  Make one, and return success.
-     If we have too many bindings, we should return an error.
      XXX - We don't find out when the socket responsible for a binding has died,
-     so stale bindings can hang around.  We really need a solution to this, e.g., 
-     probing the sockets periodically (by sending an MDP NOOP frame perhaps?) and
-     destroying any socket that reports an error.
+     so stale bindings can hang around until we fail to deliver a packet to them.
+     We really need a solution to this, e.g., probing the sockets periodically 
+     (by sending an MDP NOOP frame perhaps?) and destroying any socket that
+     reports an error.
   */
-  if (free==-1) {
-    /* XXX Should we probe for stale bindings here and now, since this is when
-       we want the spare slots ?
-
-       Picking one at random is as good a policy as any.
-       Call listeners don't have a port binding, so are unaffected by this.
-    */
-    free=random()%MDP_MAX_BINDINGS;
-  }
+  b = calloc(1, sizeof(struct mdp_binding));
+  if (!b)
+    return WHY_perror("calloc");
   if (config.debug.mdprequests) 
-    DEBUGF("Binding %s:%d", subscriber ? alloca_tohex_sid(subscriber->sid) : "NULL", port);
+    DEBUGF("Binding %s:%d (%d bindings)", subscriber ? alloca_tohex_sid(subscriber->sid) : "NULL", port, mdp_binding_count+1);
   /* Okay, record binding and report success */
-  mdp_bindings[free].port=port;
-  mdp_bindings[free].subscriber=subscriber;
-  
-  mdp_bindings[free].name_len=recvaddrlen-2;
-  memcpy(mdp_bindings[free].socket_name,recvaddr->sun_path,
-	 mdp_bindings[free].name_len);
-  mdp_bindings[free].binding_time=gettime_ms();
+  b->port=port;
+  b->subscriber=subscriber;
+  b->name_len=name_len;
+  memcpy(b->socket_name,recvaddr->sun_path,name_len);
+  b->binding_time=gettime_ms();
+  add_binding(b);
   return 0;
 }
 
-static int overlay_mdp_decode_header(struct overlay_buffer *buff, overlay_mdp_frame *mdp)
+/* Read the port numbers, leaving buff positioned at the start of the payload */
+static int overlay_mdp_decode_header(struct overlay_buffer *buff, struct internal_mdp_header *header)
 {
   /* extract MDP port numbers */
   int port = ob_get_packed_ui32(buff);
   int same = port&1;
   port >>=1;
-  mdp->in.dst.port = port;
+  header->destination_port = port;
   if (!same){
     port = ob_get_packed_ui32(buff);
   }
-  mdp->in.src.port = port;
-  
-  int len=ob_remaining(buff);
+  header->source_port = port;
   
-  if (len<0)
+  if (ob_remaining(buff)<0)
     return WHY("MDP payload is too short");
-  mdp->in.payload_length=len;
-  return ob_get_bytes(buff, &mdp->in.payload[0], len);
+  return 0;
 }
 
-int overlay_mdp_decrypt(struct overlay_frame *f, overlay_mdp_frame *mdp)
+/* Check or decrypt the payload of f where it is, leaving f->payload positioned
+   at the start of the plain text MDP payload. */
+static int overlay_mdp_decrypt(struct overlay_frame *f, struct internal_mdp_header *header)
 {
   IN();
 
-  /* Indicate MDP message type */
-  mdp->packetTypeAndFlags=MDP_TX;
-  
   switch(f->modifiers&(OF_CRYPTO_CIPHERED|OF_CRYPTO_SIGNED))  {
   case 0: 
     /* nothing to do, b already points to the plain text */
-    mdp->packetTypeAndFlags|=MDP_NOCRYPT|MDP_NOSIGN;
-    RETURN(overlay_mdp_decode_header(f->payload, mdp));
+    header->flags|=MDP_NOCRYPT|MDP_NOSIGN;
+    RETURN(overlay_mdp_decode_header(f->payload, header));
       
   case OF_CRYPTO_CIPHERED:
     RETURN(WHY("decryption not implemented"));
@@ -303,9 +550,9 @@ int overlay_mdp_decrypt(struct overlay_frame *f, overlay_mdp_frame *mdp)
       if (crypto_verify_message(f->source, ob_ptr(f->payload), &len))
 	RETURN(-1);
       
-      mdp->packetTypeAndFlags|=MDP_NOCRYPT; 
+      header->flags|=MDP_NOCRYPT; 
       ob_limitsize(f->payload, len + ob_position(f->payload));
-      RETURN(overlay_mdp_decode_header(f->payload, mdp));
+      RETURN(overlay_mdp_decode_header(f->payload, header));
     }
       
   case OF_CRYPTO_CIPHERED|OF_CRYPTO_SIGNED:
@@ -326,8 +573,8 @@ int overlay_mdp_decrypt(struct overlay_frame *f, overlay_mdp_frame *mdp)
 	     ob_remaining(f->payload));
       }
       
-      unsigned char *nonce=ob_get_bytes_ptr(f->payload, nb);
-      if (!nonce)
+      unsigned char nonce[nb];
+      if (ob_get_bytes(f->payload, nonce, nb))
 	RETURN(WHYF("Expected %d bytes of nonce", nb));
       
       int cipher_len=ob_remaining(f->payload);
@@ -335,16 +582,15 @@ int overlay_mdp_decrypt(struct overlay_frame *f, overlay_mdp_frame *mdp)
       if (!cipher_text)
 	RETURN(WHYF("Expected %d bytes of cipher text", cipher_len));
       
-      unsigned char plain_block[cipher_len+cz];
-      
-      bzero(&plain_block[0],cz);
-      
-      bcopy(cipher_text,&plain_block[cz],cipher_len);
+      /* crypto_box_open wants BOXZEROBYTES of zeros in front of the cipher
+	 text, which is where the end of the nonce was, so decrypt in place */
+      unsigned char *plain_block=cipher_text - cz;
+      bzero(plain_block,cz);
       
       if (0) {
 	dump("nm bytes",k,nm);
 	dump("nonce",nonce,nb);
-	dump("cipher block",plain_block,sizeof(plain_block)); 
+	dump("cipher block",plain_block,cipher_len+cz); 
       }
       cipher_len+=cz;
       
@@ -354,14 +600,10 @@ int overlay_mdp_decrypt(struct overlay_frame *f, overlay_mdp_frame *mdp)
 		    alloca_tohex_sid(f->source->sid), alloca_tohex_sid(f->destination->sid), cipher_len));
       }
       
-      if (0) dump("plain block",plain_block,sizeof(plain_block));
+      if (0) dump("plain block",plain_block,cipher_len);
       
-      cipher_len -= zb;
-      struct overlay_buffer *plaintext = ob_static(&plain_block[zb], cipher_len);
-      ob_limitsize(plaintext,cipher_len);
-      int ret=overlay_mdp_decode_header(plaintext, mdp);
-      ob_free(plaintext);
-      RETURN(ret);
+      f->payload->position = plain_block + zb - ob_ptr(f->payload);
+      RETURN(overlay_mdp_decode_header(f->payload, header));
     }    
   }
   RETURN(WHY("Failed to decode mdp payload"));
@@ -371,35 +613,59 @@ int overlay_mdp_decrypt(struct overlay_frame *f, overlay_mdp_frame *mdp)
 int overlay_saw_mdp_containing_frame(struct overlay_frame *f, time_ms_t now)
 {
   IN();
-  /* Take frame source and destination and use them to populate mdp->in->{src,dst}
-     SIDs.
-     Take ports from mdp frame itself.
-     Take payload from mdp frame itself.
+  /* Take frame source and destination and the ports from the mdp frame itself.
+     The payload is left where it is in f->payload.
   */
-  overlay_mdp_frame mdp;
-  bzero(&mdp, sizeof(overlay_mdp_frame));
+  struct internal_mdp_header header;
+  bzero(&header, sizeof header);
   
-  mdp.in.queue = f->queue;
-  mdp.in.ttl = f->ttl;
+  header.source = f->source;
+  header.destination = f->destination;
+  header.queue = f->queue;
+  header.ttl = f->ttl;
   
-  /* Get source and destination addresses */
-  if (f->destination)
-    bcopy(f->destination->sid,mdp.in.dst.sid,SID_SIZE);
-  else{
-    // pack the broadcast address into the mdp structure, note that we no longer care about the broadcast id
-    memset(mdp.in.dst.sid, 0xFF, SID_SIZE);
-  }
-  bcopy(f->source->sid,mdp.in.src.sid,SID_SIZE);
-
-  /* copy crypto flags from frame so that we know if we need to decrypt or verify it */
-  if (overlay_mdp_decrypt(f,&mdp))
+  /* use crypto flags from frame so that we know if we need to decrypt or verify it */
+  if (overlay_mdp_decrypt(f,&header))
     RETURN(-1);
 
   /* and do something with it! */
-  RETURN(overlay_saw_mdp_frame(f, &mdp,now));
+  RETURN(overlay_saw_mdp_frame(&header, f->payload, now));
   OUT();
 }
 
+/* Fill in everything but the payload of the overlay_mdp_frame used by clients */
+static int overlay_mdp_fill_header(const struct internal_mdp_header *header, int len, overlay_mdp_frame *mdp)
+{
+  if (len<0 || len>sizeof(mdp->in.payload))
+    return WHYF("MDP payload of %d bytes does not fit in a frame", len);
+  
+  bzero(mdp, offsetof(overlay_mdp_frame, in.payload));
+  mdp->packetTypeAndFlags=MDP_TX | (header->flags&(MDP_NOCRYPT|MDP_NOSIGN));
+  bcopy(header->source->sid, mdp->in.src.sid, SID_SIZE);
+  mdp->in.src.port=header->source_port;
+  if (header->destination)
+    bcopy(header->destination->sid, mdp->in.dst.sid, SID_SIZE);
+  else
+    memset(mdp->in.dst.sid, 0xFF, SID_SIZE);
+  mdp->in.dst.port=header->destination_port;
+  mdp->in.queue=header->queue;
+  mdp->in.ttl=header->ttl;
+  mdp->in.send_copies=header->send_copies;
+  mdp->in.payload_length=len;
+  return 0;
+}
+
+/* Copy a frame into an overlay_mdp_frame, for the services that haven't been
+   taught to read the payload where it is. */
+int overlay_mdp_fill_frame(const struct internal_mdp_header *header, struct overlay_buffer *payload, overlay_mdp_frame *mdp)
+{
+  int len=ob_remaining(payload);
+  if (overlay_mdp_fill_header(header, len, mdp))
+    return -1;
+  bcopy(ob_ptr(payload)+ob_position(payload), mdp->in.payload, len);
+  return 0;
+}
+
 int overlay_mdp_swap_src_dst(overlay_mdp_frame *mdp)
 {
   sockaddr_mdp temp;
@@ -409,75 +675,80 @@ int overlay_mdp_swap_src_dst(overlay_mdp_frame *mdp)
   return 0;
 }
 
-static int overlay_saw_mdp_frame(struct overlay_frame *frame, overlay_mdp_frame *mdp, time_ms_t now)
+static int overlay_saw_mdp_frame(struct internal_mdp_header *header, struct overlay_buffer *payload, time_ms_t now)
 {
   IN();
-  int i;
-  int match=-1;
-
-  switch(mdp->packetTypeAndFlags&MDP_TYPE_MASK) {
-  case MDP_TX: 
-    /* Regular MDP frame addressed to us.  Look for matching port binding,
-       and if available, push to client.  Else do nothing, or if we feel nice
-       send back a connection refused type message? Silence is probably the
-       more prudent path.
-    */
-
-    if (config.debug.mdprequests) 
-      DEBUGF("Received packet with listener (MDP ports: src=%s*:%d, dst=%d)",
-	   alloca_tohex(mdp->out.src.sid, 7),
-	   mdp->out.src.port,mdp->out.dst.port);
-
-    // TODO pass in dest subscriber as an argument, we should know it by now
-    struct subscriber *destination = NULL;
-    if (frame)
-      destination = frame->destination;
-    else if (!is_sid_broadcast(mdp->out.dst.sid)){
-      destination = find_subscriber(mdp->out.dst.sid, SID_SIZE, 1);
-    }
+  struct mdp_binding *match=NULL;
+
+  /* Regular MDP frame addressed to us.  Look for matching port binding,
+     and if available, push to client.  Else do nothing, or if we feel nice
+     send back a connection refused type message? Silence is probably the
+     more prudent path.
+  */
+
+  if (config.debug.mdprequests) 
+    DEBUGF("Received packet with listener (MDP ports: src=%s*:%d, dst=%d)",
+	 alloca_tohex(header->source->sid, 7),
+	 header->source_port,header->destination_port);
+
+  if (header->destination){
+    /* prefer an exact match, then an "ANY" binding */
+    match=find_binding(header->destination, header->destination_port);
+    if (!match)
+      match=find_binding(NULL, header->destination_port);
+  }else
+    match=find_any_binding(header->destination_port);
+  
+  if (match) {
+    struct sockaddr_un addr;
+
+    bcopy(match->socket_name,addr.sun_path,match->name_len);
+    addr.sun_family=AF_UNIX;
     
-    for(i=0;i<MDP_MAX_BINDINGS;i++)
-      {
-	if (mdp_bindings[i].port!=mdp->out.dst.port)
-	  continue;
-	
-	if ((!destination) || mdp_bindings[i].subscriber == destination){
-	  /* exact match, so stop searching */
-	  match=i;
-	  break;
-	}else if (!mdp_bindings[i].subscriber){
-	  /* If we find an "ANY" binding, remember it. But we will prefer an exact match if we find one */
-	  match=i;
-	}
-      }
+    /* Only the header is built here, the payload is sent from where it is */
+    overlay_mdp_frame mdp;
+    int len=ob_remaining(payload);
+    if (overlay_mdp_fill_header(header, len, &mdp))
+      RETURN(-1);
     
-    if (match>-1) {
-      struct sockaddr_un addr;
-
-      bcopy(mdp_bindings[match].socket_name,addr.sun_path,mdp_bindings[match].name_len);
-      addr.sun_family=AF_UNIX;
-      errno=0;
-      int len=overlay_mdp_relevant_bytes(mdp);
-      int r=sendto(mdp_named.poll.fd,mdp,len,0,(struct sockaddr*)&addr,sizeof(addr));
-      if (r==overlay_mdp_relevant_bytes(mdp)) {	
+    struct mdp_ring_client *ring=find_ring_client(match->socket_name, match->name_len);
+    if (ring){
+      int r=mdp_ring_put(&ring->region->to_client,
+	&mdp, offsetof(overlay_mdp_frame, in.payload),
+	ob_ptr(payload)+ob_position(payload), len);
+      if (r==1)
+	mdp_ring_doorbell(ring->to_client);
+      if (r>=0)
 	RETURN(0);
-      }
-      WHY("didn't send mdp packet");
-      if (errno==ENOENT) {
-	/* far-end of socket has died, so drop binding */
-	INFOF("Closing dead MDP client '%s'",mdp_bindings[match].socket_name);
-	overlay_mdp_releasebindings(&addr,mdp_bindings[match].name_len);
-      }
-      WHY_perror("sendto(e)");
-      RETURN(WHY("Failed to pass received MDP frame to client"));
-    } else {
-      /* No socket is bound, ignore the packet ... except for magic sockets */
-      RETURN(overlay_mdp_try_interal_services(mdp));
+      // the client isn't keeping up, fall back to its socket
     }
-    break;
-  default:
-    RETURN(WHYF("We should only see MDP_TX frames here (MDP message type = 0x%x)",
-		mdp->packetTypeAndFlags));
+
+    struct iovec iov[2]={
+      {.iov_base=&mdp, .iov_len=offsetof(overlay_mdp_frame, in.payload)},
+      {.iov_base=ob_ptr(payload)+ob_position(payload), .iov_len=len},
+    };
+    struct msghdr msg={
+      .msg_name=&addr,
+      .msg_namelen=sizeof(addr),
+      .msg_iov=iov,
+      .msg_iovlen=2,
+    };
+    errno=0;
+    int r=sendmsg(mdp_named.poll.fd,&msg,0);
+    if (r==iov[0].iov_len+len) {
+      RETURN(0);
+    }
+    WHY("didn't send mdp packet");
+    if (errno==ENOENT) {
+      /* far-end of socket has died, so drop binding */
+      INFOF("Closing dead MDP client '%s'",alloca_toprint(-1, match->socket_name, match->name_len));
+      release_client_bindings(addr.sun_path, match->name_len);
+    }
+    WHY_perror("sendmsg(e)");
+    RETURN(WHY("Failed to pass received MDP frame to client"));
+  } else {
+    /* No socket is bound, ignore the packet ... except for magic sockets */
+    RETURN(overlay_mdp_try_interal_services(header, payload));
   }
 
   RETURN(0);
@@ -514,19 +785,13 @@ int overlay_mdp_check_binding(struct subscriber *subscriber, int port, int userG
   /* Check if the address is in the list of bound addresses,
      and that the recvaddr matches. */
   
-  int i;
-  for(i = 0; i < MDP_MAX_BINDINGS; ++i) {
-    if (mdp_bindings[i].port != port)
-      continue;
-    if ((!mdp_bindings[i].subscriber) || mdp_bindings[i].subscriber == subscriber) {
-      /* Binding matches, now make sure the sockets match */
-      if (  mdp_bindings[i].name_len == recvaddrlen - sizeof(short)
-	&&  memcmp(mdp_bindings[i].socket_name, recvaddr->sun_path, recvaddrlen - sizeof(short)) == 0
-      ) {
-	/* Everything matches, so this unix socket and MDP address combination is valid */
-	return 0;
-      }
-    }
+  struct mdp_binding *b = find_binding(subscriber, port);
+  if (!b || !binding_owned_by(b, recvaddr->sun_path, recvaddrlen - sizeof(short)))
+    b = find_binding(NULL, port);
+  /* Binding matches, now make sure the sockets match */
+  if (b && binding_owned_by(b, recvaddr->sun_path, recvaddrlen - sizeof(short))) {
+    /* Everything matches, so this unix socket and MDP address combination is valid */
+    return 0;
   }
 
   return WHYF("No such binding: recvaddr=%p %s addr=%s port=%u (0x%x) -- possible spoofing attack",
@@ -551,189 +816,174 @@ int overlay_mdp_encode_ports(struct overlay_buffer *plaintext, int dst_port, int
   return 0;
 }
 
-/* Construct MDP packet frame from overlay_mdp_frame structure
-   (need to add return address from bindings list, and copy
-   payload etc).
-   This is for use by the SERVER. 
-   Clients should use overlay_mdp_send()
- */
-int overlay_mdp_dispatch(overlay_mdp_frame *mdp,int userGeneratedFrameP,
-			 struct sockaddr_un *recvaddr,int recvaddrlen)
+/* crypto_box wants ZEROBYTES of zeros in front of the plain text, and leaves
+   BOXZEROBYTES of zeros in front of the cipher text.  Building the plain text
+   after this much headroom lets us encrypt it in place, then write the nonce
+   over those leading zeros, so the frame is never copied. */
+#define MDP_CRYPT_HEADROOM (crypto_box_curve25519xsalsa20poly1305_NONCEBYTES \
+			    - crypto_box_curve25519xsalsa20poly1305_BOXZEROBYTES \
+			    + crypto_box_curve25519xsalsa20poly1305_ZEROBYTES)
+
+/* Consecutive frames between the same pair of SIDs, such as a Rhizome
+   transfer, reuse the shared secret and count up from one random nonce, rather
+   than looking up the key and reading /dev/urandom for every frame. */
+#define MDP_NONCE_REUSE 256
+
+static struct mdp_crypt_context{
+  unsigned char src[SID_SIZE];
+  unsigned char dst[SID_SIZE];
+  unsigned char k[crypto_box_curve25519xsalsa20poly1305_BEFORENMBYTES];
+  unsigned char nonce[crypto_box_curve25519xsalsa20poly1305_NONCEBYTES];
+  int remaining;
+} mdp_crypt;
+
+/* Called by keyring_forget_nm_bytes() whenever identities are unlocked or
+   released, so we never carry on encrypting as an identity we no longer hold */
+void overlay_mdp_forget_crypt_key()
 {
-  IN();
+  bzero(&mdp_crypt, sizeof mdp_crypt);
+}
 
-  /* Prepare the overlay frame for dispatch */
-  struct overlay_frame *frame = calloc(1,sizeof(struct overlay_frame));
-  if (!frame)
-    FATAL("Couldn't allocate frame buffer");
+/* Authcrypt the plain text in b, which starts MDP_CRYPT_HEADROOM bytes in,
+   leaving the nonce and cipher text in b. */
+static int overlay_mdp_encrypt(struct overlay_buffer *b, unsigned char *src, unsigned char *dst)
+{
+  IN();
+  int nb=crypto_box_curve25519xsalsa20poly1305_NONCEBYTES;
+  int zb=crypto_box_curve25519xsalsa20poly1305_ZEROBYTES;
+  int cz=crypto_box_curve25519xsalsa20poly1305_BOXZEROBYTES;
   
-  if (is_sid_any(mdp->out.src.sid)){
-    /* set source to ourselves */
-    frame->source = my_subscriber;
-    bcopy(frame->source->sid, mdp->out.src.sid, SID_SIZE);
-  }else if (is_sid_broadcast(mdp->out.src.sid)){
-    /* This is rather naughty if it happens, since broadcasting a
-     response can lead to all manner of nasty things.
-     Picture a packet with broadcast as the source address, sent
-     to, say, the MDP echo port on another node, and with a source
-     port also of the echo port.  Said echo will get multiplied many,
-     many, many times over before the TTL finally reaches zero.
-     So we just say no to any packet with a broadcast source address. 
-     (Of course we have other layers of protection against such 
-     shenanigens, such as using BPIs to smart-flood broadcasts, but
-     security comes through depth.)
-     */
-    op_free(frame);
-    RETURN(WHY("Packet had broadcast address as source address"));
+  if (mdp_crypt.remaining<=0
+      || memcmp(mdp_crypt.src, src, SID_SIZE)
+      || memcmp(mdp_crypt.dst, dst, SID_SIZE)){
+    mdp_crypt.remaining=0;
+    /* get pre-computed PKxSK bytes (the slow part of auth-cryption that can be
+       retained and reused, and use that to do the encryption quickly. */
+    unsigned char *k=keyring_get_nm_bytes(src, dst);
+    if (!k)
+      RETURN(WHY("could not compute Curve25519(NxM)"));
+    if (urandombytes(mdp_crypt.nonce,nb))
+      RETURN(WHY("urandombytes() failed to generate nonce"));
+    bcopy(k, mdp_crypt.k, sizeof mdp_crypt.k);
+    bcopy(src, mdp_crypt.src, SID_SIZE);
+    bcopy(dst, mdp_crypt.dst, SID_SIZE);
+    mdp_crypt.remaining=MDP_NONCE_REUSE;
   }else{
-    // assume all local identities have already been unlocked and marked as SELF.
-    frame->source = find_subscriber(mdp->out.src.sid, SID_SIZE, 0);
-    if (!frame->source){
-      op_free(frame);
-      RETURN(WHYF("Possible spoofing attempt, tried to send a packet from %s, which is an unknown SID", alloca_tohex_sid(mdp->out.src.sid)));
-    }
-    if (frame->source->reachable!=REACHABLE_SELF){
-      op_free(frame);
-      RETURN(WHYF("Possible spoofing attempt, tried to send a packet from %s", alloca_tohex_sid(mdp->out.src.sid)));
-    }
+    int i;
+    for (i=nb-1; i>=0 && ++mdp_crypt.nonce[i]==0; i--)
+      ;
   }
+  // reserve the high bit of the nonce as a flag for transmitting a shorter nonce.
+  mdp_crypt.nonce[0]&=0x7f;
+  mdp_crypt.remaining--;
   
-  /* Work out if destination is broadcast or not */
-  if (overlay_mdp_check_binding(frame->source, mdp->out.src.port, userGeneratedFrameP,
-				recvaddr, recvaddrlen)){
-    op_free(frame);
-    RETURN(overlay_mdp_reply_error
-	   (mdp_named.poll.fd,
-	    (struct sockaddr_un *)recvaddr,
-	    recvaddrlen,8,
-	    "Source address is invalid (you must bind to a source address before"
-	    " you can send packets"));
+  unsigned char *text=b->bytes + nb - cz;
+  int len=b->position - (nb - cz);
+  bzero(text, zb);
+  
+  /* Actually authcrypt the payload */
+  if (crypto_box_curve25519xsalsa20poly1305_afternm
+      (text,text,len,mdp_crypt.nonce,mdp_crypt.k))
+    RETURN(WHY("crypto_box_afternm() failed"));
+  
+  bcopy(mdp_crypt.nonce, b->bytes, nb);
+  RETURN(0);
+  OUT();
+}
+
+/* Start the plain text of a frame to be sent with
+   overlay_mdp_dispatch_payload(), the caller then appends the payload. */
+struct overlay_buffer *overlay_mdp_payload_new(const struct internal_mdp_header *header)
+{
+  struct overlay_buffer *payload=ob_new();
+  if (!payload)
+    return NULL;
+  
+  /* leave room to authcrypt the frame where it is */
+  if ((header->flags&(MDP_NOCRYPT|MDP_NOSIGN))==0
+      && !ob_append_space(payload, MDP_CRYPT_HEADROOM)){
+    ob_free(payload);
+    return NULL;
   }
   
-  if (is_sid_broadcast(mdp->out.dst.sid)){
-    /* broadcast packets cannot be encrypted, so complain if MDP_NOCRYPT
-     flag is not set. Also, MDP_NOSIGN must also be applied, until
-     NaCl cryptobox keys can be used for signing. */	
-    if (!(mdp->packetTypeAndFlags&MDP_NOCRYPT)){
-      op_free(frame);
-      RETURN(overlay_mdp_reply_error(mdp_named.poll.fd,
-				     recvaddr,recvaddrlen,5,
-				     "Broadcast packets cannot be encrypted "));
-    }
-    overlay_broadcast_generate_address(&frame->broadcast_id);
-    frame->destination = NULL;
-  }else{
-    frame->destination = find_subscriber(mdp->out.dst.sid, SID_SIZE, 1);
+  if (overlay_mdp_encode_ports(payload, header->destination_port, header->source_port)){
+    ob_free(payload);
+    return NULL;
+  }
+  return payload;
+}
+
+/* Send a frame built with overlay_mdp_payload_new(), delivering it to our own
+   bindings and services first if it is for us.  The payload is never copied,
+   and is always freed.
+ */
+int overlay_mdp_dispatch_payload(struct internal_mdp_header *header, struct overlay_buffer *payload)
+{
+  IN();
+  int crypt=(header->flags&(MDP_NOCRYPT|MDP_NOSIGN))==0;
+  
+  if (crypt && !header->destination){
+    ob_free(payload);
+    RETURN(WHY("Broadcast packets cannot be encrypted"));
   }
   
-  frame->ttl=mdp->out.ttl;
-  if (frame->ttl==0) 
-    frame->ttl=64; /* default TTL */	
+  if (header->ttl==0) 
+    header->ttl=64; /* default TTL */
+  if (header->queue==0)
+    header->queue=OQ_ORDINARY;
   
-  if (!frame->destination || frame->destination->reachable == REACHABLE_SELF)
+  if (!header->destination || header->destination->reachable == REACHABLE_SELF)
     {
       /* Packet is addressed such that we should process it. */
-      overlay_saw_mdp_frame(NULL,mdp,gettime_ms());
-      if (frame->destination) {
+      int start=crypt?MDP_CRYPT_HEADROOM:0;
+      int len=ob_position(payload) - start;
+      struct overlay_buffer *local=ob_slice(payload, start, len);
+      if (local){
+	struct internal_mdp_header local_header=*header;
+	ob_limitsize(local, len);
+	if (overlay_mdp_decode_header(local, &local_header)==0)
+	  overlay_saw_mdp_frame(&local_header, local, gettime_ms());
+	ob_free(local);
+      }
+      if (header->destination) {
 	/* Is local, and is not broadcast, so shouldn't get sent out
 	   on the wire. */
-	op_free(frame);
+	ob_free(payload);
 	RETURN(0);
       }
     }
   
-  frame->type=OF_TYPE_DATA;
-  frame->prev=NULL;
-  frame->next=NULL;
-  struct overlay_buffer *plaintext=ob_new();
-  
-  if (overlay_mdp_encode_ports(plaintext, mdp->out.dst.port, mdp->out.src.port)){
-    ob_free(plaintext);
-    RETURN (-1);
-  }
+  /* Prepare the overlay frame for dispatch */
+  struct overlay_frame *frame = calloc(1,sizeof(struct overlay_frame));
+  if (!frame)
+    FATAL("Couldn't allocate frame buffer");
   
-  if (ob_append_bytes(plaintext, mdp->out.payload, mdp->out.payload_length)){
-    ob_free(plaintext);
-    RETURN(-1);
-  }
+  frame->type=OF_TYPE_DATA;
+  frame->source=header->source;
+  frame->destination=header->destination;
+  if (!frame->destination)
+    overlay_broadcast_generate_address(&frame->broadcast_id);
+  frame->ttl=header->ttl;
+  frame->queue=header->queue;
+  frame->send_copies=header->send_copies;
+  frame->payload=payload;
   
   /* Work out the disposition of the frame->  For now we are only worried
      about the crypto matters, and not compression that may be applied
      before encryption (since applying it after is useless as ciphered
      text should have maximum entropy). */
-  switch(mdp->packetTypeAndFlags&(MDP_NOCRYPT|MDP_NOSIGN)) {
+  switch(header->flags&(MDP_NOCRYPT|MDP_NOSIGN)) {
   case 0: /* crypted and signed (using CryptoBox authcryption primitive) */
     frame->modifiers=OF_CRYPTO_SIGNED|OF_CRYPTO_CIPHERED;
-    {
-      int nm=crypto_box_curve25519xsalsa20poly1305_BEFORENMBYTES;
-      int zb=crypto_box_curve25519xsalsa20poly1305_ZEROBYTES;
-      int nb=crypto_box_curve25519xsalsa20poly1305_NONCEBYTES;
-      int cz=crypto_box_curve25519xsalsa20poly1305_BOXZEROBYTES;
-      
-      /* generate plain message with zero bytes and get ready to cipher it */
-      int cipher_len=ob_position(plaintext);
-      
-      // TODO, add support for leading zero's in overlay_buffer's, then we don't need to copy the plain text again.
-      unsigned char plain[zb+cipher_len];
-      
-      /* zero bytes */
-      bzero(&plain[0],zb);
-      bcopy(ob_ptr(plaintext),&plain[zb],cipher_len);
-      
-      cipher_len+=zb;
-      
-      ob_free(plaintext);
-      
-      frame->payload = ob_new();
-      
-      unsigned char *nonce = ob_append_space(frame->payload, nb+cipher_len);
-      unsigned char *cipher_text = nonce + nb;
-      if (!nonce)
-	RETURN(-1);
-      if (urandombytes(nonce,nb)) {
-	op_free(frame);
-	RETURN(WHY("urandombytes() failed to generate nonce"));
-      }
-      // reserve the high bit of the nonce as a flag for transmitting a shorter nonce.
-      nonce[0]&=0x7f;
-      
-      /* get pre-computed PKxSK bytes (the slow part of auth-cryption that can be
-	 retained and reused, and use that to do the encryption quickly. */
-      unsigned char *k=keyring_get_nm_bytes(mdp->out.src.sid, mdp->out.dst.sid);
-      if (!k) {
-	op_free(frame);
-	RETURN(WHY("could not compute Curve25519(NxM)")); 
-      }
-      /* Actually authcrypt the payload */
-      if (crypto_box_curve25519xsalsa20poly1305_afternm
-	  (cipher_text,plain,cipher_len,nonce,k)){
-	op_free(frame);
-	RETURN(WHY("crypto_box_afternm() failed")); 
-      }
-      if (0) {
-	DEBUG("authcrypted mdp frame");
-	dump("nm",k,nm);
-	dump("plain text",plain,sizeof(plain));
-	dump("nonce",nonce,nb);
-	dump("cipher text",cipher_text,cipher_len);
-      }
-      /* now shuffle down to get rid of the temporary space that crypto_box
-       uses. 
-       TODO extend overlay buffer so we don't need this.
-       */
-      bcopy(&cipher_text[cz],&cipher_text[0],cipher_len-cz);
-      frame->payload->position-=cz;
-      if (0){
-	dump("frame",&frame->payload->bytes[0],
-	     frame->payload->position);
-      }
+    if (overlay_mdp_encrypt(frame->payload, frame->source->sid, frame->destination->sid)){
+      op_free(frame);
+      RETURN(-1);
     }
     break;
       
   case MDP_NOCRYPT: 
     /* Payload is sent unencrypted, but signed. */
     frame->modifiers=OF_CRYPTO_SIGNED;
-    frame->payload = plaintext;
     ob_makespace(frame->payload,SIGNATURE_BYTES);
     if (crypto_sign_message(frame->source, frame->payload->bytes, frame->payload->allocSize, &frame->payload->position)){
       op_free(frame);
@@ -743,7 +993,6 @@ int overlay_mdp_dispatch(overlay_mdp_frame *mdp,int userGeneratedFrameP,
       
   case MDP_NOSIGN|MDP_NOCRYPT: /* clear text and no signature */
     frame->modifiers=0; 
-    frame->payload = plaintext;
     break;
   case MDP_NOSIGN: 
   default:
@@ -755,18 +1004,94 @@ int overlay_mdp_dispatch(overlay_mdp_frame *mdp,int userGeneratedFrameP,
     RETURN(WHY("Not implemented"));
   }
   
-  frame->queue=mdp->out.queue;
-  if (frame->queue==0)
-    frame->queue = OQ_ORDINARY;
-  
-  frame->send_copies = mdp->out.send_copies;
-  
   if (overlay_payload_enqueue(frame))
     op_free(frame);
   RETURN(0);
   OUT();
 }
 
+/* Construct MDP packet frame from overlay_mdp_frame structure
+   (need to add return address from bindings list, and copy
+   payload etc).
+   This is for use by the SERVER. 
+   Clients should use overlay_mdp_send()
+ */
+int overlay_mdp_dispatch(overlay_mdp_frame *mdp,int userGeneratedFrameP,
+			 struct sockaddr_un *recvaddr,int recvaddrlen)
+{
+  IN();
+
+  struct internal_mdp_header header;
+  bzero(&header, sizeof header);
+  
+  if (is_sid_any(mdp->out.src.sid)){
+    /* set source to ourselves */
+    header.source = my_subscriber;
+    bcopy(header.source->sid, mdp->out.src.sid, SID_SIZE);
+  }else if (is_sid_broadcast(mdp->out.src.sid)){
+    /* This is rather naughty if it happens, since broadcasting a
+     response can lead to all manner of nasty things.
+     Picture a packet with broadcast as the source address, sent
+     to, say, the MDP echo port on another node, and with a source
+     port also of the echo port.  Said echo will get multiplied many,
+     many, many times over before the TTL finally reaches zero.
+     So we just say no to any packet with a broadcast source address. 
+     (Of course we have other layers of protection against such 
+     shenanigens, such as using BPIs to smart-flood broadcasts, but
+     security comes through depth.)
+     */
+    RETURN(WHY("Packet had broadcast address as source address"));
+  }else{
+    // assume all local identities have already been unlocked and marked as SELF.
+    header.source = find_subscriber(mdp->out.src.sid, SID_SIZE, 0);
+    if (!header.source)
+      RETURN(WHYF("Possible spoofing attempt, tried to send a packet from %s, which is an unknown SID", alloca_tohex_sid(mdp->out.src.sid)));
+    if (header.source->reachable!=REACHABLE_SELF)
+      RETURN(WHYF("Possible spoofing attempt, tried to send a packet from %s", alloca_tohex_sid(mdp->out.src.sid)));
+  }
+  
+  /* Work out if destination is broadcast or not */
+  if (overlay_mdp_check_binding(header.source, mdp->out.src.port, userGeneratedFrameP,
+				recvaddr, recvaddrlen)){
+    RETURN(overlay_mdp_reply_error
+	   (mdp_named.poll.fd,
+	    (struct sockaddr_un *)recvaddr,
+	    recvaddrlen,8,
+	    "Source address is invalid (you must bind to a source address before"
+	    " you can send packets"));
+  }
+  
+  if (is_sid_broadcast(mdp->out.dst.sid)){
+    /* broadcast packets cannot be encrypted, so complain if MDP_NOCRYPT
+     flag is not set. Also, MDP_NOSIGN must also be applied, until
+     NaCl cryptobox keys can be used for signing. */	
+    if (!(mdp->packetTypeAndFlags&MDP_NOCRYPT))
+      RETURN(overlay_mdp_reply_error(mdp_named.poll.fd,
+				     recvaddr,recvaddrlen,5,
+				     "Broadcast packets cannot be encrypted "));
+    header.destination = NULL;
+  }else{
+    header.destination = find_subscriber(mdp->out.dst.sid, SID_SIZE, 1);
+  }
+  
+  header.source_port = mdp->out.src.port;
+  header.destination_port = mdp->out.dst.port;
+  header.flags = mdp->packetTypeAndFlags&(MDP_NOCRYPT|MDP_NOSIGN);
+  header.ttl = mdp->out.ttl;
+  header.queue = mdp->out.queue;
+  header.send_copies = mdp->out.send_copies;
+  
+  struct overlay_buffer *payload=overlay_mdp_payload_new(&header);
+  if (!payload)
+    RETURN(-1);
+  if (ob_append_bytes(payload, mdp->out.payload, mdp->out.payload_length)){
+    ob_free(payload);
+    RETURN(-1);
+  }
+  RETURN(overlay_mdp_dispatch_payload(&header, payload));
+  OUT();
+}
+
 static int search_subscribers(struct subscriber *subscriber, void *context){
   overlay_mdp_addrlist *response = context;
   
@@ -887,172 +1212,198 @@ static void overlay_mdp_scan(struct sched_ent *alarm)
   }
 }
 
-void overlay_mdp_poll(struct sched_ent *alarm)
+/* Handle one request from an MDP client.  Returns -1 if there was none waiting. */
+static int overlay_mdp_receive(struct sched_ent *alarm)
 {
-  if (alarm->poll.revents & POLLIN) {
-    unsigned char buffer[16384];
-    int ttl;
-    unsigned char recvaddrbuffer[1024];
-    struct sockaddr *recvaddr=(struct sockaddr *)&recvaddrbuffer[0];
-    socklen_t recvaddrlen=sizeof(recvaddrbuffer);
-    struct sockaddr_un *recvaddr_un=NULL;
-
-    ttl=-1;
-    bzero((void *)recvaddrbuffer,sizeof(recvaddrbuffer));
+  unsigned char buffer[16384];
+  int ttl;
+  unsigned char recvaddrbuffer[1024];
+  struct sockaddr *recvaddr=(struct sockaddr *)&recvaddrbuffer[0];
+  socklen_t recvaddrlen=sizeof(recvaddrbuffer);
+  struct sockaddr_un *recvaddr_un=NULL;
+
+  ttl=-1;
+  bzero((void *)recvaddrbuffer,sizeof(recvaddrbuffer));
+  
+  int fds[MDP_RING_FD_COUNT];
+  int fd_count=MDP_RING_FD_COUNT;
+  ssize_t len = recvwithttl_fds(alarm->poll.fd,buffer,sizeof(buffer),&ttl, recvaddr, &recvaddrlen, fds, &fd_count, MSG_DONTWAIT);
+  recvaddr_un=(struct sockaddr_un *)recvaddr;
+
+  if (len>0) {
+    /* Look at overlay_mdp_frame we have received */
+    overlay_mdp_frame *mdp=(overlay_mdp_frame *)&buffer[0];      
+    unsigned int mdp_type = mdp->packetTypeAndFlags & MDP_TYPE_MASK;
+
+    /* Only MDP_RING may pass descriptors */
+    if (mdp_type!=MDP_RING)
+      while(fd_count>0)
+	close(fds[--fd_count]);
+
+    switch (mdp_type) {
+    case MDP_GOODBYE:
+      if (config.debug.mdprequests) DEBUG("MDP_GOODBYE");
+      overlay_mdp_releasebindings(recvaddr_un,recvaddrlen);
+      return 0;
+	
+    case MDP_RING:
+      if (config.debug.mdprequests) DEBUG("MDP_RING");
+      overlay_mdp_ring_open(fds, fd_count, recvaddr_un, recvaddrlen);
+      return 0;
+
+    /* Deprecated. We can replace with a more generic dump of the routing table */
+    case MDP_NODEINFO:
+      if (config.debug.mdprequests) DEBUG("MDP_NODEINFO");
+	
+      if (!overlay_route_node_info(&mdp->nodeinfo))
+	overlay_mdp_reply(mdp_named.poll.fd,recvaddr_un,recvaddrlen,mdp);
+      return 0;
+	
+    case MDP_ROUTING_TABLE:
+      {
+	struct routing_state state={
+	  .recvaddr_un=recvaddr_un,
+	  .recvaddrlen=recvaddrlen,
+	};
+	
+	enum_subscribers(NULL, routing_table, &state);
+	
+      }
+      return 0;
     
-    ssize_t len = recvwithttl(alarm->poll.fd,buffer,sizeof(buffer),&ttl, recvaddr, &recvaddrlen);
-    recvaddr_un=(struct sockaddr_un *)recvaddr;
-
-    if (len>0) {
-      /* Look at overlay_mdp_frame we have received */
-      overlay_mdp_frame *mdp=(overlay_mdp_frame *)&buffer[0];      
-      unsigned int mdp_type = mdp->packetTypeAndFlags & MDP_TYPE_MASK;
-
-      switch (mdp_type) {
-      case MDP_GOODBYE:
-	if (config.debug.mdprequests) DEBUG("MDP_GOODBYE");
-	overlay_mdp_releasebindings(recvaddr_un,recvaddrlen);
-	return;
-	  
-      /* Deprecated. We can replace with a more generic dump of the routing table */
-      case MDP_NODEINFO:
-	if (config.debug.mdprequests) DEBUG("MDP_NODEINFO");
-	  
-	if (!overlay_route_node_info(&mdp->nodeinfo))
-	  overlay_mdp_reply(mdp_named.poll.fd,recvaddr_un,recvaddrlen,mdp);
-	return;
-	  
-      case MDP_ROUTING_TABLE:
-	{
-	  struct routing_state state={
-	    .recvaddr_un=recvaddr_un,
-	    .recvaddrlen=recvaddrlen,
-	  };
+    case MDP_GETADDRS:
+      {
+	overlay_mdp_frame mdpreply;
+	bzero(&mdpreply, sizeof(overlay_mdp_frame));
+	mdpreply.packetTypeAndFlags = MDP_ADDRLIST;
+	if (!overlay_mdp_address_list(&mdp->addrlist, &mdpreply.addrlist))
+	/* Send back to caller */
+	  overlay_mdp_reply(alarm->poll.fd,
+		      (struct sockaddr_un *)recvaddr,recvaddrlen,
+		      &mdpreply);
 	  
-	  enum_subscribers(NULL, routing_table, &state);
+	return 0;
+      }
+      break;
+	
+    case MDP_TX: /* Send payload (and don't treat it as system privileged) */
+      if (config.debug.mdprequests) DEBUG("MDP_TX");
+	
+      // Dont allow mdp clients to send very high priority payloads
+      if (mdp->out.queue<=OQ_MESH_MANAGEMENT)
+	mdp->out.queue=OQ_ORDINARY;
+      overlay_mdp_dispatch(mdp,1,(struct sockaddr_un*)recvaddr,recvaddrlen);
+      return 0;
+      break;
+	
+    case MDP_BIND: /* Bind to port */
+      {
+	if (config.debug.mdprequests) DEBUG("MDP_BIND");
+	
+	struct subscriber *subscriber=NULL;
+	/* Make sure source address is either all zeros (listen on all), or a valid
+	 local address */
+	
+	if (!is_sid_any(mdp->bind.sid)){
+	  subscriber = find_subscriber(mdp->bind.sid, SID_SIZE, 0);
+	  if ((!subscriber) || subscriber->reachable != REACHABLE_SELF){
+	    WHYF("Invalid bind request for sid=%s", alloca_tohex_sid(mdp->bind.sid));
+	    /* Source address is invalid */
+	    overlay_mdp_reply_error(alarm->poll.fd, recvaddr_un, recvaddrlen, 7,
+				     "Bind address is not valid (must be a local MDP address, or all zeroes).");
+	    return 0;
+	  }
 	  
 	}
-	return;
-      
-      case MDP_GETADDRS:
-	{
-	  overlay_mdp_frame mdpreply;
-	  bzero(&mdpreply, sizeof(overlay_mdp_frame));
-	  mdpreply.packetTypeAndFlags = MDP_ADDRLIST;
-	  if (!overlay_mdp_address_list(&mdp->addrlist, &mdpreply.addrlist))
-	  /* Send back to caller */
-	    overlay_mdp_reply(alarm->poll.fd,
-			      (struct sockaddr_un *)recvaddr,recvaddrlen,
-			      &mdpreply);
+	if (overlay_mdp_process_bind_request(alarm->poll.fd, subscriber, mdp->bind.port,
+				       mdp->packetTypeAndFlags, recvaddr_un, recvaddrlen))
+	  overlay_mdp_reply_error(alarm->poll.fd,recvaddr_un,recvaddrlen,3, "Port already in use");
+	else
+	  overlay_mdp_reply_ok(alarm->poll.fd,recvaddr_un,recvaddrlen,"Port bound");
+	return 0;
+      }
+      break;
+	
+    case MDP_SCAN:
+      {
+	struct overlay_mdp_scan *scan = (struct overlay_mdp_scan *)&mdp->raw;
+	time_ms_t start=gettime_ms();
+	
+	if (scan->addr.s_addr==0){
+	  int i=0;
+	  for (i=0;i<OVERLAY_MAX_INTERFACES;i++){
+	    // skip any interface that is already being scanned
+	    if (scans[i].interface)
+	continue;
 	    
-	  return;
-	}
-	break;
-	  
-      case MDP_TX: /* Send payload (and don't treat it as system privileged) */
-	if (config.debug.mdprequests) DEBUG("MDP_TX");
-	  
-	// Dont allow mdp clients to send very high priority payloads
-	if (mdp->out.queue<=OQ_MESH_MANAGEMENT)
-	  mdp->out.queue=OQ_ORDINARY;
-	overlay_mdp_dispatch(mdp,1,(struct sockaddr_un*)recvaddr,recvaddrlen);
-	return;
-	break;
-	  
-      case MDP_BIND: /* Bind to port */
-	{
-	  if (config.debug.mdprequests) DEBUG("MDP_BIND");
-	  
-	  struct subscriber *subscriber=NULL;
-	  /* Make sure source address is either all zeros (listen on all), or a valid
-	   local address */
-	  
-	  if (!is_sid_any(mdp->bind.sid)){
-	    subscriber = find_subscriber(mdp->bind.sid, SID_SIZE, 0);
-	    if ((!subscriber) || subscriber->reachable != REACHABLE_SELF){
-	      WHYF("Invalid bind request for sid=%s", alloca_tohex_sid(mdp->bind.sid));
-	      /* Source address is invalid */
-	      overlay_mdp_reply_error(alarm->poll.fd, recvaddr_un, recvaddrlen, 7,
-					     "Bind address is not valid (must be a local MDP address, or all zeroes).");
-	      return;
-	    }
+	    struct overlay_interface *interface = &overlay_interfaces[i];
+	    if (interface->state!=INTERFACE_STATE_UP)
+	continue;
 	    
-	  }
-	  if (overlay_mdp_process_bind_request(alarm->poll.fd, subscriber, mdp->bind.port,
-					       mdp->packetTypeAndFlags, recvaddr_un, recvaddrlen))
-	    overlay_mdp_reply_error(alarm->poll.fd,recvaddr_un,recvaddrlen,3, "Port already in use");
-	  else
-	    overlay_mdp_reply_ok(alarm->poll.fd,recvaddr_un,recvaddrlen,"Port bound");
-	  return;
-	}
-	break;
-	  
-      case MDP_SCAN:
-	{
-	  struct overlay_mdp_scan *scan = (struct overlay_mdp_scan *)&mdp->raw;
-	  time_ms_t start=gettime_ms();
-	  
-	  if (scan->addr.s_addr==0){
-	    int i=0;
-	    for (i=0;i<OVERLAY_MAX_INTERFACES;i++){
-	      // skip any interface that is already being scanned
-	      if (scans[i].interface)
-		continue;
-	      
-	      struct overlay_interface *interface = &overlay_interfaces[i];
-	      if (interface->state!=INTERFACE_STATE_UP)
-		continue;
-	      
-	      scans[i].interface = interface;
-	      scans[i].current = ntohl(interface->address.sin_addr.s_addr & interface->netmask.s_addr)+1;
-	      scans[i].last = ntohl(interface->broadcast_address.sin_addr.s_addr)-1;
-	      if (scans[i].last - scans[i].current>0x10000){
-		INFOF("Skipping scan on interface %s as the address space is too large",interface->name);
-		continue;
-	      }
-	      scans[i].alarm.alarm=start;
-	      scans[i].alarm.function=overlay_mdp_scan;
-	      start+=100;
-	      schedule(&scans[i].alarm);
-	    }
-	  }else{
-	    struct overlay_interface *interface = overlay_interface_find(scan->addr, 1);
-	    if (!interface){
-	      overlay_mdp_reply_error(alarm->poll.fd,recvaddr_un,recvaddrlen, 1, "Unable to find matching interface");
-	      return;
-	    }
-	    int i = interface - overlay_interfaces;
-	    
-	    if (!scans[i].interface){
-	      scans[i].interface = interface;
-	      scans[i].current = ntohl(scan->addr.s_addr);
-	      scans[i].last = ntohl(scan->addr.s_addr);
-	      scans[i].alarm.alarm=start;
-	      scans[i].alarm.function=overlay_mdp_scan;
-	      schedule(&scans[i].alarm);
+	    scans[i].interface = interface;
+	    scans[i].current = ntohl(interface->address.sin_addr.s_addr & interface->netmask.s_addr)+1;
+	    scans[i].last = ntohl(interface->broadcast_address.sin_addr.s_addr)-1;
+	    if (scans[i].last - scans[i].current>0x10000){
+	INFOF("Skipping scan on interface %s as the address space is too large",interface->name);
+	continue;
 	    }
+	    scans[i].alarm.alarm=start;
+	    scans[i].alarm.function=overlay_mdp_scan;
+	    start+=100;
+	    schedule(&scans[i].alarm);
+	  }
+	}else{
+	  struct overlay_interface *interface = overlay_interface_find(scan->addr, 1);
+	  if (!interface){
+	    overlay_mdp_reply_error(alarm->poll.fd,recvaddr_un,recvaddrlen, 1, "Unable to find matching interface");
+	    return 0;
 	  }
+	  int i = interface - overlay_interfaces;
 	  
-	  overlay_mdp_reply_ok(alarm->poll.fd,recvaddr_un,recvaddrlen,"Scan initiated");
+	  if (!scans[i].interface){
+	    scans[i].interface = interface;
+	    scans[i].current = ntohl(scan->addr.s_addr);
+	    scans[i].last = ntohl(scan->addr.s_addr);
+	    scans[i].alarm.alarm=start;
+	    scans[i].alarm.function=overlay_mdp_scan;
+	    schedule(&scans[i].alarm);
+	  }
 	}
-	break;
 	
-      default:
-	/* Client is not allowed to send any other frame type */
-	WARNF("Unsupported MDP frame type: %d", mdp_type);
-	mdp->packetTypeAndFlags=MDP_ERROR;
-	mdp->error.error=2;
-	snprintf(mdp->error.message,128,"Illegal request type.  Clients may use only MDP_TX or MDP_BIND.");
-	int len=4+4+strlen(mdp->error.message)+1;
-	errno=0;
-	/* We ignore the result of the following, because it is just sending an
-	   error message back to the client.  If this fails, where would we report
-	   the error to? My point exactly. */
-	sendto(alarm->poll.fd,mdp,len,0,(struct sockaddr *)recvaddr,recvaddrlen);
+	overlay_mdp_reply_ok(alarm->poll.fd,recvaddr_un,recvaddrlen,"Scan initiated");
       }
+      break;
+      
+    default:
+      /* Client is not allowed to send any other frame type */
+      WARNF("Unsupported MDP frame type: %d", mdp_type);
+      mdp->packetTypeAndFlags=MDP_ERROR;
+      mdp->error.error=2;
+      snprintf(mdp->error.message,128,"Illegal request type.  Clients may use only MDP_TX or MDP_BIND.");
+      int len=4+4+strlen(mdp->error.message)+1;
+      errno=0;
+      /* We ignore the result of the following, because it is just sending an
+	 error message back to the client.  If this fails, where would we report
+	 the error to? My point exactly. */
+      sendto(alarm->poll.fd,mdp,len,0,(struct sockaddr *)recvaddr,recvaddrlen);
     }
+    return 0;
   }
-  
+  return -1;
+}
+
+/* Clients tend to send bursts of frames, so handle up to this many per wakeup */
+#define MDP_POLL_BATCH 16
+
+void overlay_mdp_poll(struct sched_ent *alarm)
+{
+  if (alarm->poll.revents & POLLIN) {
+    int i;
+    for (i=0;i<MDP_POLL_BATCH;i++)
+      if (overlay_mdp_receive(alarm)==-1)
+	break;
+  }
+
   if (alarm->poll.revents & (POLLHUP | POLLERR)) {
     INFO("Error on mdp socket");
   }
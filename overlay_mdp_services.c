@@ -29,24 +29,27 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include "crypto.h"
 #include "log.h"
 
-int overlay_mdp_service_rhizomerequest(overlay_mdp_frame *mdp)
+static int overlay_mdp_service_rhizomerequest(struct internal_mdp_header *header, struct overlay_buffer *payload)
 {
   IN();
 
+  unsigned char *request=ob_get_bytes_ptr(payload, RHIZOME_MANIFEST_ID_BYTES+8+8+4+2);
+  if (!request)
+    RETURN(WHY("Rhizome block request is too short"));
   uint64_t version=
-    read_uint64(&mdp->out.payload[RHIZOME_MANIFEST_ID_BYTES]);
+    read_uint64(&request[RHIZOME_MANIFEST_ID_BYTES]);
   uint64_t fileOffset=
-    read_uint64(&mdp->out.payload[RHIZOME_MANIFEST_ID_BYTES+8]);
+    read_uint64(&request[RHIZOME_MANIFEST_ID_BYTES+8]);
   uint32_t bitmap=
-    read_uint32(&mdp->out.payload[RHIZOME_MANIFEST_ID_BYTES+8+8]);
+    read_uint32(&request[RHIZOME_MANIFEST_ID_BYTES+8+8]);
   uint16_t blockLength=
-    read_uint16(&mdp->out.payload[RHIZOME_MANIFEST_ID_BYTES+8+8+4]);
+    read_uint16(&request[RHIZOME_MANIFEST_ID_BYTES+8+8+4]);
   if (blockLength>1024) RETURN(-1);
 
-  struct subscriber *source = find_subscriber(mdp->out.src.sid, SID_SIZE, 0);
+  struct subscriber *source = header->source;
   
   if (config.debug.rhizome_tx)
-    DEBUGF("Requested blocks for %s @%llx", alloca_tohex_bid(&mdp->out.payload[0]), fileOffset);
+    DEBUGF("Requested blocks for %s @%llx", alloca_tohex_bid(&request[0]), fileOffset);
 
   /* Find manifest that corresponds to BID and version.
      If we don't have this combination, then do nothing.
@@ -57,115 +60,122 @@ int overlay_mdp_service_rhizomerequest(overlay_mdp_frame *mdp)
      journal, then the newer version is okay to use to service this request.
   */
   
-  char filehash[SHA512_DIGEST_STRING_LENGTH];
-  if (rhizome_database_filehash_from_id(alloca_tohex_bid(mdp->out.payload), version, filehash)<=0)
+  // the same blocks are often requested by several neighbours, so keep the payload open
+  struct rhizome_read *read=rhizome_read_cached(request, version);
+  if (!read)
     RETURN(-1);
   
-  struct rhizome_read read;
-  bzero(&read, sizeof read);
+  struct internal_mdp_header reply;
+  bzero(&reply,sizeof(reply));
+  // Reply is broadcast, so we cannot authcrypt, and signing is too time consuming
+  // for low devices.  The result is that an attacker can prevent rhizome transfers
+  // if they want to by injecting fake blocks.  The alternative is to not broadcast
+  // back replies, and then we can authcrypt.
+  // multiple receivers starting at different times, we really need merkle-tree hashing.
+  // so multiple receivers is not realistic for now.  So use non-broadcast unicode
+  // for now would seem the safest.  But that would stop us from allowing multiple
+  // receivers in the special case where additional nodes begin listening in from the
+  // beginning.
+  reply.flags=MDP_NOCRYPT|MDP_NOSIGN;
+  reply.source=my_subscriber;
+  reply.source_port=MDP_PORT_RHIZOME_RESPONSE;
+  int send_broadcast=1;
   
-  int ret=rhizome_open_read(&read, filehash, 0);
+  if (source){
+    if (!(source->reachable&REACHABLE_DIRECT))
+      send_broadcast=0;
+    if (source->reachable&REACHABLE_UNICAST && source->interface && source->interface->prefer_unicast)
+      send_broadcast=0;
+  }
+  
+  if (send_broadcast){
+    // send replies to broadcast so that others can hear blocks and record them
+    // (not that preemptive listening is implemented yet).
+    reply.destination=NULL;
+    reply.ttl=1;
+  }else{
+    // if we get a request from a peer that we can only talk to via unicast, send data via unicast too.
+    reply.destination=source;
+    reply.ttl=64;
+  }
   
-  if (!ret){
-    overlay_mdp_frame reply;
-    bzero(&reply,sizeof(reply));
-    // Reply is broadcast, so we cannot authcrypt, and signing is too time consuming
-    // for low devices.  The result is that an attacker can prevent rhizome transfers
-    // if they want to by injecting fake blocks.  The alternative is to not broadcast
-    // back replies, and then we can authcrypt.
-    // multiple receivers starting at different times, we really need merkle-tree hashing.
-    // so multiple receivers is not realistic for now.  So use non-broadcast unicode
-    // for now would seem the safest.  But that would stop us from allowing multiple
-    // receivers in the special case where additional nodes begin listening in from the
-    // beginning.
-    reply.packetTypeAndFlags=MDP_TX|MDP_NOCRYPT|MDP_NOSIGN;
-    bcopy(my_subscriber->sid,reply.out.src.sid,SID_SIZE);
-    reply.out.src.port=MDP_PORT_RHIZOME_RESPONSE;
-    int send_broadcast=1;
+  reply.destination_port=MDP_PORT_RHIZOME_RESPONSE;
+  reply.queue=OQ_OPPORTUNISTIC;
+  
+  int i;
+  for(i=0;i<32;i++){
+    if (bitmap&(1<<(31-i)))
+      continue;
     
-    if (source){
-      if (!(source->reachable&REACHABLE_DIRECT))
-	send_broadcast=0;
-      if (source->reachable&REACHABLE_UNICAST && source->interface && source->interface->prefer_unicast)
-	send_broadcast=0;
-    }
+    if (overlay_queue_remaining(reply.queue) < 10)
+      break;
     
-    if (send_broadcast){
-      // send replies to broadcast so that others can hear blocks and record them
-      // (not that preemptive listening is implemented yet).
-      memset(reply.out.dst.sid,0xff,SID_SIZE);
-      reply.out.ttl=1;
-    }else{
-      // if we get a request from a peer that we can only talk to via unicast, send data via unicast too.
-      bcopy(mdp->out.src.sid,reply.out.dst.sid,SID_SIZE);
-      reply.out.ttl=64;
+    // calculate and set offset of block
+    read->offset = fileOffset+i*blockLength;
+    
+    // stop if we passed the length of the file
+    // (but we may not know the file length until we attempt a read)
+    if (read->length!=-1 && read->offset>read->length)
+      break;
+    
+    // build each block straight into the payload of the outgoing frame
+    struct overlay_buffer *block=overlay_mdp_payload_new(&reply);
+    if (!block)
+      break;
+    unsigned char *p=ob_append_space(block, 1+16+8+8+blockLength);
+    if (!p){
+      ob_free(block);
+      break;
     }
     
-    reply.out.dst.port=MDP_PORT_RHIZOME_RESPONSE;
-    reply.out.queue=OQ_OPPORTUNISTIC;
-    reply.out.payload[0]='B'; // reply contains blocks
+    p[0]='B'; // reply contains blocks
     // include 16 bytes of BID prefix for identification
-    bcopy(&mdp->out.payload[0],&reply.out.payload[1],16);
+    bcopy(&request[0],&p[1],16);
     // and version of manifest
-    bcopy(&mdp->out.payload[RHIZOME_MANIFEST_ID_BYTES],
-	  &reply.out.payload[1+16],8);
+    bcopy(&request[RHIZOME_MANIFEST_ID_BYTES],&p[1+16],8);
+    write_uint64(&p[1+16+8], read->offset);
     
-    int i;
-    for(i=0;i<32;i++){
-      if (bitmap&(1<<(31-i)))
-	continue;
-      
-      if (overlay_queue_remaining(reply.out.queue) < 10)
-	break;
-      
-      // calculate and set offset of block
-      read.offset = fileOffset+i*blockLength;
-      
-      // stop if we passed the length of the file
-      // (but we may not know the file length until we attempt a read)
-      if (read.length!=-1 && read.offset>read.length)
-	break;
-      
-      write_uint64(&reply.out.payload[1+16+8], read.offset);
-      
-      int bytes_read = rhizome_read(&read, &reply.out.payload[1+16+8+8], blockLength);
-      if (bytes_read<=0)
-	break;
-      
-      reply.out.payload_length=1+16+8+8+bytes_read;
-      
-      // Mark the last block of the file, if required
-      if (read.offset >= read.length)
-	reply.out.payload[0]='T';
-      
-      // send packet
-      if (overlay_mdp_dispatch(&reply,0 /* system generated */, NULL,0))
-	break;
+    int bytes_read = rhizome_read(read, &p[1+16+8+8], blockLength);
+    if (bytes_read<=0){
+      ob_free(block);
+      break;
     }
+    block->position -= blockLength - bytes_read;
+    
+    // Mark the last block of the file, if required
+    if (read->offset >= read->length)
+      p[0]='T';
+    
+    // send packet
+    if (overlay_mdp_dispatch_payload(&reply, block))
+      break;
   }
-  rhizome_read_close(&read);
+  rhizome_read_release(read);
 
-  RETURN(ret);
+  RETURN(0);
   OUT();
 }
 
-int overlay_mdp_service_rhizomeresponse(overlay_mdp_frame *mdp)
+static int overlay_mdp_service_rhizomeresponse(struct internal_mdp_header *header, struct overlay_buffer *payload)
 {
   IN();
   
-  if (!mdp->out.payload_length) RETURN(-1);
+  int len=ob_remaining(payload);
+  if (!len) RETURN(-1);
+  unsigned char *data=ob_get_bytes_ptr(payload, len);
+  if (!data) RETURN(-1);
 
-  int type=mdp->out.payload[0];
+  int type=data[0];
   switch (type) {
   case 'B': /* data block */
   case 'T': /* terminal data block */
     {
-      if (mdp->out.payload_length<(1+16+8+8+1)) RETURN(-1);
-      unsigned char *bidprefix=&mdp->out.payload[1];
-      uint64_t version=read_uint64(&mdp->out.payload[1+16]);
-      uint64_t offset=read_uint64(&mdp->out.payload[1+16+8]);
-      int count=mdp->out.payload_length-(1+16+8+8);
-      unsigned char *bytes=&mdp->out.payload[1+16+8+8];
+      if (len<(1+16+8+8+1)) RETURN(-1);
+      unsigned char *bidprefix=&data[1];
+      uint64_t version=read_uint64(&data[1+16]);
+      uint64_t offset=read_uint64(&data[1+16+8]);
+      int count=len-(1+16+8+8);
+      unsigned char *bytes=&data[1+16+8+8];
       if (config.debug.rhizome_rx) 
 	DEBUGF("Received %d bytes @ 0x%llx for %s* version 0x%llx",
 	       count,offset,alloca_tohex(bidprefix,16),version);
@@ -259,6 +269,13 @@ int overlay_mdp_service_echo(overlay_mdp_frame *mdp)
   if (mdp->out.dst.port==MDP_PORT_ECHO) {
     RETURN(WHY("echo loop averted"));
   }
+  /* Don't answer a ping or probe from someone we can't route to yet */
+  struct subscriber *sender=find_subscriber(mdp->out.dst.sid, SID_SIZE, 0);
+  if (sender && sender->reachable!=REACHABLE_SELF && !overlay_forwarding_lookup(sender)){
+    if (config.debug.mdprequests)
+      DEBUGF("Not echoing to %s, it isn't reachable yet", alloca_tohex_sid(mdp->out.dst.sid));
+    RETURN(0);
+  }
   /* If the packet was sent to broadcast, then replace broadcast address
      with our local address. For now just responds with first local address */
   if (is_sid_broadcast(mdp->out.src.sid))
@@ -377,16 +394,13 @@ end:
 
 static int overlay_mdp_service_manifest_response(overlay_mdp_frame *mdp){
   int offset=0;
-  char id_hex[RHIZOME_MANIFEST_ID_STRLEN];
   rhizome_manifest *m = rhizome_new_manifest();
   if (!m)
     return WHY("Unable to allocate manifest");
   
   while (offset<mdp->out.payload_length){
     unsigned char *bar=&mdp->out.payload[offset];
-    tohex(id_hex, &bar[RHIZOME_BAR_PREFIX_OFFSET], RHIZOME_BAR_PREFIX_BYTES);
-    strcat(id_hex, "%");
-    if (!rhizome_retrieve_manifest(id_hex, m)){
+    if (!rhizome_retrieve_manifest_by_prefix(&bar[RHIZOME_BAR_PREFIX_OFFSET], RHIZOME_BAR_PREFIX_BYTES, m)){
       rhizome_advertise_manifest(m);
     }
     offset+=RHIZOME_BAR_BYTES;
@@ -396,29 +410,38 @@ static int overlay_mdp_service_manifest_response(overlay_mdp_frame *mdp){
   return 0;
 }
 
-int overlay_mdp_try_interal_services(overlay_mdp_frame *mdp)
+int overlay_mdp_try_interal_services(struct internal_mdp_header *header, struct overlay_buffer *payload)
 {
   IN();
-  switch(mdp->out.dst.port) {
-  case MDP_PORT_VOMP:             RETURN(vomp_mdp_received(mdp));
-  case MDP_PORT_KEYMAPREQUEST:    RETURN(keyring_mapping_request(keyring,mdp));
-  case MDP_PORT_DNALOOKUP:        RETURN(overlay_mdp_service_dnalookup(mdp));
-  case MDP_PORT_ECHO:             RETURN(overlay_mdp_service_echo(mdp));
-  case MDP_PORT_TRACE:            RETURN(overlay_mdp_service_trace(mdp));
-  case MDP_PORT_PROBE:            RETURN(overlay_mdp_service_probe(mdp));
-  case MDP_PORT_STUNREQ:          RETURN(overlay_mdp_service_stun_req(mdp));
-  case MDP_PORT_STUN:             RETURN(overlay_mdp_service_stun(mdp));
+  /* Services that read the payload where it is */
+  switch(header->destination_port) {
   case MDP_PORT_RHIZOME_REQUEST: 
     if (is_rhizome_mdp_server_running()) {
-      RETURN(overlay_mdp_service_rhizomerequest(mdp));
+      RETURN(overlay_mdp_service_rhizomerequest(header, payload));
     }
-    break;
-  case MDP_PORT_RHIZOME_RESPONSE: RETURN(overlay_mdp_service_rhizomeresponse(mdp));    
-  case MDP_PORT_RHIZOME_MANIFEST_REQUEST: RETURN(overlay_mdp_service_manifest_response(mdp));
+    RETURN(WHYF("Received packet for which no listening process exists (MDP ports: src=%d, dst=%d",
+		header->source_port,header->destination_port));
+  case MDP_PORT_RHIZOME_RESPONSE: RETURN(overlay_mdp_service_rhizomeresponse(header, payload));
+  }
+  
+  overlay_mdp_frame mdp;
+  if (overlay_mdp_fill_frame(header, payload, &mdp))
+    RETURN(-1);
+  
+  switch(mdp.out.dst.port) {
+  case MDP_PORT_VOMP:             RETURN(vomp_mdp_received(&mdp));
+  case MDP_PORT_KEYMAPREQUEST:    RETURN(keyring_mapping_request(keyring,&mdp));
+  case MDP_PORT_DNALOOKUP:        RETURN(overlay_mdp_service_dnalookup(&mdp));
+  case MDP_PORT_ECHO:             RETURN(overlay_mdp_service_echo(&mdp));
+  case MDP_PORT_TRACE:            RETURN(overlay_mdp_service_trace(&mdp));
+  case MDP_PORT_PROBE:            RETURN(overlay_mdp_service_probe(&mdp));
+  case MDP_PORT_STUNREQ:          RETURN(overlay_mdp_service_stun_req(&mdp));
+  case MDP_PORT_STUN:             RETURN(overlay_mdp_service_stun(&mdp));
+  case MDP_PORT_RHIZOME_MANIFEST_REQUEST: RETURN(overlay_mdp_service_manifest_response(&mdp));
   }
    
   /* Unbound socket.  We won't be sending ICMP style connection refused
      messages, partly because they are a waste of bandwidth. */
   RETURN(WHYF("Received packet for which no listening process exists (MDP ports: src=%d, dst=%d",
-	      mdp->out.src.port,mdp->out.dst.port));
+	      mdp.out.src.port,mdp.out.dst.port));
 }
@@ -147,10 +147,13 @@ static void parse_frame(struct overlay_buffer *buff){
   overlay_interface *interface = overlay_interface_find(*addr, 1);
   if (interface){
     // always update the IP address we heard them from, even if we don't need to use it right now
-    context.sender->address.sin_family = AF_INET;
-    context.sender->address.sin_addr = *addr;
+    struct sockaddr_in address;
+    bzero(&address, sizeof address);
+    address.sin_family = AF_INET;
+    address.sin_addr = *addr;
     // assume the port number of the other servald matches our local port number configuration
-    context.sender->address.sin_port = htons(interface->port);
+    address.sin_port = htons(interface->port);
+    set_subscriber_address(context.sender, context.sender->interface, &address);
 
     if (context.sender->reachable==REACHABLE_NONE){
       set_reachable(context.sender, REACHABLE_UNICAST|REACHABLE_ASSUMED);
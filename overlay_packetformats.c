@@ -34,7 +34,7 @@ struct sockaddr_in loopback;
 int overlay_packet_init_header(int encapsulation, 
 			       struct decode_context *context, struct overlay_buffer *buff, 
 			       struct subscriber *destination, 
-			       char unicast, char interface, char seq){
+			       char unicast, char interface, int seq){
   
   if (encapsulation !=ENCAP_OVERLAY && encapsulation !=ENCAP_SINGLE)
     return WHY("Invalid packet encapsulation");
@@ -54,7 +54,7 @@ int overlay_packet_init_header(int encapsulation,
     flags |= PACKET_UNICAST;
   if (interface)
     flags |= PACKET_INTERFACE;
-  if (seq)
+  if (seq>=0)
     flags |= PACKET_SEQ;
   
   ob_append_byte(buff,flags);
@@ -80,6 +80,7 @@ int process_incoming_frame(time_ms_t now, struct overlay_interface *interface, s
       overlay_route_saw_selfannounce_ack(f,now);
       break;
     case OF_TYPE_NODEANNOUNCE:
+    case OF_TYPE_NODEANNOUNCE_DELTA:
       if (config.debug.overlayframes)
 	DEBUG("Processing OF_TYPE_NODEANNOUNCE");
       overlay_route_saw_advertisements(id,f,context,now);
@@ -97,6 +98,11 @@ int process_incoming_frame(time_ms_t now, struct overlay_interface *interface, s
 	DEBUG("Processing OF_TYPE_DATA");
       overlay_saw_mdp_containing_frame(f,now);
       break;
+    case OF_TYPE_NODEANNOUNCE_RESYNC:
+      if (config.debug.overlayframes)
+	DEBUG("Processing OF_TYPE_NODEANNOUNCE_RESYNC");
+      overlay_route_saw_advert_resync(id,f);
+      break;
     case OF_TYPE_PLEASEEXPLAIN:
       if (config.debug.overlayframes)
 	DEBUG("Processing OF_TYPE_PLEASEEXPLAIN");
@@ -135,6 +141,7 @@ int overlay_forward_payload(struct overlay_frame *f){
     op_free(qf);
     RETURN(WHY("failed to enqueue forwarded payload"));
   }
+  forwarding_stats.forwarded++;
   
   RETURN(0);
   OUT();
@@ -255,8 +262,9 @@ int parseEnvelopeHeader(struct decode_context *context, struct overlay_interface
   if (packet_flags & PACKET_INTERFACE)
     sender_interface = ob_get(buffer);
   
+  int sequence = -1;
   if (packet_flags & PACKET_SEQ)
-    ob_get(buffer); // sequence number, not implemented yet
+    sequence = ob_get(buffer);
   
   if (context->sender){
     // ignore packets that have been reflected back to me
@@ -272,13 +280,13 @@ int parseEnvelopeHeader(struct decode_context *context, struct overlay_interface
     
     // if this is a dummy announcement for a node that isn't in our routing table
     if (context->sender->reachable == REACHABLE_NONE) {
-      context->sender->interface = interface;
-      
+      struct sockaddr_in address;
       if (addr)
-	context->sender->address = *addr;
+	address = *addr;
       else
-	bzero(&context->sender->address, sizeof context->sender->address);
-	
+	bzero(&address, sizeof address);
+      set_subscriber_address(context->sender, interface, &address);
+      
       context->sender->last_probe = 0;
       
       // assume for the moment, that we can reply with the same packet type
@@ -293,6 +301,10 @@ int parseEnvelopeHeader(struct decode_context *context, struct overlay_interface
     if (addr && (context->sender->last_probe==0 || now - context->sender->last_probe > interface->tick_ms*10))
       overlay_send_probe(context->sender, *addr, interface, OQ_MESH_MANAGEMENT);
     
+    // count any broadcast packets we missed from this neighbour before we ack them
+    if (sequence>=0 && !(packet_flags&PACKET_UNICAST))
+      overlay_route_saw_sequence(context->sender, interface, sender_interface, sequence, now);
+    
     if ((!(packet_flags&PACKET_UNICAST)) && context->sender->last_acked + interface->tick_ms <= now){
       overlay_route_ack_selfannounce(interface,
 				     context->sender->last_acked>now - 3*interface->tick_ms?context->sender->last_acked:now,
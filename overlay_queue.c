@@ -47,7 +47,8 @@ struct outgoing_packet{
   struct decode_context context;
 };
 
-struct sched_ent next_packet;
+static struct sched_ent _next_packet;
+static struct sched_ent *next_packet=&_next_packet;
 struct profile_total send_packet;
 
 static void overlay_send_packet(struct sched_ent *alarm);
@@ -67,6 +68,40 @@ int overlay_queue_init(){
   return 0;  
 }
 
+struct queue_state{
+  overlay_txqueue tx[OQ_MAX];
+  struct sched_ent *next_packet;
+};
+
+/* Exchange the transmit queues with those saved in *state. A NULL *state is
+   replaced with a freshly initialised set of empty queues.
+   Used by the mesh simulator to host many nodes in one process. */
+int overlay_queue_swap_state(void **state){
+  struct queue_state *s = *state;
+  int fresh = 0;
+  if (!s){
+    s = calloc(1, sizeof(struct queue_state));
+    if (!s)
+      return WHY_perror("calloc");
+    s->next_packet = calloc(1, sizeof(struct sched_ent));
+    if (!s->next_packet){
+      free(s);
+      return WHY_perror("calloc");
+    }
+    *state = s;
+    fresh = 1;
+  }
+  struct queue_state old;
+  bcopy(overlay_tx, old.tx, sizeof overlay_tx);
+  old.next_packet = next_packet;
+  bcopy(s->tx, overlay_tx, sizeof overlay_tx);
+  next_packet = s->next_packet;
+  *s = old;
+  if (fresh)
+    overlay_queue_init();
+  return 0;
+}
+
 /* remove and free a payload from the queue */
 static struct overlay_frame *
 overlay_queue_remove(overlay_txqueue *queue, struct overlay_frame *frame){
@@ -147,16 +182,10 @@ int overlay_payload_enqueue(struct overlay_frame *p)
       break;
     if (!p->destination)
       break;
-    int r = subscriber_is_reachable(p->destination);
-    if (r&REACHABLE)
+    if (overlay_forwarding_lookup(p->destination))
       break;
     
-    if (directory_service){
-      r = subscriber_is_reachable(directory_service);
-      if (r&REACHABLE)
-	break;
-    }
-    
+    int r = subscriber_is_reachable(p->destination);
     return WHYF("Cannot send %x packet, destination %s is %s", p->type, 
 		alloca_tohex_sid(p->destination->sid), r==REACHABLE_SELF?"myself":"unreachable");
   } while(0);
@@ -164,8 +193,10 @@ int overlay_payload_enqueue(struct overlay_frame *p)
   if (p->queue>=OQ_MAX) 
     return WHY("Invalid queue specified");
   
-  /* queue a unicast probe if we haven't for a while. */
-  if (p->destination && (p->destination->last_probe==0 || gettime_ms() - p->destination->last_probe > 5000))
+  /* queue a unicast probe if we haven't for a while. Only neighbours have an address to probe,
+     frames to anyone else go via a next hop. */
+  if (p->destination && (p->destination->reachable & REACHABLE_DIRECT)
+    && (p->destination->last_probe==0 || gettime_ms() - p->destination->last_probe > 5000))
     overlay_send_probe(p->destination, p->destination->address, p->destination->interface, OQ_MESH_MANAGEMENT);
   
   overlay_txqueue *queue = &overlay_tx[p->queue];
@@ -243,24 +274,28 @@ overlay_init_packet(struct outgoing_packet *packet, struct subscriber *destinati
     packet->unicast_subscriber = destination;
   ob_limitsize(packet->buffer, packet->interface->mtu);
   
+  // only broadcast packets are numbered, so every neighbour should hear every number
+  int seq = -1;
+  if (!unicast)
+    seq = (interface->sequence_number++) & 0xFF;
   overlay_packet_init_header(ENCAP_OVERLAY, &packet->context, packet->buffer, 
-			     destination, unicast, packet->i, 0);
+			     destination, unicast, packet->i, seq);
   packet->header_length = ob_position(packet->buffer);
 }
 
 int overlay_queue_schedule_next(time_ms_t next_allowed_packet){
-  if (next_packet.alarm==0 || next_allowed_packet < next_packet.alarm){
+  if (next_packet->alarm==0 || next_allowed_packet < next_packet->alarm){
     
-    if (!next_packet.function){
-      next_packet.function=overlay_send_packet;
+    if (!next_packet->function){
+      next_packet->function=overlay_send_packet;
       send_packet.name="overlay_send_packet";
-      next_packet.stats=&send_packet;
+      next_packet->stats=&send_packet;
     }
-    unschedule(&next_packet);
-    next_packet.alarm=next_allowed_packet;
+    unschedule(next_packet);
+    next_packet->alarm=next_allowed_packet;
     // small grace period, we want to read incoming IO first
-    next_packet.deadline=next_allowed_packet+15;
-    schedule(&next_packet);
+    next_packet->deadline=next_allowed_packet+15;
+    schedule(next_packet);
   }
   return 0;  
 }
@@ -336,47 +371,23 @@ overlay_stuff_packet(struct outgoing_packet *packet, overlay_txqueue *queue, tim
       
       if (frame->next_hop){
 	// Where do we need to route this payload next?
-	
-	int r = subscriber_is_reachable(frame->next_hop);
-	
-	// first, should we try to bounce this payload off the directory service?
-	if (r==REACHABLE_NONE && 
-	    directory_service && 
-	    frame->next_hop!=directory_service){
-	  frame->next_hop=directory_service;
-	  r=subscriber_is_reachable(directory_service);
-	}
-	
-	// do we need to route via a neighbour?
-	if (r&REACHABLE_INDIRECT){
-	  frame->next_hop = frame->next_hop->next_hop;
-	  r = subscriber_is_reachable(frame->next_hop);
-	}
-	
-	if (!(r&REACHABLE_DIRECT)){
+	struct forwarding_entry *route = overlay_forwarding_lookup(frame->destination);
+	if (!route)
 	  goto skip;
-	}
 	
-	frame->interface = frame->next_hop->interface;
+	frame->next_hop = route->next_hop;
+	frame->interface = route->interface;
+	frame->recvaddr = route->addr;
 	
-	// if both broadcast and unicast are available, pick on based on interface preference
-	if ((r&(REACHABLE_UNICAST|REACHABLE_BROADCAST))==(REACHABLE_UNICAST|REACHABLE_BROADCAST)){
-	  if (frame->interface->prefer_unicast){
-	    r=REACHABLE_UNICAST;
-	    // used by tests
-	    if (config.debug.overlayframes)
-	      DEBUGF("Choosing to send via unicast for %s", alloca_tohex_sid(frame->destination->sid));
-	  }else
-	    r=REACHABLE_BROADCAST;
-	}
+	// used by tests
+	if (route->prefer_unicast && config.debug.overlayframes)
+	  DEBUGF("Choosing to send via unicast for %s", alloca_tohex_sid(frame->destination->sid));
 	
-	if(r&REACHABLE_UNICAST){
-	  frame->recvaddr = frame->next_hop->address;
+	if (route->unicast){
 	  frame->unicast = 1;
 	  // ignore resend logic for unicast packets, where wifi gives better resilience
 	  frame->send_copies=1;
-	}else
-	  frame->recvaddr = frame->interface->broadcast_address;
+	}
 	
 	frame->destination_resolved=1;
       }else{
@@ -513,9 +524,9 @@ overlay_fill_send_packet(struct outgoing_packet *packet, time_ms_t now) {
   int i;
   IN();
   // while we're looking at queues, work out when to schedule another packet
-  unschedule(&next_packet);
-  next_packet.alarm=0;
-  next_packet.deadline=0;
+  unschedule(next_packet);
+  next_packet->alarm=0;
+  next_packet->deadline=0;
   
   for (i=0;i<OQ_MAX;i++){
     overlay_txqueue *queue=&overlay_tx[i];
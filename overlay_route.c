@@ -141,6 +141,29 @@ struct overlay_neighbour_observation {
   unsigned char valid;
 };
 
+/* Delivery ratios are kept as fixed point fractions of LINK_QUALITY_ONE, and
+   smoothed over roughly the last 1<<LINK_QUALITY_SHIFT packets. */
+#define LINK_QUALITY_ONE (1<<16)
+#define LINK_QUALITY_SHIFT 3
+
+/* ETX style estimate of how reliable the link to a neighbour is on one of our
+   interfaces.
+   The reverse ratio (neighbour to us) is measured by counting gaps in the
+   sequence numbers of the broadcast packets they send. We return it to them in
+   our self-announce acks, which is how we learn the forward ratio (us to
+   neighbour) from their point of view. */
+struct overlay_link_quality {
+  unsigned char measured;
+  unsigned char sender_interface;
+  unsigned char last_sequence;
+  /* packets we have already counted as lost since last_sequence */
+  int missed;
+  time_ms_t last_sequence_time;
+  int reverse;
+  /* as reported by the neighbour, 1-255, 0 if they haven't told us yet */
+  unsigned char forward;
+};
+
 struct overlay_neighbour {
   time_ms_t last_observation_time_ms;
   time_ms_t last_metric_update;
@@ -152,6 +175,8 @@ struct overlay_neighbour {
    This is so that the sender knows which interface to use to reach us.
    */
   unsigned char scores[OVERLAY_MAX_INTERFACES];
+  
+  struct overlay_link_quality links[OVERLAY_MAX_INTERFACES];
 };
 
 /* We need to keep track of which nodes are our direct neighbours.
@@ -166,11 +191,13 @@ struct overlay_neighbour {
 */
 #define overlay_max_neighbours 128
 int overlay_neighbour_count=0;
-struct overlay_neighbour overlay_neighbours[overlay_max_neighbours];
+static struct overlay_neighbour _overlay_neighbours[overlay_max_neighbours];
+struct overlay_neighbour *overlay_neighbours=_overlay_neighbours;
 
 int overlay_route_recalc_node_metrics(overlay_node *n, time_ms_t now);
 int overlay_route_recalc_neighbour_metrics(struct overlay_neighbour *n, time_ms_t now);
 struct overlay_neighbour *overlay_route_get_neighbour_structure(overlay_node *node, int createP);
+static int link_reverse_ratio(struct subscriber *subscriber, overlay_interface *interface, int sender_interface);
 
 
 overlay_node *get_node(struct subscriber *subscriber, int create){
@@ -258,6 +285,9 @@ int overlay_route_ack_selfannounce(overlay_interface *recv_interface,
   ob_append_ui32(out->payload,s1);
   ob_append_ui32(out->payload,s2);
   ob_append_byte(out->payload,interface);
+  /* Tell them how many of their broadcast packets we are hearing. Older nodes
+     stop reading after the interface number. */
+  ob_append_byte(out->payload,link_reverse_ratio(subscriber, recv_interface, interface));
 
   /* Add to queue. Keep broadcast status that we have assigned here if required to
      get ack back to sender before we have a route. */
@@ -317,8 +347,102 @@ struct overlay_neighbour *overlay_route_get_neighbour_structure(overlay_node *no
   return &overlay_neighbours[node->neighbour_id];
 }
 
+static void link_quality_update(struct overlay_link_quality *link, int received)
+{
+  link->reverse -= link->reverse >> LINK_QUALITY_SHIFT;
+  if (received)
+    link->reverse += LINK_QUALITY_ONE >> LINK_QUALITY_SHIFT;
+}
+
+/* Count the broadcast packets we should have heard from a neighbour by now as
+   lost, so a link that goes silent decays without waiting for the next packet.
+   Every node sends at least one broadcast per tick, we assume they tick at the
+   same rate we do, and allow one tick of slack. */
+static void link_quality_expire(struct overlay_link_quality *link, overlay_interface *interface, time_ms_t now)
+{
+  if (!link->measured || interface->tick_ms<=0)
+    return;
+  time_ms_t expected = (now - link->last_sequence_time) / interface->tick_ms - 1;
+  // the sequence numbers wrap after 256 packets, by then the link is long gone anyway
+  if (expected > 256)
+    expected = 256;
+  while (link->missed < expected){
+    link_quality_update(link, 0);
+    link->missed++;
+  }
+}
+
+/* Link quality as a fraction of 255, ie the inverse of the ETX. 
+   Directions we haven't measured yet are assumed to be perfect, so that new links
+   and neighbours that don't report delivery ratios aren't penalised. */
+static int link_quality(struct overlay_link_quality *link)
+{
+  int reverse = link->measured ? link->reverse * 255 / LINK_QUALITY_ONE : 255;
+  int forward = link->forward ? link->forward : 255;
+  return reverse * forward / 255;
+}
+
+/* How reliably can we hear this neighbour on this interface, to report back in a
+   self-announce ack. 1-255, or 0 if we haven't measured it. */
+static int link_reverse_ratio(struct subscriber *subscriber, overlay_interface *interface, int sender_interface)
+{
+  struct overlay_neighbour *neh=overlay_route_get_neighbour_structure(subscriber->node, 0);
+  if (!neh)
+    return 0;
+  struct overlay_link_quality *link = &neh->links[interface - overlay_interfaces];
+  if (!link->measured || link->sender_interface != sender_interface)
+    return 0;
+  int ratio = link->reverse * 255 / LINK_QUALITY_ONE;
+  return ratio<1?1:ratio;
+}
+
+static int next_hop_link_quality(struct subscriber *next_hop)
+{
+  if (!(next_hop->reachable&REACHABLE_DIRECT) || !next_hop->interface)
+    return 255;
+  struct overlay_neighbour *neh=overlay_route_get_neighbour_structure(next_hop->node, 0);
+  if (!neh)
+    return 255;
+  return link_quality(&neh->links[next_hop->interface - overlay_interfaces]);
+}
+
+/* Account for a sequence numbered broadcast packet received from a neighbour.
+   Any gap since the last number we heard on this interface is counted as loss. */
+int overlay_route_saw_sequence(struct subscriber *subscriber, overlay_interface *interface,
+			       int sender_interface, int sequence, time_ms_t now)
+{
+  // only measure links to nodes that have already become neighbours
+  struct overlay_neighbour *neh=overlay_route_get_neighbour_structure(subscriber->node, 0);
+  if (!neh)
+    return 0;
+  
+  struct overlay_link_quality *link = &neh->links[interface - overlay_interfaces];
+  if (!link->measured || link->sender_interface != sender_interface){
+    link->measured=1;
+    link->sender_interface=sender_interface;
+    link->reverse=LINK_QUALITY_ONE;
+  }else{
+    int gap = (unsigned char)(sequence - link->last_sequence);
+    if (gap==0)
+      return 0;
+    // a large jump backwards means a reordered packet or a restarted neighbour, just resync
+    if (gap<128){
+      int lost = gap - 1 - link->missed;
+      if (lost>0 && config.debug.overlayrouting)
+	DEBUGF("Lost %d packets from %s on %s", lost, alloca_tohex_sid(subscriber->sid), interface->name);
+      while(lost-- > 0)
+	link_quality_update(link, 0);
+    }
+    link_quality_update(link, 1);
+  }
+  link->last_sequence=sequence;
+  link->last_sequence_time=now;
+  link->missed=0;
+  return 0;
+}
+
 int overlay_route_node_can_hear_me(struct subscriber *subscriber, int sender_interface,
-				   unsigned int s1,unsigned int s2,
+				   unsigned int s1,unsigned int s2, int forward_ratio,
 				   time_ms_t now)
 {
   /* 1. Find (or create) node entry for the node.
@@ -331,6 +455,9 @@ int overlay_route_node_can_hear_me(struct subscriber *subscriber, int sender_int
   if (!neh)
     return WHY("Unable to create neighbour structure");
   
+  if (forward_ratio>0 && sender_interface>=0 && sender_interface<OVERLAY_MAX_INTERFACES)
+    neh->links[sender_interface].forward=forward_ratio;
+  
   int obs_index=neh->most_recent_observation_id;
   int merge=0;
 
@@ -428,6 +555,8 @@ int overlay_route_recalc_node_metrics(overlay_node *n, time_ms_t now)
 	    int discounted_score=n->observations[o].observed_score;
 	    discounted_score-=(now-n->observations[o].rx_time)/1000;
 	    if (discounted_score<0) discounted_score=0;
+	    // a path is only as good as our link to the first hop along it
+	    discounted_score=discounted_score*next_hop_link_quality(n->observations[o].sender)/255;
 	    n->observations[o].corrected_score=discounted_score;
 	    if (discounted_score>best_score)  {
 	      best_score=discounted_score;
@@ -455,10 +584,14 @@ int overlay_route_recalc_node_metrics(overlay_node *n, time_ms_t now)
   /* Remember new reachability information */
   switch (reachable){
     case REACHABLE_INDIRECT:
+      if (n->subscriber->next_hop != next_hop)
+	overlay_forwarding_invalidate();
       n->subscriber->next_hop = next_hop;
       break;
     case REACHABLE_BROADCAST:
     case REACHABLE_BROADCAST|REACHABLE_UNICAST:
+      if (n->subscriber->interface != interface)
+	overlay_forwarding_invalidate();
       n->subscriber->interface = interface;
       break;
   }
@@ -468,7 +601,9 @@ int overlay_route_recalc_node_metrics(overlay_node *n, time_ms_t now)
   
   if (old_best && !best_score){
     INFOF("PEER UNREACHABLE, sid=%s", alloca_tohex_sid(n->subscriber->sid));
-    overlay_send_probe(n->subscriber, n->subscriber->address, n->subscriber->interface, OQ_MESH_MANAGEMENT);
+    // we can only probe a neighbour, there's no address for anyone else
+    if (n->neighbour_id)
+      overlay_send_probe(n->subscriber, n->subscriber->address, n->subscriber->interface, OQ_MESH_MANAGEMENT);
     
   }else if(best_score && !old_best){
     INFOF("PEER REACHABLE, sid=%s", alloca_tohex_sid(n->subscriber->sid));
@@ -611,6 +746,11 @@ int overlay_route_recalc_neighbour_metrics(struct overlay_neighbour *n, time_ms_
       else
 	score=contrib_5+contrib_200;      
 
+      /* Scale by our ETX estimate, so that lossy links (in either direction)
+         lose out to clean ones that have been heard for as long */
+      link_quality_expire(&n->links[i], interface, now);
+      score=score*link_quality(&n->links[i])/255;
+
       /* Deal with invalid sequence number ranges */
       if (score<1) score=1;
       if (score>255) score=255;
@@ -663,9 +803,13 @@ int overlay_route_saw_selfannounce_ack(struct overlay_frame *f,long long now)
   unsigned int s1=ob_get_ui32(f->payload);
   unsigned int s2=ob_get_ui32(f->payload);
   int iface=ob_get(f->payload);
+  // the delivery ratio they measured for our broadcasts, if they are new enough to send it
+  int forward_ratio=0;
+  if (ob_remaining(f->payload)>0)
+    forward_ratio=ob_get(f->payload);
 
   // Call something like the following for each link
-  overlay_route_node_can_hear_me(f->source,iface,s1,s2,now);
+  overlay_route_node_can_hear_me(f->source,iface,s1,s2,forward_ratio,now);
   
   RETURN(0);
   OUT();
@@ -811,8 +955,9 @@ int overlay_route_dump()
 		(long long)(now - overlay_neighbours[n].last_observation_time_ms));
 	for(i=0;i<OVERLAY_MAX_INTERFACES;i++)
 	  if (overlay_neighbours[n].scores[i]) 
-	    strbuf_sprintf(b," %d(via #%d)",
-		    overlay_neighbours[n].scores[i],i);
+	    strbuf_sprintf(b," %d(via #%d, quality %d)",
+		    overlay_neighbours[n].scores[i],i,
+		    link_quality(&overlay_neighbours[n].links[i]));
 	strbuf_sprintf(b,"\n");
       }
   DEBUG(strbuf_str(b));
@@ -821,6 +966,9 @@ int overlay_route_dump()
   strbuf_sprintf(b,"Overlay Mesh Route Table\n------------------------\n");
   
   enum_subscribers(NULL, node_dump, &b);
+  strbuf_sprintf(b,"Forwarded %u frames, %u next hop lookups, %u rebuilds, %u invalidations\n",
+		 forwarding_stats.forwarded, forwarding_stats.lookups,
+		 forwarding_stats.rebuilds, forwarding_stats.invalidations);
   
   DEBUG(strbuf_str(b));
   return 0;
@@ -874,6 +1022,37 @@ void overlay_route_tick(struct sched_ent *alarm)
   return;
 }
 
+struct route_state{
+  struct overlay_neighbour *neighbours;
+  int neighbour_count;
+};
+
+/* Exchange the neighbour table with the one saved in *state, or with an empty
+   table if *state is NULL.  Used by the mesh simulator to host many nodes. */
+int overlay_route_swap_state(void **state)
+{
+  struct route_state *s = *state;
+  if (!s){
+    s = calloc(1, sizeof(struct route_state));
+    if (!s)
+      return WHY_perror("calloc");
+    s->neighbours = calloc(overlay_max_neighbours, sizeof(struct overlay_neighbour));
+    if (!s->neighbours){
+      free(s);
+      return WHY_perror("calloc");
+    }
+    *state = s;
+  }
+  struct route_state old={
+    .neighbours=overlay_neighbours,
+    .neighbour_count=overlay_neighbour_count,
+  };
+  overlay_neighbours=s->neighbours;
+  overlay_neighbour_count=s->neighbour_count;
+  *s=old;
+  return 0;
+}
+
 int overlay_route_node_info(overlay_mdp_nodeinfo *node_info)
 {
   time_ms_t now = gettime_ms();
@@ -0,0 +1,582 @@
+/*
+Serval Mesh Simulator
+Copyright (C) 2013 Serval Project, Inc.
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+/*
+  Runs many virtual nodes inside one process so that routing behaviour can be
+  measured at a scale that separate servald processes over dummy interface files
+  cannot reach.
+
+  Each node owns a complete copy of the overlay state (subscriber tree, neighbour
+  table, interfaces, transmit queues, scheduled alarms and keyring).  Before a node
+  does any work, its state is swapped into the globals used by the rest of the
+  overlay code, so the real packet parsing, routing and queueing code runs
+  unmodified.  Time is a virtual clock that only advances between events, and
+  every node has a single simulated radio interface.  Packets sent on it are
+  delivered to the node's neighbours in a random geometric topology after a fixed
+  latency, subject to random loss.  Any separate components of the topology are
+  joined by linking their closest nodes, so that every node should be able to
+  reach every other.
+*/
+
+#include <math.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <arpa/inet.h>
+#include "serval.h"
+#include "conf.h"
+#include "cli.h"
+#include "overlay_address.h"
+
+#define SIM_LATENCY_MS 5
+#define SIM_TICK_MS 500
+#define SIM_PACKET_INTERVAL 100
+#define SIM_CHECK_INTERVAL_MS 1000
+
+struct sim_node{
+  /* swapped in while this node is running */
+  struct overlay_state state;
+
+  struct sched_ent route_tick;
+  /* time of the pending wakeup event, or -1 */
+  time_ms_t wake_at;
+
+  unsigned char sid[SID_SIZE];
+  double x, y;
+  int *links;
+  int link_count;
+  int component;
+
+  long long tx_packets;
+  long long tx_bytes;
+  long long rx_packets;
+  long long cpu_us;
+};
+
+struct sim_event{
+  time_ms_t when;
+  unsigned long long sequence;
+  int node;
+  /* for packet deliveries, the sending node and a copy of the packet */
+  int from;
+  unsigned char *packet;
+  int len;
+};
+
+static struct sim_node *nodes=NULL;
+static int node_count=0;
+static int current_node=-1;
+static int loss_percent=0;
+static time_ms_t sim_now=0;
+
+static struct sim_event *events=NULL;
+static int event_count=0;
+static int event_size=0;
+static unsigned long long event_sequence=0;
+
+static struct profile_total sim_tick_stats={.name="sim_interface_tick"};
+static struct profile_total sim_route_stats={.name="overlay_route_tick"};
+
+static int event_before(const struct sim_event *a, const struct sim_event *b)
+{
+  if (a->when != b->when)
+    return a->when < b->when;
+  return a->sequence < b->sequence;
+}
+
+static int push_event(struct sim_event *e)
+{
+  if (event_count>=event_size){
+    int size = event_size?event_size*2:1024;
+    struct sim_event *n = realloc(events, size * sizeof(struct sim_event));
+    if (!n)
+      return WHY_perror("realloc");
+    events=n;
+    event_size=size;
+  }
+  e->sequence=event_sequence++;
+  int i=event_count++;
+  while(i>0){
+    int parent=(i-1)/2;
+    if (!event_before(e, &events[parent]))
+      break;
+    events[i]=events[parent];
+    i=parent;
+  }
+  events[i]=*e;
+  return 0;
+}
+
+static void pop_event(struct sim_event *e)
+{
+  *e=events[0];
+  struct sim_event last=events[--event_count];
+  int i=0;
+  while(1){
+    int child=i*2+1;
+    if (child>=event_count)
+      break;
+    if (child+1<event_count && event_before(&events[child+1], &events[child]))
+      child++;
+    if (!event_before(&events[child], &last))
+      break;
+    events[i]=events[child];
+    i=child;
+  }
+  if (event_count)
+    events[i]=last;
+}
+
+static int switch_node(int n)
+{
+  if (current_node==n)
+    return 0;
+  if (current_node>=0 && overlay_swap_state(&nodes[current_node].state))
+    return -1;
+  current_node=-1;
+  if (n>=0){
+    if (overlay_swap_state(&nodes[n].state))
+      return -1;
+    current_node=n;
+  }
+  return 0;
+}
+
+static long long cpu_time_us()
+{
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage))
+    return 0;
+  return (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000LL
+    + usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+}
+
+static int node_from_address(struct in_addr addr)
+{
+  int n = (ntohl(addr.s_addr) & 0x00FFFFFF) - 1;
+  if (n<0 || n>=node_count)
+    return -1;
+  return n;
+}
+
+/* Called by overlay_broadcast_ensemble() for SOCK_SIMULATED interfaces, while the
+   sending node is swapped in */
+int overlay_simulator_transmit(overlay_interface *interface,
+			       struct sockaddr_in *recipientaddr,
+			       unsigned char *bytes, int len)
+{
+  if (current_node<0)
+    return WHY("No simulated node is running");
+  struct sim_node *node=&nodes[current_node];
+  node->tx_packets++;
+  node->tx_bytes+=len;
+
+  int broadcast = recipientaddr->sin_addr.s_addr == interface->broadcast_address.sin_addr.s_addr;
+  int dest = broadcast?-1:node_from_address(recipientaddr->sin_addr);
+  int i;
+  for (i=0;i<node->link_count;i++){
+    int n=node->links[i];
+    if (!broadcast && n!=dest)
+      continue;
+    if (loss_percent && random()%100 < loss_percent)
+      continue;
+    struct sim_event e={
+      .when=sim_now+SIM_LATENCY_MS,
+      .node=n,
+      .from=current_node,
+      .len=len,
+    };
+    e.packet=malloc(len);
+    if (!e.packet)
+      return WHY_perror("malloc");
+    bcopy(bytes, e.packet, len);
+    if (push_event(&e)){
+      free(e.packet);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/* The tick half of overlay_interface_poll(); simulated interfaces have nothing to read */
+static void sim_interface_tick(struct sched_ent *alarm)
+{
+  overlay_interface *interface = (overlay_interface *)alarm;
+  time_ms_t now = gettime_ms();
+  overlay_route_queue_advertisements(interface);
+  interface->last_tick_ms=now;
+  alarm->alarm=now+interface->tick_ms;
+  alarm->deadline=alarm->alarm+interface->tick_ms/2;
+  schedule(alarm);
+}
+
+static struct in_addr node_address(int n)
+{
+  struct in_addr addr = {.s_addr=htonl(0x0A000000 | (n+1))};
+  return addr;
+}
+
+/* Create an identity and a simulated interface for node n, which must be swapped in */
+static int init_node(int n)
+{
+  struct sim_node *node=&nodes[n];
+
+  if (!(keyring = keyring_create_in_memory()))
+    return WHYF("Could not create an identity for simulated node %d", n);
+  if (!my_subscriber)
+    return WHYF("Simulated node %d has no identity", n);
+  bcopy(my_subscriber->sid, node->sid, SID_SIZE);
+
+  overlay_interface *interface=&overlay_interfaces[0];
+  snprintf(interface->name, sizeof interface->name, "sim%d", n);
+  interface->type=OVERLAY_INTERFACE_WIFI;
+  interface->socket_type=SOCK_SIMULATED;
+  interface->encapsulation=ENCAP_OVERLAY;
+  interface->port=PORT_DNA;
+  interface->send_broadcasts=1;
+  interface->mtu=1200;
+  interface->tick_ms=SIM_TICK_MS;
+  interface->last_tick_ms=-1;
+  limit_init(&interface->transfer_limit, SIM_PACKET_INTERVAL);
+
+  interface->address.sin_family=AF_INET;
+  interface->address.sin_port=htons(PORT_DNA);
+  interface->address.sin_addr=node_address(n);
+  interface->netmask.s_addr=htonl(0xFF000000);
+  interface->broadcast_address.sin_family=AF_INET;
+  interface->broadcast_address.sin_port=htons(PORT_DNA);
+  interface->broadcast_address.sin_addr.s_addr=interface->address.sin_addr.s_addr | ~interface->netmask.s_addr;
+  interface->state=INTERFACE_STATE_UP;
+  overlay_interface_count=1;
+
+  // start each node at a random point in its tick cycle, as real nodes would
+  interface->alarm.function=sim_interface_tick;
+  interface->alarm.stats=&sim_tick_stats;
+  interface->alarm.alarm=sim_now + random()%SIM_TICK_MS;
+  interface->alarm.deadline=interface->alarm.alarm+SIM_TICK_MS/2;
+  schedule(&interface->alarm);
+
+  node->route_tick.function=overlay_route_tick;
+  node->route_tick.stats=&sim_route_stats;
+  node->route_tick.alarm=sim_now + 100 + random()%5000;
+  node->route_tick.deadline=node->route_tick.alarm+100;
+  schedule(&node->route_tick);
+  return 0;
+}
+
+/* Run whatever is due on node n and arrange to be woken for its next alarm */
+static int run_node(int n, struct sim_event *e)
+{
+  struct sim_node *node=&nodes[n];
+  if (switch_node(n))
+    return -1;
+  long long start=cpu_time_us();
+
+  if (e && e->packet){
+    struct sockaddr_in addr={
+      .sin_family=AF_INET,
+      .sin_port=htons(PORT_DNA),
+      .sin_addr=node_address(e->from),
+    };
+    node->rx_packets++;
+    if (packetOkOverlay(&overlay_interfaces[0], e->packet, e->len, -1, (struct sockaddr *)&addr, sizeof addr)<0
+      && config.debug.rejecteddata)
+      WARNF("Simulated node %d rejected a packet from node %d", n, e->from);
+  }
+
+  time_ms_t next = fd_run_alarms();
+  node->cpu_us+=cpu_time_us()-start;
+
+  if (next==-1)
+    return 0;
+  // anything rescheduled for the current millisecond runs on the next one
+  if (next<=sim_now)
+    next=sim_now+1;
+  if (node->wake_at==-1 || next<node->wake_at){
+    node->wake_at=next;
+    struct sim_event wake={.when=next, .node=n, .from=-1};
+    if (push_event(&wake))
+      return -1;
+  }
+  return 0;
+}
+
+static int add_link(struct sim_node *node, int n)
+{
+  int *links = realloc(node->links, (node->link_count+1) * sizeof(int));
+  if (!links)
+    return WHY_perror("realloc");
+  links[node->link_count++]=n;
+  node->links=links;
+  return 0;
+}
+
+static double distance2(int i, int j)
+{
+  double dx=nodes[i].x-nodes[j].x, dy=nodes[i].y-nodes[j].y;
+  return dx*dx+dy*dy;
+}
+
+/* Label the component containing node i, using queue for the search.
+   Returns the number of nodes in it */
+static int label_component(int i, int component, int *queue)
+{
+  int head=0, tail=0, j;
+  queue[tail++]=i;
+  nodes[i].component=component;
+  while(head<tail){
+    struct sim_node *node=&nodes[queue[head++]];
+    for (j=0;j<node->link_count;j++){
+      if (nodes[node->links[j]].component!=component){
+	nodes[node->links[j]].component=component;
+	queue[tail++]=node->links[j];
+      }
+    }
+  }
+  return tail;
+}
+
+/* Place nodes at random in a unit square, linking every pair closer than the
+   radius that gives the requested mean number of neighbours.  Then, while the
+   topology is in pieces, link the closest pair of nodes that joins the piece
+   containing node 0 to another.  Returns the number of links added that way */
+static int build_topology(int neighbours)
+{
+  double radius = sqrt(neighbours / (M_PI * node_count));
+  int i, j;
+  for (i=0;i<node_count;i++){
+    nodes[i].x = (random()%1000000) / 1000000.0;
+    nodes[i].y = (random()%1000000) / 1000000.0;
+    nodes[i].wake_at=-1;
+  }
+  for (i=0;i<node_count;i++){
+    for (j=0;j<node_count;j++){
+      if (i!=j && distance2(i, j) <= radius*radius && add_link(&nodes[i], j))
+	return -1;
+    }
+  }
+
+  int *queue = malloc(node_count * sizeof(int));
+  if (!queue)
+    return WHY_perror("malloc");
+  int joins=0;
+  for (i=0;i<node_count;i++)
+    nodes[i].component=-1;
+  while(label_component(0, joins, queue) < node_count){
+    int best_i=-1, best_j=-1;
+    for (i=0;i<node_count;i++){
+      if (nodes[i].component!=joins)
+	continue;
+      for (j=0;j<node_count;j++){
+	if (nodes[j].component!=joins
+	  && (best_i==-1 || distance2(i, j) < distance2(best_i, best_j))){
+	  best_i=i;
+	  best_j=j;
+	}
+      }
+    }
+    if (add_link(&nodes[best_i], best_j) || add_link(&nodes[best_j], best_i)){
+      free(queue);
+      return -1;
+    }
+    joins++;
+  }
+  free(queue);
+  return joins;
+}
+
+static int node_from_sid(const unsigned char *sid)
+{
+  int i;
+  for (i=0;i<node_count;i++)
+    if (memcmp(nodes[i].sid, sid, SID_SIZE)==0)
+      return i;
+  return -1;
+}
+
+/* Follow the routing tables from node i towards node dest, one hop at a time,
+   as a frame would be forwarded.  Returns 1 if it arrives over real links */
+static int route_arrives(int i, int dest)
+{
+  int hops;
+  for (hops=0;hops<node_count && i!=dest;hops++){
+    if (switch_node(i))
+      return -1;
+    struct subscriber *subscriber=find_subscriber(nodes[dest].sid, SID_SIZE, 0);
+    if (!subscriber)
+      return 0;
+    int next;
+    if (subscriber->reachable & REACHABLE_DIRECT)
+      next=dest;
+    else if ((subscriber->reachable & REACHABLE_INDIRECT) && subscriber->next_hop)
+      next=node_from_sid(subscriber->next_hop->sid);
+    else
+      return 0;
+    int j;
+    for (j=0;j<nodes[i].link_count && nodes[i].links[j]!=next;j++)
+      ;
+    if (next<0 || j>=nodes[i].link_count)
+      return 0;
+    i=next;
+  }
+  return i==dest;
+}
+
+/* Count the nodes with a working route to every other node */
+static int count_converged()
+{
+  int i, j, converged=0;
+  for (i=0;i<node_count;i++){
+    for (j=0;j<node_count;j++){
+      if (i==j)
+	continue;
+      int r=route_arrives(i, j);
+      if (r<0)
+	return -1;
+      if (!r)
+	break;
+    }
+    if (j>=node_count)
+      converged++;
+  }
+  return converged;
+}
+
+int app_mesh_simulate(const struct cli_parsed *parsed, void *context)
+{
+  if (config.debug.verbose)
+    DEBUG_cli_parsed(parsed);
+  const char *arg_nodes, *arg_neighbours, *arg_loss, *arg_seconds;
+  if (cli_arg(parsed, "nodes", &arg_nodes, cli_uint, NULL) == -1
+    || cli_arg(parsed, "neighbours", &arg_neighbours, cli_uint, "6") == -1
+    || cli_arg(parsed, "loss", &arg_loss, cli_uint, "0") == -1
+    || cli_arg(parsed, "seconds", &arg_seconds, cli_uint, "60") == -1)
+    return -1;
+  node_count=atoi(arg_nodes);
+  loss_percent=atoi(arg_loss);
+  time_ms_t duration=atoi(arg_seconds)*1000LL;
+  if (node_count<2)
+    return WHY("Need at least 2 nodes to simulate");
+  if (loss_percent>100)
+    return WHY("Loss must be a percentage");
+
+  nodes=calloc(node_count, sizeof(struct sim_node));
+  if (!nodes)
+    return WHY_perror("calloc");
+
+  // keep topologies reproducible between runs
+  srandom(node_count);
+  bzero(&forwarding_stats, sizeof forwarding_stats);
+  bzero(&nm_cache_stats, sizeof nm_cache_stats);
+  int joins = build_topology(atoi(arg_neighbours));
+  if (joins<0)
+    return -1;
+
+  sim_now=gettime_ms();
+  virtual_time_ms=&sim_now;
+  time_ms_t start=sim_now;
+  time_ms_t end=start+duration;
+  time_ms_t next_check=start+SIM_CHECK_INTERVAL_MS;
+  time_ms_t converged_ms=-1;
+  int converged=0;
+  int ret=0;
+
+  int i;
+  for (i=0;i<node_count;i++){
+    if (switch_node(i) || init_node(i) || run_node(i, NULL)){
+      ret=-1;
+      goto cleanup;
+    }
+  }
+
+  while(event_count>0 && events[0].when<=end){
+    struct sim_event e;
+    pop_event(&e);
+
+    while (next_check<=e.when){
+      sim_now=next_check;
+      converged=count_converged();
+      if (converged<0){
+	free(e.packet);
+	ret=-1;
+	goto cleanup;
+      }
+      if (converged==node_count && converged_ms==-1)
+	converged_ms=sim_now-start;
+      next_check+=SIM_CHECK_INTERVAL_MS;
+    }
+
+    sim_now=e.when;
+    if (!e.packet){
+      // stale wakeup, the node has already been woken for an earlier alarm
+      if (nodes[e.node].wake_at!=e.when)
+	continue;
+      nodes[e.node].wake_at=-1;
+    }
+    int r=run_node(e.node, &e);
+    free(e.packet);
+    if (r){
+      ret=-1;
+      goto cleanup;
+    }
+  }
+  sim_now=end;
+  converged=count_converged();
+
+  long long tx_packets=0, tx_bytes=0, cpu_us=0, cpu_max=0;
+  int links=0;
+  for (i=0;i<node_count;i++){
+    tx_packets+=nodes[i].tx_packets;
+    tx_bytes+=nodes[i].tx_bytes;
+    cpu_us+=nodes[i].cpu_us;
+    if (nodes[i].cpu_us>cpu_max)
+      cpu_max=nodes[i].cpu_us;
+    links+=nodes[i].link_count;
+  }
+  double seconds = duration/1000.0;
+
+  cli_puts("nodes"); cli_delim(":"); cli_printf("%d", node_count); cli_delim("\n");
+  cli_puts("links"); cli_delim(":"); cli_printf("%d", links/2); cli_delim("\n");
+  cli_puts("joining_links"); cli_delim(":"); cli_printf("%d", joins); cli_delim("\n");
+  cli_puts("duration_ms"); cli_delim(":"); cli_printf("%lld", (long long)duration); cli_delim("\n");
+  cli_puts("converged_nodes"); cli_delim(":"); cli_printf("%d", converged); cli_delim("\n");
+  cli_puts("convergence_ms"); cli_delim(":"); cli_printf("%lld", (long long)converged_ms); cli_delim("\n");
+  cli_puts("tx_packets"); cli_delim(":"); cli_printf("%lld", tx_packets); cli_delim("\n");
+  cli_puts("tx_bytes"); cli_delim(":"); cli_printf("%lld", tx_bytes); cli_delim("\n");
+  cli_puts("bytes_per_node_per_second"); cli_delim(":"); cli_printf("%.1f", tx_bytes/seconds/node_count); cli_delim("\n");
+  cli_puts("cpu_ms"); cli_delim(":"); cli_printf("%.1f", cpu_us/1000.0); cli_delim("\n");
+  cli_puts("cpu_us_per_node_per_second"); cli_delim(":"); cli_printf("%.1f", cpu_us/seconds/node_count); cli_delim("\n");
+  cli_puts("cpu_ms_max_node"); cli_delim(":"); cli_printf("%.1f", cpu_max/1000.0); cli_delim("\n");
+  cli_puts("forwarded_frames"); cli_delim(":"); cli_printf("%u", forwarding_stats.forwarded); cli_delim("\n");
+  cli_puts("next_hop_lookups"); cli_delim(":"); cli_printf("%u", forwarding_stats.lookups); cli_delim("\n");
+  cli_puts("next_hop_rebuilds"); cli_delim(":"); cli_printf("%u", forwarding_stats.rebuilds); cli_delim("\n");
+  cli_puts("next_hop_invalidations"); cli_delim(":"); cli_printf("%u", forwarding_stats.invalidations); cli_delim("\n");
+  cli_puts("nm_cache_hits"); cli_delim(":"); cli_printf("%u", nm_cache_stats.hits); cli_delim("\n");
+  cli_puts("nm_cache_misses"); cli_delim(":"); cli_printf("%u", nm_cache_stats.misses); cli_delim("\n");
+
+cleanup:
+  // put the process's own state back; the simulated nodes' state is released at exit
+  switch_node(-1);
+  virtual_time_ms=NULL;
+  for (i=0;i<event_count;i++)
+    free(events[i].packet);
+  free(events);
+  events=NULL;
+  event_count=event_size=0;
+  return ret;
+}
@@ -163,6 +163,9 @@ int fd_showstats()
 	  rhizome_active_fetch_bytes_received(3),
 	  rhizome_active_fetch_bytes_received(4));
 
+  // Show any lock contention on the rhizome database
+  rhizome_database_showstats();
+
   // Report any functions that take too much time
   if (!config.debug.timing)
     {
@@ -279,11 +279,11 @@ int rhizome_manifest_check_duplicate(rhizome_manifest *m_in, rhizome_manifest **
   return 0;
 }
 
-int rhizome_add_manifest(rhizome_manifest *m_in,int ttl)
+/* Everything rhizome_add_manifest() checks before it stores the bundle.  Returns 0 if the bundle
+ * should be stored, -1 otherwise.
+ */
+int rhizome_add_manifest_check(rhizome_manifest *m_in, int ttl)
 {
-  if (config.debug.rhizome)
-    DEBUGF("rhizome_add_manifest(m_in=%p, ttl=%d)",m_in, ttl);
-
   if (m_in->finalised==0)
     return WHY("Manifest must be finalised before being stored");
 
@@ -307,7 +307,8 @@ int rhizome_add_manifest(rhizome_manifest *m_in,int ttl)
   str_toupper_inplace(id);
   /* Discard the new manifest unless it is newer than the most recent known version with the same ID */
   long long storedversion = -1;
-  switch (sqlite_exec_int64(&storedversion, "SELECT version from manifests where id='%s';", id)) {
+  sqlite_retry_state retry = SQLITE_RETRY_STATE_DEFAULT;
+  switch (sqlite_exec_int64_bind(&retry, &storedversion, "SELECT version FROM manifests WHERE id = ?;", SQL_TEXT, id, SQL_END)) {
     case -1:
       return WHY("Select failed");
     case 0:
@@ -323,6 +324,16 @@ int rhizome_add_manifest(rhizome_manifest *m_in,int ttl)
     default:
       return WHY("Select found too many rows!");
   }
+  return 0;
+}
+
+int rhizome_add_manifest(rhizome_manifest *m_in,int ttl)
+{
+  if (config.debug.rhizome)
+    DEBUGF("rhizome_add_manifest(m_in=%p, ttl=%d)",m_in, ttl);
+
+  if (rhizome_add_manifest_check(m_in, ttl) == -1)
+    return -1;
 
   /* Okay, it is written, and can be put directly into the rhizome database now */
   return rhizome_store_bundle(m_in);
@@ -77,6 +77,11 @@ extern time_ms_t rhizome_voice_timeout;
 
 #define RHIZOME_IDLE_TIMEOUT 10000
 
+// values of PRAGMA synchronous
+#define RHIZOME_DB_SYNC_OFF 0
+#define RHIZOME_DB_SYNC_NORMAL 1
+#define RHIZOME_DB_SYNC_FULL 2
+
 #define EXISTING_BUNDLE_ID 1
 #define NEW_BUNDLE_ID 2
 
@@ -202,6 +207,13 @@ extern sqlite3 *rhizome_db;
 int rhizome_opendb();
 int rhizome_close_db();
 
+int rhizome_bar_index_load();
+void rhizome_bar_index_free();
+int rhizome_bar_index_loaded();
+void rhizome_bar_index_store(const unsigned char *bid, int64_t version);
+void rhizome_bar_index_remove(const unsigned char *bid);
+int rhizome_bar_index_lookup(const unsigned char *prefix, int prefix_len, int64_t *version);
+
 struct rhizome_cleanup_report {
     int deleted_stale_incoming_files;
     int deleted_orphan_files;
@@ -235,6 +247,16 @@ typedef struct sqlite_retry_state {
 
 sqlite_retry_state sqlite_retry_state_init(int serverLimit, int serverSleep, int otherLimit, int otherSleep);
 
+/* Lock contention between processes sharing the database */
+struct sqlite_busy_stats{
+  unsigned int busy; // times a query returned BUSY or LOCKED
+  unsigned int recovered; // queries that succeeded after retrying
+  unsigned int gave_up; // queries that ran out of retry time
+  unsigned int sleep_ms; // time spent sleeping between retries
+};
+extern struct sqlite_busy_stats sqlite_busy_stats;
+void rhizome_database_showstats();
+
 #define SQLITE_RETRY_STATE_DEFAULT sqlite_retry_state_init(-1,-1,-1,-1)
 
 int rhizome_write_manifest_file(rhizome_manifest *m, const char *filename, char append);
@@ -255,6 +277,34 @@ rhizome_manifest *_rhizome_new_manifest(struct __sourceloc __whence);
 #define rhizome_new_manifest() _rhizome_new_manifest(__WHENCE__)
 int rhizome_manifest_pack_variables(rhizome_manifest *m);
 int rhizome_store_bundle(rhizome_manifest *m);
+
+/* The MANIFESTS columns of a bundle, copied out of the manifest so that the row can be stored
+ * without touching the manifest.
+ */
+struct rhizome_manifest_row {
+  char manifestid[RHIZOME_MANIFEST_ID_STRLEN + 1];
+  unsigned char bid[RHIZOME_MANIFEST_ID_BYTES];
+  unsigned char bar[RHIZOME_BAR_BYTES];
+  char filehash[RHIZOME_FILEHASH_STRLEN + 1];
+  char author_hex[SID_STRLEN + 1];
+  const char *author;
+  const char *service;
+  const char *name;
+  const char *sender;
+  const char *recipient;
+  const unsigned char *manifestdata;
+  int manifest_bytes;
+  int64_t version;
+  int64_t filesize;
+};
+int rhizome_manifest_row(rhizome_manifest *m, struct rhizome_manifest_row *row);
+int rhizome_store_manifest_row_db(sqlite3 *db, const struct rhizome_manifest_row *row, time_ms_t inserttime, char *error, size_t error_len);
+void rhizome_manifest_row_stored(const struct rhizome_manifest_row *row, const char *filename);
+
+int rhizome_bundle_import_async(rhizome_manifest *m, int ttl);
+int rhizome_import_pending(const unsigned char *prefix, int prefix_len, int64_t *version);
+int rhizome_import_worker_thread();
+void rhizome_import_close();
 int rhizome_manifest_add_group(rhizome_manifest *m,char *groupid);
 int rhizome_clean_payload(const char *fileidhex);
 int rhizome_store_file(rhizome_manifest *m,const unsigned char *key);
@@ -263,11 +313,15 @@ int rhizome_bundle_import(rhizome_manifest *m, int ttl);
 int rhizome_fill_manifest(rhizome_manifest *m, const char *filepath, const sid_t *authorSid, rhizome_bk_t *bsk);
 
 int rhizome_manifest_verify(rhizome_manifest *m);
+int rhizome_manifest_verify_batch(rhizome_manifest **manifests, int count);
+typedef void (*rhizome_verified_callback)(rhizome_manifest *m, int result, void *context);
+int rhizome_manifest_verify_async(rhizome_manifest *m, rhizome_verified_callback callback, void *context);
 int rhizome_manifest_check_sanity(rhizome_manifest *m_in);
 int rhizome_manifest_check_duplicate(rhizome_manifest *m_in,rhizome_manifest **m_out, int check_author);
 
 int rhizome_manifest_bind_id(rhizome_manifest *m_in);
 int rhizome_manifest_finalise(rhizome_manifest *m, rhizome_manifest **mout);
+int rhizome_add_manifest_check(rhizome_manifest *m_in, int ttl);
 int rhizome_add_manifest(rhizome_manifest *m_in,int ttl);
 
 void rhizome_bytes_to_hex_upper(unsigned const char *in, char *out, int byteCount);
@@ -303,6 +357,32 @@ int _sqlite_exec_strbuf(struct __sourceloc, strbuf sb, const char *sqlformat, ..
 int _sqlite_exec_strbuf_retry(struct __sourceloc, sqlite_retry_state *retry, strbuf sb, const char *sqlformat, ...);
 int _sqlite_vexec_strbuf_retry(struct __sourceloc, sqlite_retry_state *retry, strbuf sb, const char *sqlformat, va_list ap);
 
+/* Parameter types for the *_bind() functions, each followed by its value(s):
+ *    SQL_INT     int
+ *    SQL_INT64   int64_t
+ *    SQL_TEXT    const char * (NULL binds an SQL NULL)
+ *    SQL_BLOB    const void *, int length
+ * The list of parameters must be terminated by SQL_END.
+ *
+ * The *_bind() functions take SQL text with ? placeholders, not a printf format, and keep the
+ * prepared statement in a cache keyed by that text, so it is only parsed once.  Statements from
+ * sqlite_prepare_bind() must be given back with sqlite_release(), never sqlite3_finalize().
+ */
+enum sqlbind_type {
+  SQL_END = 0x51b1d000, // an unlikely value, to catch a missing SQL_END
+  SQL_INT,
+  SQL_INT64,
+  SQL_TEXT,
+  SQL_BLOB
+};
+
+sqlite3_stmt *_sqlite_prepare_bind(struct __sourceloc, int log_level, sqlite_retry_state *retry, const char *sql, ...);
+int _sqlite_exec_void_bind(struct __sourceloc, int log_level, sqlite_retry_state *retry, const char *sql, ...);
+int _sqlite_exec_int64_bind(struct __sourceloc, sqlite_retry_state *retry, long long *result, const char *sql, ...);
+int _sqlite_exec_strbuf_bind(struct __sourceloc, sqlite_retry_state *retry, strbuf sb, const char *sql, ...);
+void sqlite_release(sqlite3_stmt *statement);
+void sqlite_statement_cache_flush();
+
 #define sqlite_prepare(rs,fmt,...)              _sqlite_prepare(__WHENCE__, (rs), (fmt), ##__VA_ARGS__)
 #define sqlite_prepare_loglevel(ll,rs,sb)       _sqlite_prepare_loglevel(__WHENCE__, (ll), (rs), (sb))
 #define sqlite_retry(rs,action)                 _sqlite_retry(__WHENCE__, (rs), (action))
@@ -317,9 +397,22 @@ int _sqlite_vexec_strbuf_retry(struct __sourceloc, sqlite_retry_state *retry, st
 #define sqlite_exec_int64_retry(rs,res,fmt,...) _sqlite_exec_int64_retry(__WHENCE__, (rs), (res), (fmt), ##__VA_ARGS__)
 #define sqlite_exec_strbuf(sb,fmt,...)          _sqlite_exec_strbuf(__WHENCE__, (sb), (fmt), ##__VA_ARGS__)
 #define sqlite_exec_strbuf_retry(rs,sb,fmt,...) _sqlite_exec_strbuf_retry(__WHENCE__, (rs), (sb), (fmt), ##__VA_ARGS__)
+#define sqlite_prepare_bind(rs,sql,...)         _sqlite_prepare_bind(__WHENCE__, LOG_LEVEL_ERROR, (rs), (sql), ##__VA_ARGS__)
+#define sqlite_exec_void_bind(rs,sql,...)       _sqlite_exec_void_bind(__WHENCE__, LOG_LEVEL_ERROR, (rs), (sql), ##__VA_ARGS__)
+#define sqlite_exec_void_bind_loglevel(ll,rs,sql,...) _sqlite_exec_void_bind(__WHENCE__, (ll), (rs), (sql), ##__VA_ARGS__)
+#define sqlite_exec_int64_bind(rs,res,sql,...)  _sqlite_exec_int64_bind(__WHENCE__, (rs), (res), (sql), ##__VA_ARGS__)
+#define sqlite_exec_strbuf_bind(rs,sb,sql,...)  _sqlite_exec_strbuf_bind(__WHENCE__, (rs), (sb), (sql), ##__VA_ARGS__)
 
 double rhizome_manifest_get_double(rhizome_manifest *m,char *var,double default_value);
 int rhizome_manifest_extract_signature(rhizome_manifest *m,int *ofs);
+int rhizome_manifest_check_signatures(rhizome_manifest **manifests, const int *offsets, int count);
+int rhizome_manifest_check_signatures_async(rhizome_manifest *m, int offset, rhizome_verified_callback callback, void *context);
+struct sig_cache_stats{
+  unsigned int hits;
+  unsigned int misses;
+  unsigned int evictions;
+};
+extern struct sig_cache_stats sig_cache_stats;
 int rhizome_update_file_priority(const char *fileid);
 int rhizome_find_duplicate(const rhizome_manifest *m, rhizome_manifest **found, int check_author);
 int rhizome_manifest_to_bar(rhizome_manifest *m,unsigned char *bar);
@@ -330,6 +423,7 @@ int rhizome_list_manifests(const char *service, const char *name,
 			   const char *sender_sid, const char *recipient_sid, 
 			   int limit, int offset, char count_rows);
 int rhizome_retrieve_manifest(const char *manifestid, rhizome_manifest *m);
+int rhizome_retrieve_manifest_by_prefix(const unsigned char *prefix, int prefix_len, rhizome_manifest *m);
 int rhizome_advertise_manifest(rhizome_manifest *m);
 int rhizome_delete_bundle(const char *manifestid);
 int rhizome_delete_manifest(const char *manifestid);
@@ -343,6 +437,8 @@ int rhizome_fetching_get_fds(struct pollfd *fds,int *fdcount,int fdmax);
 int rhizome_manifest_version_cache_lookup(rhizome_manifest *m);
 int rhizome_manifest_version_cache_store(rhizome_manifest *m);
 int monitor_announce_bundle(rhizome_manifest *m);
+int monitor_announce_bundle_fields(const unsigned char *bid, const char *service, int64_t version,
+  int64_t filesize, const char *sender, const char *recipient, const char *filename);
 int rhizome_find_secret(const unsigned char *authorSid, int *rs_len, const unsigned char **rs);
 int rhizome_bk_xor_stream(
   const unsigned char bid[crypto_sign_edwards25519sha512batch_PUBLICKEYBYTES],
@@ -421,6 +517,17 @@ struct rhizome_read{
   
   int64_t blob_rowid;
   int blob_fd;
+  // kept open between reads, closed by rhizome_read_release(), rhizome_read_close(), or once the
+  // last byte has been read
+  sqlite3_blob *blob;
+  
+  // external blob files are mapped, so reads come straight from the page cache
+  const unsigned char *mapped;
+  
+  // small reads are served from here, so sequential reads touch the store once per buffer
+  unsigned char *read_ahead;
+  int64_t read_ahead_offset;
+  int read_ahead_length;
   
   int64_t offset;
   int64_t length;
@@ -457,6 +564,8 @@ typedef struct rhizome_http_request {
 #define RHIZOME_HTTP_REQUEST_STORE 32
 #define RHIZOME_HTTP_REQUEST_BLOB 64
 #define RHIZOME_HTTP_REQUEST_FAVICON 128
+  // unencrypted external blob files go straight from the file to the socket
+#define RHIZOME_HTTP_REQUEST_SENDFILE 256
   
   /* Local buffer of data to be sent.
    If a RHIZOME_HTTP_REQUEST_FROMBUFFER, then the buffer is sent, and when empty
@@ -687,9 +796,17 @@ int rhizome_add_file(rhizome_manifest *m, const char *filepath,
 int rhizome_derive_key(rhizome_manifest *m, rhizome_bk_t *bsk);
 int rhizome_crypt_xor_block(unsigned char *buffer, int buffer_size, int64_t stream_offset, 
 			    const unsigned char *key, const unsigned char *nonce);
+int rhizome_crypt_xor_copy(unsigned char *buffer, const unsigned char *src, int buffer_size, int64_t stream_offset, 
+			    const unsigned char *key, const unsigned char *nonce);
 int rhizome_open_read(struct rhizome_read *read, const char *fileid, int hash);
 int rhizome_read(struct rhizome_read *read, unsigned char *buffer, int buffer_length);
 int rhizome_read_close(struct rhizome_read *read);
+void rhizome_read_release(struct rhizome_read *read);
+const unsigned char *rhizome_read_mapped(struct rhizome_read *read, int *length);
+int rhizome_read_can_sendfile(const struct rhizome_read *read);
+int rhizome_read_sendfile(struct rhizome_read *read, int out_fd, int64_t length);
+struct rhizome_read *rhizome_read_cached(const unsigned char *bid, uint64_t version);
+void rhizome_read_cache_flush();
 int rhizome_store_delete(const char *id);
 int rhizome_open_decrypt_read(rhizome_manifest *m, rhizome_bk_t *bsk, struct rhizome_read *read_state, int hash);
 int rhizome_extract_file(rhizome_manifest *m, const char *filepath, rhizome_bk_t *bsk);
@@ -0,0 +1,236 @@
+/*
+Serval Distributed Numbering Architecture (DNA)
+Copyright (C) 2012 Serval Project Inc.
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#include "serval.h"
+#include "conf.h"
+#include "rhizome.h"
+
+/* Every stored bundle id with its stored version, so that the BARs in every
+   advertisement we hear can be checked without a database query.
+
+   The daemon loads the index when it opens the database, and
+   rhizome_store_bundle() and the delete functions keep it up to date.  Other
+   processes, eg the command line, may change the database behind the
+   daemon's back, so callers treat a miss as a hint to ask the database.
+   A hit is only wrong if another process deleted the bundle, so a trigger
+   counts deleted manifests and the index reloads itself when that count
+   moves without us. It checks at most once every BAR_INDEX_CHECK_INTERVAL_MS,
+   so a bundle deleted elsewhere can look stored for that long.
+
+   Bundle ids are public keys, so their leading bytes are already uniformly
+   distributed and serve as the hash.
+ */
+
+struct bar_index_entry{
+  struct bar_index_entry *next;
+  int64_t version;
+  unsigned char bid[RHIZOME_MANIFEST_ID_BYTES];
+};
+
+#define BAR_INDEX_INITIAL_BINS 1024
+// bytes of the bundle id used for the hash, shorter prefixes can't be looked up
+#define BAR_INDEX_HASH_BYTES 4
+
+static struct bar_index_entry **bins=NULL;
+static unsigned int bin_count=0;
+static unsigned int entry_count=0;
+// deleted manifest count that the index agrees with, -1 if unknown
+static long long deletions=-1;
+static time_ms_t last_check=0;
+
+#define BAR_INDEX_CHECK_INTERVAL_MS 1000
+
+static long long bar_index_count_deletions()
+{
+  long long count=-1;
+  sqlite_retry_state retry = SQLITE_RETRY_STATE_DEFAULT;
+  if (sqlite_exec_int64_retry(&retry, &count, "SELECT count FROM MANIFEST_DELETIONS;") != 1)
+    return -1;
+  return count;
+}
+
+static unsigned int bar_index_hash(const unsigned char *bid)
+{
+  return (((unsigned int)bid[0]<<24)|((unsigned int)bid[1]<<16)|((unsigned int)bid[2]<<8)|bid[3]) & (bin_count-1);
+}
+
+static int bar_index_grow()
+{
+  unsigned int old_count=bin_count;
+  struct bar_index_entry **old_bins=bins;
+  unsigned int new_count=old_count ? old_count*2 : BAR_INDEX_INITIAL_BINS;
+  struct bar_index_entry **new_bins=calloc(new_count, sizeof(struct bar_index_entry *));
+  if (!new_bins)
+    return WHY_perror("calloc");
+  bins=new_bins;
+  bin_count=new_count;
+  unsigned int i;
+  for (i=0;i<old_count;i++){
+    struct bar_index_entry *e=old_bins[i];
+    while(e){
+      struct bar_index_entry *next=e->next;
+      unsigned int h=bar_index_hash(e->bid);
+      e->next=bins[h];
+      bins[h]=e;
+      e=next;
+    }
+  }
+  free(old_bins);
+  return 0;
+}
+
+int rhizome_bar_index_loaded()
+{
+  return bins!=NULL;
+}
+
+/* Remember the stored version of a bundle */
+void rhizome_bar_index_store(const unsigned char *bid, int64_t version)
+{
+  if (!bins)
+    return;
+  struct bar_index_entry *e;
+  for (e=bins[bar_index_hash(bid)];e;e=e->next){
+    if (memcmp(e->bid, bid, RHIZOME_MANIFEST_ID_BYTES)==0){
+      e->version=version;
+      return;
+    }
+  }
+  // keep chains short, if we can't it just gets slower
+  if (entry_count >= bin_count*2)
+    bar_index_grow();
+  e=malloc(sizeof(struct bar_index_entry));
+  if (!e){
+    WHY_perror("malloc");
+    return;
+  }
+  bcopy(bid, e->bid, RHIZOME_MANIFEST_ID_BYTES);
+  e->version=version;
+  unsigned int h=bar_index_hash(bid);
+  e->next=bins[h];
+  bins[h]=e;
+  entry_count++;
+}
+
+void rhizome_bar_index_remove(const unsigned char *bid)
+{
+  if (!bins)
+    return;
+  struct bar_index_entry **p;
+  for (p=&bins[bar_index_hash(bid)];*p;p=&(*p)->next){
+    if (memcmp((*p)->bid, bid, RHIZOME_MANIFEST_ID_BYTES)==0){
+      struct bar_index_entry *e=*p;
+      *p=e->next;
+      free(e);
+      entry_count--;
+      break;
+    }
+  }
+  // our own deletion, the trigger will have counted it too
+  if (deletions!=-1)
+    deletions++;
+}
+
+/* Reload the index if another process has deleted any manifests since we
+   last looked */
+static void bar_index_check_deletions()
+{
+  time_ms_t now=gettime_ms();
+  if (now - last_check < BAR_INDEX_CHECK_INTERVAL_MS)
+    return;
+  last_check=now;
+  long long count=bar_index_count_deletions();
+  if (count==-1 || count==deletions)
+    return;
+  if (config.debug.rhizome)
+    DEBUGF("Manifests have been deleted by another process, reloading the BAR index");
+  rhizome_bar_index_free();
+  rhizome_bar_index_load();
+}
+
+/* Find the highest stored version of any bundle whose id starts with prefix.
+ *
+ * Returns 1 and sets *version if there is one
+ * Returns 0 if there is none
+ * Returns -1 if the index is not loaded
+ */
+int rhizome_bar_index_lookup(const unsigned char *prefix, int prefix_len, int64_t *version)
+{
+  if (!bins || prefix_len<BAR_INDEX_HASH_BYTES)
+    return -1;
+  bar_index_check_deletions();
+  if (!bins)
+    return -1;
+  int found=0;
+  struct bar_index_entry *e;
+  for (e=bins[bar_index_hash(prefix)];e;e=e->next){
+    if (memcmp(e->bid, prefix, prefix_len)==0 && (!found || e->version > *version)){
+      *version=e->version;
+      found=1;
+    }
+  }
+  return found;
+}
+
+int rhizome_bar_index_load()
+{
+  if (bins)
+    return 0;
+  if (!rhizome_db)
+    return WHY("Rhizome database is not open");
+  if (bar_index_grow()==-1)
+    return -1;
+  // count first, so deletions while we read are noticed at the next check
+  deletions=bar_index_count_deletions();
+  last_check=gettime_ms();
+
+  sqlite_retry_state retry = SQLITE_RETRY_STATE_DEFAULT;
+  sqlite3_stmt *statement = sqlite_prepare(&retry, "SELECT bid, version FROM MANIFESTS;");
+  if (!statement){
+    rhizome_bar_index_free();
+    return -1;
+  }
+  while(sqlite_step_retry(&retry, statement) == SQLITE_ROW){
+    const unsigned char *bid = sqlite3_column_blob(statement, 0);
+    if (bid && sqlite3_column_bytes(statement, 0) == RHIZOME_MANIFEST_ID_BYTES)
+      rhizome_bar_index_store(bid, sqlite3_column_int64(statement, 1));
+  }
+  sqlite3_finalize(statement);
+  if (config.debug.rhizome)
+    DEBUGF("Loaded %u bundle ids into the BAR index (%u bins)", entry_count, bin_count);
+  return 0;
+}
+
+void rhizome_bar_index_free()
+{
+  unsigned int i;
+  for (i=0;i<bin_count;i++){
+    struct bar_index_entry *e=bins[i];
+    while(e){
+      struct bar_index_entry *next=e->next;
+      free(e);
+      e=next;
+    }
+  }
+  free(bins);
+  bins=NULL;
+  bin_count=0;
+  entry_count=0;
+  deletions=-1;
+}
@@ -22,8 +22,10 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include "conf.h"
 #include "rhizome.h"
 #include "str.h"
+#include "sha512_multi.h"
 
-int rhizome_manifest_verify(rhizome_manifest *m)
+/* Return the offset of the first signature block */
+static int rhizome_manifest_body_length(rhizome_manifest *m)
 {
   int end_of_text=0;
 
@@ -31,11 +33,22 @@ int rhizome_manifest_verify(rhizome_manifest *m)
   while(m->manifestdata[end_of_text]&&end_of_text<m->manifest_all_bytes)
     end_of_text++;
   end_of_text++; /* include null byte in body for verification purposes */
+  return end_of_text;
+}
+
+/* Hash the manifest body, returning the offset of the first signature block */
+static int rhizome_manifest_hash_body(rhizome_manifest *m)
+{
+  int end_of_text=rhizome_manifest_body_length(m);
 
   /* Calculate hash of the text part of the file, as we need to couple this with
      each signature block to */
   crypto_hash_sha512(m->manifesthash,m->manifestdata,end_of_text);
-  
+  return end_of_text;
+}
+
+static int rhizome_manifest_verify_hashed(rhizome_manifest *m, int end_of_text)
+{
   /* Read signature blocks from file. */
   int ofs=end_of_text;  
   while(ofs<m->manifest_all_bytes) {
@@ -84,6 +97,65 @@ int rhizome_manifest_verify(rhizome_manifest *m)
   else return 0;
 }
 
+int rhizome_manifest_verify(rhizome_manifest *m)
+{
+  return rhizome_manifest_verify_batch(&m, 1) ? -1 : 0;
+}
+
+/* Manifests hashed side by side and checked as one batch; longer lists are
+   verified this many at a time. */
+#define VERIFY_CHUNK 16
+
+/* Verify several manifests, checking all of their signatures as one batch.
+   Returns the number of manifests that failed; each has m->errors set. */
+int rhizome_manifest_verify_batch(rhizome_manifest **manifests, int count)
+{
+  int offsets[VERIFY_CHUNK];
+  int i, failed=0;
+  if (count<=0)
+    return 0;
+  if (count>VERIFY_CHUNK){
+    for (i=0;i<count;i+=VERIFY_CHUNK)
+      failed+=rhizome_manifest_verify_batch(&manifests[i], count-i<VERIFY_CHUNK?count-i:VERIFY_CHUNK);
+    return failed;
+  }
+  if (count>1){
+    // hash the bodies side by side, in as many vector lanes as the CPU has
+    const unsigned char *bodies[VERIFY_CHUNK]={NULL};
+    size_t lengths[VERIFY_CHUNK]={0};
+    unsigned char hashes[VERIFY_CHUNK][SHA512_DIGEST_LENGTH];
+    for (i=0;i<count;i++){
+      offsets[i]=rhizome_manifest_body_length(manifests[i]);
+      bodies[i]=manifests[i]->manifestdata;
+      lengths[i]=offsets[i];
+    }
+    sha512_multi(count, bodies, lengths, hashes);
+    for (i=0;i<count;i++)
+      bcopy(hashes[i], manifests[i]->manifesthash, sizeof manifests[i]->manifesthash);
+  }else{
+    offsets[0]=rhizome_manifest_hash_body(manifests[0]);
+  }
+  rhizome_manifest_check_signatures(manifests, offsets, count);
+  for (i=0;i<count;i++)
+    if (rhizome_manifest_verify_hashed(manifests[i], offsets[i]))
+      failed++;
+  return failed;
+}
+
+/* Check the manifest's signatures on a worker thread, then verify it from the
+   main loop and pass the result of rhizome_manifest_verify() to callback.
+   Returns 1 if the manifest has been handed over, in which case the caller must
+   not touch it until callback is called, or 0 if the caller should verify it
+   now, eg because there are no worker threads.
+ */
+int rhizome_manifest_verify_async(rhizome_manifest *m, rhizome_verified_callback callback, void *context)
+{
+  if (!fd_workers_running())
+    return 0;
+  int end_of_text=rhizome_manifest_hash_body(m);
+  return rhizome_manifest_check_signatures_async(m, end_of_text, callback, context);
+}
+
 int rhizome_read_manifest_file(rhizome_manifest *m, const char *filename, int bufferP)
 {
   IN();
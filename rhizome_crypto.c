@@ -24,6 +24,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include "conf.h"
 #include "str.h"
 #include "rhizome.h"
+#include "crypto.h"
 #include <stdlib.h>
 #include <ctype.h>
 
@@ -422,46 +423,93 @@ int rhizome_sign_hash_with_key(rhizome_manifest *m,const unsigned char *sk,
   OUT();
 }
 
+/* Results of manifest signature checks, keyed on the manifest hash and the
+   signature block (signature and public key), so that a manifest we hear
+   advertised again and again is only verified once.  Four way set associative,
+   least recently used entry in a set is replaced.
+ */
+#define SIG_CACHE_SIGNATURE_BYTES (crypto_sign_edwards25519sha512batch_BYTES + crypto_sign_edwards25519sha512batch_PUBLICKEYBYTES)
+#define SIG_CACHE_SETS 256
+#define SIG_CACHE_WAYS 4
+
 typedef struct manifest_signature_block_cache {
   unsigned char manifest_hash[crypto_hash_sha512_BYTES];
-  unsigned char signature_bytes[256];
+  unsigned char signature_bytes[SIG_CACHE_SIGNATURE_BYTES];
+  // 0 if this entry is empty
   int signature_length;
   int signature_valid;
+  // stored by rhizome_manifest_check_signatures() and not yet looked up
+  int prefetched;
+  unsigned int last_used;
 } manifest_signature_block_cache;
 
-#define SIG_CACHE_SIZE 1024
-manifest_signature_block_cache sig_cache[SIG_CACHE_SIZE];
+static manifest_signature_block_cache sig_cache[SIG_CACHE_SETS][SIG_CACHE_WAYS];
+static unsigned int sig_cache_clock=0;
+struct sig_cache_stats sig_cache_stats;
 
-int rhizome_manifest_lookup_signature_validity(unsigned char *hash,unsigned char *sig,int sig_len)
+#define SIG_BATCH_SIZE 64
+
+static manifest_signature_block_cache *sig_cache_set(const unsigned char *hash, const unsigned char *sig)
 {
-  IN();
-  unsigned int slot=0;
-  int i;
+  // both are effectively random, so a few bytes of each make a good index
+  unsigned int set = (hash[0] | hash[1]<<8) ^ (sig[0] | sig[1]<<8);
+  return sig_cache[set % SIG_CACHE_SETS];
+}
 
-  for(i=0;i<crypto_hash_sha512_BYTES;i++) {
-    slot=(slot<<1)+(slot&0x80000000?1:0);
-    slot+=hash[i];
+static manifest_signature_block_cache *sig_cache_find(const unsigned char *hash, const unsigned char *sig, int sig_len)
+{
+  manifest_signature_block_cache *set=sig_cache_set(hash, sig);
+  int i;
+  for (i=0;i<SIG_CACHE_WAYS;i++){
+    manifest_signature_block_cache *entry=&set[i];
+    if (entry->signature_length==sig_len
+      && memcmp(entry->manifest_hash, hash, crypto_hash_sha512_BYTES)==0
+      && memcmp(entry->signature_bytes, sig, sig_len)==0)
+      return entry;
   }
-  for(i=0;i<sig_len;i++) {
-    slot=(slot<<1)+(slot&0x80000000?1:0);
-    slot+=sig[i];
+  return NULL;
+}
+
+static manifest_signature_block_cache *sig_cache_store(const unsigned char *hash, const unsigned char *sig, int sig_len, int valid)
+{
+  manifest_signature_block_cache *set=sig_cache_set(hash, sig);
+  manifest_signature_block_cache *entry=&set[0];
+  int i;
+  for (i=0;i<SIG_CACHE_WAYS;i++){
+    if (set[i].signature_length==0){
+      entry=&set[i];
+      break;
+    }
+    if (set[i].last_used < entry->last_used)
+      entry=&set[i];
   }
-  slot%=SIG_CACHE_SIZE;
-
-  int replace=0;
-  if (sig_cache[slot].signature_length!=sig_len) replace=1;
-  for(i=0;i<crypto_hash_sha512_BYTES;i++)
-    if (hash[i]!=sig_cache[i].manifest_hash[i]) { replace=1; break; }
-  for(i=0;i<sig_len;i++)
-    if (sig[i]!=sig_cache[i].signature_bytes[i]) { replace=1; break; }
-
-  if (replace) {
-    for(i=0;i<crypto_hash_sha512_BYTES;i++)
-      sig_cache[i].manifest_hash[i]=hash[i];
-    for(i=0;i<sig_len;i++)
-      sig_cache[i].signature_bytes[i]=sig[i];
-    sig_cache[i].signature_length=sig_len;
+  if (entry->signature_length)
+    sig_cache_stats.evictions++;
+  bcopy(hash, entry->manifest_hash, crypto_hash_sha512_BYTES);
+  bcopy(sig, entry->signature_bytes, sig_len);
+  entry->signature_length=sig_len;
+  entry->signature_valid=valid;
+  entry->prefetched=0;
+  entry->last_used=++sig_cache_clock;
+  return entry;
+}
 
+int rhizome_manifest_lookup_signature_validity(unsigned char *hash,unsigned char *sig,int sig_len)
+{
+  IN();
+  if (sig_len>SIG_CACHE_SIGNATURE_BYTES)
+    RETURN(WHYF("Signature block is too long (%d bytes)", sig_len));
+
+  manifest_signature_block_cache *entry=sig_cache_find(hash, sig, sig_len);
+  if (entry && !entry->prefetched) {
+    sig_cache_stats.hits++;
+    entry->last_used=++sig_cache_clock;
+  } else if (entry) {
+    // verified in a batch just before this lookup, so not really a hit
+    sig_cache_stats.misses++;
+    entry->prefetched=0;
+  } else {
+    sig_cache_stats.misses++;
     unsigned char sigBuf[256];
     unsigned char verifyBuf[256];
     unsigned char publicKey[256];
@@ -475,12 +523,159 @@ int rhizome_manifest_lookup_signature_validity(unsigned char *hash,unsigned char
     bcopy(&sig[64],&publicKey[0],crypto_sign_edwards25519sha512batch_PUBLICKEYBYTES);
 
     unsigned long long mlen=0;
-    sig_cache[i].signature_valid=
-      crypto_sign_edwards25519sha512batch_open(verifyBuf,&mlen,&sigBuf[0],128,
+    int valid=crypto_sign_edwards25519sha512batch_open(verifyBuf,&mlen,&sigBuf[0],128,
 					       publicKey)
       ? -1 : 0;
+    entry=sig_cache_store(hash, sig, sig_len, valid);
+  }
+  RETURN(entry->signature_valid);
+  OUT();
+}
+
+static void check_signature_batch(struct signature_check *checks, int count)
+{
+  crypto_verify_signatures(checks, count);
+  int i;
+  for (i=0;i<count;i++){
+    // the signature block is the signature followed by the public key
+    manifest_signature_block_cache *entry=sig_cache_store(checks[i].content, checks[i].signature,
+      SIG_CACHE_SIGNATURE_BYTES, checks[i].valid?0:-1);
+    entry->prefetched=1;
+  }
+}
+
+/* Verify every crypto_sign signature block in these manifests that is not
+   already in the signature cache as one batch, and cache the results, so that
+   rhizome_manifest_extract_signature() finds them there.  Each manifest's
+   manifesthash must already be set, and offsets[i] is the start of its
+   signature blocks.
+ */
+int rhizome_manifest_check_signatures(rhizome_manifest **manifests, const int *offsets, int count)
+{
+  IN();
+  struct signature_check checks[SIG_BATCH_SIZE];
+  int n=0;
+  int i;
+
+  for (i=0;i<count;i++){
+    rhizome_manifest *m=manifests[i];
+    int ofs=offsets[i];
+    while(ofs<m->manifest_all_bytes){
+      int sigType=m->manifestdata[ofs];
+      int len=(sigType&0x3f)*4+4+1;
+      if (sigType==0x17 && ofs+len<=m->manifest_all_bytes){
+	unsigned char *sig=&m->manifestdata[ofs+1];
+	if (!sig_cache_find(m->manifesthash, sig, SIG_CACHE_SIGNATURE_BYTES)){
+	  checks[n].signature=sig;
+	  checks[n].public_key=&sig[64];
+	  checks[n].content=m->manifesthash;
+	  checks[n].content_len=crypto_hash_sha512_BYTES;
+	  if (++n>=SIG_BATCH_SIZE){
+	    check_signature_batch(checks, n);
+	    n=0;
+	  }
+	}
+      }
+      ofs+=len;
+    }
+  }
+  check_signature_batch(checks, n);
+  RETURN(0);
+  OUT();
+}
+
+/* Signature checks for one manifest, running on a worker thread.  Limited so
+   that a flood of adverts can't tie up every manifest record waiting for them.
+ */
+#define MAX_ASYNC_SIGNATURES 8
+#define MAX_ASYNC_MANIFESTS 8
+
+struct manifest_signature_job{
+  struct work_item work;
+  rhizome_manifest *manifest;
+  rhizome_verified_callback callback;
+  void *context;
+  int count;
+  struct signature_check checks[MAX_ASYNC_SIGNATURES];
+};
+
+static int async_manifests=0;
+
+static void manifest_signature_work(struct work_item *item)
+{
+  struct manifest_signature_job *job=item->context;
+  crypto_verify_signatures(job->checks, job->count);
+}
+
+static void manifest_signature_complete(struct work_item *item)
+{
+  struct manifest_signature_job *job=item->context;
+  int i;
+  for (i=0;i<job->count;i++){
+    manifest_signature_block_cache *entry=sig_cache_store(job->checks[i].content, job->checks[i].signature,
+      SIG_CACHE_SIGNATURE_BYTES, job->checks[i].valid?0:-1);
+    entry->prefetched=1;
+  }
+  async_manifests--;
+  rhizome_manifest *m=job->manifest;
+  rhizome_verified_callback callback=job->callback;
+  void *context=job->context;
+  free(job);
+  callback(m, rhizome_manifest_verify(m), context);
+}
+
+/* As rhizome_manifest_check_signatures() for one manifest, but on a worker
+   thread.  Returns 0 without doing anything if there is nothing to check, or
+   the check can't be queued, in which case the caller should verify the
+   manifest itself.
+ */
+int rhizome_manifest_check_signatures_async(rhizome_manifest *m, int offset, rhizome_verified_callback callback, void *context)
+{
+  IN();
+  if (async_manifests>=MAX_ASYNC_MANIFESTS)
+    RETURN(0);
+  
+  struct manifest_signature_job *job=malloc(sizeof(struct manifest_signature_job));
+  if (!job)
+    RETURN(0);
+  job->count=0;
+  
+  int ofs=offset;
+  while(ofs<m->manifest_all_bytes){
+    int sigType=m->manifestdata[ofs];
+    int len=(sigType&0x3f)*4+4+1;
+    if (sigType==0x17 && ofs+len<=m->manifest_all_bytes){
+      unsigned char *sig=&m->manifestdata[ofs+1];
+      if (!sig_cache_find(m->manifesthash, sig, SIG_CACHE_SIGNATURE_BYTES)){
+	if (job->count>=MAX_ASYNC_SIGNATURES){
+	  job->count=0;
+	  break;
+	}
+	struct signature_check *check=&job->checks[job->count++];
+	check->signature=sig;
+	check->public_key=&sig[64];
+	check->content=m->manifesthash;
+	check->content_len=crypto_hash_sha512_BYTES;
+      }
+    }
+    ofs+=len;
+  }
+  if (job->count==0){
+    free(job);
+    RETURN(0);
   }
-  RETURN(sig_cache[i].signature_valid);
+  
+  job->manifest=m;
+  job->callback=callback;
+  job->context=context;
+  job->work.work=manifest_signature_work;
+  job->work.complete=manifest_signature_complete;
+  job->work.context=job;
+  async_manifests++;
+  if (config.debug.rhizome)
+    DEBUGF("Checking %d signatures of bid=%s on a worker thread", job->count, alloca_tohex_bid(m->cryptoSignPublic));
+  fd_submit_work(&job->work);
+  RETURN(1);
   OUT();
 }
 
@@ -570,7 +765,10 @@ static void add_nonce(unsigned char *nonce, int64_t value){
 /* crypt a block of a stream, allowing for offsets that don't align perfectly to block boundaries
  * for efficiency the caller should use a buffer size of (n*RHIZOME_CRYPT_PAGE_SIZE)
  */
-int rhizome_crypt_xor_block(unsigned char *buffer, int buffer_size, int64_t stream_offset, 
+/* Encrypt or decrypt src into buffer, which may be the same.  src is never written, so may be a
+ * read-only mapping of the payload.
+ */
+int rhizome_crypt_xor_copy(unsigned char *buffer, const unsigned char *src, int buffer_size, int64_t stream_offset, 
 			    const unsigned char *key, const unsigned char *nonce){
   int64_t nonce_offset = stream_offset & ~(RHIZOME_CRYPT_PAGE_SIZE -1);
   int offset=0;
@@ -585,10 +783,12 @@ int rhizome_crypt_xor_block(unsigned char *buffer, int buffer_size, int64_t stre
     if (size>buffer_size)
       size=buffer_size;
     
+    // the key stream starts at the page boundary, so line the bytes up with it
     unsigned char temp[RHIZOME_CRYPT_PAGE_SIZE];
+    bzero(temp, padding);
+    bcopy(src, temp + padding, size);
+    crypto_stream_xsalsa20_xor(temp, temp, padding + size, block_nonce, key);
     bcopy(temp + padding, buffer, size);
-    crypto_stream_xsalsa20_xor(temp, temp, size, block_nonce, key);
-    bcopy(buffer, temp + padding, size);
     
     add_nonce(block_nonce, RHIZOME_CRYPT_PAGE_SIZE);
     offset+=size;
@@ -599,7 +799,7 @@ int rhizome_crypt_xor_block(unsigned char *buffer, int buffer_size, int64_t stre
     if (size>RHIZOME_CRYPT_PAGE_SIZE)
       size=RHIZOME_CRYPT_PAGE_SIZE;
     
-    crypto_stream_xsalsa20_xor(buffer+offset, buffer+offset, size, block_nonce, key);
+    crypto_stream_xsalsa20_xor(buffer+offset, src+offset, size, block_nonce, key);
     
     add_nonce(block_nonce, RHIZOME_CRYPT_PAGE_SIZE);
     offset+=size;
@@ -608,6 +808,11 @@ int rhizome_crypt_xor_block(unsigned char *buffer, int buffer_size, int64_t stre
   return 0;
 }
 
+int rhizome_crypt_xor_block(unsigned char *buffer, int buffer_size, int64_t stream_offset, 
+			    const unsigned char *key, const unsigned char *nonce){
+  return rhizome_crypt_xor_copy(buffer, buffer, buffer_size, stream_offset, key, nonce);
+}
+
 int rhizome_derive_key(rhizome_manifest *m, rhizome_bk_t *bsk)
 {
   // don't do anything if the manifest isn't flagged as being encrypted
@@ -26,6 +26,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include "strbuf.h"
 #include "strbuf_helpers.h"
 #include "str.h"
+#include "strlcpy.h"
 
 int min(int a,int b)
 {
@@ -162,9 +163,37 @@ int (*sqlite_set_tracefunc(int (*newfunc)()))()
 }
 
 void sqlite_log(void *ignored, int result, const char *msg){
+  // logging is not thread safe, and the import worker reports its own errors
+  if (rhizome_import_worker_thread())
+    return;
   WARNF("Sqlite: %d %s", result, msg);
 }
 
+// manifest records are scarce (MAX_RHIZOME_MANIFESTS), so keep batches small
+#define VERIFY_BATCH 8
+
+static void verify_bundle_batch(rhizome_manifest **manifests, sqlite3_int64 *rowids, int count)
+{
+  // check all the signatures together, then store each manifest again
+  rhizome_manifest_verify_batch(manifests, count);
+  int i;
+  for (i=0;i<count;i++){
+    rhizome_manifest *m=manifests[i];
+    int ret=m->errors?-1:0;
+    if (ret==0){
+      m->finalised=1;
+      m->manifest_bytes=m->manifest_all_bytes;
+      // store it again, to ensure it is valid and stored correctly with matching file content.
+      ret=rhizome_store_bundle(m);
+    }
+    if (ret!=0){
+      DEBUGF("Removing invalid manifest entry @%lld", rowids[i]);
+      //sqlite_exec_void_retry(&retry, "DELETE FROM MANIFESTS WHERE ROWID=%lld;", rowid);
+    }
+    rhizome_manifest_free(m);
+  }
+}
+
 static void verify_bundles(){
   // assume that only the manifest itself can be trusted
   // fetch all manifests and reinsert them.
@@ -172,33 +201,77 @@ static void verify_bundles(){
   // This cursor must be ordered descending as re-inserting the manifests will give them a new higher manifest id.
   // If we didn't, we'd get stuck in an infinite loop.
   sqlite3_stmt *statement = sqlite_prepare(&retry, "SELECT ROWID, MANIFEST FROM MANIFESTS ORDER BY ROWID DESC;");
+  rhizome_manifest *manifests[VERIFY_BATCH];
+  sqlite3_int64 rowids[VERIFY_BATCH];
+  int count=0;
   while(sqlite_step_retry(&retry, statement)==SQLITE_ROW){
     sqlite3_int64 rowid = sqlite3_column_int64(statement, 0);
     const void *manifest = sqlite3_column_blob(statement, 1);
     int manifest_length = sqlite3_column_bytes(statement, 1);
     
     rhizome_manifest *m=rhizome_new_manifest();
-    int ret=0;
-    ret = rhizome_read_manifest_file(m, manifest, manifest_length);
-    if (ret==0 && m->errors)
-      ret=-1;
-    if (ret==0)
-      ret=rhizome_manifest_verify(m);
-    if (ret==0){
-      m->finalised=1;
-      m->manifest_bytes=m->manifest_all_bytes;
-      // store it again, to ensure it is valid and stored correctly with matching file content.
-      ret=rhizome_store_bundle(m);
-    }
-    if (ret!=0){
+    if (!m)
+      break;
+    if (rhizome_read_manifest_file(m, manifest, manifest_length) || m->errors){
       DEBUGF("Removing invalid manifest entry @%lld", rowid);
-      //sqlite_exec_void_retry(&retry, "DELETE FROM MANIFESTS WHERE ROWID=%lld;", rowid);
+      rhizome_manifest_free(m);
+      continue;
+    }
+    manifests[count]=m;
+    rowids[count]=rowid;
+    if (++count>=VERIFY_BATCH){
+      verify_bundle_batch(manifests, rowids, count);
+      count=0;
     }
-    rhizome_manifest_free(m);
   }
+  if (count)
+    verify_bundle_batch(manifests, rowids, count);
   sqlite3_finalize(statement);
 }
 
+/* Fill in the binary bundle id of manifests stored before the BID column
+   existed, so that BAR lookups can seek on it. */
+static int rhizome_fill_bid_column(sqlite_retry_state *retry)
+{
+  if (sqlite_exec_void_retry(retry, "BEGIN TRANSACTION;") == -1)
+    return -1;
+  sqlite3_stmt *update = sqlite_prepare(retry, "UPDATE MANIFESTS SET bid = ? WHERE ROWID = ?;");
+  sqlite3_stmt *statement = sqlite_prepare(retry, "SELECT ROWID, id FROM MANIFESTS WHERE bid IS NULL;");
+  int count=0;
+  int ret=(update && statement)?0:-1;
+  while(ret==0 && sqlite_step_retry(retry, statement)==SQLITE_ROW){
+    sqlite3_int64 rowid = sqlite3_column_int64(statement, 0);
+    const char *id = (const char *) sqlite3_column_text(statement, 1);
+    unsigned char bid[RHIZOME_MANIFEST_ID_BYTES];
+    if (!id || fromhexstr(bid, id, RHIZOME_MANIFEST_ID_BYTES) == -1){
+      WARNF("Manifest @%lld has an invalid id", (long long) rowid);
+      continue;
+    }
+    sqlite3_bind_blob(update, 1, bid, sizeof bid, SQLITE_TRANSIENT);
+    sqlite3_bind_int64(update, 2, rowid);
+    if (sqlite_step_retry(retry, update) == -1){
+      ret=-1;
+      break;
+    }
+    sqlite3_reset(update);
+    count++;
+  }
+  if (statement)
+    sqlite3_finalize(statement);
+  if (update)
+    sqlite3_finalize(update);
+  if (ret==-1){
+    // leave the column unfilled so the next open tries again
+    sqlite_exec_void_retry(retry, "ROLLBACK;");
+    return -1;
+  }
+  if (config.debug.rhizome)
+    DEBUGF("Stored the binary bundle id of %d manifests", count);
+  if (sqlite_exec_void_retry(retry, "COMMIT;") == -1)
+    return -1;
+  return 0;
+}
+
 /*
  * The MANIFESTS table 'author' column records the cryptographically verified SID of the author
  * that has write permission on the bundle, ie, possesses the Rhizome secret key that generated the
@@ -223,6 +296,45 @@ static void verify_bundles(){
  * -- Andrew Bettison <andrew@servalproject.com>, October 2012
  */
 
+/* Apply the rhizome.db configuration to a newly opened database.  None of this is fatal, and
+ * versions of SQLite that do not know a pragma simply ignore it.
+ */
+static void rhizome_db_pragmas(sqlite_retry_state *retry)
+{
+  /* The journal mode is stored in the database file, so every process that opens it uses the
+     same mode.  Changing it needs exclusive access, so may fail while another process has the
+     database open, in which case the next process to open it will try again. */
+  strbuf mode = strbuf_alloca(16);
+  if (sqlite_exec_strbuf_retry(retry, mode, "PRAGMA journal_mode;") == 1
+      && (strcasecmp(strbuf_str(mode), "wal") == 0) != (config.rhizome.db.wal != 0)) {
+    strbuf_reset(mode);
+    if (sqlite_exec_strbuf_retry(retry, mode, "PRAGMA journal_mode=%s;", config.rhizome.db.wal ? "WAL" : "DELETE") == 1
+	&& (strcasecmp(strbuf_str(mode), "wal") == 0) == (config.rhizome.db.wal != 0)) {
+      if (config.debug.rhizome)
+	DEBUGF("Rhizome database journal_mode=%s", strbuf_str(mode));
+    } else
+      WARNF("Could not change Rhizome database journal_mode from %s", strbuf_str(mode));
+  }
+  
+  sqlite_exec_void_retry_loglevel(LOG_LEVEL_WARN, retry, "PRAGMA synchronous=%d;", config.rhizome.db.synchronous);
+  
+  if (config.rhizome.db.cache_size) {
+    long long page_size;
+    if (sqlite_exec_int64_retry(retry, &page_size, "PRAGMA page_size;") == 1 && page_size > 0) {
+      long long pages = config.rhizome.db.cache_size / page_size;
+      sqlite_exec_void_retry_loglevel(LOG_LEVEL_WARN, retry, "PRAGMA cache_size=%lld;", pages > 0 ? pages : 1);
+    }
+  }
+  
+  if (config.rhizome.db.mmap_size) {
+    // returns the new size, or nothing if not supported
+    long long mmap_size = 0;
+    sqlite_exec_int64_retry(retry, &mmap_size, "PRAGMA mmap_size=%llu;", (unsigned long long) config.rhizome.db.mmap_size);
+    if (config.debug.rhizome)
+      DEBUGF("Rhizome database mmap_size=%lld", mmap_size);
+  }
+}
+
 int rhizome_opendb()
 {
   if (rhizome_db) return 0;
@@ -288,6 +400,8 @@ int rhizome_opendb()
     sqlite_exec_void_loglevel(LOG_LEVEL_WARN, "ALTER TABLE MANIFESTS ADD COLUMN name text;");
     sqlite_exec_void_loglevel(LOG_LEVEL_WARN, "ALTER TABLE MANIFESTS ADD COLUMN sender text collate nocase;");
     sqlite_exec_void_loglevel(LOG_LEVEL_WARN, "ALTER TABLE MANIFESTS ADD COLUMN recipient text collate nocase;");
+    // verify_bundles() stores every column, including those added by later upgrades
+    sqlite_exec_void_loglevel(LOG_LEVEL_WARN, "ALTER TABLE MANIFESTS ADD COLUMN bid blob;");
     // if more bundle verification is required in later upgrades, move this to the end, don't run it more than once.
     verify_bundles();
     sqlite_exec_void_loglevel(LOG_LEVEL_WARN, "PRAGMA user_version=2;");
@@ -298,12 +412,37 @@ int rhizome_opendb()
     sqlite_exec_void_loglevel(LOG_LEVEL_WARN, "PRAGMA user_version=3;");
   }
   
+  if (version<4){
+    /* BARs carry a binary prefix of the bundle id, which can be looked up by
+       range on a binary column, but not on the hex id without a LIKE scan */
+    if (version>=2)
+      sqlite_exec_void_loglevel(LOG_LEVEL_WARN, "ALTER TABLE MANIFESTS ADD COLUMN bid blob;");
+    if (rhizome_fill_bid_column(&retry) == -1)
+      RETURN(WHY("Failed to fill in binary bundle ids"));
+    sqlite_exec_void_loglevel(LOG_LEVEL_WARN, "CREATE INDEX IF NOT EXISTS IDX_MANIFESTS_BID_VERSION ON MANIFESTS(bid, version);");
+    sqlite_exec_void_loglevel(LOG_LEVEL_WARN, "PRAGMA user_version=4;");
+  }
+  
+  if (version<5){
+    /* Count deleted manifests, so the daemon can tell when another process has
+       deleted a bundle that its BAR index still holds */
+    if (	sqlite_exec_void_retry(&retry, "CREATE TABLE IF NOT EXISTS MANIFEST_DELETIONS(count integer);") == -1
+      ||	sqlite_exec_void_retry(&retry, "INSERT INTO MANIFEST_DELETIONS(count) SELECT 0 WHERE NOT EXISTS (SELECT 1 FROM MANIFEST_DELETIONS);") == -1
+      ||	sqlite_exec_void_retry(&retry, "CREATE TRIGGER IF NOT EXISTS MANIFEST_DELETED AFTER DELETE ON MANIFESTS BEGIN UPDATE MANIFEST_DELETIONS SET count=count+1; END;") == -1
+    ) {
+      RETURN(WHY("Failed to create manifest deletion counter"));
+    }
+    sqlite_exec_void_loglevel(LOG_LEVEL_WARN, "PRAGMA user_version=5;");
+  }
+  
   // TODO recreate tables with collate nocase on hex columns
   
   /* Future schema updates should be performed here. 
    The above schema can be assumed to exist.
    All changes should attempt to preserve any existing data */
   
+  rhizome_db_pragmas(&retry);
+  
   // We can't delete a file that is being transferred in another process at this very moment...
   if (config.rhizome.clean_on_open)
     rhizome_cleanup(NULL);
@@ -315,10 +454,18 @@ int rhizome_close_db()
 {
   IN();
   if (rhizome_db) {
+    // cached payloads hold blob handles, which would stop the database from closing
+    rhizome_read_cache_flush();
+    if (config.debug.rhizome)
+      rhizome_database_showstats();
+    if (config.debug.rhizome && sig_cache_stats.hits+sig_cache_stats.misses)
+      DEBUGF("Manifest signature cache: %u hits, %u misses, %u evictions",
+	sig_cache_stats.hits, sig_cache_stats.misses, sig_cache_stats.evictions);
     if (!sqlite3_get_autocommit(rhizome_db)){
       WHY("Uncommitted transaction!");
       sqlite_exec_void("ROLLBACK;");
     }
+    sqlite_statement_cache_flush();
     sqlite3_stmt *stmt = NULL;
     while ((stmt = sqlite3_next_stmt(rhizome_db, stmt))) {
       const char *sql = sqlite3_sql(stmt);
@@ -328,6 +475,8 @@ int rhizome_close_db()
     if (r != SQLITE_OK)
       RETURN(WHYF("Failed to close sqlite database, %s",sqlite3_errmsg(rhizome_db)));
   }
+  rhizome_import_close();
+  rhizome_bar_index_free();
   rhizome_db=NULL;
   RETURN(0);
   OUT();
@@ -384,10 +533,14 @@ sqlite_retry_state sqlite_retry_state_init(int serverLimit, int serverSleep, int
     };
 }
 
+struct sqlite_busy_stats sqlite_busy_stats;
+static struct sqlite_busy_stats busy_stats_reported;
+
 int _sqlite_retry(struct __sourceloc __whence, sqlite_retry_state *retry, const char *action)
 {
   time_ms_t now = gettime_ms();
   ++retry->busytries;
+  ++sqlite_busy_stats.busy;
   if (retry->start == -1)
     retry->start = now;
   retry->elapsed = now - retry->start;
@@ -401,6 +554,7 @@ int _sqlite_retry(struct __sourceloc __whence, sqlite_retry_state *retry, const
     );
   
   if (retry->elapsed >= retry->limit) {
+    ++sqlite_busy_stats.gave_up;
     // reset ready for next query
     retry->busytries = 0;
     if (!serverMode)
@@ -408,14 +562,17 @@ int _sqlite_retry(struct __sourceloc __whence, sqlite_retry_state *retry, const
     return 0; // tell caller to stop trying
   }
   
-  if (retry->sleep)
+  if (retry->sleep) {
     sleep_ms(retry->sleep);
+    sqlite_busy_stats.sleep_ms += retry->sleep;
+  }
   return 1; // tell caller to try again
 }
 
 void _sqlite_retry_done(struct __sourceloc __whence, sqlite_retry_state *retry, const char *action)
 {
   if (retry->busytries) {
+    ++sqlite_busy_stats.recovered;
     time_ms_t now = gettime_ms();
     INFOF("succeeded on try %u after %.3f seconds (limit %.3f): %s",
 	retry->busytries + 1,
@@ -442,33 +599,216 @@ sqlite3_stmt *_sqlite_prepare(struct __sourceloc __whence, sqlite_retry_state *r
   return _sqlite_prepare_loglevel(__whence, LOG_LEVEL_ERROR, retry, sql);
 }
 
-sqlite3_stmt *_sqlite_prepare_loglevel(struct __sourceloc __whence, int log_level, sqlite_retry_state *retry, strbuf stmt)
+static sqlite3_stmt *_sqlite_prepare_sql(struct __sourceloc __whence, int log_level, sqlite_retry_state *retry, const char *sql)
 {
   sqlite3_stmt *statement = NULL;
-  if (strbuf_overrun(stmt)) {
-    WHYF("SQL overrun: %s", strbuf_str(stmt));
-    return NULL;
-  }
   if (!rhizome_db && rhizome_opendb() == -1)
     return NULL;
   while (1) {
-    switch (sqlite3_prepare_v2(rhizome_db, strbuf_str(stmt), -1, &statement, NULL)) {
+    switch (sqlite3_prepare_v2(rhizome_db, sql, -1, &statement, NULL)) {
       case SQLITE_OK:
 	return statement;
       case SQLITE_BUSY:
       case SQLITE_LOCKED:
-	if (retry && _sqlite_retry(__whence, retry, strbuf_str(stmt))) {
+	if (retry && _sqlite_retry(__whence, retry, sql)) {
 	  break; // back to sqlite3_prepare_v2()
 	}
 	// fall through...
       default:
-	LOGF(log_level, "query invalid, %s: %s", sqlite3_errmsg(rhizome_db), strbuf_str(stmt));
+	LOGF(log_level, "query invalid, %s: %s", sqlite3_errmsg(rhizome_db), sql);
 	sqlite3_finalize(statement);
 	return NULL;
     }
   }
 }
 
+sqlite3_stmt *_sqlite_prepare_loglevel(struct __sourceloc __whence, int log_level, sqlite_retry_state *retry, strbuf stmt)
+{
+  if (strbuf_overrun(stmt)) {
+    WHYF("SQL overrun: %s", strbuf_str(stmt));
+    return NULL;
+  }
+  return _sqlite_prepare_sql(__whence, log_level, retry, strbuf_str(stmt));
+}
+
+/* Prepared statements for SQL text that is used over and over again, so that sqlite only has to
+ * parse and plan it once.  Each entry is either idle, reset with no bindings, or lent to exactly
+ * one caller until it is given back by sqlite_release().  If the same SQL is needed again while
+ * its statement is lent out (eg, a nested query) a second entry is prepared.
+ */
+#define SQLITE_STATEMENT_CACHE_SIZE 32
+
+static struct cached_statement {
+  sqlite3_stmt *statement;
+  unsigned int hash;
+  unsigned int last_used;
+  int in_use;
+} statement_cache[SQLITE_STATEMENT_CACHE_SIZE];
+
+static unsigned int statement_cache_clock = 0;
+
+static struct {
+  unsigned int hits;
+  unsigned int misses;
+  unsigned int evictions;
+} statement_cache_stats;
+
+static unsigned int sql_hash(const char *sql)
+{
+  unsigned int hash = 5381;
+  for (; *sql; ++sql)
+    hash = hash * 33 + (unsigned char) *sql;
+  return hash;
+}
+
+static sqlite3_stmt *_sqlite_prepare_cached(struct __sourceloc __whence, int log_level, sqlite_retry_state *retry, const char *sql)
+{
+  unsigned int hash = sql_hash(sql);
+  struct cached_statement *victim = NULL;
+  int i;
+  for (i = 0; i < SQLITE_STATEMENT_CACHE_SIZE; ++i) {
+    struct cached_statement *c = &statement_cache[i];
+    if (!c->statement) {
+      if (!victim || victim->statement)
+	victim = c;
+      continue;
+    }
+    if (c->in_use)
+      continue;
+    if (c->hash == hash && strcmp(sqlite3_sql(c->statement), sql) == 0) {
+      statement_cache_stats.hits++;
+      c->in_use = 1;
+      c->last_used = ++statement_cache_clock;
+      return c->statement;
+    }
+    if (!victim || (victim->statement && c->last_used < victim->last_used))
+      victim = c;
+  }
+  statement_cache_stats.misses++;
+  sqlite3_stmt *statement = _sqlite_prepare_sql(__whence, log_level, retry, sql);
+  if (!statement || !victim)
+    return statement;
+  if (victim->statement) {
+    statement_cache_stats.evictions++;
+    sqlite3_finalize(victim->statement);
+  }
+  victim->statement = statement;
+  victim->hash = hash;
+  victim->in_use = 1;
+  victim->last_used = ++statement_cache_clock;
+  return statement;
+}
+
+/* Give back a statement from sqlite_prepare_bind(), or finalise any other statement.
+ */
+void sqlite_release(sqlite3_stmt *statement)
+{
+  if (!statement)
+    return;
+  int i;
+  for (i = 0; i < SQLITE_STATEMENT_CACHE_SIZE; ++i) {
+    if (statement_cache[i].statement == statement) {
+      // releases any locks held by a statement that was not stepped to completion
+      sqlite3_reset(statement);
+      sqlite3_clear_bindings(statement);
+      statement_cache[i].in_use = 0;
+      return;
+    }
+  }
+  sqlite3_finalize(statement);
+}
+
+/* Finalise every cached statement, which must be done before closing the database.
+ */
+void sqlite_statement_cache_flush()
+{
+  if (config.debug.rhizome && statement_cache_stats.hits+statement_cache_stats.misses)
+    DEBUGF("SQL statement cache: %u hits, %u misses, %u evictions",
+      statement_cache_stats.hits, statement_cache_stats.misses, statement_cache_stats.evictions);
+  int i;
+  for (i = 0; i < SQLITE_STATEMENT_CACHE_SIZE; ++i) {
+    struct cached_statement *c = &statement_cache[i];
+    if (c->statement) {
+      if (c->in_use)
+	WARNF("statement still in use: %s", sqlite3_sql(c->statement));
+      sqlite3_finalize(c->statement);
+    }
+    c->statement = NULL;
+    c->in_use = 0;
+  }
+}
+
+static int _sqlite_vbind(struct __sourceloc __whence, int log_level, sqlite3_stmt *statement, va_list ap)
+{
+  int index;
+  for (index = 1; ; ++index) {
+    int type = va_arg(ap, int);
+    int code;
+    switch (type) {
+      case SQL_END:
+	return 0;
+      case SQL_INT:
+	code = sqlite3_bind_int(statement, index, va_arg(ap, int));
+	break;
+      case SQL_INT64:
+	code = sqlite3_bind_int64(statement, index, va_arg(ap, int64_t));
+	break;
+      case SQL_TEXT: {
+	  const char *text = va_arg(ap, const char *);
+	  code = text ? sqlite3_bind_text(statement, index, text, -1, SQLITE_TRANSIENT) : sqlite3_bind_null(statement, index);
+	}
+	break;
+      case SQL_BLOB: {
+	  const void *blob = va_arg(ap, const void *);
+	  int length = va_arg(ap, int);
+	  code = blob ? sqlite3_bind_blob(statement, index, blob, length, SQLITE_TRANSIENT) : sqlite3_bind_null(statement, index);
+	}
+	break;
+      default:
+	return WHYF("invalid bind type %#x for parameter %d (missing SQL_END?): %s", type, index, sqlite3_sql(statement));
+    }
+    if (code != SQLITE_OK) {
+      LOGF(log_level, "cannot bind parameter %d, %s: %s", index, sqlite3_errmsg(rhizome_db), sqlite3_sql(statement));
+      return -1;
+    }
+  }
+}
+
+static sqlite3_stmt *_sqlite_vprepare_bind(struct __sourceloc __whence, int log_level, sqlite_retry_state *retry, const char *sql, va_list ap)
+{
+  sqlite3_stmt *statement = _sqlite_prepare_cached(__whence, log_level, retry, sql);
+  if (statement && _sqlite_vbind(__whence, log_level, statement, ap) == -1) {
+    sqlite_release(statement);
+    return NULL;
+  }
+  return statement;
+}
+
+/* Convenience wrapper for preparing an SQL statement and binding its parameters, see enum
+ * sqlbind_type.  Returns NULL if an error occurs (logged at the given level).  The caller must
+ * give the statement back with sqlite_release().
+ */
+sqlite3_stmt *_sqlite_prepare_bind(struct __sourceloc __whence, int log_level, sqlite_retry_state *retry, const char *sql, ...)
+{
+  va_list ap;
+  va_start(ap, sql);
+  sqlite3_stmt *statement = _sqlite_vprepare_bind(__whence, log_level, retry, sql, ap);
+  va_end(ap);
+  return statement;
+}
+
+/* Log the lock contention since the last call, if there was any.
+ */
+void rhizome_database_showstats()
+{
+  struct sqlite_busy_stats *s = &sqlite_busy_stats, *r = &busy_stats_reported;
+  if (s->busy == r->busy)
+    return;
+  INFOF("Rhizome database busy %u times, %u queries succeeded on retry, %u gave up, %u ms asleep",
+      s->busy - r->busy, s->recovered - r->recovered, s->gave_up - r->gave_up, s->sleep_ms - r->sleep_ms);
+  *r = *s;
+}
+
 int _sqlite_step_retry(struct __sourceloc __whence, int log_level, sqlite_retry_state *retry, sqlite3_stmt *statement)
 {
   int ret = -1;
@@ -504,7 +844,7 @@ int _sqlite_step_retry(struct __sourceloc __whence, int log_level, sqlite_retry_
 
 /*
  * Convenience wrapper for executing a prepared SQL statement where the row outputs are not wanted.
- * Always finalises the statement before returning.
+ * Always finalises (or releases) the statement before returning.
  *
  * If an error occurs then logs it at the given level and returns -1.
  *
@@ -525,17 +865,15 @@ static int _sqlite_exec_prepared(struct __sourceloc __whence, int log_level, sql
   int stepcode;
   while ((stepcode = _sqlite_step_retry(__whence, log_level, retry, statement)) == SQLITE_ROW)
     ++rowcount;
-  sqlite3_finalize(statement);
+  sqlite_release(statement);
   if (sqlite_trace_func())
     DEBUGF("rowcount=%d changes=%d", rowcount, sqlite3_changes(rhizome_db));
   return sqlite_code_ok(stepcode) ? rowcount : -1;
 }
 
-static int _sqlite_vexec_void(struct __sourceloc __whence, int log_level, sqlite_retry_state *retry, const char *sqlformat, va_list ap)
+static int _sqlite_exec_void_prepared(struct __sourceloc __whence, int log_level, sqlite_retry_state *retry, sqlite3_stmt *statement)
 {
-  strbuf stmt = strbuf_alloca(8192);
-  strbuf_vsprintf(stmt, sqlformat, ap);
-  int rowcount = _sqlite_exec_prepared(__whence, log_level, retry, _sqlite_prepare_loglevel(__whence, log_level, retry, stmt));
+  int rowcount = _sqlite_exec_prepared(__whence, log_level, retry, statement);
   if (rowcount == -1)
     return -1;
   if (rowcount)
@@ -543,6 +881,13 @@ static int _sqlite_vexec_void(struct __sourceloc __whence, int log_level, sqlite
   return sqlite3_changes(rhizome_db);
 }
 
+static int _sqlite_vexec_void(struct __sourceloc __whence, int log_level, sqlite_retry_state *retry, const char *sqlformat, va_list ap)
+{
+  strbuf stmt = strbuf_alloca(8192);
+  strbuf_vsprintf(stmt, sqlformat, ap);
+  return _sqlite_exec_void_prepared(__whence, log_level, retry, _sqlite_prepare_loglevel(__whence, log_level, retry, stmt));
+}
+
 /* Convenience wrapper for executing an SQL command that returns no value.
  * If an error occurs then logs it at ERROR level and returns -1.  Otherwise returns the number of
  * rows changed by the command.
@@ -602,11 +947,8 @@ int _sqlite_exec_void_retry_loglevel(struct __sourceloc __whence, int log_level,
   return ret;
 }
 
-static int _sqlite_vexec_int64(struct __sourceloc __whence, sqlite_retry_state *retry, long long *result, const char *sqlformat, va_list ap)
+static int _sqlite_exec_int64_prepared(struct __sourceloc __whence, sqlite_retry_state *retry, long long *result, sqlite3_stmt *statement)
 {
-  strbuf stmt = strbuf_alloca(8192);
-  strbuf_vsprintf(stmt, sqlformat, ap);
-  sqlite3_stmt *statement = _sqlite_prepare_loglevel(__whence, LOG_LEVEL_ERROR, retry, stmt);
   if (!statement)
     return -1;
   int ret = 0;
@@ -621,7 +963,7 @@ static int _sqlite_vexec_int64(struct __sourceloc __whence, sqlite_retry_state *
   }
   if (rowcount > 1)
     WARNF("query unexpectedly returned %d rows, ignored all but first", rowcount);
-  sqlite3_finalize(statement);
+  sqlite_release(statement);
   if (!sqlite_code_ok(stepcode) || ret == -1)
     return -1;
   if (sqlite_trace_func())
@@ -629,6 +971,13 @@ static int _sqlite_vexec_int64(struct __sourceloc __whence, sqlite_retry_state *
   return rowcount;
 }
 
+static int _sqlite_vexec_int64(struct __sourceloc __whence, sqlite_retry_state *retry, long long *result, const char *sqlformat, va_list ap)
+{
+  strbuf stmt = strbuf_alloca(8192);
+  strbuf_vsprintf(stmt, sqlformat, ap);
+  return _sqlite_exec_int64_prepared(__whence, retry, result, _sqlite_prepare_loglevel(__whence, LOG_LEVEL_ERROR, retry, stmt));
+}
+
 /*
  * Convenience wrapper for executing an SQL command that returns a single int64 value.
  * Logs an error and returns -1 if an error occurs.
@@ -692,11 +1041,8 @@ int _sqlite_exec_strbuf_retry(struct __sourceloc __whence, sqlite_retry_state *r
   return ret;
 }
 
-int _sqlite_vexec_strbuf_retry(struct __sourceloc __whence, sqlite_retry_state *retry, strbuf sb, const char *sqlformat, va_list ap)
+static int _sqlite_exec_strbuf_prepared(struct __sourceloc __whence, sqlite_retry_state *retry, strbuf sb, sqlite3_stmt *statement)
 {
-  strbuf stmt = strbuf_alloca(8192);
-  strbuf_vsprintf(stmt, sqlformat, ap);
-  sqlite3_stmt *statement = _sqlite_prepare_loglevel(__whence, LOG_LEVEL_ERROR, retry, stmt);
   if (!statement)
     return -1;
   int ret = 0;
@@ -711,10 +1057,48 @@ int _sqlite_vexec_strbuf_retry(struct __sourceloc __whence, sqlite_retry_state *
   }
   if (rowcount > 1)
     WARNF("query unexpectedly returned %d rows, ignored all but first", rowcount);
-  sqlite3_finalize(statement);
+  sqlite_release(statement);
   return sqlite_code_ok(stepcode) && ret != -1 ? rowcount : -1;
 }
 
+int _sqlite_vexec_strbuf_retry(struct __sourceloc __whence, sqlite_retry_state *retry, strbuf sb, const char *sqlformat, va_list ap)
+{
+  strbuf stmt = strbuf_alloca(8192);
+  strbuf_vsprintf(stmt, sqlformat, ap);
+  return _sqlite_exec_strbuf_prepared(__whence, retry, sb, _sqlite_prepare_loglevel(__whence, LOG_LEVEL_ERROR, retry, stmt));
+}
+
+/* Same as sqlite_exec_void_retry(), sqlite_exec_int64_retry() and sqlite_exec_strbuf_retry(), but
+ * with bound parameters instead of a printf format, using a cached statement.  See enum
+ * sqlbind_type.
+ */
+int _sqlite_exec_void_bind(struct __sourceloc __whence, int log_level, sqlite_retry_state *retry, const char *sql, ...)
+{
+  va_list ap;
+  va_start(ap, sql);
+  sqlite3_stmt *statement = _sqlite_vprepare_bind(__whence, log_level, retry, sql, ap);
+  va_end(ap);
+  return _sqlite_exec_void_prepared(__whence, log_level, retry, statement);
+}
+
+int _sqlite_exec_int64_bind(struct __sourceloc __whence, sqlite_retry_state *retry, long long *result, const char *sql, ...)
+{
+  va_list ap;
+  va_start(ap, sql);
+  sqlite3_stmt *statement = _sqlite_vprepare_bind(__whence, LOG_LEVEL_ERROR, retry, sql, ap);
+  va_end(ap);
+  return _sqlite_exec_int64_prepared(__whence, retry, result, statement);
+}
+
+int _sqlite_exec_strbuf_bind(struct __sourceloc __whence, sqlite_retry_state *retry, strbuf sb, const char *sql, ...)
+{
+  va_list ap;
+  va_start(ap, sql);
+  sqlite3_stmt *statement = _sqlite_vprepare_bind(__whence, LOG_LEVEL_ERROR, retry, sql, ap);
+  va_end(ap);
+  return _sqlite_exec_strbuf_prepared(__whence, retry, sb, statement);
+}
+
 long long rhizome_database_used_bytes()
 {
   long long db_page_size;
@@ -733,8 +1117,9 @@ int rhizome_database_filehash_from_id(const char *id, uint64_t version, char has
   IN();
   
   strbuf hash_sb = strbuf_local(hash, SHA512_DIGEST_STRING_LENGTH);
-  RETURN(sqlite_exec_strbuf(hash_sb, "SELECT filehash FROM MANIFESTS WHERE manifests.version=%lld AND manifests.id='%s';",
-			    version,id));
+  sqlite_retry_state retry = SQLITE_RETRY_STATE_DEFAULT;
+  RETURN(sqlite_exec_strbuf_bind(&retry, hash_sb, "SELECT filehash FROM MANIFESTS WHERE version = ? AND id = ?;",
+	SQL_INT64, (int64_t) version, SQL_TEXT, id, SQL_END));
   OUT();
 }
 
@@ -835,6 +1220,13 @@ int rhizome_make_space(int group_priority, long long bytes)
   return WHY("Incomplete");
 }
 
+static void bar_index_remove_hex(const char *manifestid)
+{
+  unsigned char bid[RHIZOME_MANIFEST_ID_BYTES];
+  if (rhizome_bar_index_loaded() && fromhexstr(bid, manifestid, RHIZOME_MANIFEST_ID_BYTES) != -1)
+    rhizome_bar_index_remove(bid);
+}
+
 /* Drop the specified file from storage, and any manifests that reference it, 
    provided that none of those manifests are being retained at a higher priority
    than the maximum specified here. */
@@ -843,7 +1235,7 @@ int rhizome_drop_stored_file(const char *id,int maximum_priority)
   if (!rhizome_str_is_file_hash(id))
     return WHYF("invalid file hash id=%s", alloca_toprint(-1, id, strlen(id)));
   sqlite_retry_state retry = SQLITE_RETRY_STATE_DEFAULT;
-  sqlite3_stmt *statement = sqlite_prepare(&retry, "select id from manifests where filehash='%s'", id);
+  sqlite3_stmt *statement = sqlite_prepare_bind(&retry, "SELECT id FROM manifests WHERE filehash = ?;", SQL_TEXT, id, SQL_END);
   if (!statement)
     return WHYF("Could not drop stored file id=%s", id);
   int can_drop = 1;
@@ -867,16 +1259,17 @@ int rhizome_drop_stored_file(const char *id,int maximum_priority)
     } else {
       if (config.debug.rhizome)
 	DEBUGF("removing stale manifests, groupmemberships");
-      sqlite_exec_void_retry(&retry, "delete from manifests where id='%s';", manifestId);
-      sqlite_exec_void_retry(&retry, "delete from keypairs where public='%s';", manifestId);
-      sqlite_exec_void_retry(&retry, "delete from groupmemberships where manifestid='%s';", manifestId);
+      if (sqlite_exec_void_bind(&retry, "DELETE FROM manifests WHERE id = ?;", SQL_TEXT, manifestId, SQL_END) > 0)
+	bar_index_remove_hex(manifestId);
+      sqlite_exec_void_bind(&retry, "DELETE FROM keypairs WHERE public = ?;", SQL_TEXT, manifestId, SQL_END);
+      sqlite_exec_void_bind(&retry, "DELETE FROM groupmemberships WHERE manifestid = ?;", SQL_TEXT, manifestId, SQL_END);
     }
   }
-  sqlite3_finalize(statement);
+  sqlite_release(statement);
   if (can_drop) {
-    sqlite_exec_void_retry(&retry, "delete from files where id='%s';",id);
+    sqlite_exec_void_bind(&retry, "DELETE FROM files WHERE id = ?;", SQL_TEXT, id, SQL_END);
     rhizome_store_delete(id);
-    sqlite_exec_void_retry(&retry, "delete from fileblobs where id='%s';",id);
+    sqlite_exec_void_bind(&retry, "DELETE FROM fileblobs WHERE id = ?;", SQL_TEXT, id, SQL_END);
   }
   return 0;
 }
@@ -902,7 +1295,10 @@ int rhizome_drop_stored_file(const char *id,int maximum_priority)
   We need to also need to create the appropriate row(s) in the MANIFESTS, FILES, 
    and GROUPMEMBERSHIPS tables, and possibly GROUPLIST as well.
  */
-int rhizome_store_bundle(rhizome_manifest *m)
+/* Fill in the MANIFESTS row for a finalised manifest.  The string fields point into the manifest,
+ * so the row is only valid while the manifest is.
+ */
+int rhizome_manifest_row(rhizome_manifest *m, struct rhizome_manifest_row *row)
 {
   if (!m->finalised) return WHY("Manifest was not finalised");
 
@@ -916,59 +1312,158 @@ int rhizome_store_bundle(rhizome_manifest *m)
       return WHY("Manifest is not signed, and I don't have the key.  Manifest might be forged or corrupt.");
   }
 
-  char manifestid[RHIZOME_MANIFEST_ID_STRLEN + 1];
-  rhizome_manifest_get(m, "id", manifestid, sizeof manifestid);
-  str_toupper_inplace(manifestid);
+  rhizome_manifest_get(m, "id", row->manifestid, sizeof row->manifestid);
+  str_toupper_inplace(row->manifestid);
+  if (fromhexstr(row->bid, row->manifestid, RHIZOME_MANIFEST_ID_BYTES) == -1)
+    return WHYF("Invalid manifest id %s", row->manifestid);
 
   /* Bind BAR to data field */
-  unsigned char bar[RHIZOME_BAR_BYTES];
-  rhizome_manifest_to_bar(m,bar);
+  rhizome_manifest_to_bar(m, row->bar);
 
   /* Store the file (but not if it is already in the database) */
-  char filehash[RHIZOME_FILEHASH_STRLEN + 1];
   if (m->fileLength > 0) {
-    strncpy(filehash, m->fileHexHash, sizeof filehash);
-    str_toupper_inplace(filehash);
+    strncpy(row->filehash, m->fileHexHash, sizeof row->filehash);
+    row->filehash[sizeof row->filehash - 1] = '\0';
+    str_toupper_inplace(row->filehash);
 
-    if (!rhizome_exists(filehash)) {
+    if (!rhizome_exists(row->filehash)) {
       cli_delim("\n");cli_puts("File should already be stored by now because filehash already exist in add manifest");
       return WHY("File should already be stored by now");}
   } else {
-    filehash[0] = '\0';
+    row->filehash[0] = '\0';
   }
 
-  const char *author = is_sid_any(m->author) ? NULL : alloca_tohex_sid(m->author);
-  const char *name = rhizome_manifest_get(m, "name", NULL, 0);
-  const char *sender = rhizome_manifest_get(m, "sender", NULL, 0);
-  const char *recipient = rhizome_manifest_get(m, "recipient", NULL, 0);
-  const char *service = rhizome_manifest_get(m, "service", NULL, 0);
-  
+  if (is_sid_any(m->author))
+    row->author = NULL;
+  else {
+    tohex(row->author_hex, m->author, SID_SIZE);
+    row->author = row->author_hex;
+  }
+  row->name = rhizome_manifest_get(m, "name", NULL, 0);
+  row->sender = rhizome_manifest_get(m, "sender", NULL, 0);
+  row->recipient = rhizome_manifest_get(m, "recipient", NULL, 0);
+  row->service = rhizome_manifest_get(m, "service", NULL, 0);
+  row->manifestdata = m->manifestdata;
+  row->manifest_bytes = m->manifest_bytes;
+  row->version = m->version;
+  row->filesize = m->fileLength;
+  return 0;
+}
+
+static const char manifest_row_insert[] =
+  "INSERT OR REPLACE INTO MANIFESTS(id,manifest,version,inserttime,bar,filesize,filehash,author,service,name,sender,recipient,bid) VALUES(?,?,?,?,?,?,?,?,?,?,?,?,?);";
+
+/* Bind a row to manifest_row_insert, returning the first sqlite error code.  Does not log, so that
+ * it can be used on the import worker thread.
+ */
+static int bind_manifest_row(sqlite3_stmt *stmt, const struct rhizome_manifest_row *row, time_ms_t inserttime)
+{
+  int code;
+  if (   (code = sqlite3_bind_text(stmt, 1, row->manifestid, -1, SQLITE_STATIC)) != SQLITE_OK
+      || (code = sqlite3_bind_blob(stmt, 2, row->manifestdata, row->manifest_bytes, SQLITE_STATIC)) != SQLITE_OK
+      || (code = sqlite3_bind_int64(stmt, 3, row->version)) != SQLITE_OK
+      || (code = sqlite3_bind_int64(stmt, 4, inserttime)) != SQLITE_OK
+      || (code = sqlite3_bind_blob(stmt, 5, row->bar, RHIZOME_BAR_BYTES, SQLITE_STATIC)) != SQLITE_OK
+      || (code = sqlite3_bind_int64(stmt, 6, row->filesize)) != SQLITE_OK
+      || (code = sqlite3_bind_text(stmt, 7, row->filehash, -1, SQLITE_STATIC)) != SQLITE_OK
+      || (code = sqlite3_bind_text(stmt, 8, row->author, -1, SQLITE_STATIC)) != SQLITE_OK
+      || (code = sqlite3_bind_text(stmt, 9, row->service, -1, SQLITE_STATIC)) != SQLITE_OK
+      || (code = sqlite3_bind_text(stmt, 10, row->name, -1, SQLITE_STATIC)) != SQLITE_OK
+      || (code = sqlite3_bind_text(stmt, 11, row->sender, -1, SQLITE_STATIC)) != SQLITE_OK
+      || (code = sqlite3_bind_text(stmt, 12, row->recipient, -1, SQLITE_STATIC)) != SQLITE_OK
+      || (code = sqlite3_bind_blob(stmt, 13, row->bid, RHIZOME_MANIFEST_ID_BYTES, SQLITE_STATIC)) != SQLITE_OK)
+    return code;
+  return SQLITE_OK;
+}
+
+/* Everything that follows a successful store of a row: keep the BAR index up to date and tell
+ * anyone who is interested.
+ */
+void rhizome_manifest_row_stored(const struct rhizome_manifest_row *row, const char *filename)
+{
+  rhizome_bar_index_store(row->bid, row->version);
+  // This message used in tests; do not modify or remove.
+  INFOF("RHIZOME ADD MANIFEST service=%s bid=%s version=%lld",
+	row->service ? row->service : "NULL",
+	alloca_tohex_sid(row->bid),
+	row->version
+	);
+  monitor_announce_bundle_fields(row->bid, row->service, row->version, row->filesize,
+	row->sender, row->recipient, filename);
+}
+
+/* Store a row in its own transaction on the given connection, unless a version at least as new
+ * is already stored.  This is the store stage of the import pipeline, so it runs on a worker
+ * thread, must not log, and must not touch any other daemon state (including rhizome_db).  Any
+ * error message is copied into error.
+ *
+ * Returns 0 if stored, 1 if superseded, -1 on error.
+ */
+int rhizome_store_manifest_row_db(sqlite3 *db, const struct rhizome_manifest_row *row, time_ms_t inserttime, char *error, size_t error_len)
+{
+  sqlite3_stmt *stmt = NULL;
+  int ret = -1;
+  // take the write lock now, so that the version check holds until the commit
+  if (sqlite3_exec(db, "BEGIN IMMEDIATE;", NULL, NULL, NULL) != SQLITE_OK)
+    goto fail;
+  if (sqlite3_prepare_v2(db, "SELECT version FROM MANIFESTS WHERE id = ?;", -1, &stmt, NULL) != SQLITE_OK
+      || sqlite3_bind_text(stmt, 1, row->manifestid, -1, SQLITE_STATIC) != SQLITE_OK)
+    goto rollback;
+  switch (sqlite3_step(stmt)) {
+    case SQLITE_ROW:
+      if (sqlite3_column_int64(stmt, 0) >= row->version) {
+	ret = 1;
+	goto rollback;
+      }
+      break;
+    case SQLITE_DONE:
+      break;
+    default:
+      goto rollback;
+  }
+  sqlite3_finalize(stmt);
+  stmt = NULL;
+  if (   sqlite3_prepare_v2(db, manifest_row_insert, -1, &stmt, NULL) != SQLITE_OK
+      || bind_manifest_row(stmt, row, inserttime) != SQLITE_OK
+      || sqlite3_step(stmt) != SQLITE_DONE)
+    goto rollback;
+  sqlite3_finalize(stmt);
+  stmt = NULL;
+  if (sqlite3_exec(db, "COMMIT;", NULL, NULL, NULL) != SQLITE_OK)
+    goto rollback;
+  return 0;
+rollback:
+  if (ret == -1)
+    strlcpy(error, sqlite3_errmsg(db), error_len);
+  if (stmt)
+    sqlite3_finalize(stmt);
+  sqlite3_exec(db, "ROLLBACK;", NULL, NULL, NULL);
+  return ret;
+fail:
+  strlcpy(error, sqlite3_errmsg(db), error_len);
+  return -1;
+}
+
+int rhizome_store_bundle(rhizome_manifest *m)
+{
+  struct rhizome_manifest_row row;
+  if (rhizome_manifest_row(m, &row) == -1)
+    return -1;
+
   sqlite_retry_state retry = SQLITE_RETRY_STATE_DEFAULT;
   if (sqlite_exec_void_retry(&retry, "BEGIN TRANSACTION;") == -1)
     return WHY("Failed to begin transaction");
   
   sqlite3_stmt *stmt;
-  if ((stmt = sqlite_prepare(&retry, "INSERT OR REPLACE INTO MANIFESTS(id,manifest,version,inserttime,bar,filesize,filehash,author,service,name,sender,recipient) VALUES(?,?,?,?,?,?,?,?,?,?,?,?);")) == NULL)
+  if ((stmt = sqlite_prepare_bind(&retry, manifest_row_insert, SQL_END)) == NULL)
     goto rollback;
-  if (!(   sqlite_code_ok(sqlite3_bind_text(stmt, 1, manifestid, -1, SQLITE_STATIC))
-        && sqlite_code_ok(sqlite3_bind_blob(stmt, 2, m->manifestdata, m->manifest_bytes, SQLITE_STATIC))
-	&& sqlite_code_ok(sqlite3_bind_int64(stmt, 3, m->version))
-	&& sqlite_code_ok(sqlite3_bind_int64(stmt, 4, (long long) gettime_ms()))
-	&& sqlite_code_ok(sqlite3_bind_blob(stmt, 5, bar, RHIZOME_BAR_BYTES, SQLITE_STATIC))
-	&& sqlite_code_ok(sqlite3_bind_int64(stmt, 6, m->fileLength))
-	&& sqlite_code_ok(sqlite3_bind_text(stmt, 7, filehash, -1, SQLITE_STATIC))
-	&& sqlite_code_ok(sqlite3_bind_text(stmt, 8, author, -1, SQLITE_STATIC))
-	&& sqlite_code_ok(sqlite3_bind_text(stmt, 9, service, -1, SQLITE_STATIC))
-	&& sqlite_code_ok(sqlite3_bind_text(stmt, 10, name, -1, SQLITE_STATIC))
-	&& sqlite_code_ok(sqlite3_bind_text(stmt, 11, sender, -1, SQLITE_STATIC))
-	&& sqlite_code_ok(sqlite3_bind_text(stmt, 12, recipient, -1, SQLITE_STATIC))
-  )) {
+  if (bind_manifest_row(stmt, &row, gettime_ms()) != SQLITE_OK) {
     WHYF("query failed, %s: %s", sqlite3_errmsg(rhizome_db), sqlite3_sql(stmt));
     goto rollback;
   }
   if (sqlite_step_retry(&retry, stmt) == -1)
     goto rollback;
-  sqlite3_finalize(stmt);
+  sqlite_release(stmt);
   stmt = NULL;
 
   // TODO remove old payload?
@@ -978,28 +1473,26 @@ int rhizome_store_bundle(rhizome_manifest *m)
     if (closed<1) closed=0;
     int ciphered=rhizome_manifest_get_ll(m,"cipheredgroup");
     if (ciphered<1) ciphered=0;
-    if ((stmt = sqlite_prepare(&retry, "INSERT OR REPLACE INTO GROUPLIST(id,closed,ciphered,priority) VALUES (?,?,?,?);")) == NULL)
+    if ((stmt = sqlite_prepare_bind(&retry,
+	  "INSERT OR REPLACE INTO GROUPLIST(id,closed,ciphered,priority) VALUES (?,?,?,?);",
+	  SQL_TEXT, row.manifestid,
+	  SQL_INT, closed,
+	  SQL_INT, ciphered,
+	  SQL_INT, RHIZOME_PRIORITY_DEFAULT,
+	  SQL_END)) == NULL)
       goto rollback;
-    if (!(   sqlite_code_ok(sqlite3_bind_text(stmt, 1, manifestid, -1, SQLITE_TRANSIENT))
-          && sqlite_code_ok(sqlite3_bind_int(stmt, 2, closed))
-          && sqlite_code_ok(sqlite3_bind_int(stmt, 3, ciphered))
-          && sqlite_code_ok(sqlite3_bind_int(stmt, 4, RHIZOME_PRIORITY_DEFAULT))
-    )) {
-      WHYF("query failed, %s: %s", sqlite3_errmsg(rhizome_db), sqlite3_sql(stmt));
-      goto rollback;
-    }
     if (sqlite_step_retry(&retry, stmt) == -1)
       goto rollback;
-    sqlite3_finalize(stmt);
+    sqlite_release(stmt);
     stmt = NULL;
   }
 
   if (m->group_count > 0) {
-    if ((stmt = sqlite_prepare(&retry, "INSERT OR REPLACE INTO GROUPMEMBERSHIPS(manifestid,groupid) VALUES(?, ?);")) == NULL)
+    if ((stmt = sqlite_prepare_bind(&retry, "INSERT OR REPLACE INTO GROUPMEMBERSHIPS(manifestid,groupid) VALUES(?, ?);", SQL_END)) == NULL)
       goto rollback;
     int i;
     for (i=0;i<m->group_count;i++){
-      if (!(   sqlite_code_ok(sqlite3_bind_text(stmt, 1, manifestid, -1, SQLITE_TRANSIENT))
+      if (!(   sqlite_code_ok(sqlite3_bind_text(stmt, 1, row.manifestid, -1, SQLITE_TRANSIENT))
 	    && sqlite_code_ok(sqlite3_bind_text(stmt, 2, m->groups[i], -1, SQLITE_TRANSIENT))
       )) {
 	WHYF("query failed, %s: %s", sqlite3_errmsg(rhizome_db), sqlite3_sql(stmt));
@@ -1009,24 +1502,16 @@ int rhizome_store_bundle(rhizome_manifest *m)
 	goto rollback;
       sqlite3_reset(stmt);
     }
-    sqlite3_finalize(stmt);
+    sqlite_release(stmt);
     stmt = NULL;
   }
   if (sqlite_exec_void_retry(&retry, "COMMIT;") != -1){
-    // This message used in tests; do not modify or remove.
-    const char *service = rhizome_manifest_get(m, "service", NULL, 0);
-    INFOF("RHIZOME ADD MANIFEST service=%s bid=%s version=%lld",
-	  service ? service : "NULL",
-	  alloca_tohex_sid(m->cryptoSignPublic),
-	  m->version
-	  );
-    monitor_announce_bundle(m);
+    rhizome_manifest_row_stored(&row, m->dataFileName);
     return 0;
   }
 rollback:
-  if (stmt)
-    sqlite3_finalize(stmt);
-  WHYF("Failed to store bundle bid=%s", manifestid);
+  sqlite_release(stmt);
+  WHYF("Failed to store bundle bid=%s", row.manifestid);
   sqlite_exec_void_retry(&retry, "ROLLBACK;");
   return -1;
 }
@@ -1296,14 +1781,15 @@ int rhizome_update_file_priority(const char *fileid)
   /* work out the highest priority of any referrer */
   long long highestPriority = -1;
   sqlite_retry_state retry = SQLITE_RETRY_STATE_DEFAULT;
-  if (sqlite_exec_int64_retry(&retry, &highestPriority,
+  if (sqlite_exec_int64_bind(&retry, &highestPriority,
 	"SELECT max(grouplist.priority) FROM MANIFESTS,GROUPMEMBERSHIPS,GROUPLIST"
-	" where manifests.filehash='%s'"
+	" where manifests.filehash = ?"
 	"   AND groupmemberships.manifestid=manifests.id"
 	"   AND groupmemberships.groupid=grouplist.id;",
-	fileid) == -1)
+	SQL_TEXT, fileid, SQL_END) == -1)
     return -1;
-  if (highestPriority >= 0 && sqlite_exec_void_retry(&retry, "UPDATE files set highestPriority=%lld WHERE id='%s';", highestPriority, fileid) == -1)
+  if (highestPriority >= 0 && sqlite_exec_void_bind(&retry, "UPDATE files set highestPriority = ? WHERE id = ?;",
+	SQL_INT64, (int64_t) highestPriority, SQL_TEXT, fileid, SQL_END) == -1)
     return WHYF("cannot update priority for fileid=%s", fileid);
   return 0;
 }
@@ -1485,6 +1971,27 @@ int rhizome_find_duplicate(const rhizome_manifest *m, rhizome_manifest **found,
   return ret;
 }
 
+/* Bind the range of bundle ids that start with a binary prefix to parameters
+ * index and index+1 of "bid >= ? AND bid <= ?".  Blobs compare as memcmp()
+ * and then by length, so the bare prefix sorts before every id that starts
+ * with it, and the prefix padded with 0xFF after them, so the query is a seek
+ * on IDX_MANIFESTS_BID_VERSION.
+ */
+static int bind_bid_prefix(sqlite3_stmt *statement, int index, const unsigned char *prefix, int prefix_len)
+{
+  unsigned char last[RHIZOME_MANIFEST_ID_BYTES];
+  if (prefix_len<0 || prefix_len>sizeof last)
+    return WHYF("Invalid bundle id prefix length %d", prefix_len);
+  memset(last, 0xFF, sizeof last);
+  bcopy(prefix, last, prefix_len);
+  if (   !sqlite_code_ok(sqlite3_bind_blob(statement, index, prefix, prefix_len, SQLITE_TRANSIENT))
+      || !sqlite_code_ok(sqlite3_bind_blob(statement, index+1, last, sizeof last, SQLITE_TRANSIENT)))
+    return WHYF("query failed, %s: %s", sqlite3_errmsg(rhizome_db), sqlite3_sql(statement));
+  return 0;
+}
+
+static int retrieve_manifest(sqlite_retry_state *retry, sqlite3_stmt *statement, const char *manifestid, rhizome_manifest *m);
+
 /* Retrieve a manifest from the database, given its manifest ID.
  *
  * Returns 0 if manifest is found
@@ -1494,16 +2001,40 @@ int rhizome_find_duplicate(const rhizome_manifest *m, rhizome_manifest **found,
  */
 int rhizome_retrieve_manifest(const char *manifestid, rhizome_manifest *m)
 {
-  int ret=0;
+  sqlite_retry_state retry = SQLITE_RETRY_STATE_DEFAULT;
   
+  sqlite3_stmt *statement = sqlite_prepare_bind(&retry, "SELECT manifest, version, inserttime, author FROM manifests WHERE id like ?",
+      SQL_TEXT, manifestid, SQL_END);
+  if (!statement)
+    return -1;
+  return retrieve_manifest(&retry, statement, manifestid, m);
+}
+
+/* Retrieve a manifest whose bundle id starts with a binary prefix, as carried
+ * in a BAR.  Returns as rhizome_retrieve_manifest().
+ */
+int rhizome_retrieve_manifest_by_prefix(const unsigned char *prefix, int prefix_len, rhizome_manifest *m)
+{
   sqlite_retry_state retry = SQLITE_RETRY_STATE_DEFAULT;
   
-  sqlite3_stmt *statement = sqlite_prepare(&retry, "SELECT manifest, version, inserttime, author FROM manifests WHERE id like ?");
+  sqlite3_stmt *statement = sqlite_prepare_bind(&retry, "SELECT manifest, version, inserttime, author FROM manifests WHERE bid >= ? AND bid <= ? LIMIT 1", SQL_END);
   if (!statement)
     return -1;
+  if (bind_bid_prefix(statement, 1, prefix, prefix_len) == -1){
+    sqlite_release(statement);
+    return -1;
+  }
+  return retrieve_manifest(&retry, statement, alloca_tohex(prefix, prefix_len), m);
+}
 
-  sqlite3_bind_text(statement, 1, manifestid, -1, SQLITE_STATIC);
-  if (sqlite_step_retry(&retry, statement) == SQLITE_ROW){
+/* Read the first row of a manifest, version, inserttime, author query into m,
+ * and release the statement.
+ */
+static int retrieve_manifest(sqlite_retry_state *retry, sqlite3_stmt *statement, const char *manifestid, rhizome_manifest *m)
+{
+  int ret=0;
+  
+  if (sqlite_step_retry(retry, statement) == SQLITE_ROW){
     const char *manifestblob = (char *) sqlite3_column_blob(statement, 0);
     long long q_version = (long long) sqlite3_column_int64(statement, 1);
     long long q_inserttime = (long long) sqlite3_column_int64(statement, 2);
@@ -1530,47 +2061,38 @@ int rhizome_retrieve_manifest(const char *manifestid, rhizome_manifest *m)
   }
   
 done:
-  sqlite3_finalize(statement);
+  sqlite_release(statement);
   return ret;  
 }
 
 int rhizome_delete_manifest_retry(sqlite_retry_state *retry, const char *manifestid)
 {
-  sqlite3_stmt *statement = sqlite_prepare(retry, "DELETE FROM manifests WHERE id = ?");
-  if (!statement)
-    return -1;
-  sqlite3_bind_text(statement, 1, manifestid, -1, SQLITE_STATIC);
-  if (_sqlite_exec_prepared(__WHENCE__, LOG_LEVEL_ERROR, retry, statement) == -1)
+  rhizome_read_cache_flush();
+  int changes = sqlite_exec_void_bind(retry, "DELETE FROM manifests WHERE id = ?;", SQL_TEXT, manifestid, SQL_END);
+  if (changes == -1)
     return -1;
-  return sqlite3_changes(rhizome_db) ? 0 : 1;
+  if (!changes)
+    return 1;
+  bar_index_remove_hex(manifestid);
+  return 0;
 }
 
 static int rhizome_delete_file_retry(sqlite_retry_state *retry, const char *fileid)
 {
+  rhizome_read_cache_flush();
   int ret = 0;
-  sqlite3_stmt *statement = sqlite_prepare(retry, "DELETE FROM files WHERE id = ?");
-  if (!statement)
+  if (sqlite_exec_void_bind(retry, "DELETE FROM files WHERE id = ?;", SQL_TEXT, fileid, SQL_END) == -1)
     ret = -1;
-  else {
-    sqlite3_bind_text(statement, 1, fileid, -1, SQLITE_STATIC);
-    if (_sqlite_exec_prepared(__WHENCE__, LOG_LEVEL_ERROR, retry, statement) == -1)
-      ret = -1;
-  }
-  statement = sqlite_prepare(retry, "DELETE FROM fileblobs WHERE id = ?");
-  if (!statement)
+  int changes = sqlite_exec_void_bind(retry, "DELETE FROM fileblobs WHERE id = ?;", SQL_TEXT, fileid, SQL_END);
+  if (changes == -1)
     ret = -1;
-  else {
-    sqlite3_bind_text(statement, 1, fileid, -1, SQLITE_STATIC);
-    if (_sqlite_exec_prepared(__WHENCE__, LOG_LEVEL_ERROR, retry, statement) == -1)
-      ret = -1;
-  }
-  return ret == -1 ? -1 : sqlite3_changes(rhizome_db) ? 0 : 1;
+  return ret == -1 ? -1 : changes ? 0 : 1;
 }
 
 int rhizome_delete_payload_retry(sqlite_retry_state *retry, const char *manifestid)
 {
   strbuf fh = strbuf_alloca(RHIZOME_FILEHASH_STRLEN + 1);
-  int rows = sqlite_exec_strbuf_retry(retry, fh, "SELECT filehash FROM manifests WHERE id = '%s'", manifestid);
+  int rows = sqlite_exec_strbuf_bind(retry, fh, "SELECT filehash FROM manifests WHERE id = ?;", SQL_TEXT, manifestid, SQL_END);
   if (rows == -1)
     return -1;
   if (rows && rhizome_delete_file_retry(retry, strbuf_str(fh)) == -1)
@@ -1639,64 +2161,59 @@ int rhizome_delete_file(const char *fileid)
   return rhizome_delete_file_retry(&retry, fileid);
 }
 
-time_ms_t lookup_time=0;
-time_ms_t last_bar_lookup=0;
 int rhizome_is_bar_interesting(unsigned char *bar){
   IN();
 
-  if (last_bar_lookup>(gettime_ms()-1000)) {
-    /* Looking up rhizome bundles by BAR can be slow.
-       If so, then ignore some percentage of BARs. */
-    if (lookup_time>10) {
-      // if >10ms then only check 1 in 8 BARs
-      if (random()&0x7) RETURN(0);    
-    }
-    if (lookup_time>100) {
-      // if >10ms then only check 1 in 32 (1 in 8 of 1 in 4) BARs
-      if (random()&0x3) RETURN(0);   
-    }
-  }
-
   time_ms_t start_time=gettime_ms();
 
   int64_t version = rhizome_bar_version(bar);
   int ret=1;
-  char id_hex[RHIZOME_MANIFEST_ID_STRLEN];
-  tohex(id_hex, &bar[RHIZOME_BAR_PREFIX_OFFSET], RHIZOME_BAR_PREFIX_BYTES);
-  strcat(id_hex, "%");
+  unsigned char *prefix = &bar[RHIZOME_BAR_PREFIX_OFFSET];
   
   // are we ignoring this manifest?
-  if (rhizome_ignore_manifest_check(&bar[RHIZOME_BAR_PREFIX_OFFSET], RHIZOME_BAR_PREFIX_BYTES)){
-    DEBUGF("Ignoring %s", id_hex);
+  if (rhizome_ignore_manifest_check(prefix, RHIZOME_BAR_PREFIX_BYTES)){
+    DEBUGF("Ignoring %s", alloca_tohex(prefix, RHIZOME_BAR_PREFIX_BYTES));
     RETURN(0);
   }
   
   // are we already fetching this bundle [or later]?
-  rhizome_manifest *m=rhizome_fetch_search(&bar[RHIZOME_BAR_PREFIX_OFFSET], RHIZOME_BAR_PREFIX_BYTES);
+  rhizome_manifest *m=rhizome_fetch_search(prefix, RHIZOME_BAR_PREFIX_BYTES);
   if (m && m->version >= version)
     RETURN(0);
   
   // do we have this bundle [or later]?
+  int64_t stored_version;
+  if (rhizome_bar_index_lookup(prefix, RHIZOME_BAR_PREFIX_BYTES, &stored_version) == 1
+      && stored_version >= version)
+    RETURN(0);
+  
+  // or are we about to?
+  if (rhizome_import_pending(prefix, RHIZOME_BAR_PREFIX_BYTES, &stored_version) == 1
+      && stored_version >= version)
+    RETURN(0);
+  
+  // the index may not have seen bundles added by other processes
   sqlite_retry_state retry = SQLITE_RETRY_STATE_DEFAULT;
-  sqlite3_stmt *statement = sqlite_prepare(&retry, 
-    "SELECT id, version FROM manifests WHERE id like ? and version >= ?");
+  sqlite3_stmt *statement = sqlite_prepare_bind(&retry, 
+    "SELECT bid, version FROM manifests WHERE bid >= ? AND bid <= ? AND version >= ? LIMIT 1", SQL_END);
+  if (!statement)
+    RETURN(-1);
   
-  sqlite3_bind_text(statement, 1, id_hex, -1, SQLITE_STATIC);
-  sqlite3_bind_int64(statement, 2, version);
+  if (bind_bid_prefix(statement, 1, prefix, RHIZOME_BAR_PREFIX_BYTES) == -1){
+    sqlite_release(statement);
+    RETURN(-1);
+  }
+  sqlite3_bind_int64(statement, 3, version);
   
   if (sqlite_step_retry(&retry, statement) == SQLITE_ROW){
-    if (0){
-      const char *q_id = (const char *) sqlite3_column_text(statement, 0);
-      long long q_version = (long long) sqlite3_column_int64(statement, 1);
-      DEBUGF("Already have %s, %lld (vs %s, %lld)", q_id, q_version, id_hex, version);
-    }
+    const unsigned char *bid = sqlite3_column_blob(statement, 0);
+    if (bid && sqlite3_column_bytes(statement, 0) == RHIZOME_MANIFEST_ID_BYTES)
+      rhizome_bar_index_store(bid, sqlite3_column_int64(statement, 1));
     ret=0;
-  }  
-  sqlite3_finalize(statement);
+  }
+  sqlite_release(statement);
 
-  time_ms_t end_time=gettime_ms();
-  lookup_time=end_time-start_time;
-  last_bar_lookup=end_time;
+  time_ms_t lookup_time=gettime_ms()-start_time;
   if (lookup_time>50) WARNF("Looking up a BAR took %lldms",lookup_time);
 
   RETURN(ret);
@@ -316,10 +316,25 @@ int rhizome_manifest_version_cache_lookup(rhizome_manifest *m)
   
   // TODO, work out why the cache was failing and fix it, then prove that it is faster than accessing the database.
   
-  // skip the cache for now
+  // skip the cache for now, the daemon's BAR index answers most of these
+  unsigned char bid[RHIZOME_MANIFEST_ID_BYTES];
+  int64_t indexVersion;
+  int have_bid = fromhexstr(bid, id, RHIZOME_MANIFEST_ID_BYTES) != -1;
+  if (have_bid
+      && rhizome_bar_index_lookup(bid, RHIZOME_MANIFEST_ID_BYTES, &indexVersion) == 1
+      && indexVersion >= m->version)
+    return -1;
+  if (have_bid
+      && rhizome_import_pending(bid, RHIZOME_MANIFEST_ID_BYTES, &indexVersion) == 1
+      && indexVersion >= m->version)
+    return -1;
   long long dbVersion = -1;
-  if (sqlite_exec_int64(&dbVersion, "SELECT version FROM MANIFESTS WHERE id='%s';", id) == -1)
+  sqlite_retry_state retry = SQLITE_RETRY_STATE_DEFAULT;
+  int rows = sqlite_exec_int64_bind(&retry, &dbVersion, "SELECT version FROM MANIFESTS WHERE id = ?;", SQL_TEXT, id, SQL_END);
+  if (rows == -1)
     return WHY("Select failure");
+  if (rows == 1 && have_bid)
+    rhizome_bar_index_store(bid, dbVersion);
   if (dbVersion >= m->version) {
     if (0) WHYF("We already have %s (%lld vs %lld)", id, dbVersion, m->version);
     return -1;
@@ -511,7 +526,7 @@ static int rhizome_import_received_bundle(struct rhizome_manifest *m)
 	   m->manifest_bytes, m->sig_count,(long long)m->fileLength);
     dump("manifest", m->manifestdata, m->manifest_all_bytes);
   }
-  return rhizome_bundle_import(m, m->ttl - 1 /* TTL */);
+  return rhizome_bundle_import_async(m, m->ttl - 1 /* TTL */);
 }
 
 static int schedule_fetch(struct rhizome_fetch_slot *slot)
@@ -708,7 +723,7 @@ rhizome_fetch(struct rhizome_fetch_slot *slot, rhizome_manifest *m, const struct
   if (rhizome_exists(m->fileHexHash)){
     if (config.debug.rhizome_rx)
       DEBUGF("   fetch not started - payload already present, so importing instead");
-    if (rhizome_add_manifest(m, m->ttl-1) == -1)
+    if (rhizome_bundle_import_async(m, m->ttl-1) == -1)
       return WHY("add manifest failed");
     return IMPORTED;
   }
@@ -893,6 +908,42 @@ rhizome_manifest * rhizome_fetch_search(unsigned char *id, int prefix_length){
 struct profile_total rsnqf_stats={.name="rhizome_start_next_queued_fetches"};
 struct profile_total rfmsc_stats={.name="rhizome_fetch_mdp_slot_callback"};
 
+struct suggested_import{
+  struct sockaddr_in peerip;
+  unsigned char peersid[SID_SIZE];
+};
+
+static void rhizome_suggest_verified(rhizome_manifest *m, int result, void *context)
+{
+  struct suggested_import *s=context;
+  if (result){
+    WHY("Error verifying manifest when considering queuing for import");
+    /* Don't waste time looking at this manifest again for a while */
+    rhizome_queue_ignore_manifest(m->cryptoSignPublic,
+				  crypto_sign_edwards25519sha512batch_PUBLICKEYBYTES, 60000);
+    rhizome_manifest_free(m);
+  }else
+    rhizome_suggest_queue_manifest_import(m, &s->peerip, s->peersid);
+  free(s);
+}
+
+/* If there are worker threads, verify the manifest on one of them and consider
+   it again once that is done.  Returns 1 if the manifest has been handed over. */
+static int rhizome_suggest_verify_async(rhizome_manifest *m, const struct sockaddr_in *peerip, const unsigned char peersid[SID_SIZE])
+{
+  if (!fd_workers_running())
+    return 0;
+  struct suggested_import *s=malloc(sizeof(struct suggested_import));
+  if (!s)
+    return 0;
+  s->peerip=*peerip;
+  bcopy(peersid, s->peersid, SID_SIZE);
+  if (rhizome_manifest_verify_async(m, rhizome_suggest_verified, s))
+    return 1;
+  free(s);
+  return 0;
+}
+
 int rhizome_suggest_queue_manifest_import(rhizome_manifest *m, const struct sockaddr_in *peerip,const unsigned char peersid[SID_SIZE])
 {
   IN();
@@ -911,12 +962,15 @@ int rhizome_suggest_queue_manifest_import(rhizome_manifest *m, const struct sock
 
   if (config.debug.rhizome_rx) {
     long long stored_version;
-    if (sqlite_exec_int64(&stored_version, "select version from manifests where id='%s'", bid) > 0)
+    sqlite_retry_state retry = SQLITE_RETRY_STATE_DEFAULT;
+    if (sqlite_exec_int64_bind(&retry, &stored_version, "SELECT version FROM MANIFESTS WHERE id = ?;", SQL_TEXT, bid, SQL_END) > 0)
       DEBUGF("   is new (have version %lld)", stored_version);
   }
 
   if (m->fileLength == 0) {
-    if (rhizome_manifest_verify(m) != 0) {
+    if (!m->selfSigned && rhizome_suggest_verify_async(m, peerip, peersid))
+      RETURN(0);
+    if (!m->selfSigned && rhizome_manifest_verify(m) != 0) {
       WHY("Error verifying manifest when considering for import");
       /* Don't waste time looking at this manifest again for a while */
       rhizome_queue_ignore_manifest(m->cryptoSignPublic,
@@ -951,6 +1005,8 @@ int rhizome_suggest_queue_manifest_import(rhizome_manifest *m, const struct sock
 	    rhizome_manifest_free(m);
 	    RETURN(0);
 	  }
+	  if (!m->selfSigned && rhizome_suggest_verify_async(m, peerip, peersid))
+	    RETURN(0);
 	  if (!m->selfSigned && rhizome_manifest_verify(m)) {
 	    WHY("Error verifying manifest when considering queuing for import");
 	    /* Don't waste time looking at this manifest again for a while */
@@ -978,6 +1034,8 @@ int rhizome_suggest_queue_manifest_import(rhizome_manifest *m, const struct sock
     RETURN(1);
   }
 
+  if (!m->selfSigned && rhizome_suggest_verify_async(m, peerip, peersid))
+    RETURN(0);
   if (!m->selfSigned && rhizome_manifest_verify(m)) {
     WHY("Error verifying manifest when considering queuing for import");
     /* Don't waste time looking at this manifest again for a while */
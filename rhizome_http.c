@@ -582,7 +582,12 @@ int rhizome_server_parse_http_request(rhizome_http_request *r)
 	    r->read_state.offset = r->source_index = 0;
 	    if (r->read_state.length - r->read_state.offset>0){
 	      rhizome_server_http_response_header(r, 200, "application/binary", r->read_state.length - r->read_state.offset);
-	      r->request_type |= RHIZOME_HTTP_REQUEST_STORE;
+	      if (rhizome_read_can_sendfile(&r->read_state)){
+		if (config.debug.rhizome_tx)
+		  DEBUGF("Sending payload %s with sendfile()", id);
+		r->request_type |= RHIZOME_HTTP_REQUEST_SENDFILE;
+	      }else
+		r->request_type |= RHIZOME_HTTP_REQUEST_STORE;
 	    }
 	  }
 	}
@@ -818,6 +823,28 @@ int rhizome_server_http_send_bytes(rhizome_http_request *r)
 	
 	break;
       }
+      case RHIZOME_HTTP_REQUEST_SENDFILE:
+	{
+	  int64_t sent = rhizome_read_sendfile(&r->read_state, r->alarm.poll.fd, 65536);
+	  if (sent == -1){
+	    r->request_type=0;
+	    break;
+	  }
+	  if (sent == 0 && r->read_state.offset < r->read_state.length){
+	    // stop writing when the tcp buffer is full
+	    return 1;
+	  }
+	  
+	  // reset inactivity timer
+	  r->alarm.alarm = gettime_ms()+RHIZOME_IDLE_TIMEOUT;
+	  r->alarm.deadline = r->alarm.alarm+RHIZOME_IDLE_TIMEOUT;
+	  unschedule(&r->alarm);
+	  schedule(&r->alarm);
+	  
+	  if (r->read_state.offset >= r->read_state.length)
+	    r->request_type=0;
+	  break;
+	}
       case RHIZOME_HTTP_REQUEST_BLOB:
 	{
 	  /* Get more data from the file and put it in the buffer */
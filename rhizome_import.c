@@ -0,0 +1,269 @@
+/*
+Serval Distributed Numbering Architecture (DNA)
+Copyright (C) 2012 Serval Project Inc.
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#include "serval.h"
+#include "conf.h"
+#include "rhizome.h"
+#include "str.h"
+#include "strlcpy.h"
+
+/* Importing a received bundle in stages, so that the main loop doesn't wait for the database
+   while it writes and syncs a new manifest.
+
+   verify    rhizome_manifest_verify_async() checks signatures on a worker thread before the
+	     bundle gets here.
+   dedupe    on the main thread, the same checks as rhizome_bundle_import(), then the row to
+	     store is copied out of the manifest, so the caller may free it.
+   store     on a worker thread, with a database connection of its own, the row is written in
+	     one transaction, unless a newer version has appeared in the meantime.
+   announce  back on the main thread, the BAR index is updated and the bundle is announced.
+
+   Only one store is in flight at a time, so the worker connection is never shared between
+   threads and versions of the same bundle are stored in the order they arrived.  Bundles that
+   are queued but not yet stored are visible through rhizome_import_pending(), so that we don't
+   fetch them again.
+
+   The store stage must not log or touch any other daemon state; errors are carried back to the
+   announce stage.
+ */
+
+#define MAX_PENDING_IMPORTS 32
+
+struct import_job{
+  struct work_item work;
+  struct import_job *next;
+  struct rhizome_manifest_row row;
+  unsigned char manifestdata[MAX_MANIFEST_BYTES];
+  char *filename;
+  time_ms_t inserttime;
+  int result;
+  char error[256];
+};
+
+static struct import_job *pending=NULL, *pending_tail=NULL;
+static int pending_count=0;
+static int in_flight=0;
+static int close_requested=0;
+
+// only touched by the worker running the store stage, or by the main thread when idle
+static sqlite3 *import_db=NULL;
+static char import_db_path[1024];
+static int import_synchronous;
+
+static __thread int import_worker=0;
+
+int rhizome_import_worker_thread()
+{
+  return import_worker;
+}
+
+static void import_job_free(struct import_job *job)
+{
+  free((char *)job->row.service);
+  free((char *)job->row.name);
+  free((char *)job->row.sender);
+  free((char *)job->row.recipient);
+  free(job->filename);
+  free(job);
+}
+
+static char *import_strdup(const char *s)
+{
+  return s ? strdup(s) : NULL;
+}
+
+static void import_store_work(struct work_item *item)
+{
+  struct import_job *job=(struct import_job *)item;
+  import_worker=1;
+  if (!import_db){
+    if (sqlite3_open_v2(import_db_path, &import_db, SQLITE_OPEN_READWRITE, NULL) != SQLITE_OK){
+      strlcpy(job->error, import_db ? sqlite3_errmsg(import_db) : "out of memory", sizeof job->error);
+      sqlite3_close(import_db);
+      import_db=NULL;
+      job->result=-1;
+      import_worker=0;
+      return;
+    }
+    // the main thread's connection may hold the write lock for a while
+    sqlite3_busy_timeout(import_db, 5000);
+    char sql[32];
+    snprintf(sql, sizeof sql, "PRAGMA synchronous=%d;", import_synchronous);
+    sqlite3_exec(import_db, sql, NULL, NULL, NULL);
+  }
+  job->result=rhizome_store_manifest_row_db(import_db, &job->row, job->inserttime, job->error, sizeof job->error);
+  import_worker=0;
+}
+
+static void import_close_db()
+{
+  if (import_db){
+    sqlite3_close(import_db);
+    import_db=NULL;
+  }
+  close_requested=0;
+}
+
+static void import_store_complete(struct work_item *item);
+
+static void import_next()
+{
+  if (in_flight || !pending)
+    return;
+  in_flight=1;
+  pending->work.work=import_store_work;
+  pending->work.complete=import_store_complete;
+  pending->work.context=NULL;
+  fd_submit_work(&pending->work);
+}
+
+static void import_store_complete(struct work_item *item)
+{
+  struct import_job *job=(struct import_job *)item;
+  // jobs are stored strictly in order, so this is always the head of the queue
+  pending=job->next;
+  if (!pending)
+    pending_tail=NULL;
+  pending_count--;
+  in_flight=0;
+
+  switch(job->result){
+    case 0:
+      rhizome_manifest_row_stored(&job->row, job->filename);
+      break;
+    case 1:
+      if (config.debug.rhizome_rx)
+	DEBUGF("Not storing bid=%s version=%lld, a newer version was stored first",
+	  job->row.manifestid, (long long)job->row.version);
+      break;
+    default:
+      WHYF("Failed to store bundle bid=%s: %s", job->row.manifestid, job->error);
+      break;
+  }
+  import_job_free(job);
+
+  if (close_requested && !pending)
+    import_close_db();
+  import_next();
+}
+
+/* Find the highest version of any bundle whose id starts with prefix that is waiting to be
+ * stored.
+ *
+ * Returns 1 and sets *version if there is one
+ * Returns 0 if there is none
+ */
+int rhizome_import_pending(const unsigned char *prefix, int prefix_len, int64_t *version)
+{
+  int found=0;
+  struct import_job *job;
+  for (job=pending;job;job=job->next){
+    if (memcmp(job->row.bid, prefix, prefix_len)==0 && (!found || job->row.version > *version)){
+      *version=job->row.version;
+      found=1;
+    }
+  }
+  return found;
+}
+
+/* Import a received bundle like rhizome_bundle_import(), but store it on a worker thread.  Falls
+ * back to importing synchronously if there are no workers, the queue is full, or the bundle
+ * involves groups, which need more than the MANIFESTS row.
+ *
+ * Returns 0 if the bundle was stored or queued, otherwise whatever rhizome_bundle_import() would.
+ */
+int rhizome_bundle_import_async(rhizome_manifest *m, int ttl)
+{
+  if (!fd_workers_running()
+      || !sqlite3_threadsafe()
+      || pending_count >= MAX_PENDING_IMPORTS
+      || m->group_count > 0
+      || rhizome_manifest_get(m, "isagroup", NULL, 0) != NULL)
+    return rhizome_bundle_import(m, ttl);
+
+  if (config.debug.rhizome)
+    DEBUGF("(m=%p, ttl=%d)", m, ttl);
+  int ret = rhizome_manifest_check_duplicate(m, NULL, 0);
+  if (ret != 0)
+    return ret;
+  if (rhizome_add_manifest_check(m, ttl) == -1)
+    return WHY("rhizome_add_manifest() failed");
+
+  struct import_job *job = calloc(1, sizeof(struct import_job));
+  if (!job)
+    return WHY_perror("calloc");
+  if (rhizome_manifest_row(m, &job->row) == -1){
+    free(job);
+    return -1;
+  }
+
+  int64_t pending_version;
+  if (rhizome_import_pending(job->row.bid, RHIZOME_MANIFEST_ID_BYTES, &pending_version) == 1
+      && pending_version >= job->row.version){
+    free(job);
+    return WHY("Same or newer version of manifest is already being stored");
+  }
+
+  // the row must not refer to the manifest, which the caller may free as soon as we return
+  if (job->row.manifest_bytes > sizeof job->manifestdata){
+    WHYF("Manifest is too long (%d bytes)", job->row.manifest_bytes);
+    free(job);
+    return -1;
+  }
+  bcopy(job->row.manifestdata, job->manifestdata, job->row.manifest_bytes);
+  job->row.manifestdata = job->manifestdata;
+  if (job->row.author)
+    job->row.author = job->row.author_hex;
+  job->row.service = import_strdup(job->row.service);
+  job->row.name = import_strdup(job->row.name);
+  job->row.sender = import_strdup(job->row.sender);
+  job->row.recipient = import_strdup(job->row.recipient);
+  job->filename = import_strdup(m->dataFileName);
+  job->inserttime = gettime_ms();
+
+  if (!import_db_path[0] && !FORM_RHIZOME_DATASTORE_PATH(import_db_path, "rhizome.db")){
+    import_job_free(job);
+    return WHY("Invalid path");
+  }
+  import_synchronous = config.rhizome.db.synchronous;
+
+  if (config.debug.rhizome_rx)
+    DEBUGF("Storing bid=%s version=%lld on a worker thread", job->row.manifestid, (long long)job->row.version);
+
+  if (pending_tail)
+    pending_tail->next=job;
+  else
+    pending=job;
+  pending_tail=job;
+  pending_count++;
+  close_requested=0;
+  import_next();
+  return 0;
+}
+
+/* Close the worker's database connection, now if nothing is being stored, otherwise once the
+ * queue drains.
+ */
+void rhizome_import_close()
+{
+  if (pending)
+    close_requested=1;
+  else
+    import_close_db();
+}
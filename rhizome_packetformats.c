@@ -137,7 +137,7 @@ unsigned long long rhizome_bar_bidprefix_ll(unsigned char *bar)
 static int append_bars(struct overlay_buffer *e, sqlite_retry_state *retry, const char *sql, long long *last_rowid){
   int count=0;
   
-  sqlite3_stmt *statement=sqlite_prepare(retry, sql, *last_rowid);
+  sqlite3_stmt *statement=sqlite_prepare_bind(retry, sql, SQL_INT64, (int64_t) *last_rowid, SQL_END);
   
   while(sqlite_step_retry(retry, statement) == SQLITE_ROW) {
     count++;
@@ -163,8 +163,7 @@ static int append_bars(struct overlay_buffer *e, sqlite_retry_state *retry, cons
     *last_rowid=rowid;
   }
   
-  if (statement)
-    sqlite3_finalize(statement);
+  sqlite_release(statement);
   
   return count;
 }
@@ -184,7 +183,7 @@ void overlay_rhizome_advertise(struct sched_ent *alarm){
   sqlite_retry_state retry = SQLITE_RETRY_STATE_DEFAULT;
 
   /* Get number of bundles available */
-  if (sqlite_exec_int64_retry(&retry, &bundles_available, "SELECT COUNT(BAR) FROM MANIFESTS;") != 1){
+  if (sqlite_exec_int64_bind(&retry, &bundles_available, "SELECT COUNT(BAR) FROM MANIFESTS;", SQL_END) != 1){
     WHY("Could not count BARs for advertisement");
     goto end;
   }
@@ -204,9 +203,9 @@ void overlay_rhizome_advertise(struct sched_ent *alarm){
   ob_append_byte(frame->payload, 2);
   ob_append_ui16(frame->payload, rhizome_http_server_port);
   
-  long long rowid=0;
+  long long rowid=INT64_MAX;
   int count = append_bars(frame->payload, &retry, 
-			  "SELECT BAR,ROWID FROM MANIFESTS ORDER BY ROWID DESC LIMIT 3", 
+			  "SELECT BAR,ROWID FROM MANIFESTS WHERE ROWID < ? ORDER BY ROWID DESC LIMIT 3", 
 			  &rowid);
   
   if (count>=3){
@@ -214,7 +213,7 @@ void overlay_rhizome_advertise(struct sched_ent *alarm){
       bundle_last_rowid=rowid;
     
     count = append_bars(frame->payload, &retry, 
-			"SELECT BAR,ROWID FROM MANIFESTS WHERE ROWID < %lld ORDER BY ROWID DESC LIMIT 17", 
+			"SELECT BAR,ROWID FROM MANIFESTS WHERE ROWID < ? ORDER BY ROWID DESC LIMIT 17", 
 			&bundle_last_rowid);
     if (count<17)
       bundle_last_rowid=INT64_MAX;
@@ -1,3 +1,6 @@
+#ifdef HAVE_SYS_SENDFILE_H
+#include <sys/sendfile.h>
+#endif
 #include "serval.h"
 #include "rhizome.h"
 #include "conf.h"
@@ -7,10 +10,11 @@
 
 int rhizome_exists(const char *fileHash){
   long long gotfile = 0;
+  sqlite_retry_state retry = SQLITE_RETRY_STATE_DEFAULT;
   
-  if (sqlite_exec_int64(&gotfile, 
-	"SELECT COUNT(*) FROM FILES WHERE ID='%s' and datavalid=1;", 
-			fileHash) != 1){
+  if (sqlite_exec_int64_bind(&retry, &gotfile, 
+	"SELECT COUNT(*) FROM FILES WHERE ID = ? and datavalid=1;", 
+	SQL_TEXT, fileHash, SQL_END) != 1){
     return 0;
   }
   return gotfile;
@@ -503,7 +507,14 @@ int rhizome_open_read(struct rhizome_read *read, const char *fileid, int hash)
   str_toupper_inplace(read->id);
   read->blob_rowid = -1;
   read->blob_fd = -1;
-  if (sqlite_exec_int64(&read->blob_rowid, "SELECT FILEBLOBS.rowid FROM FILEBLOBS, FILES WHERE FILEBLOBS.id = FILES.id AND FILES.id = '%s' AND FILES.datavalid != 0", read->id) == -1)
+  read->blob = NULL;
+  read->mapped = NULL;
+  read->read_ahead = NULL;
+  read->read_ahead_length = 0;
+  sqlite_retry_state retry = SQLITE_RETRY_STATE_DEFAULT;
+  if (sqlite_exec_int64_bind(&retry, &read->blob_rowid,
+	"SELECT FILEBLOBS.rowid FROM FILEBLOBS, FILES WHERE FILEBLOBS.id = FILES.id AND FILES.id = ? AND FILES.datavalid != 0",
+	SQL_TEXT, read->id, SQL_END) == -1)
 {   cli_puts("no file found in the database _ rhizome_open_read");
     return -1;
 }
@@ -522,6 +533,18 @@ int rhizome_open_read(struct rhizome_read *read, const char *fileid, int hash)
     }
     if ((read->length = lseek(read->blob_fd, 0, SEEK_END)) == -1)
       return WHYF_perror("lseek(%s,0,SEEK_END)", alloca_str_toprint(blob_path));
+    if (read->length > 0 && (size_t)read->length == read->length) {
+      void *map = mmap(NULL, read->length, PROT_READ, MAP_SHARED, read->blob_fd, 0);
+      if (map == MAP_FAILED) {
+	// eg out of address space, so fall back to read()
+	if (config.debug.externalblobs)
+	  DEBUGF_perror("mmap(%s)", alloca_str_toprint(blob_path));
+      } else {
+	read->mapped = map;
+	// most readers go from start to end, so ask the kernel to read ahead
+	madvise(map, read->length, MADV_SEQUENTIAL);
+      }
+    }
   }
   read->hash = hash;
   read->offset = 0;
@@ -530,58 +553,92 @@ int rhizome_open_read(struct rhizome_read *read, const char *fileid, int hash)
   return 0; // file opened
 }
 
-/* Read content from the store, hashing and decrypting as we go. 
- Random access is supported, but hashing requires reads to be sequential though we don't enforce this. */
-// returns the number of bytes read
-int rhizome_read(struct rhizome_read *read_state, unsigned char *buffer, int buffer_length)
+// reads smaller than this are served from the read-ahead buffer
+#define RHIZOME_READ_AHEAD_BYTES (8*RHIZOME_CRYPT_PAGE_SIZE)
+
+/* Close the blob handle, if any, so that the read no longer holds a read transaction open.  The
+ * read state stays usable; the next read that needs the store opens the blob again.
+ */
+void rhizome_read_release(struct rhizome_read *read_state)
+{
+  if (read_state->blob){
+    sqlite3_blob_close(read_state->blob);
+    read_state->blob = NULL;
+  }
+}
+
+/* Read raw bytes from the store at the given offset, without hashing or decrypting.  The blob
+ * handle stays open for the next read; it is reopened if a write to its row has expired it.
+ * Returns the number of bytes read, -1 on error.
+ */
+static int read_from_store(struct rhizome_read *read_state, unsigned char *buffer, int buffer_length, int64_t offset)
 {
-  IN();
   int bytes_read = 0;
   if (read_state->blob_fd != -1) {
-    if (lseek(read_state->blob_fd, read_state->offset, SEEK_SET) == -1)
-      RETURN(WHYF_perror("lseek(%d,%ld,SEEK_SET)", read_state->blob_fd, (long)read_state->offset));
+    if (lseek(read_state->blob_fd, offset, SEEK_SET) == -1)
+      return WHYF_perror("lseek(%d,%ld,SEEK_SET)", read_state->blob_fd, (long)offset);
     bytes_read = read(read_state->blob_fd, buffer, buffer_length);
     if (bytes_read == -1)
-      RETURN(WHYF_perror("read(%d,%p,%ld)", read_state->blob_fd, buffer, (long)buffer_length));
+      return WHYF_perror("read(%d,%p,%ld)", read_state->blob_fd, buffer, (long)buffer_length);
   } else if (read_state->blob_rowid != -1) {
     sqlite_retry_state retry = SQLITE_RETRY_STATE_DEFAULT;
+    int reopened = 0;
     do{
-      sqlite3_blob *blob = NULL;
-      int ret = sqlite3_blob_open(rhizome_db, "main", "FILEBLOBS", "data", read_state->blob_rowid, 0 /* read only */, &blob);
-      if (sqlite_code_busy(ret))
-	goto again;
-      else if(ret!=SQLITE_OK)
-	RETURN(WHYF("sqlite3_blob_open failed: %s",sqlite3_errmsg(rhizome_db)));
-      if (read_state->length==-1)
-	read_state->length=sqlite3_blob_bytes(blob);
-      bytes_read = read_state->length - read_state->offset;
+      int ret;
+      if (!read_state->blob){
+	ret = sqlite3_blob_open(rhizome_db, "main", "FILEBLOBS", "data", read_state->blob_rowid, 0 /* read only */, &read_state->blob);
+	if (sqlite_code_busy(ret))
+	  goto again;
+	else if(ret!=SQLITE_OK){
+	  WHYF("sqlite3_blob_open failed: %s",sqlite3_errmsg(rhizome_db));
+	  rhizome_read_release(read_state);
+	  return -1;
+	}
+	if (read_state->length==-1)
+	  read_state->length=sqlite3_blob_bytes(read_state->blob);
+      }
+      bytes_read = read_state->length - offset;
       if (bytes_read>buffer_length)
 	bytes_read=buffer_length;
       // allow the caller to do a dummy read, just to work out the length
-      if (!buffer)
+      if (!buffer || bytes_read<0)
 	bytes_read=0;
       if (bytes_read>0){
-	ret = sqlite3_blob_read(blob, buffer, bytes_read, read_state->offset);
+	ret = sqlite3_blob_read(read_state->blob, buffer, bytes_read, offset);
+	if (ret == SQLITE_ABORT && !reopened){
+	  // the row was written since we opened it, so try again with a fresh handle
+	  reopened = 1;
+	  rhizome_read_release(read_state);
+	  continue;
+	}
 	if (sqlite_code_busy(ret))
 	  goto again;
 	else if(ret!=SQLITE_OK){
 	  WHYF("sqlite3_blob_read failed: %s",sqlite3_errmsg(rhizome_db));
-	  sqlite3_blob_close(blob);
-	  RETURN(-1);
+	  rhizome_read_release(read_state);
+	  return -1;
 	}
       }
-      sqlite3_blob_close(blob);
       break;
     again:
-      if (blob) sqlite3_blob_close(blob);
+      rhizome_read_release(read_state);
       if (!sqlite_retry(&retry, "sqlite3_blob_open"))
-	RETURN(-1);
+	return -1;
     } while (1);
+    sqlite_retry_done(&retry, "sqlite3_blob_open");
+    // an open blob holds a read transaction, so don't keep it once there is nothing left to read
+    if (offset + bytes_read >= read_state->length)
+      rhizome_read_release(read_state);
   } else
-    RETURN(WHY("file not open"));
+    return WHY("file not open");
+  return bytes_read;
+}
+
+static void read_hash(struct rhizome_read *read_state, const unsigned char *data, int bytes_read)
+{
   if (read_state->hash){
-    if (buffer && bytes_read>0)
-      SHA512_Update(&read_state->sha512_context, buffer, bytes_read);
+    if (data && bytes_read>0)
+      SHA512_Update(&read_state->sha512_context, data, bytes_read);
     if (read_state->offset + bytes_read>=read_state->length){
       char hash_out[SHA512_DIGEST_STRING_LENGTH+1];
       SHA512_End(&read_state->sha512_context, hash_out);
@@ -591,24 +648,248 @@ int rhizome_read(struct rhizome_read *read_state, unsigned char *buffer, int buf
       read_state->hash=0;
     }
   }
-  if (read_state->crypt && buffer && bytes_read>0){
-    if(rhizome_crypt_xor_block(buffer, bytes_read, read_state->offset, read_state->key, read_state->nonce)){
-      RETURN(-1);
+}
+
+/* Read content from the store, hashing and decrypting as we go. 
+ Random access is supported, but hashing requires reads to be sequential though we don't enforce this. */
+// returns the number of bytes read
+int rhizome_read(struct rhizome_read *read_state, unsigned char *buffer, int buffer_length)
+{
+  IN();
+  int bytes_read = 0;
+  // the stored bytes, which are only copied into buffer as they are decrypted
+  const unsigned char *data = buffer;
+  if (read_state->mapped) {
+    int64_t remaining = read_state->length - read_state->offset;
+    bytes_read = remaining < buffer_length ? remaining : buffer_length;
+    if (!buffer || bytes_read<0)
+      bytes_read = 0;
+    data = read_state->mapped + read_state->offset;
+  } else if (buffer && buffer_length > 0 && buffer_length < RHIZOME_READ_AHEAD_BYTES) {
+    // payloads never change once stored, so whatever is in the buffer is still good
+    if (read_state->offset < read_state->read_ahead_offset
+	|| read_state->offset >= read_state->read_ahead_offset + read_state->read_ahead_length) {
+      if (!read_state->read_ahead && (read_state->read_ahead = malloc(RHIZOME_READ_AHEAD_BYTES)) == NULL)
+	RETURN(WHY_perror("malloc"));
+      read_state->read_ahead_offset = read_state->offset;
+      read_state->read_ahead_length = read_from_store(read_state, read_state->read_ahead, RHIZOME_READ_AHEAD_BYTES, read_state->offset);
+      if (read_state->read_ahead_length == -1){
+	read_state->read_ahead_length = 0;
+	RETURN(-1);
+      }
     }
+    bytes_read = read_state->read_ahead_offset + read_state->read_ahead_length - read_state->offset;
+    if (bytes_read > buffer_length)
+      bytes_read = buffer_length;
+    if (bytes_read < 0)
+      bytes_read = 0;
+    data = read_state->read_ahead + (read_state->offset - read_state->read_ahead_offset);
+  } else {
+    bytes_read = read_from_store(read_state, buffer, buffer_length, read_state->offset);
+    if (bytes_read == -1)
+      RETURN(-1);
+  }
+  read_hash(read_state, data, bytes_read);
+  if (buffer && bytes_read>0){
+    if (read_state->crypt){
+      if(rhizome_crypt_xor_copy(buffer, data, bytes_read, read_state->offset, read_state->key, read_state->nonce)){
+	RETURN(-1);
+      }
+    } else if (data != buffer)
+      bcopy(data, buffer, bytes_read);
   }
   read_state->offset+=bytes_read;
   RETURN(bytes_read);
   OUT();
 }
 
+/* Read straight from a mapped payload, without copying it.  Returns a pointer to the next *length
+ * bytes, or fewer at the end of the payload, and moves past them.  Returns NULL if the payload is
+ * not mapped or has to be decrypted, in which case use rhizome_read().
+ */
+const unsigned char *rhizome_read_mapped(struct rhizome_read *read_state, int *length)
+{
+  if (!read_state->mapped || read_state->crypt)
+    return NULL;
+  int64_t remaining = read_state->length - read_state->offset;
+  if (remaining < 0)
+    remaining = 0;
+  if (*length > remaining)
+    *length = remaining;
+  const unsigned char *data = read_state->mapped + read_state->offset;
+  read_hash(read_state, data, *length);
+  read_state->offset += *length;
+  return data;
+}
+
+/* Whether rhizome_read_sendfile() can send this payload.  It must be an unencrypted external blob
+ * file, and if it is being hashed, mapped, since the bytes never pass through here.
+ */
+int rhizome_read_can_sendfile(const struct rhizome_read *read_state)
+{
+#ifdef HAVE_SYS_SENDFILE_H
+  return read_state->blob_fd != -1 && !read_state->crypt && (!read_state->hash || read_state->mapped);
+#else
+  return 0;
+#endif
+}
+
+/* Send up to length bytes of the payload from the current offset straight to a socket, without
+ * copying them through a buffer.
+ *
+ * Returns the number of bytes sent, 0 if the socket would block, -1 on error.
+ */
+int rhizome_read_sendfile(struct rhizome_read *read_state, int out_fd, int64_t length)
+{
+  if (!rhizome_read_can_sendfile(read_state))
+    return WHY("Payload can't be sent with sendfile()");
+#ifdef HAVE_SYS_SENDFILE_H
+  int64_t remaining = read_state->length - read_state->offset;
+  if (length > remaining)
+    length = remaining;
+  if (length <= 0)
+    return 0;
+  off_t offset = read_state->offset;
+  ssize_t sent = sendfile(out_fd, read_state->blob_fd, &offset, length);
+  if (sent == -1) {
+    if (errno == EAGAIN || errno == EINTR)
+      return 0;
+    return WHYF_perror("sendfile(%d,%d,%lld,%lld)", out_fd, read_state->blob_fd, (long long)read_state->offset, (long long)length);
+  }
+  read_hash(read_state, read_state->mapped ? read_state->mapped + read_state->offset : NULL, sent);
+  read_state->offset += sent;
+  return sent;
+#else
+  return -1;
+#endif
+}
+
 int rhizome_read_close(struct rhizome_read *read)
 {
   if (read->blob_fd != -1)
     close(read->blob_fd);
   read->blob_fd = -1;
+  rhizome_read_release(read);
+  if (read->mapped)
+    munmap((void *)read->mapped, read->length);
+  read->mapped = NULL;
+  if (read->read_ahead)
+    free(read->read_ahead);
+  read->read_ahead = NULL;
+  read->read_ahead_length = 0;
   return 0;
 }
 
+/* Open payloads, so that serving the same bundle one block request at a time, often to several
+   neighbours at once, doesn't look up and open the payload for every request.  A bundle id and
+   version always name the same payload, so entries only go away when they have been idle for a
+   while, or when something is deleted from the store.
+ */
+#define RHIZOME_READ_CACHE_SIZE 8
+#define RHIZOME_READ_CACHE_IDLE_MS 10000
+
+struct rhizome_read_cache_entry{
+  unsigned char bid[RHIZOME_MANIFEST_ID_BYTES];
+  uint64_t version;
+  time_ms_t last_used;
+  int open;
+  struct rhizome_read read;
+};
+
+static struct rhizome_read_cache_entry read_cache[RHIZOME_READ_CACHE_SIZE];
+static struct sched_ent read_cache_alarm = STRUCT_SCHED_ENT_UNUSED;
+static struct profile_total read_cache_stats = {.name="rhizome_read_cache_expire"};
+
+static void read_cache_close(struct rhizome_read_cache_entry *entry)
+{
+  rhizome_read_close(&entry->read);
+  entry->open=0;
+}
+
+static void read_cache_expire(struct sched_ent *alarm)
+{
+  time_ms_t now = gettime_ms();
+  time_ms_t next = 0;
+  int i;
+  for (i=0;i<RHIZOME_READ_CACHE_SIZE;i++){
+    struct rhizome_read_cache_entry *entry=&read_cache[i];
+    if (!entry->open)
+      continue;
+    time_ms_t expires = entry->last_used + RHIZOME_READ_CACHE_IDLE_MS;
+    if (expires <= now){
+      if (config.debug.rhizome_tx)
+	DEBUGF("Closing idle payload of bid=%s version=%lld", alloca_tohex_bid(entry->bid), (long long)entry->version);
+      read_cache_close(entry);
+    }else if (!next || expires < next)
+      next = expires;
+  }
+  if (next){
+    alarm->alarm = next;
+    alarm->deadline = next + 1000;
+    schedule(alarm);
+  }
+}
+
+/* Find the open payload of a bundle version, opening it if need be.  The caller must set the
+ * offset before each read, and should call rhizome_read_release() when it has finished for now.
+ *
+ * Returns NULL if we don't have that version, or its payload can't be opened.
+ */
+struct rhizome_read *rhizome_read_cached(const unsigned char *bid, uint64_t version)
+{
+  time_ms_t now = gettime_ms();
+  struct rhizome_read_cache_entry *lru = NULL;
+  int i;
+  for (i=0;i<RHIZOME_READ_CACHE_SIZE;i++){
+    struct rhizome_read_cache_entry *entry=&read_cache[i];
+    if (entry->open && entry->version == version && memcmp(entry->bid, bid, RHIZOME_MANIFEST_ID_BYTES)==0){
+      entry->last_used = now;
+      return &entry->read;
+    }
+    if (!lru || !entry->open || (lru->open && entry->last_used < lru->last_used))
+      lru = entry;
+  }
+
+  char filehash[SHA512_DIGEST_STRING_LENGTH];
+  if (rhizome_database_filehash_from_id(alloca_tohex_bid(bid), version, filehash)<=0)
+    return NULL;
+
+  if (lru->open)
+    read_cache_close(lru);
+  bzero(&lru->read, sizeof lru->read);
+  if (rhizome_open_read(&lru->read, filehash, 0)){
+    rhizome_read_close(&lru->read);
+    return NULL;
+  }
+  if (config.debug.rhizome_tx)
+    DEBUGF("Opened payload of bid=%s version=%lld", alloca_tohex_bid(bid), (long long)version);
+  bcopy(bid, lru->bid, RHIZOME_MANIFEST_ID_BYTES);
+  lru->version = version;
+  lru->last_used = now;
+  lru->open = 1;
+
+  if (!is_scheduled(&read_cache_alarm)){
+    read_cache_alarm.function = read_cache_expire;
+    read_cache_alarm.stats = &read_cache_stats;
+    read_cache_alarm.alarm = now + RHIZOME_READ_CACHE_IDLE_MS;
+    read_cache_alarm.deadline = read_cache_alarm.alarm + 1000;
+    schedule(&read_cache_alarm);
+  }
+  return &lru->read;
+}
+
+/* Close every cached payload, eg because something may have been deleted from the store */
+void rhizome_read_cache_flush()
+{
+  int i;
+  for (i=0;i<RHIZOME_READ_CACHE_SIZE;i++){
+    if (read_cache[i].open)
+      read_cache_close(&read_cache[i]);
+  }
+  if (is_scheduled(&read_cache_alarm))
+    unschedule(&read_cache_alarm);
+}
+
 /* Returns -1 on error, 0 on success.
  */
 static int write_file(struct rhizome_read *read, const char *filepath){
@@ -621,9 +902,18 @@ static int write_file(struct rhizome_read *read, const char *filepath){
   }
   
   unsigned char buffer[RHIZOME_CRYPT_PAGE_SIZE];
-  while((ret=rhizome_read(read, buffer, sizeof(buffer)))>0){
+  while(1){
+    // write straight from the mapped payload if we can
+    int length = 65536;
+    const unsigned char *data = rhizome_read_mapped(read, &length);
+    if (!data){
+      data = buffer;
+      length = rhizome_read(read, buffer, sizeof(buffer));
+    }
+    if ((ret=length)<=0)
+      break;
     if (fd!=-1){
-      if (write(fd,buffer,ret)!=ret) {
+      if (write(fd,data,ret)!=ret) {
 	ret = WHY("Failed to write data to file");
 	break;
       }
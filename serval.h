@@ -263,8 +263,21 @@ int keyring_identity_mac(keyring_context *c,keyring_identity *id,
 /* handle to keyring file for use in running instance */
 extern keyring_file *keyring;
 
+/* Everything the overlay knows as one node, so that several nodes can share a
+   process by swapping their state in and out; see overlay_swap_state() */
+struct overlay_state{
+  void *fd;
+  void *address;
+  void *route;
+  void *queue;
+  void *interface;
+  keyring_file *keyring;
+};
+int overlay_swap_state(struct overlay_state *state);
+
 /* Public calls to keyring management */
 keyring_file *keyring_open(char *file);
+keyring_file *keyring_create_in_memory();
 keyring_file *keyring_open_instance();
 keyring_file *keyring_open_instance_cli(const struct cli_parsed *parsed);
 int keyring_enter_pin(keyring_file *k, const char *pin);
@@ -325,6 +338,21 @@ struct sched_ent{
   int _poll_index;
 };
 
+struct work_item;
+
+typedef void (*WORK_FUNCP) (struct work_item *item);
+
+/* A job for the worker threads started by fd_start_workers().  work() runs on
+   a worker thread, so it must not log, use IN()/OUT() or touch any global
+   state.  complete() is then called from fd_poll() on the main thread. */
+struct work_item{
+  struct work_item *_next;
+  
+  WORK_FUNCP work;
+  WORK_FUNCP complete;
+  void *context;
+};
+
 struct limit_state{
   // length of time for a burst
   time_ms_t burst_length;
@@ -393,6 +421,7 @@ typedef struct overlay_interface {
   // copy of ifconfig flags
   char drop_broadcasts;
   char drop_unicasts;
+  int drop_percent;
   int port;
   int type;
   int socket_type;
@@ -417,11 +446,20 @@ typedef struct overlay_interface {
   
   struct subscriber *next_advert;
   
+  /* Delta route advertisement counters. The epoch is chosen at random when the
+     interface starts, so neighbours can tell a restart from missed frames,
+     the sequence advances with every delta frame sent. */
+  unsigned char advert_epoch;
+  unsigned char advert_sequence;
+  /* A neighbour missed a delta, so repeat every route until the current sweep completes */
+  unsigned char advert_resync;
+  
   /* The time of the last tick on this interface in milli seconds */
   time_ms_t last_tick_ms;
   
-  /* sequence number of last packet sent on this interface.
-   Used to allow NACKs that can request retransmission of recent packets.
+  /* sequence number of the next broadcast packet sent on this interface.
+   Neighbours count the gaps to estimate how reliably they hear us.
+   Could also allow NACKs that can request retransmission of recent packets.
    */
   int sequence_number;
   /* XXX need recent packet buffers to support the above */
@@ -448,10 +486,34 @@ typedef struct overlay_interface {
   int state;  
 } overlay_interface;
 
+/* Record format of dummy interface files */
+struct file_packet{
+  struct sockaddr_in src_addr;
+  struct sockaddr_in dst_addr;
+  int pid;
+  int payload_length;
+  
+  /* TODO ? ;
+   half-power beam height (uint16)
+   half-power beam width (uint16)
+   range in metres, centre beam (uint32)
+   latitude (uint32)
+   longitude (uint32)
+   X/Z direction (uint16)
+   Y direction (uint16)
+   speed in metres per second (uint16)
+   TX frequency in Hz, uncorrected for doppler (which must be done at the receiving end to take into account
+   relative motion)
+   coding method (use for doppler response etc) null terminated string
+   */
+  
+  unsigned char payload[1400];
+};
+
 /* Maximum interface count is rather arbitrary.
  Memory consumption is O(n) with respect to this parameter, so let's not make it too big for now.
  */
-extern overlay_interface overlay_interfaces[OVERLAY_MAX_INTERFACES];
+extern overlay_interface *overlay_interfaces;
 extern int overlay_last_interface_number; // used to remember where a packet came from
 extern unsigned int overlay_sequence_number;
 
@@ -513,7 +575,7 @@ int single_packet_encapsulation(struct overlay_buffer *b, struct overlay_frame *
 int overlay_packet_init_header(int encapsulation, 
 			       struct decode_context *context, struct overlay_buffer *buff, 
 			       struct subscriber *destination, 
-			       char unicast, char interface, char seq);
+			       char unicast, char interface, int seq);
 int overlay_frame_build_header(struct decode_context *context, struct overlay_buffer *buff, 
 			       int queue, int type, int modifiers, int ttl, 
 			       struct broadcast *broadcast, struct subscriber *next_hop,
@@ -562,6 +624,8 @@ int overlay_route_ack_selfannounce(overlay_interface *recv_interface,
 				   unsigned int s1,unsigned int s2,
 				   int interface,
 				   struct subscriber *subscriber);
+int overlay_route_saw_sequence(struct subscriber *subscriber, overlay_interface *interface,
+			       int sender_interface, int sequence, time_ms_t now);
 overlay_node *overlay_route_find_node(const unsigned char *sid,int prefixLen,int createP);
 
 int overlayServerMode();
@@ -576,6 +640,7 @@ int overlay_route_queue_advertisements(overlay_interface *interface);
 int ovleray_route_please_advertise(overlay_node *n);
 
 int overlay_route_saw_advertisements(int i, struct overlay_frame *f, struct decode_context *context, time_ms_t now);
+int overlay_route_saw_advert_resync(int i, struct overlay_frame *f);
 int overlay_rhizome_saw_advertisements(int i, struct overlay_frame *f,  time_ms_t now);
 int overlay_route_please_advertise(overlay_node *n);
 int rhizome_server_get_fds(struct pollfd *fds,int *fdcount,int fdmax);
@@ -602,6 +667,13 @@ typedef struct sockaddr_mdp {
   unsigned int port;
 } sockaddr_mdp;
 unsigned char *keyring_get_nm_bytes(unsigned char *known_sid, unsigned char *unknown_sid);
+void keyring_forget_nm_bytes();
+struct nm_cache_stats{
+  unsigned int hits;
+  unsigned int misses;
+  unsigned int evictions;
+};
+extern struct nm_cache_stats nm_cache_stats;
 
 typedef struct overlay_mdp_data_frame {
   sockaddr_mdp src;
@@ -656,6 +728,22 @@ typedef struct overlay_mdp_frame {
 
 int keyring_mapping_request(keyring_file *k,overlay_mdp_frame *req);
 
+/* An MDP frame inside the daemon.  Its payload stays in the overlay_buffer it
+   arrived or was built in, and is only copied into an overlay_mdp_frame when a
+   client or an older service needs one. */
+struct internal_mdp_header{
+  struct subscriber *source;
+  int source_port;
+  // NULL for broadcast
+  struct subscriber *destination;
+  int destination_port;
+  // MDP_NOCRYPT and/or MDP_NOSIGN
+  uint16_t flags;
+  int ttl;
+  int queue;
+  int send_copies;
+};
+
 /* Server-side MDP functions */
 int overlay_mdp_swap_src_dst(overlay_mdp_frame *mdp);
 int overlay_mdp_reply(int sock,struct sockaddr_un *recvaddr,int recvaddrlen,
@@ -663,6 +751,10 @@ int overlay_mdp_reply(int sock,struct sockaddr_un *recvaddr,int recvaddrlen,
 int overlay_mdp_dispatch(overlay_mdp_frame *mdp,int userGeneratedFrameP,
 		     struct sockaddr_un *recvaddr,int recvaddlen);
 int overlay_mdp_encode_ports(struct overlay_buffer *plaintext, int dst_port, int src_port);
+struct overlay_buffer *overlay_mdp_payload_new(const struct internal_mdp_header *header);
+int overlay_mdp_dispatch_payload(struct internal_mdp_header *header, struct overlay_buffer *payload);
+void overlay_mdp_forget_crypt_key();
+int overlay_mdp_fill_frame(const struct internal_mdp_header *header, struct overlay_buffer *payload, overlay_mdp_frame *mdp);
 int overlay_mdp_dnalookup_reply(const sockaddr_mdp *dstaddr, const unsigned char *resolved_sid, const char *uri, const char *did, const char *name);
 
 struct vomp_call_state;
@@ -701,10 +793,14 @@ int overlay_interface_register(char *name,
 overlay_interface * overlay_interface_get_default();
 overlay_interface * overlay_interface_find(struct in_addr addr, int return_default);
 overlay_interface * overlay_interface_find_name(const char *name);
+int overlay_interface_swap_state(void **state);
 int
 overlay_broadcast_ensemble(overlay_interface *interface,
 			   struct sockaddr_in *recipientaddr,
 			   unsigned char *bytes,int len);
+int overlay_simulator_transmit(overlay_interface *interface,
+			       struct sockaddr_in *recipientaddr,
+			       unsigned char *bytes, int len);
 
 int directory_registration();
 int directory_service_init();
@@ -715,6 +811,7 @@ int app_rhizome_direct_sync(const struct cli_parsed *parsed, void *context);
 int app_pa_phone(const struct cli_parsed *parsed, void *context);
 #endif
 int app_monitor_cli(const struct cli_parsed *parsed, void *context);
+int app_mesh_simulate(const struct cli_parsed *parsed, void *context);
 int app_vomp_console(const struct cli_parsed *parsed, void *context);
 
 int app_meshms_add_message(const struct cli_parsed *parsed, void *context);
@@ -793,6 +890,11 @@ int _unwatch(struct __sourceloc whence, struct sched_ent *alarm);
 #define watch(alarm)      _watch(__WHENCE__, alarm)
 #define unwatch(alarm)    _unwatch(__WHENCE__, alarm)
 int fd_poll();
+time_ms_t fd_run_alarms();
+int fd_swap_state(void **state);
+int fd_start_workers(int count);
+int fd_workers_running();
+int fd_submit_work(struct work_item *item);
 
 void overlay_interface_discover(struct sched_ent *alarm);
 void overlay_packetradio_poll(struct sched_ent *alarm);
@@ -800,10 +902,11 @@ int overlay_packetradio_setup_port(overlay_interface *interface);
 int overlay_packetradio_tx_packet(struct overlay_frame *frame);
 void overlay_dummy_poll(struct sched_ent *alarm);
 void overlay_route_tick(struct sched_ent *alarm);
+int overlay_route_swap_state(void **state);
 void server_config_reload(struct sched_ent *alarm);
 void server_shutdown_check(struct sched_ent *alarm);
 void overlay_mdp_poll(struct sched_ent *alarm);
-int overlay_mdp_try_interal_services(overlay_mdp_frame *mdp);
+int overlay_mdp_try_interal_services(struct internal_mdp_header *header, struct overlay_buffer *payload);
 int overlay_send_probe(struct subscriber *peer, struct sockaddr_in addr, overlay_interface *interface, int queue);
 int overlay_send_stun_request(struct subscriber *server, struct subscriber *request);
 void fd_periodicstats(struct sched_ent *alarm);
@@ -811,6 +914,7 @@ void rhizome_check_connections(struct sched_ent *alarm);
 
 int overlay_tick_interface(int i, time_ms_t now);
 int overlay_queue_init();
+int overlay_queue_swap_state(void **state);
 
 void monitor_client_poll(struct sched_ent *alarm);
 void monitor_poll(struct sched_ent *alarm);
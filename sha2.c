@@ -70,7 +70,12 @@
  *
  *   #define SHA2_UNROLL_TRANSFORM
  *
+ * Serval DNA hashes every payload with SHA-512, so the unrolled transform is
+ * the default here; define SHA2_ROLL_TRANSFORM to get the smaller one back.
  */
+#ifndef SHA2_ROLL_TRANSFORM
+#define SHA2_UNROLL_TRANSFORM
+#endif
 
 
 /*** SHA-256/384/512 Machine Architecture Definitions *****************/
@@ -148,6 +153,12 @@ typedef u_int64_t sha2_word64;	/* Exactly 8 bytes */
 	tmp = (tmp >> 16) | (tmp << 16); \
 	(x) = ((tmp & 0xff00ff00UL) >> 8) | ((tmp & 0x00ff00ffUL) << 8); \
 }
+#if defined(__GNUC__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 3))
+/* a single bswap instruction on most targets */
+#define REVERSE64(w,x)	{ \
+	(x) = __builtin_bswap64(w); \
+}
+#else
 #define REVERSE64(w,x)	{ \
 	sha2_word64 tmp = (w); \
 	tmp = (tmp >> 32) | (tmp << 32); \
@@ -156,6 +167,7 @@ typedef u_int64_t sha2_word64;	/* Exactly 8 bytes */
 	(x) = ((tmp & 0xffff0000ffff0000ULL) >> 16) | \
 	      ((tmp & 0x0000ffff0000ffffULL) << 16); \
 }
+#endif
 #endif /* BYTE_ORDER == LITTLE_ENDIAN */
 
 /*
@@ -214,9 +226,10 @@ typedef u_int64_t sha2_word64;	/* Exactly 8 bytes */
 /* 64-bit Rotate-right (used in SHA-384 and SHA-512): */
 #define S64(b,x)	(((x) >> (b)) | ((x) << (64 - (b))))
 
-/* Two of six logical functions used in SHA-256, SHA-384, and SHA-512: */
-#define Ch(x,y,z)	(((x) & (y)) ^ ((~(x)) & (z)))
-#define Maj(x,y,z)	(((x) & (y)) ^ ((x) & (z)) ^ ((y) & (z)))
+/* Two of six logical functions used in SHA-256, SHA-384, and SHA-512,
+ * in equivalent forms that need fewer operations: */
+#define Ch(x,y,z)	((z) ^ ((x) & ((y) ^ (z))))
+#define Maj(x,y,z)	(((x) & (y)) | ((z) & ((x) | (y))))
 
 /* Four of six logical functions used in SHA-256: */
 #define Sigma0_256(x)	(S32(2,  (x)) ^ S32(13, (x)) ^ S32(22, (x)))
@@ -689,23 +702,28 @@ void SHA512_Init(SHA512_CTX* context) {
 
 #ifdef SHA2_UNROLL_TRANSFORM
 
-/* Unrolled SHA-512 round macros: */
+/* Unrolled SHA-512 round macros.  The message schedule is kept in a local
+ * array rather than in context->buffer, so the compiler can keep it in
+ * registers and need not assume that it aliases the input, and each block is
+ * loaded a byte-swapped word at a time without assuming any alignment: */
 #if BYTE_ORDER == LITTLE_ENDIAN
 
 #define ROUND512_0_TO_15(a,b,c,d,e,f,g,h)	\
-	REVERSE64(*data++, W512[j]); \
+	MEMCPY_BCOPY(&W512[j], &data[j], sizeof(sha2_word64)); \
+	REVERSE64(W512[j], W512[j]); \
 	T1 = (h) + Sigma1_512(e) + Ch((e), (f), (g)) + \
              K512[j] + W512[j]; \
-	(d) += T1, \
-	(h) = T1 + Sigma0_512(a) + Maj((a), (b), (c)), \
+	(d) += T1; \
+	(h) = T1 + Sigma0_512(a) + Maj((a), (b), (c)); \
 	j++
 
 
 #else /* BYTE_ORDER == LITTLE_ENDIAN */
 
 #define ROUND512_0_TO_15(a,b,c,d,e,f,g,h)	\
+	MEMCPY_BCOPY(&W512[j], &data[j], sizeof(sha2_word64)); \
 	T1 = (h) + Sigma1_512(e) + Ch((e), (f), (g)) + \
-             K512[j] + (W512[j] = *data++); \
+             K512[j] + W512[j]; \
 	(d) += T1; \
 	(h) = T1 + Sigma0_512(a) + Maj((a), (b), (c)); \
 	j++
@@ -725,7 +743,7 @@ void SHA512_Init(SHA512_CTX* context) {
 
 void SHA512_Transform(SHA512_CTX* context, const sha2_word64* data) {
 	sha2_word64	a, b, c, d, e, f, g, h, s0, s1;
-	sha2_word64	T1, *W512 = (sha2_word64*)context->buffer;
+	sha2_word64	T1, W512[16];
 	int		j;
 
 	/* Initialize registers with the prev. intermediate value */
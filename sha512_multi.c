@@ -0,0 +1,318 @@
+/*
+Serval Distributed Numbering Architecture (DNA)
+Copyright (C) 2013 Serval Project Inc.
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#include <stdint.h>
+#include <string.h>
+#include "sha512_multi.h"
+
+/* This file is also linked into crypto_bench, so it must not depend on the
+   rest of servald, not even for logging.
+
+   The vector implementations use GCC vector extensions with per function
+   target attributes, so the rest of servald is still built for the baseline
+   instruction set, and configure only defines HAVE_SHA512_SIMD if the
+   compiler supports them for x86.  SSE2 has no 64 bit rotate, so two lanes
+   in an SSE2 register are no faster than the unrolled transform in sha2.c,
+   and there is no implementation for it.
+ */
+
+#ifdef HAVE_SHA512_SIMD
+
+static const uint64_t K512[80] = {
+  0x428a2f98d728ae22ULL, 0x7137449123ef65cdULL, 0xb5c0fbcfec4d3b2fULL, 0xe9b5dba58189dbbcULL,
+  0x3956c25bf348b538ULL, 0x59f111f1b605d019ULL, 0x923f82a4af194f9bULL, 0xab1c5ed5da6d8118ULL,
+  0xd807aa98a3030242ULL, 0x12835b0145706fbeULL, 0x243185be4ee4b28cULL, 0x550c7dc3d5ffb4e2ULL,
+  0x72be5d74f27b896fULL, 0x80deb1fe3b1696b1ULL, 0x9bdc06a725c71235ULL, 0xc19bf174cf692694ULL,
+  0xe49b69c19ef14ad2ULL, 0xefbe4786384f25e3ULL, 0x0fc19dc68b8cd5b5ULL, 0x240ca1cc77ac9c65ULL,
+  0x2de92c6f592b0275ULL, 0x4a7484aa6ea6e483ULL, 0x5cb0a9dcbd41fbd4ULL, 0x76f988da831153b5ULL,
+  0x983e5152ee66dfabULL, 0xa831c66d2db43210ULL, 0xb00327c898fb213fULL, 0xbf597fc7beef0ee4ULL,
+  0xc6e00bf33da88fc2ULL, 0xd5a79147930aa725ULL, 0x06ca6351e003826fULL, 0x142929670a0e6e70ULL,
+  0x27b70a8546d22ffcULL, 0x2e1b21385c26c926ULL, 0x4d2c6dfc5ac42aedULL, 0x53380d139d95b3dfULL,
+  0x650a73548baf63deULL, 0x766a0abb3c77b2a8ULL, 0x81c2c92e47edaee6ULL, 0x92722c851482353bULL,
+  0xa2bfe8a14cf10364ULL, 0xa81a664bbc423001ULL, 0xc24b8b70d0f89791ULL, 0xc76c51a30654be30ULL,
+  0xd192e819d6ef5218ULL, 0xd69906245565a910ULL, 0xf40e35855771202aULL, 0x106aa07032bbd1b8ULL,
+  0x19a4c116b8d2d0c8ULL, 0x1e376c085141ab53ULL, 0x2748774cdf8eeb99ULL, 0x34b0bcb5e19b48a8ULL,
+  0x391c0cb3c5c95a63ULL, 0x4ed8aa4ae3418acbULL, 0x5b9cca4f7763e373ULL, 0x682e6ff3d6b2b8a3ULL,
+  0x748f82ee5defb2fcULL, 0x78a5636f43172f60ULL, 0x84c87814a1f0ab72ULL, 0x8cc702081a6439ecULL,
+  0x90befffa23631e28ULL, 0xa4506cebde82bde9ULL, 0xbef9a3f7b2c67915ULL, 0xc67178f2e372532bULL,
+  0xca273eceea26619cULL, 0xd186b8c721c0c207ULL, 0xeada7dd6cde0eb1eULL, 0xf57d4f7fee6ed178ULL,
+  0x06f067aa72176fbaULL, 0x0a637dc5a2c898a6ULL, 0x113f9804bef90daeULL, 0x1b710b35131c471bULL,
+  0x28db77f523047d84ULL, 0x32caab7b40c72493ULL, 0x3c9ebe0a15c9bebcULL, 0x431d67c49c100d4cULL,
+  0x4cc5d4becb3e42b6ULL, 0x597f299cfc657e2aULL, 0x5fcb6fab3ad6faecULL, 0x6c44198c4a475817ULL
+};
+
+static const uint64_t sha512_initial_hash_value[8] = {
+  0x6a09e667f3bcc908ULL, 0xbb67ae8584caa73bULL, 0x3c6ef372fe94f82bULL, 0xa54ff53a5f1d36f1ULL,
+  0x510e527fade682d1ULL, 0x9b05688c2b3e6c1fULL, 0x1f83d9abfb41bd6bULL, 0x5be0cd19137e2179ULL
+};
+
+/* These work the same on a uint64_t or on a vector of them, one per lane */
+#define ROTR(x,n)	(((x) >> (n)) | ((x) << (64 - (n))))
+#define Sigma0(x)	(ROTR((x),28) ^ ROTR((x),34) ^ ROTR((x),39))
+#define Sigma1(x)	(ROTR((x),14) ^ ROTR((x),18) ^ ROTR((x),41))
+#define sigma0(x)	(ROTR((x),1) ^ ROTR((x),8) ^ ((x) >> 7))
+#define sigma1(x)	(ROTR((x),19) ^ ROTR((x),61) ^ ((x) >> 6))
+#define Ch(x,y,z)	((z) ^ ((x) & ((y) ^ (z))))
+#define Maj(x,y,z)	(((x) & (y)) | ((z) & ((x) | (y))))
+
+#define ROUND(a,b,c,d,e,f,g,h,i) { \
+    T1 = (h) + Sigma1(e) + Ch((e),(f),(g)) + K512[i] + W[(i)&15]; \
+    (d) += T1; \
+    (h) = T1 + Sigma0(a) + Maj((a),(b),(c)); \
+  }
+
+#define EXPAND(i) \
+  W[(i)&15] += sigma1(W[((i)-2)&15]) + W[((i)-7)&15] + sigma0(W[((i)-15)&15])
+
+/* Define a transform of one block for each of LANES messages at once, in
+   vectors of type VT.  Lane l of the state is column l of state[][], and its
+   block starts at block[l], which need not be aligned.
+ */
+#define SHA512_MULTI_TRANSFORM(NAME, VT, LANES, TARGET) \
+TARGET static void NAME(uint64_t state[8][SHA512_MULTI_MAX_LANES], const unsigned char *const block[]) \
+{ \
+  VT W[16], S[8], T1; \
+  VT a, b, c, d, e, f, g, h; \
+  int i, l; \
+  for (i=0;i<16;i++){ \
+    uint64_t w[LANES]; \
+    for (l=0;l<LANES;l++){ \
+      memcpy(&w[l], block[l] + i*8, 8); \
+      w[l] = __builtin_bswap64(w[l]); \
+    } \
+    memcpy(&W[i], w, sizeof W[i]); \
+  } \
+  for (i=0;i<8;i++) \
+    memcpy(&S[i], state[i], sizeof S[i]); \
+  a=S[0]; b=S[1]; c=S[2]; d=S[3]; e=S[4]; f=S[5]; g=S[6]; h=S[7]; \
+  for (i=0;i<80;i+=8){ \
+    if (i>=16){ \
+      for (l=0;l<8;l++) \
+	EXPAND(i+l); \
+    } \
+    ROUND(a,b,c,d,e,f,g,h,i); \
+    ROUND(h,a,b,c,d,e,f,g,i+1); \
+    ROUND(g,h,a,b,c,d,e,f,i+2); \
+    ROUND(f,g,h,a,b,c,d,e,i+3); \
+    ROUND(e,f,g,h,a,b,c,d,i+4); \
+    ROUND(d,e,f,g,h,a,b,c,i+5); \
+    ROUND(c,d,e,f,g,h,a,b,i+6); \
+    ROUND(b,c,d,e,f,g,h,a,i+7); \
+  } \
+  S[0]+=a; S[1]+=b; S[2]+=c; S[3]+=d; S[4]+=e; S[5]+=f; S[6]+=g; S[7]+=h; \
+  for (i=0;i<8;i++) \
+    memcpy(state[i], &S[i], sizeof S[i]); \
+}
+
+typedef uint64_t sha512_v4 __attribute__((vector_size(32)));
+typedef uint64_t sha512_v8 __attribute__((vector_size(64)));
+
+// finishes the last message when there is nothing left to share the vector with
+SHA512_MULTI_TRANSFORM(sha512_transform_x1, uint64_t, 1, )
+SHA512_MULTI_TRANSFORM(sha512_transform_x4, sha512_v4, 4, __attribute__((target("avx2"))))
+SHA512_MULTI_TRANSFORM(sha512_transform_x8, sha512_v8, 8, __attribute__((target("avx512f"))))
+
+typedef void (*sha512_transform_func)(uint64_t state[8][SHA512_MULTI_MAX_LANES], const unsigned char *const block[]);
+
+/* A message being hashed in one lane: its whole blocks straight from the
+   caller's buffer, then one or two blocks with the rest of the message and
+   the padding.
+ */
+struct sha512_lane{
+  int message;
+  const unsigned char *data;
+  size_t blocks;
+  int tail_next;
+  int tail_blocks;
+  unsigned char tail[2*SHA512_BLOCK_LENGTH];
+};
+
+static void store64(unsigned char *p, uint64_t v)
+{
+  int i;
+  for (i=7;i>=0;i--){
+    p[i]=v&0xff;
+    v>>=8;
+  }
+}
+
+static void lane_start(struct sha512_lane *lane, uint64_t state[8][SHA512_MULTI_MAX_LANES], int l,
+		       int message, const unsigned char *data, size_t length)
+{
+  lane->message = message;
+  lane->data = data;
+  lane->blocks = length / SHA512_BLOCK_LENGTH;
+  size_t rest = length % SHA512_BLOCK_LENGTH;
+  memset(lane->tail, 0, sizeof lane->tail);
+  if (rest)
+    memcpy(lane->tail, data + lane->blocks * SHA512_BLOCK_LENGTH, rest);
+  lane->tail[rest] = 0x80;
+  lane->tail_next = 0;
+  lane->tail_blocks = rest < SHA512_BLOCK_LENGTH - 16 ? 1 : 2;
+  // the message length in bits, as a 128 bit big endian number
+  unsigned char *end = lane->tail + lane->tail_blocks * SHA512_BLOCK_LENGTH;
+  store64(end - 16, (uint64_t)length >> 61);
+  store64(end - 8, (uint64_t)length << 3);
+  int i;
+  for (i=0;i<8;i++)
+    state[i][l] = sha512_initial_hash_value[i];
+}
+
+static const unsigned char *lane_block(struct sha512_lane *lane)
+{
+  if (lane->blocks)
+    return lane->data;
+  return lane->tail + lane->tail_next * SHA512_BLOCK_LENGTH;
+}
+
+// returns 1 when the lane's last block has been hashed
+static int lane_next(struct sha512_lane *lane)
+{
+  if (lane->blocks){
+    lane->blocks--;
+    lane->data += SHA512_BLOCK_LENGTH;
+  }else
+    lane->tail_next++;
+  return lane->blocks==0 && lane->tail_next == lane->tail_blocks;
+}
+
+static void lane_digest(uint64_t state[8][SHA512_MULTI_MAX_LANES], int l, unsigned char *digest)
+{
+  int i;
+  for (i=0;i<8;i++)
+    store64(digest + i*8, state[i][l]);
+}
+
+static void sha512_multi_lanes_hash(int lanes, sha512_transform_func transform, unsigned count,
+				    const unsigned char *const data[], const size_t length[],
+				    unsigned char digest[][SHA512_DIGEST_LENGTH])
+{
+  static const unsigned char idle[SHA512_BLOCK_LENGTH];
+  uint64_t state[8][SHA512_MULTI_MAX_LANES];
+  struct sha512_lane lane[SHA512_MULTI_MAX_LANES];
+  const unsigned char *block[SHA512_MULTI_MAX_LANES];
+  unsigned next=0;
+  int active=0;
+  int l;
+
+  for (l=0;l<lanes;l++){
+    if (next < count){
+      lane_start(&lane[l], state, l, next, data[next], length[next]);
+      next++;
+      active++;
+    }else
+      lane[l].message = -1;
+  }
+
+  while(active){
+    if (active==1 && next>=count){
+      // don't spend a whole vector on the one message left
+      for (l=0;lane[l].message==-1;l++)
+	;
+      int i;
+      for (i=0;i<8;i++)
+	state[i][0]=state[i][l];
+      do{
+	block[0] = lane_block(&lane[l]);
+	sha512_transform_x1(state, block);
+      }while(!lane_next(&lane[l]));
+      lane_digest(state, 0, digest[lane[l].message]);
+      return;
+    }
+
+    for (l=0;l<lanes;l++)
+      block[l] = lane[l].message==-1 ? idle : lane_block(&lane[l]);
+    transform(state, block);
+
+    for (l=0;l<lanes;l++){
+      if (lane[l].message==-1 || !lane_next(&lane[l]))
+	continue;
+      lane_digest(state, l, digest[lane[l].message]);
+      if (next < count){
+	lane_start(&lane[l], state, l, next, data[next], length[next]);
+	next++;
+      }else{
+	lane[l].message = -1;
+	active--;
+      }
+    }
+  }
+}
+
+#endif
+
+static int selected_lanes=0;
+
+static int lanes_supported(int lanes)
+{
+  switch(lanes){
+    case 1:
+      return 1;
+#ifdef HAVE_SHA512_SIMD
+    case 4:
+      return __builtin_cpu_supports("avx2");
+    case 8:
+      return __builtin_cpu_supports("avx512f");
+#endif
+  }
+  return 0;
+}
+
+int sha512_multi_lanes()
+{
+  if (!selected_lanes){
+    int lanes;
+    for (lanes=SHA512_MULTI_MAX_LANES;lanes>1 && !lanes_supported(lanes);lanes--)
+      ;
+    selected_lanes=lanes;
+  }
+  return selected_lanes;
+}
+
+int sha512_multi_set_lanes(int lanes)
+{
+  if (lanes<1 || lanes>SHA512_MULTI_MAX_LANES || !lanes_supported(lanes))
+    return -1;
+  selected_lanes=lanes;
+  return 0;
+}
+
+void sha512_multi(unsigned count, const unsigned char *const data[], const size_t length[],
+		  unsigned char digest[][SHA512_DIGEST_LENGTH])
+{
+#ifdef HAVE_SHA512_SIMD
+  if (count>1){
+    switch(sha512_multi_lanes()){
+      case 4:
+	sha512_multi_lanes_hash(4, sha512_transform_x4, count, data, length, digest);
+	return;
+      case 8:
+	sha512_multi_lanes_hash(8, sha512_transform_x8, count, data, length, digest);
+	return;
+    }
+  }
+#endif
+  unsigned i;
+  for (i=0;i<count;i++){
+    SHA512_CTX context;
+    SHA512_Init(&context);
+    SHA512_Update(&context, data[i], length[i]);
+    SHA512_Final(digest[i], &context);
+  }
+}
@@ -0,0 +1,51 @@
+/*
+Serval Distributed Numbering Architecture (DNA)
+Copyright (C) 2013 Serval Project Inc.
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#ifndef __SERVALD_SHA512_MULTI_H
+#define __SERVALD_SHA512_MULTI_H
+
+#include <stddef.h>
+#include "sha2.h"
+
+/* SHA-512 of several independent messages at once.
+
+   SHA-512 can't be vectorised within one message, as every round depends on
+   the last, but the same round can be computed for several messages in the
+   lanes of one vector register.  Where the compiler and CPU support them, the
+   messages are hashed four at a time in AVX2 registers, or eight at a time in
+   AVX-512 registers, each lane taking the next message as soon as it finishes
+   the last.  Otherwise each message is hashed with sha2.c in turn.
+
+   The widest implementation the CPU supports is chosen on first use.
+ */
+
+#define SHA512_MULTI_MAX_LANES 8
+
+void sha512_multi(unsigned count, const unsigned char *const data[], const size_t length[],
+		  unsigned char digest[][SHA512_DIGEST_LENGTH]);
+
+/* Number of messages hashed at once, 1 if there is no vector implementation */
+int sha512_multi_lanes();
+
+/* Use a particular implementation, for tests and benchmarks.  Returns -1 if
+   there is none of that width or the CPU doesn't support it.
+ */
+int sha512_multi_set_lanes(int lanes);
+
+#endif
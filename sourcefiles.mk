@@ -19,6 +19,7 @@ SERVAL_SOURCES = $(SERVAL_BASE)audiodevices.c \
 	$(SERVAL_BASE)lsif.c \
 	$(SERVAL_BASE)main.c \
 	$(SERVAL_BASE)mdp_client.c \
+	$(SERVAL_BASE)mdp_ring.c \
 	$(SERVAL_BASE)os.c \
 	$(SERVAL_BASE)mem.c \
 	$(SERVAL_BASE)meshms.c \
@@ -41,10 +42,12 @@ SERVAL_SOURCES = $(SERVAL_BASE)audiodevices.c \
 	$(SERVAL_BASE)overlay_packetformats.c \
 	$(SERVAL_BASE)overlay_payload.c \
 	$(SERVAL_BASE)overlay_route.c \
+	$(SERVAL_BASE)overlay_simulator.c \
 	$(SERVAL_BASE)packetformats.c \
 	$(SERVAL_BASE)performance_timing.c \
 	$(SERVAL_BASE)randombytes.c \
 	$(SERVAL_BASE)rhizome.c \
+	$(SERVAL_BASE)rhizome_bar_index.c \
 	$(SERVAL_BASE)rhizome_bundle.c \
 	$(SERVAL_BASE)rhizome_crypto.c \
 	$(SERVAL_BASE)rhizome_database.c \
@@ -52,12 +55,14 @@ SERVAL_SOURCES = $(SERVAL_BASE)audiodevices.c \
 	$(SERVAL_BASE)rhizome_direct_http.c \
 	$(SERVAL_BASE)rhizome_fetch.c \
 	$(SERVAL_BASE)rhizome_http.c \
+	$(SERVAL_BASE)rhizome_import.c \
 	$(SERVAL_BASE)rhizome_packetformats.c \
 	$(SERVAL_BASE)rhizome_store.c \
 	$(SERVAL_BASE)serialization_meshms.c \
 	$(SERVAL_BASE)serval_packetvisualise.c \
 	$(SERVAL_BASE)server.c \
 	$(SERVAL_BASE)sha2.c \
+	$(SERVAL_BASE)sha512_multi.c \
 	$(SERVAL_BASE)sighandlers.c \
 	$(SERVAL_BASE)slip.c \
 	$(SERVAL_BASE)sqlite-amalgamation-3070900/sqlite3.c \